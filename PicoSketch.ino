@@ -38,6 +38,51 @@ volatile boolean charging, systemOn;
 
 #define DEBUG true
 
+// Protocol v2, see pico_protocol.h on the host side
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define FRAME_KEY 1
+#define FRAME_DELTA 2
+#define STATUS_FAN 0x02
+#define STATUS_BACKLIGHT 0x04
+#define STATUS_PROTOCOL 0x08
+#define KEYFRAME_INTERVAL 1000
+#define PROTOCOL_FLAG_COBS 0x100
+#define STATUS_PING 0x10
+#define STATUS_BAUD 0x20
+#define STATUS_PUSH 0x40
+
+#define TELEMETRY_BATTERY 0
+#define TELEMETRY_FAN 1
+#define TELEMETRY_BACKLIGHT 2
+#define TELEMETRY_CHANNELS 3
+#define TELEMETRY_INTERVAL_UNIT 10
+
+#define BASE_BAUD 115200
+#define MAX_BAUD 3000000
+#define BAUD_CONFIRM_TIMEOUT 500
+
+volatile int protocolVersion = PROTOCOL_V1;
+volatile boolean cobsFraming = false;
+long currentBaud = BASE_BAUD, confirmedBaud = BASE_BAUD;
+boolean baudPending = false;
+unsigned long baud_stamp;
+
+struct Subscription {
+  boolean active;
+  unsigned long interval;
+  int threshold;
+  int lastValue;
+  boolean lastCharging;
+  unsigned long lastSent;
+};
+
+Subscription subscriptions[TELEMETRY_CHANNELS];
+byte sequence[5];
+byte sentButtons[5][4];
+int sentAxes[5][8];
+unsigned long keyframe_stamp[5];
+
 void setup() {
   pinMode(LED_PIN, OUTPUT_8MA);
   pinMode(FAN_PIN, OUTPUT_4MA);
@@ -89,8 +134,23 @@ long startTime = 0;
 void loop() {
   readSerial();
   systemOn = (abs((long)(millis() - alive_stamp)) < ALIVE_TIMEOUT);
+  if(!systemOn){ //Whoever talks to us next may only know v1
+    protocolVersion = PROTOCOL_V1;
+    cobsFraming = false;
+    confirmedBaud = BASE_BAUD;
+    for(int c = 0; c < TELEMETRY_CHANNELS; c++){ //The host renews these while it's there
+      subscriptions[c].active = false;
+    }
+  }
+  if(baudPending && millis() - baud_stamp >= BAUD_CONFIRM_TIMEOUT){ //Host never heard us at the new speed
+    baudPending = false;
+  }
+  if(!baudPending && currentBaud != confirmedBaud){
+    setBaud(confirmedBaud);
+  }
   setFanSpeed(fanVal);
   setBrightness(bacVal);
+  pushTelemetry();
 
   if(charging){
     if(getBatteryPercent() > 0.9){
@@ -308,9 +368,114 @@ void processCommand(int func, int value){
       controllers[0].axis[0].x = controllers[0].axis[0].y = bacVal;
       sendFullState(0);
       break;  
+    case 8: { //Set Protocol Version and flags, acked in plain v1 before switching so any host can read it
+      int version = ((value & 0xFF) == PROTOCOL_V2) ? PROTOCOL_V2 : PROTOCOL_V1;
+      int flags = (version == PROTOCOL_V2) ? (value & PROTOCOL_FLAG_COBS) : 0;
+      protocolVersion = PROTOCOL_V1;
+      cobsFraming = false;
+      controllers[0].button_states[0] = charging;
+      controllers[0].button_states[1] = false;
+      controllers[0].button_states[2] = false;
+      controllers[0].button_states[3] = true;
+      controllers[0].axis[0].x = version;
+      controllers[0].axis[0].y = flags;
+      sendFullState(0);
+      controllers[0].button_states[3] = false;
+
+      for(int c = 0; c < 5; c++){
+        keyframe_stamp[c] = millis() - KEYFRAME_INTERVAL; //Host has no baseline yet
+      }
+      protocolVersion = version;
+      cobsFraming = (flags & PROTOCOL_FLAG_COBS) != 0;
+      break;
+    }
+    case 9: { //Set Baud, acked at the old speed then switched, reverted unless confirmed in time
+      long baud = value;
+      boolean ok = baud >= BASE_BAUD && baud <= MAX_BAUD;
+      sendStatus(STATUS_BAUD, ok ? baud / 100 : 0);
+      if(ok){
+        Serial1.flush(); //Let the ack finish at the old speed
+        setBaud(baud);
+        baudPending = true;
+        baud_stamp = millis();
+      }
+      break;
+    }
+    case 10: //Ping, echoes the value so the host can check the link
+      sendStatus(STATUS_PING, value & 0xFFFF);
+      break;
+    case 11: //Confirm Baud
+      if(baudPending && value == currentBaud){
+        confirmedBaud = currentBaud;
+        baudPending = false;
+      }
+      break;
+    case 12: { //Subscribe to a telemetry channel, acked by pushing the current value
+      int channel = value & 0xFF;
+      if(channel >= TELEMETRY_CHANNELS) break;
+      Subscription& sub = subscriptions[channel];
+      sub.interval = ((value >> 8) & 0xFF) * TELEMETRY_INTERVAL_UNIT;
+      sub.threshold = (value >> 16) & 0xFFFF;
+      sub.active = sub.interval > 0;
+      if(sub.active){
+        pushChannel(channel);
+      }
+      break;
+    }
   }
 }
 
+int telemetryValue(int channel){
+  switch(channel){
+    case TELEMETRY_FAN: return fanVal;
+    case TELEMETRY_BACKLIGHT: return bacVal;
+  }
+  return getBatteryRaw();
+}
+
+void pushChannel(int channel){
+  Subscription& sub = subscriptions[channel];
+  sub.lastValue = telemetryValue(channel);
+  sub.lastCharging = charging;
+  sub.lastSent = millis();
+  int flags = STATUS_PUSH;
+  if(channel == TELEMETRY_FAN) flags |= STATUS_FAN;
+  if(channel == TELEMETRY_BACKLIGHT) flags |= STATUS_BACKLIGHT;
+  sendStatus(flags, sub.lastValue);
+}
+
+//Only sends what moved past its threshold, and no more often than asked
+void pushTelemetry(){
+  for(int c = 0; c < TELEMETRY_CHANNELS; c++){
+    Subscription& sub = subscriptions[c];
+    if(!sub.active || millis() - sub.lastSent < sub.interval) continue;
+    boolean moved = abs(telemetryValue(c) - sub.lastValue) >= sub.threshold;
+    if(c == TELEMETRY_BATTERY && charging != sub.lastCharging) moved = true;
+    if(moved){
+      pushChannel(c);
+    }
+  }
+}
+
+void sendStatus(int flags, int value){
+  controllers[0].button_states[0] = charging;
+  for(int i = 1; i < 8; i++){
+    controllers[0].button_states[i] = (flags >> i) & 1;
+  }
+  controllers[0].axis[0].x = controllers[0].axis[0].y = (short)value;
+  sendFullState(0);
+  for(int i = 1; i < 8; i++){
+    controllers[0].button_states[i] = false;
+  }
+}
+
+void setBaud(long baud){
+  Serial1.end();
+  Serial1.begin(baud);
+  currentBaud = baud;
+  reading = false;
+}
+
 void readSerial(){
   if(abs((int)(micros() - startTime)) > SERIAL_READ_TIMEOUT){
     reading = false;
@@ -466,7 +631,11 @@ void calcDebouce(){
       }
     }
 
-    if(changed) sendFullState(c);
+    if(changed){
+      sendChanges(c);
+    } else if(protocolVersion == PROTOCOL_V2 && controllers[c].plugged_in && millis() - keyframe_stamp[c] >= KEYFRAME_INTERVAL){
+      sendKeyFrame(c); //Lets the host recover from a lost delta
+    }
   }
 }
 
@@ -506,6 +675,10 @@ void sendButtonEvent(int controller, int button, boolean state){
 }
 
 void sendFullState(int c){
+  if(protocolVersion == PROTOCOL_V2){
+    sendKeyFrame(c);
+    return;
+  }
   sendFullStateRaw(c);
   if(!DEBUG || true) return;
 
@@ -584,50 +757,144 @@ void add_crc(uint8_t* message, size_t length) {
     message[length + 1] = (crc >> 8) & 0xFF; // High byte of CRC
 }
 
-void sendFullStateRaw(int c){
+//Packs the button states 8 to a byte, returns the byte count
+int packButtons(int c, byte* out){
   int count = controllers[c].button_count;
-  byte msg[32];
+  for(int i = 0; i < (count + 7) / 8; i++){
+    out[i] = 0;
+  }
+  for(int i = 0; i < count; i++){
+    out[i / 8] |= (controllers[c].button_states[i] ? 1 : 0) << (i % 8);
+  }
+  return (count + 7) / 8;
+}
+
+//Controller, button count, buttons, axis count, axes. The v1 body and v2 key payload
+int packState(int c, byte* msg, int msg_len){
+  msg[msg_len++] = c;
+  msg[msg_len++] = controllers[c].button_count & 0xFF;
+  msg_len += packButtons(c, msg + msg_len);
+
+  int count = controllers[c].axis_count;
+  msg[msg_len++] = count & 0xFF;
+  for(int i = 0; i < count; i++){
+    msg[msg_len++] = (controllers[c].axis[i].x >> 8) & 0xFF;
+    msg[msg_len++] = (controllers[c].axis[i].x) & 0xFF;
+    msg[msg_len++] = (controllers[c].axis[i].y >> 8) & 0xFF;
+    msg[msg_len++] = (controllers[c].axis[i].y) & 0xFF;
+  }
+  return msg_len;
+}
+
+void sendFullStateRaw(int c){
+  byte msg[48];
   int msg_len = 0;
   
   msg[msg_len++] = '{';
-  msg[msg_len++] = c;
+  msg_len = packState(c, msg, msg_len);
+  msg[msg_len++] = '}';
+  add_crc(msg, msg_len);
 
+  Serial1.write(msg, msg_len + 2); //Print and add crc length;
+}
 
-  byte data;
-  data = count & 0xFF;
-  msg[msg_len++] = data;
-  
-  msg_len = 3;
+void sendV2Frame(byte type, int c, const byte* payload, int payload_len){
+  byte msg[48];
+  int msg_len = 0;
 
-  for(int i = 0; i < count; i++){
-    if(i % 8 == 0) data = 0;
-    data += (controllers[c].button_states[i] ? 1 : 0) << (i % 8);
+  msg[msg_len++] = '[';
+  msg[msg_len++] = type;
+  msg[msg_len++] = sequence[c]++;
+  msg[msg_len++] = payload_len;
+  memcpy(msg + msg_len, payload, payload_len);
+  msg_len += payload_len;
+  msg[msg_len++] = ']';
+  add_crc(msg, msg_len);
+  msg_len += 2;
 
-    if(i % 8 == 7) {
-      msg[msg_len++] = data;
-    }
+  if(cobsFraming){
+    byte encoded[52];
+    int encoded_len = cobsEncode(msg, msg_len, encoded);
+    encoded[encoded_len++] = 0; //Frame boundary
+    Serial1.write(encoded, encoded_len);
+    return;
   }
+  Serial1.write(msg, msg_len);
+}
 
-  count = controllers[c].axis_count;
-  data = count & 0xFF;
-  msg[msg_len++] = data;
+//Consistent overhead byte stuffing, replaces every zero with the distance to
+//the next so the only zero on the wire is the one ending the frame
+int cobsEncode(const byte* data, int len, byte* out){
+  int code_pos = 0, pos = 1;
+  byte code = 1;
+  for(int i = 0; i < len; i++){
+    if(data[i] != 0){
+      out[pos++] = data[i];
+      code++;
+    }
+    if(data[i] == 0 || code == 0xFF){
+      out[code_pos] = code;
+      code_pos = pos++;
+      code = 1;
+    }
+  }
+  out[code_pos] = code;
+  return pos;
+}
 
-  for(int i = 0; i < count; i++){
-    byte up, low;
-    up  = (controllers[c].axis[i].x >> 8) & 0xFF;
-    low = (controllers[c].axis[i].x) & 0xFF;
+void sendKeyFrame(int c){
+  byte payload[40];
+  int len = packState(c, payload, 0);
+  sendV2Frame(FRAME_KEY, c, payload, len);
 
-    msg[msg_len++] = up;
-    msg[msg_len++] = low;
+  packButtons(c, sentButtons[c]);
+  for(int i = 0; i < controllers[c].axis_count; i++){
+    sentAxes[c][i * 2] = controllers[c].axis[i].x;
+    sentAxes[c][i * 2 + 1] = controllers[c].axis[i].y;
+  }
+  keyframe_stamp[c] = millis();
+}
 
-    up  = (controllers[c].axis[i].y >> 8) & 0xFF;
-    low = (controllers[c].axis[i].y) & 0xFF;
-    
-    msg[msg_len++] = up;
-    msg[msg_len++] = low;
+//Only the button bytes and axis values that changed since the last frame
+void sendDeltaFrame(int c){
+  byte payload[40];
+  int len = 0;
+  payload[len++] = c;
+
+  byte packed[4];
+  int button_bytes = packButtons(c, packed);
+  int mask_pos = len++;
+  byte mask = 0;
+  for(int i = 0; i < button_bytes; i++){
+    if(packed[i] == sentButtons[c][i]) continue;
+    mask |= 1 << i;
+    payload[len++] = packed[i];
+    sentButtons[c][i] = packed[i];
   }
-  msg[msg_len++] = '}';
-  add_crc(msg, msg_len);
+  payload[mask_pos] = mask;
+
+  mask_pos = len++;
+  byte axis_mask = 0;
+  for(int i = 0; i < controllers[c].axis_count * 2; i++){
+    int value = (i % 2 == 0) ? controllers[c].axis[i / 2].x : controllers[c].axis[i / 2].y;
+    if(value == sentAxes[c][i]) continue;
+    axis_mask |= 1 << i;
+    payload[len++] = (value >> 8) & 0xFF;
+    payload[len++] = value & 0xFF;
+    sentAxes[c][i] = value;
+  }
+  payload[mask_pos] = axis_mask;
 
-  Serial1.write(msg, msg_len + 2); //Print and add crc length;
-}
\ No newline at end of file
+  if(mask == 0 && axis_mask == 0) return;
+  sendV2Frame(FRAME_DELTA, c, payload, len);
+}
+
+void sendChanges(int c){
+  if(protocolVersion != PROTOCOL_V2){
+    sendFullState(c);
+  } else if(millis() - keyframe_stamp[c] >= KEYFRAME_INTERVAL){
+    sendKeyFrame(c);
+  } else {
+    sendDeltaFrame(c);
+  }
+}
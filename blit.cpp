@@ -0,0 +1,124 @@
+#include "blit.h"
+#include "span.h"
+
+// Maps destination pixels [start, end) of a span of dstLength pixels onto a
+// source of srcLength pixels, as 16.16 fixed point. The index is the left
+// sample and the weight (0 - 255) how much of the right sample to use.
+static void buildScaleMap(int srcLength, int dstLength, int start, int end, int mode, int* index, uint8_t* weight) {
+	int64_t step = ((int64_t)srcLength << 16) / dstLength;
+	int64_t pos = start * step;
+	if(mode == SCALE_BILINEAR) pos += step / 2 - 0x8000; // Sample at pixel centers
+
+	for(int i = start; i < end; ++i, pos += step) {
+		int64_t p = pos < 0 ? 0 : pos;
+		int idx = (int)(p >> 16);
+		uint8_t w = mode == SCALE_BILINEAR ? (p >> 8) & 0xFF : 0;
+		if(idx >= srcLength - 1) {
+			idx = srcLength - 1;
+			w = 0;
+		}
+		index[i - start] = idx;
+		weight[i - start] = w;
+	}
+}
+
+// Narrows destination pixels [start, end) of a span to those whose samples
+// can reach source pixels [boundStart, boundEnd), the rest only ever see
+// transparent ones. The margin covers the bilinear neighbour and the half
+// pixel offset however far the span is shrunk.
+static void trimSpan(int srcLength, int dstLength, int pos, int boundStart, int boundEnd, int& start, int& end) {
+	int margin = srcLength / dstLength + 2;
+	int64_t first = (int64_t)(boundStart - margin) * dstLength / srcLength;
+	int64_t last = ((int64_t)(boundEnd + margin) * dstLength + srcLength - 1) / srcLength;
+	if(pos + first > start) start = (int)(pos + first);
+	if(pos + last < end) end = (int)(pos + last);
+}
+
+static inline uint8_t lerp8(uint8_t a, uint8_t b, uint8_t w) {
+	return (uint8_t)(a + (((b - a) * w) >> 8));
+}
+
+Rect Blitter::blit(Surface& dst, const Surface& src, int posX, int posY, int targetWidth, int targetHeight, int mode) {
+	if(src.bounds.width <= 0 || src.bounds.height <= 0 || targetWidth <= 0 || targetHeight <= 0) return Rect{0, 0, 0, 0};
+	int width = dst.width, height = dst.height;
+	uint16_t* colorBuffer = dst.color.data();
+	uint8_t* transparencyBuffer = dst.alpha.data();
+
+	// Clip the destination rectangle up front
+	int x0 = posX < 0 ? 0 : posX;
+	int y0 = posY < 0 ? 0 : posY;
+	int x1 = posX + targetWidth > width ? width : posX + targetWidth;
+	int y1 = posY + targetHeight > height ? height : posY + targetHeight;
+	trimSpan(src.width, targetWidth, posX, src.bounds.x, src.bounds.x + src.bounds.width, x0, x1);
+	trimSpan(src.height, targetHeight, posY, src.bounds.y, src.bounds.y + src.bounds.height, y0, y1);
+	if(x0 >= x1 || y0 >= y1) return Rect{0, 0, 0, 0};
+	int spanLength = x1 - x0;
+	Rect drawn = {x0, y0, spanLength, y1 - y0};
+
+	// Unscaled, composite the source rows directly
+	if(targetWidth == src.width && targetHeight == src.height) {
+		for(int y = y0; y < y1; ++y) {
+			int srcOffset = (y - posY) * src.width + (x0 - posX);
+			int dstOffset = y * width + x0;
+			blendSpan(colorBuffer + dstOffset, transparencyBuffer + dstOffset,
+					  src.color.data() + srcOffset, src.alpha.data() + srcOffset, spanLength);
+		}
+		return drawn;
+	}
+
+	scaleIndex.resize(spanLength);
+	scaleWeight.resize(spanLength);
+	rowColor.resize(spanLength);
+	rowAlpha.resize(spanLength);
+	if(mode == SCALE_BILINEAR) {
+		vertColor.resize(src.width);
+		vertAlpha.resize(src.width);
+	}
+	buildScaleMap(src.width, targetWidth, x0 - posX, x1 - posX, mode, scaleIndex.data(), scaleWeight.data());
+
+	int rowIndex;
+	uint8_t rowWeight;
+	for(int y = y0; y < y1; ++y) {
+		buildScaleMap(src.height, targetHeight, y - posY, y - posY + 1, mode, &rowIndex, &rowWeight);
+		const uint16_t* topColor = src.color.data() + rowIndex * src.width;
+		const uint8_t* topAlpha = src.alpha.data() + rowIndex * src.width;
+
+		if(mode == SCALE_BILINEAR) {
+			// Blend the two source rows once, in the spread 0x07E0F81F form
+			// so each channel can be weighted with a single multiply, then
+			// only the horizontal blend is left per destination pixel
+			int nextRow = rowWeight != 0 ? src.width : 0;
+			int first = scaleIndex[0];
+			int last = scaleIndex[spanLength - 1] + 1;
+			if(last >= src.width) last = src.width - 1;
+			uint32_t wy = (rowWeight + 4) >> 3;
+
+			for(int sx = first; sx <= last; ++sx) {
+				uint32_t t = (topColor[sx] | ((uint32_t)topColor[sx] << 16)) & 0x07E0F81F;
+				uint32_t b = (topColor[sx + nextRow] | ((uint32_t)topColor[sx + nextRow] << 16)) & 0x07E0F81F;
+				vertColor[sx] = (t + (((b - t) * wy) >> 5)) & 0x07E0F81F;
+				vertAlpha[sx] = lerp8(topAlpha[sx], topAlpha[sx + nextRow], rowWeight);
+			}
+
+			for(int i = 0; i < spanLength; ++i) {
+				int sx = scaleIndex[i];
+				uint8_t wx = scaleWeight[i];
+				int nx = wx != 0 ? sx + 1 : sx;
+
+				uint32_t l = vertColor[sx];
+				uint32_t c = (l + (((vertColor[nx] - l) * ((wx + 4u) >> 3)) >> 5)) & 0x07E0F81F;
+				rowColor[i] = (uint16_t)(c | (c >> 16));
+				rowAlpha[i] = lerp8(vertAlpha[sx], vertAlpha[nx], wx);
+			}
+		} else {
+			for(int i = 0; i < spanLength; ++i) {
+				rowColor[i] = topColor[scaleIndex[i]];
+				rowAlpha[i] = topAlpha[scaleIndex[i]];
+			}
+		}
+
+		int dstOffset = y * width + x0;
+		blendSpan(colorBuffer + dstOffset, transparencyBuffer + dstOffset, rowColor.data(), rowAlpha.data(), spanLength);
+	}
+	return drawn;
+}
@@ -0,0 +1,29 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <cstdint>
+#include <vector>
+
+#include "surface.h"
+
+// Scaled, clipped blits from one Surface onto another. OverlayManager draws
+// images with one, anything else with a Surface of its own can too. The
+// scratch rows grow to the widest blit seen and are kept, so once warmed up
+// blitting doesn't allocate.
+class Blitter {
+public:
+	// Draws src stretched to targetWidth x targetHeight with its top left at
+	// posX, posY. Returns the part of dst that was drawn on, which is empty
+	// when nothing was.
+	Rect blit(Surface& dst, const Surface& src, int posX, int posY, int targetWidth, int targetHeight, int mode);
+
+private:
+	std::vector<int> scaleIndex;
+	std::vector<uint8_t> scaleWeight;
+	std::vector<uint16_t> rowColor;
+	std::vector<uint8_t> rowAlpha;
+	std::vector<uint32_t> vertColor;
+	std::vector<uint8_t> vertAlpha;
+};
+
+#endif // BLIT_H
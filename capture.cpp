@@ -0,0 +1,148 @@
+#include "capture.h"
+
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#define CAPTURE_FLUSH_INTERVAL 1000000 // us, bounds what a crash can lose
+
+static int64_t monotonicMicros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+CaptureWriter::CaptureWriter() {
+}
+
+CaptureWriter::~CaptureWriter() {
+	close();
+}
+
+bool CaptureWriter::open(const std::string& path) {
+	close();
+	file = fopen(path.c_str(), "wb");
+	if(file == nullptr) {
+		perror(("Unable to open capture " + path).c_str());
+		return false;
+	}
+	setvbuf(file, nullptr, _IOFBF, 1 << 16);
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), file);
+	fputc(CAPTURE_VERSION, file);
+	putVarint((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+
+	openTime = lastTime = lastFlush = monotonicMicros();
+	return true;
+}
+
+void CaptureWriter::close() {
+	if(file != nullptr) fclose(file);
+	file = nullptr;
+}
+
+bool CaptureWriter::isOpen() {
+	return file != nullptr;
+}
+
+void CaptureWriter::write(int direction, const uint8_t* data, size_t len, int64_t time) {
+	if(file == nullptr || len == 0) return;
+
+	while(len > CAPTURE_MAX_RECORD) { // Keep records readable into a fixed buffer
+		write(direction, data, CAPTURE_MAX_RECORD, time);
+		data += CAPTURE_MAX_RECORD;
+		len -= CAPTURE_MAX_RECORD;
+	}
+
+	int64_t now = monotonicMicros();
+	int64_t stamp = time < 0 ? now : openTime + time;
+	putVarint(stamp > lastTime ? stamp - lastTime : 0);
+	putVarint((len << 1) | (direction & 1));
+	fwrite(data, 1, len, file);
+	if(stamp > lastTime) lastTime = stamp;
+
+	if(now - lastFlush > CAPTURE_FLUSH_INTERVAL) flush();
+}
+
+void CaptureWriter::flush() {
+	if(file == nullptr) return;
+	fflush(file);
+	lastFlush = monotonicMicros();
+}
+
+void CaptureWriter::putVarint(uint64_t value) {
+	while(value >= 0x80) {
+		fputc((value & 0x7F) | 0x80, file);
+		value >>= 7;
+	}
+	fputc(value, file);
+}
+
+CaptureReader::CaptureReader() {
+}
+
+CaptureReader::~CaptureReader() {
+	close();
+}
+
+bool CaptureReader::open(const std::string& path) {
+	close();
+	file = fopen(path.c_str(), "rb");
+	if(file == nullptr) {
+		perror(("Unable to open capture " + path).c_str());
+		return false;
+	}
+
+	char magic[8] = {0};
+	size_t magicLen = strlen(CAPTURE_MAGIC);
+	uint64_t start;
+	if(fread(magic, 1, magicLen, file) != magicLen || memcmp(magic, CAPTURE_MAGIC, magicLen) != 0 ||
+	   fgetc(file) != CAPTURE_VERSION || !getVarint(start)) {
+		std::cerr << path << " is not a version " << CAPTURE_VERSION << " capture" << std::endl;
+		close();
+		return false;
+	}
+	startTime = start;
+	time = 0;
+	return true;
+}
+
+void CaptureReader::close() {
+	if(file != nullptr) fclose(file);
+	file = nullptr;
+}
+
+// False at the end of the file, a truncated last record counts as the end
+bool CaptureReader::next(CaptureRecord& record) {
+	uint64_t delta, header;
+	if(file == nullptr || !getVarint(delta) || !getVarint(header)) return false;
+
+	record.length = header >> 1;
+	record.direction = header & 1;
+	if(record.length > CAPTURE_MAX_RECORD) {
+		std::cerr << "Corrupt capture record of " << record.length << " bytes" << std::endl;
+		return false;
+	}
+	if(fread(record.data, 1, record.length, file) != record.length) return false;
+
+	time += delta;
+	record.time = time;
+	return true;
+}
+
+int64_t CaptureReader::getStartTime() {
+	return startTime;
+}
+
+bool CaptureReader::getVarint(uint64_t& value) {
+	value = 0;
+	for(int shift = 0; shift < 64; shift += 7) {
+		int c = fgetc(file);
+		if(c == EOF) return false;
+		value |= (uint64_t)(c & 0x7F) << shift;
+		if(!(c & 0x80)) return true;
+	}
+	return false;
+}
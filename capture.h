@@ -0,0 +1,68 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Raw serial traffic as it was read, so field problems can be replayed later.
+//
+// File: "PTCAP" version, varint start time (unix microseconds), then records
+//   varint delta_us  varint (length << 1 | direction)  bytes[length]
+// where delta_us is since the previous record.
+
+#define CAPTURE_MAGIC   "PTCAP"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_RX 0 // Pico -> host
+#define CAPTURE_TX 1 // Host -> Pico
+
+#define CAPTURE_MAX_RECORD 4096
+
+class CaptureWriter {
+public:
+	CaptureWriter();
+	~CaptureWriter();
+
+	bool open(const std::string& path);
+	void close();
+	bool isOpen();
+
+	// time is microseconds since open(), for captures that are made up
+	// rather than recorded. -1 stamps the record with the current time.
+	void write(int direction, const uint8_t* data, size_t len, int64_t time = -1);
+	void flush();
+
+private:
+	FILE* file = nullptr;
+	int64_t openTime = 0, lastTime = 0, lastFlush = 0;
+
+	void putVarint(uint64_t value);
+};
+
+struct CaptureRecord {
+	int64_t time; // Microseconds since the start of the capture
+	int direction;
+	size_t length;
+	uint8_t data[CAPTURE_MAX_RECORD];
+};
+
+class CaptureReader {
+public:
+	CaptureReader();
+	~CaptureReader();
+
+	bool open(const std::string& path);
+	void close();
+
+	bool next(CaptureRecord& record);
+	int64_t getStartTime();
+
+private:
+	FILE* file = nullptr;
+	int64_t startTime = 0, time = 0;
+
+	bool getVarint(uint64_t& value);
+};
+
+#endif // CAPTURE_H
@@ -0,0 +1,103 @@
+#include "command_queue.h"
+#include "capture.h"
+#include "serial_port.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <sys/uio.h>
+
+// Settings where only the newest value matters. Anything else only merges
+// with an identical request, so every ping still goes out.
+static bool isSetting(uint8_t func) {
+	return func == REQUEST_WRITE_FAN || func == REQUEST_WRITE_BACKLIGHT;
+}
+
+CommandQueue::CommandQueue() {
+}
+
+CommandQueue::Command& CommandQueue::at(size_t index) {
+	return commands[(head + index) % COMMAND_QUEUE_SIZE];
+}
+
+// False when the queue is full and the request was dropped
+bool CommandQueue::push(uint8_t func, uint32_t value) {
+	// The head frame is untouchable once part of it is on the wire
+	for(size_t i = offset > 0 ? 1 : 0; i < count; ++i) {
+		Command& c = at(i);
+		if(c.func != func || (c.value != value && !isSetting(func))) continue;
+		c.value = value;
+		encodeRequest(c.frame, func, value);
+		coalesced++;
+		return true;
+	}
+
+	if(count == COMMAND_QUEUE_SIZE) {
+		overflows++;
+		return false;
+	}
+	Command& c = at(count++);
+	c.func = func;
+	c.value = value;
+	encodeRequest(c.frame, func, value);
+	if(count > maxDepth) maxDepth = count;
+	return true;
+}
+
+// Writes as much as the port takes. Returns the bytes written, or -1 if the
+// port failed, in which case the queue is dropped as nothing will reach the
+// Pico anyway.
+ssize_t CommandQueue::flush(SerialPort& port, CaptureWriter* capture) {
+	if(count == 0) return 0;
+	if(!port.isOpen()) { // Replaying a capture, or the link is down
+		clear();
+		return -1;
+	}
+
+	struct iovec iov[COMMAND_QUEUE_SIZE];
+	for(size_t i = 0; i < count; ++i) {
+		size_t skip = i == 0 ? offset : 0;
+		iov[i].iov_base = at(i).frame + skip;
+		iov[i].iov_len = REQUEST_FRAME_SIZE - skip;
+	}
+
+	ssize_t written = port.writev(iov, count);
+	if(written < 0) {
+		if(errno == EAGAIN || errno == EINTR) return 0; // Try again next flush
+		LOG_ERROR("CommandQueue: write failed: %s", strerror(errno));
+		clear();
+		return -1;
+	}
+
+	size_t left = written;
+	for(size_t i = 0; i < count && left > 0; ++i) {
+		size_t len = left < iov[i].iov_len ? left : iov[i].iov_len;
+		if(capture != nullptr) capture->write(CAPTURE_TX, (const uint8_t*)iov[i].iov_base, len);
+		left -= len;
+	}
+
+	left = written;
+	while(count > 0 && left >= REQUEST_FRAME_SIZE - offset) {
+		left -= REQUEST_FRAME_SIZE - offset;
+		head = (head + 1) % COMMAND_QUEUE_SIZE;
+		count--;
+		offset = 0;
+	}
+	if(left > 0) {
+		offset += left;
+		partialWrites++;
+	}
+	return written;
+}
+
+void CommandQueue::clear() {
+	head = count = offset = 0;
+}
+
+size_t CommandQueue::depth() {
+	return count;
+}
+
+bool CommandQueue::empty() {
+	return count == 0;
+}
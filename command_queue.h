@@ -0,0 +1,48 @@
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+#include "pico_protocol.h"
+
+class CaptureWriter;
+class SerialPort;
+
+#define COMMAND_QUEUE_SIZE 32
+
+// Requests waiting to go to the Pico. Everything queued goes out in one
+// writev() per flush. A request for something already waiting replaces it
+// rather than queueing behind it, so a held hotkey sends the latest fan speed
+// instead of every step on the way there. When the port won't take it all the
+// rest stays queued, including the tail of a partly written frame.
+class CommandQueue {
+public:
+	CommandQueue();
+
+	bool push(uint8_t func, uint32_t value);
+	ssize_t flush(SerialPort& port, CaptureWriter* capture);
+	void clear();
+
+	size_t depth();
+	bool empty();
+
+	size_t maxDepth = 0;
+	uint64_t coalesced = 0, overflows = 0, partialWrites = 0;
+
+private:
+	struct Command {
+		uint8_t func;
+		uint32_t value;
+		uint8_t frame[REQUEST_FRAME_SIZE];
+	};
+
+	Command commands[COMMAND_QUEUE_SIZE];
+	size_t head = 0, count = 0;
+	size_t offset = 0; // Bytes of the head frame already written
+
+	Command& at(size_t index);
+};
+
+#endif // COMMAND_QUEUE_H
@@ -0,0 +1,207 @@
+#include "control_server.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+ControlServer::ControlServer() {
+}
+
+ControlServer::~ControlServer() {
+	close();
+}
+
+bool ControlServer::open(const std::string& path) {
+	close();
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(addr.sun_path)) {
+		LOG_ERROR("Control socket path too long: %s", path.c_str());
+		return false;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listenFd == -1) {
+		LOG_ERROR("ControlServer: socket: %s", strerror(errno));
+		return false;
+	}
+	unlink(path.c_str()); // Left over from a previous run
+	if(bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listenFd, 4) == -1) {
+		LOG_ERROR("ControlServer: bind %s: %s", path.c_str(), strerror(errno));
+		::close(listenFd);
+		listenFd = -1;
+		return false;
+	}
+	chmod(path.c_str(), 0660); // It can change settings, keep it to the owner and group
+	this->path = path;
+	LOG_INFO("Control socket listening on %s", path.c_str());
+	return true;
+}
+
+void ControlServer::close() {
+	for(Client& client : clients) {
+		if(client.fd != -1) drop(client);
+	}
+	if(listenFd != -1) {
+		::close(listenFd);
+		unlink(path.c_str());
+		listenFd = -1;
+	}
+}
+
+bool ControlServer::isOpen() {
+	return listenFd != -1;
+}
+
+void ControlServer::addCommand(const std::string& name, const std::string& usage, ControlHandler handler, void* context) {
+	commands.push_back({name, usage, handler, context});
+}
+
+bool ControlServer::hasSubscribers() {
+	return subscribers > 0;
+}
+
+void ControlServer::poll() {
+	if(listenFd == -1) return;
+	struct pollfd fds[CONTROL_MAX_CLIENTS + 1];
+	fds[0] = {listenFd, POLLIN, 0};
+	for(int i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+		fds[i + 1] = {clients[i].fd, (short)(POLLIN | (clients[i].out.empty() ? 0 : POLLOUT)), 0}; // -1 is skipped
+	}
+	if(::poll(fds, CONTROL_MAX_CLIENTS + 1, 0) <= 0) return;
+
+	for(int i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+		Client& client = clients[i];
+		if(client.fd == -1) continue;
+		if(fds[i + 1].revents & POLLOUT) flush(client);
+		if(client.fd != -1 && (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) receive(client);
+	}
+	if(fds[0].revents & POLLIN) accept();
+}
+
+void ControlServer::publish(const char* line) {
+	if(subscribers == 0) return;
+	for(Client& client : clients) {
+		if(client.fd != -1 && client.subscribed) send(client, std::string("event ") + line + "\n");
+	}
+}
+
+void ControlServer::accept() {
+	int fd;
+	while((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		Client* free = nullptr;
+		for(Client& client : clients) {
+			if(client.fd == -1) {
+				free = &client;
+				break;
+			}
+		}
+		if(free == nullptr) {
+			static const char full[] = "error too many clients\n";
+			::send(fd, full, sizeof(full) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+			::close(fd);
+			continue;
+		}
+		free->fd = fd;
+	}
+}
+
+void ControlServer::drop(Client& client) {
+	::close(client.fd);
+	if(client.subscribed) subscribers--;
+	client = Client();
+}
+
+void ControlServer::receive(Client& client) {
+	char buffer[512];
+	ssize_t len = recv(client.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if(len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+		drop(client);
+		return;
+	}
+	if(len < 0) return;
+	client.in.append(buffer, len);
+
+	size_t end;
+	while(client.fd != -1 && (end = client.in.find('\n')) != std::string::npos) {
+		std::string line = client.in.substr(0, end);
+		client.in.erase(0, end + 1);
+		if(!line.empty() && line.back() == '\r') line.pop_back();
+		execute(client, line);
+	}
+	if(client.fd != -1 && client.in.size() > CONTROL_LINE_SIZE) {
+		send(client, "error line too long\n");
+		if(client.fd != -1) drop(client);
+	}
+}
+
+void ControlServer::execute(Client& client, const std::string& line) {
+	std::vector<std::string> args;
+	std::istringstream words(line);
+	std::string word;
+	while(words >> word) args.push_back(word);
+	if(args.empty()) return;
+
+	if(args[0] == "quit") {
+		drop(client);
+		return;
+	}
+	if(args[0] == "subscribe") {
+		if(!client.subscribed) subscribers++;
+		client.subscribed = true;
+		send(client, "ok\n");
+		return;
+	}
+	if(args[0] == "help") {
+		std::string reply = "help\nsubscribe\nquit\n";
+		for(const Command& command : commands) {
+			reply += command.name + (command.usage.empty() ? "" : " " + command.usage) + "\n";
+		}
+		send(client, reply + "ok\n");
+		return;
+	}
+
+	for(const Command& command : commands) {
+		if(command.name != args[0]) continue;
+		std::string reply;
+		bool ok = command.handler(command.context, args, reply);
+		if(ok) {
+			send(client, reply + "ok\n");
+		} else {
+			send(client, "error " + reply + "\n");
+		}
+		return;
+	}
+	send(client, "error unknown command " + args[0] + "\n");
+}
+
+// Queued and written as far as the socket takes it, a client that lets
+// CONTROL_OUT_SIZE pile up has stopped reading and is dropped
+void ControlServer::send(Client& client, const std::string& text) {
+	client.out += text;
+	if(client.out.size() > CONTROL_OUT_SIZE) {
+		LOG_WARN("Control client stopped reading, dropping it");
+		drop(client);
+		return;
+	}
+	flush(client);
+}
+
+void ControlServer::flush(Client& client) {
+	while(!client.out.empty()) {
+		ssize_t sent = ::send(client.fd, client.out.data(), client.out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(sent < 0) {
+			if(errno != EAGAIN && errno != EINTR) drop(client);
+			return;
+		}
+		client.out.erase(0, sent);
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef CONTROL_SERVER_H
+#define CONTROL_SERVER_H
+
+#include <string>
+#include <vector>
+
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_LINE_SIZE   256 // Longest command a client may send
+#define CONTROL_OUT_SIZE    65536 // Bytes waiting for a client before it is dropped as stuck
+
+// Handles one command, args[0] is its name. Whatever it puts in reply is sent
+// back, followed by "ok", or after "error " when it returns false.
+typedef bool (*ControlHandler)(void* context, const std::vector<std::string>& args, std::string& reply);
+
+// Line based control socket, served from the main loop with poll() so a
+// client can never hold up input. Each line is a command, words split on
+// spaces. help, subscribe and quit are built in, the rest are added with
+// addCommand. Subscribers are sent every publish() as "event <line>".
+class ControlServer {
+public:
+	ControlServer();
+	~ControlServer();
+
+	bool open(const std::string& path);
+	void close();
+	bool isOpen();
+
+	void addCommand(const std::string& name, const std::string& usage, ControlHandler handler, void* context);
+	void poll(); // Accepts, reads and writes whatever is ready, never waits
+	void publish(const char* line); // Costs nothing without subscribers
+	bool hasSubscribers();
+
+private:
+	struct Command {
+		std::string name, usage;
+		ControlHandler handler;
+		void* context;
+	};
+	struct Client {
+		int fd = -1;
+		bool subscribed = false;
+		std::string in, out;
+	};
+
+	std::string path;
+	int listenFd = -1;
+	int subscribers = 0;
+	std::vector<Command> commands;
+	Client clients[CONTROL_MAX_CLIENTS];
+
+	void accept();
+	void drop(Client& client);
+	void receive(Client& client);
+	void execute(Client& client, const std::string& line);
+	void send(Client& client, const std::string& text);
+	void flush(Client& client);
+};
+
+#endif // CONTROL_SERVER_H
@@ -1,7 +1,10 @@
 #include "controller.h"
-#include <iostream>
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
 #include <cstdio>
-#include <iomanip>
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <chrono>
@@ -10,7 +13,21 @@
 
 using String = std::string;
 
-ControllerManager::ControllerManager(JoyCallback callback) {
+#define LOOP_INTERVAL 500 // us between monitor updates
+
+static Counter* reportsMetric      = Metrics::counter("picotroller_controller_reports_total", "Player reports from the monitor");
+static Counter* eventsMetric       = Metrics::counter("picotroller_uinput_events_total", "Events written to the virtual joysticks");
+static Counter* writeErrorsMetric  = Metrics::counter("picotroller_uinput_write_errors_total", "Reports uinput refused");
+static Histogram* updateMetric     = Metrics::histogram("picotroller_loop_update_us", "Time spent in one pass of the controller loop in microseconds");
+static Histogram* lateMetric       = Metrics::histogram("picotroller_loop_late_us", "How far past its interval the controller loop woke in microseconds");
+
+// Without createDevices nothing is registered with uinput, events only go to
+// the sink. Replaying captures uses this so it runs anywhere.
+ControllerManager::ControllerManager(JoyCallback callback, bool createDevices) {
+	this->createDevices = createDevices;
+	memset(keyStates, -1, sizeof(keyStates)); // Unknown, the first report sends everything
+	memset(controllers, 0, sizeof(controllers));
+	memset(snapshot, 0, sizeof(snapshot));
 	setup_uinput_device(0);
     //for(int i = 0; i < 4; ++i) {
     //    setup_uinput_device(i + 1);  // Joystick IDs 1 to 4
@@ -20,7 +37,8 @@ ControllerManager::ControllerManager(JoyCallback callback) {
 }
 
 ControllerManager::~ControllerManager() {
-    for(int i = 0; i < fd_count; ++i) {
+    for(int i = 0; i < MAX_JOYSTICKS; ++i) {
+        if(!made[i] || fds[i] == -1) continue;
         ioctl(fds[i], UI_DEV_DESTROY);
         close(fds[i]);
     }
@@ -28,16 +46,38 @@ ControllerManager::~ControllerManager() {
 
 void ControllerManager::setMonitor(Monitor* monitor){
 	this->monitor = monitor;
-	this->monitor->callback = [this](unsigned char a, unsigned char b, const unsigned char* c, unsigned char d, const short int* e) {
-        this->monitorJoystick(a, b, c, d, e);
-    };
+	this->monitor->callback = onReport;
+	this->monitor->callbackContext = this;
+}
+
+void ControllerManager::onReport(void* context, byte controller_index, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values) {
+	static_cast<ControllerManager*>(context)->monitorJoystick(controller_index, button_count, button_values, axis_count, axis_values);
+}
+
+void ControllerManager::setEventSink(EventSink sink, void* context) {
+	this->sink = sink;
+	this->sinkContext = context;
+}
+
+void ControllerManager::setStateFeed(StateFeed* feed) {
+	this->feed = feed;
+}
+
+void ControllerManager::setFlightRecorder(FlightRecorder* recorder) {
+	this->recorder = recorder;
 }
 
 void ControllerManager::setup_uinput_device(int joystick_id) {
+    made[joystick_id] = true;
+    if(!createDevices) {
+        fds[joystick_id] = -1;
+        return;
+    }
+
     struct uinput_setup usetup;
     int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
     if(fd < 0) {
-        perror("Unable to open /dev/uinput");
+        LOG_ERROR("Unable to open /dev/uinput: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -67,7 +107,7 @@ void ControllerManager::setup_uinput_device(int joystick_id) {
     ioctl(fd, UI_DEV_SETUP, &usetup);
     ioctl(fd, UI_DEV_CREATE);
 
-    fds[fd_count++] = fd;
+    fds[joystick_id] = fd;
 }
 
 int ControllerManager::initMonitor() {
@@ -76,15 +116,21 @@ int ControllerManager::initMonitor() {
 
 
 void ControllerManager::loop() {
+	auto last = std::chrono::steady_clock::now();
 	while(true) {
+		auto start = std::chrono::steady_clock::now();
+		auto slept = std::chrono::duration_cast<std::chrono::microseconds>(start - last).count();
+		lateMetric->record(slept > LOOP_INTERVAL ? slept - LOOP_INTERVAL : 0);
         monitor->update();
 		callback(controllers, 0);
-        std::this_thread::sleep_for(std::chrono::microseconds(500));
+		last = std::chrono::steady_clock::now();
+		updateMetric->record(std::chrono::duration_cast<std::chrono::microseconds>(last - start).count());
+        std::this_thread::sleep_for(std::chrono::microseconds(LOOP_INTERVAL));
     }
 }
 
 void ControllerManager::monitorJoystick(byte controller_index, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values) {
-	if(controller_index < 0 || controller_index > fd_count) return; // Invalid controller index
+	if(controller_index < 0 || controller_index > MAX_JOYSTICKS) return; // Invalid controller index
 	if(controller_index == 0) {
 		pluggedIn =  (button_values[0] & 0x01) > 0;
 		bool isFan = (button_values[0] & 0x02) > 0;
@@ -99,7 +145,22 @@ void ControllerManager::monitorJoystick(byte controller_index, byte button_count
 		}
 		return;
 	}
+	TRACE_SCOPE("report");
 	controller_index--;
+	ControllerData& seen = controllers[controller_index];
+	if(button_count == 0 && axis_count == 0) {
+		if(seen.button_count != 0 || seen.axis_count != 0) unplug(controller_index); // Its source dropped it
+		return; // Otherwise the Pico answering for a pad that was never plugged in
+	}
+	reportsMetric->add();
+	if(!made[controller_index]) setup_uinput_device(controller_index); // First report from this player
+	
+	int slot = controller_index + 1;
+	uint64_t now = 0;
+	if(recorder != nullptr) {
+		now = FlightRecorder::now();
+		recorder->record(now, FLIGHT_FRAME, slot, monitor->sequenceBits, monitor->sequence);
+	}
 	
 	if(controllers[controller_index].button_count < button_count || controllers[controller_index].axis_count < axis_count) {
 		controllers[controller_index].button_count = button_count;
@@ -110,88 +171,142 @@ void ControllerManager::monitorJoystick(byte controller_index, byte button_count
         byte bit_index = i % 8;
         byte button_state = (button_values[byte_index] >> bit_index) & 1;
 			
-		controllers[controller_index].button_states[i] = button_state == 1;
+		bool pressed = button_state == 1;
+		if(recorder != nullptr && controllers[controller_index].button_states[i] != pressed) {
+			recorder->record(now, FLIGHT_BUTTON, slot, i, pressed);
+		}
+		controllers[controller_index].button_states[i] = pressed;
 	}
 	for(byte i = 0; i < axis_count; i++) {
-        controllers[controller_index].axis[i].x = axis_values[i * 2];
-        controllers[controller_index].axis[i].y = axis_values[i * 2 + 1];
+		AxisData& axis = controllers[controller_index].axis[i];
+		if(recorder != nullptr) {
+			if(axis.x != axis_values[i * 2])     recorder->record(now, FLIGHT_AXIS, slot, i * 2, axis_values[i * 2]);
+			if(axis.y != axis_values[i * 2 + 1]) recorder->record(now, FLIGHT_AXIS, slot, i * 2 + 1, axis_values[i * 2 + 1]);
+		}
+        axis.x = axis_values[i * 2];
+        axis.y = axis_values[i * 2 + 1];
     }
+	{
+		std::lock_guard<std::mutex> guard(snapshotLock);
+		snapshot[controller_index] = controllers[controller_index];
+	}
 	
-	if(callback(controllers, controller_index)) return;
+	bool handled;
+	{
+		TRACE_SCOPE("joyCheck");
+		handled = callback(controllers, controller_index);
+	}
+	if(handled) { // A hotkey, neither uinput nor the feed see it
+		if(recorder != nullptr) recorder->record(now, FLIGHT_HANDLED, slot, 0, 0);
+		return;
+	}
+	if(feed != nullptr) feed->publish(controller_index, controllers[controller_index]);
 	
 	controller_index++;
 	emulateJoystick(controller_index, button_count, button_values, axis_count, axis_values);
 }
 
-void ControllerManager::emulateJoystick(byte controller_index, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values) {
-    int fd = fds[controller_index - 1]; // Convert to 0-based index
-    sendEvent(fd, EV_SYN, SYN_REPORT, 0);
-
-    for(byte i = 0; i < button_count; ++i) {
-		int code;
-        switch (i + 1) {
-            case 1: code = BTN_A; break;
-            case 2: code = BTN_B; break;
-            case 3: code = BTN_X; break;
-            case 4: code = BTN_Y; break;
-            case 5: code = BTN_START; break;
-            case 6: code = BTN_SELECT; break;
-            case 7: code = BTN_TL; break;
-            case 8: code = BTN_TR; break;
-            default: continue;
-        }
-        sendEvent(fd, EV_KEY, code, controllers[controller_index - 1].button_states[i]);
-    }
-	
-    sendEvent(fd, EV_SYN, SYN_REPORT, 0);
-	
-	if(controllers[controller_index - 1].axis[0].x > 100) {
-        sendEvent(fd, EV_KEY, BTN_DPAD_RIGHT, 1);
-        sendEvent(fd, EV_KEY, BTN_DPAD_LEFT, 0);
-	} else if(controllers[controller_index - 1].axis[0].x < -100) {
-        sendEvent(fd, EV_KEY, BTN_DPAD_RIGHT, 0);
-        sendEvent(fd, EV_KEY, BTN_DPAD_LEFT, 1);
-	} else {
-        sendEvent(fd, EV_KEY, BTN_DPAD_LEFT, 0);
-        sendEvent(fd, EV_KEY, BTN_DPAD_RIGHT, 0);
+// Lets go of everything the player was holding and takes it out of the
+// feed. Its device stays for when the pad comes back.
+void ControllerManager::unplug(byte controller_index) {
+	ControllerData& controller = controllers[controller_index];
+	int button_count = controller.button_count, axis_count = controller.axis_count;
+	if(recorder != nullptr) {
+		uint64_t now = FlightRecorder::now();
+		for(int i = 0; i < button_count; i++) {
+			if(controller.button_states[i]) recorder->record(now, FLIGHT_BUTTON, controller_index + 1, i, 0);
+		}
+		for(int i = 0; i < axis_count; i++) {
+			if(controller.axis[i].x != 0) recorder->record(now, FLIGHT_AXIS, controller_index + 1, i * 2, 0);
+			if(controller.axis[i].y != 0) recorder->record(now, FLIGHT_AXIS, controller_index + 1, i * 2 + 1, 0);
+		}
 	}
-	
-	if(controllers[controller_index - 1].axis[0].y > 100) {
-        sendEvent(fd, EV_KEY, BTN_DPAD_DOWN, 1);
-        sendEvent(fd, EV_KEY, BTN_DPAD_UP, 0);
-	} else if(controllers[controller_index - 1].axis[0].y < -100) {
-        sendEvent(fd, EV_KEY, BTN_DPAD_UP, 1);
-        sendEvent(fd, EV_KEY, BTN_DPAD_DOWN, 0);
-	} else {
-        sendEvent(fd, EV_KEY, BTN_DPAD_UP, 0);
-        sendEvent(fd, EV_KEY, BTN_DPAD_DOWN, 0);
+	memset(controller.button_states, 0, sizeof(controller.button_states));
+	memset(controller.axis, 0, sizeof(controller.axis));
+	controller.button_count = controller.axis_count = 0;
+	{
+		std::lock_guard<std::mutex> guard(snapshotLock);
+		snapshot[controller_index] = controller;
 	}
+	if(feed != nullptr) feed->unpublish(controller_index);
+
+	const byte buttons[REPORT_MAX_BUTTONS / 8] = {0};
+	const int16_t axes[REPORT_MAX_AXES * 2] = {0};
+	emulateJoystick(controller_index + 1, button_count, buttons, axis_count, axes);
+}
+
+// Only keys whose state differs from what uinput last saw are written, all in
+// one report with a single write()
+void ControllerManager::emulateJoystick(byte controller_index, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values) {
+    int device = controller_index - 1; // Convert to 0-based index
+    ControllerData& controller = controllers[device];
+
+    static const int buttonCodes[8] = {BTN_A, BTN_B, BTN_X, BTN_Y, BTN_START, BTN_SELECT, BTN_TL, BTN_TR};
+    for(byte i = 0; i < button_count && i < 8; ++i) {
+        sendKey(device, i, buttonCodes[i], controller.button_states[i]);
+    }
+
+    int16_t x = controller.axis[0].x, y = controller.axis[0].y;
+    sendKey(device, KEY_SLOT_RIGHT, BTN_DPAD_RIGHT, x > 100);
+    sendKey(device, KEY_SLOT_LEFT,  BTN_DPAD_LEFT,  x < -100);
+    sendKey(device, KEY_SLOT_DOWN,  BTN_DPAD_DOWN,  y > 100);
+    sendKey(device, KEY_SLOT_UP,    BTN_DPAD_UP,    y < -100);
 
-    sendEvent(fd, EV_SYN, SYN_REPORT, 0);
+    flushEvents(device);
 
-    if(DEBUG) {
-        std::cout << "\rAxes: ";
-        for(byte i = 0; i < axis_count * 2; ++i) {
-            std::cout << std::setw(3) << static_cast<int>(i) << ":" << std::setw(6) << controllers[controller_index - 1].axis[i].x << " " << controllers[controller_index - 1].axis[i].y << " ";
+    if(Log::enabled(LOG_LEVEL_DEBUG)) {
+        char axes[LOG_STRING_SIZE], buttons[LOG_STRING_SIZE];
+        int used = 0;
+        for(byte i = 0; i < axis_count && used < (int)sizeof(axes); ++i) {
+            used += snprintf(axes + used, sizeof(axes) - used, "%d:%d,%d ", i, controller.axis[i].x, controller.axis[i].y);
         }
-        std::cout << "Buttons: ";
-        for(byte i = 0; i < button_count; ++i) {
-            std::cout << std::setw(2) << static_cast<int>(i) << ":" << (controllers[controller_index - 1].button_states[i] ? "on " : "off ");
+        axes[std::min(used, (int)sizeof(axes) - 1)] = '\0';
+        for(byte i = 0; i < button_count && i < sizeof(buttons) - 1; ++i) {
+            buttons[i] = controller.button_states[i] ? '1' : '0';
         }
-        std::cout << std::flush;
-		if(!ONE_LINE) std::cout << std::endl;
+        buttons[std::min<int>(button_count, sizeof(buttons) - 1)] = '\0';
+        LOG_DEBUG("Joystick %d axes %sbuttons %s", controller_index, axis_count > 0 ? axes : "", buttons);
     }
 }
 
-void ControllerManager::sendEvent(int fd, int type, int code, int16_t value) {
-    struct input_event ev;
+void ControllerManager::sendKey(int device, int slot, int code, int value) {
+    if(keyStates[device][slot] == value) return;
+    keyStates[device][slot] = value;
+    sendEvent(device, EV_KEY, code, value);
+}
+
+// Queued until flushEvents(), the sink sees them straight away
+void ControllerManager::sendEvent(int device, int type, int code, int16_t value) {
+    if(sink != nullptr) sink(sinkContext, device, type, code, value);
+    // The last slot is kept for the SYN flushEvents() closes the report with
+    if(type != EV_SYN && pendingCount >= MAX_PENDING_EVENTS - 1) flushEvents(device);
+
+    struct input_event& ev = pending[pendingCount++];
     memset(&ev, 0, sizeof(ev));
     ev.type = type;
     ev.code = code;
     ev.value = value;
-    if(write(fd, &ev, sizeof(ev)) < 0) {
-        perror("Failed to write event");
+}
+
+// Closes the report and hands it to uinput, nothing at all if nothing changed
+void ControllerManager::flushEvents(int device) {
+    if(pendingCount == 0) return;
+    if(pending[pendingCount - 1].type != EV_SYN) sendEvent(device, EV_SYN, SYN_REPORT, 0);
+
+    TRACE_SCOPE("uinput write");
+    int fd = fds[device];
+    if(fd != -1 && write(fd, pending, pendingCount * sizeof(struct input_event)) < 0) {
+        writeErrorsMetric->add();
+        LOG_ERROR("Failed to write event: %s", strerror(errno));
     }
+    eventsMetric->add(pendingCount);
+    if(recorder != nullptr) {
+        uint64_t now = FlightRecorder::now();
+        for(int i = 0; i < pendingCount; ++i) {
+            if(pending[i].type == EV_KEY) recorder->record(now, FLIGHT_KEY, device + 1, pending[i].code, pending[i].value);
+        }
+    }
+    pendingCount = 0;
 }
 
 void ControllerManager::addSample(int newSample) {
@@ -214,6 +329,17 @@ float ControllerManager::getBatteryAverage() {
     return (float)sample_sum / sample_count;
 }
 
+// The main loop reads players through this, copying controllers itself would
+// race the monitor thread writing them mid report
+void ControllerManager::getControllers(ControllerData out[MAX_JOYSTICKS]) {
+	std::lock_guard<std::mutex> guard(snapshotLock);
+	memcpy(out, snapshot, sizeof(snapshot));
+}
+
 void ControllerManager::monitorRequest(byte func, unsigned int value){
 	monitor->request(func, value);
+}
+
+void ControllerManager::monitorRequest(byte func, unsigned int value, RequestCallback done, void* context){
+	monitor->request(func, value, done, context);
 }
\ No newline at end of file
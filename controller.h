@@ -2,6 +2,7 @@
 #define CONTROLLER_H
 
 #include <cstdint>
+#include <mutex>
 #include <unistd.h>
 #include <string>
 #include <vector>
@@ -9,10 +10,8 @@
 #include <linux/uinput.h>
 
 #include "monitor.h"
-
-// Define DEBUG as a boolean
-#define DEBUG false
-#define ONE_LINE false
+#include "state_feed.h"
+#include "flight_recorder.h"
 
 
 #define EVENT_BUTTON  1
@@ -31,6 +30,17 @@
 
 #define SAMPLE_SIZE 100
 
+#define MAX_PENDING_EVENTS 32
+
+#define MAX_JOYSTICKS 4 // Virtual joysticks, made when their controller first reports
+
+// Last value sent for each key, buttons use their index
+#define KEY_SLOT_UP    8
+#define KEY_SLOT_DOWN  9
+#define KEY_SLOT_LEFT  10
+#define KEY_SLOT_RIGHT 11
+#define KEY_SLOTS      12
+
 class ControllerManager {
 	
 public:
@@ -38,25 +48,44 @@ public:
 	bool pluggedIn;
 	
 	typedef bool (*JoyCallback)(ControllerData[],int);
+	typedef void (*EventSink)(void* context, int device, int type, int code, int value);
 	typedef uint8_t byte;
 	JoyCallback callback;
 	Monitor* monitor = nullptr;
-	ControllerData controllers[4];
+	ControllerData controllers[MAX_JOYSTICKS];
 
-    ControllerManager(JoyCallback callback);
+    ControllerManager(JoyCallback callback, bool createDevices = true);
     ~ControllerManager();
 	
 	
 	void setMonitor(Monitor* monitor);
+	void setEventSink(EventSink sink, void* context);
+	void setStateFeed(StateFeed* feed);
+	void setFlightRecorder(FlightRecorder* recorder);
 	int initMonitor();
 	void loop();
 	void monitorRequest(byte func, unsigned int value);
+	void monitorRequest(byte func, unsigned int value, RequestCallback done, void* context);
 	
 	float getBatteryAverage();
+	void getControllers(ControllerData out[MAX_JOYSTICKS]); // Safe from any thread, controllers is only for the monitor's
 	
 private:
-    int fds[4];  // File descriptors for the virtual joysticks
-    int fd_count = 0;
+    int fds[MAX_JOYSTICKS];  // File descriptors for the virtual joysticks, -1 when dry
+    bool made[MAX_JOYSTICKS] = {false}; // Only players that have sent something get a device
+	bool createDevices;
+	
+	EventSink sink = nullptr; // Sees every event, uinput or not
+	void* sinkContext = nullptr;
+	StateFeed* feed = nullptr; // Gets what uinput gets, as a snapshot, so not hotkeys
+	FlightRecorder* recorder = nullptr; // Reports in and keys out
+	
+	std::mutex snapshotLock; // Held for one copy, never while reporting
+	ControllerData snapshot[MAX_JOYSTICKS]; // controllers as of the last whole report
+	
+	int keyStates[MAX_JOYSTICKS][KEY_SLOTS];
+	struct input_event pending[MAX_PENDING_EVENTS];
+	int pendingCount = 0;
 	
 	bool controlMode = false;
 	
@@ -68,9 +97,13 @@ private:
     void setup_uinput_device(int joystick_id);
 	void addSample(int newSample);
 	
+	void unplug(byte controller_index);
     void emulateJoystick(byte controller_index, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values);
     void monitorJoystick(byte controller_index, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values);
-    void sendEvent(int fd, int type, int code, int16_t value);
+    static void onReport(void* context, byte controller_index, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values);
+    void sendKey(int device, int slot, int code, int value);
+    void sendEvent(int device, int type, int code, int16_t value);
+    void flushEvents(int device);
 };
 
 
@@ -0,0 +1,313 @@
+#include "evdev_monitor.h"
+#include "log.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <linux/input.h>
+#include <libevdev/libevdev.h>
+
+#define AXIS_FULL      32000 // What a dpad direction reads as, same as GpioMonitor
+#define STICK_DEADZONE 8192  // Axis 0 becomes a dpad, a resting stick must read 0
+
+#define DPAD_UP    0x01
+#define DPAD_DOWN  0x02
+#define DPAD_LEFT  0x04
+#define DPAD_RIGHT 0x08
+
+// Pipeline button index for a key, the order emulateJoystick() maps back to
+// BTN_* codes. Keyboards get the usual emulator layout.
+static int buttonIndex(int code) {
+	switch(code) {
+		case BTN_A:      case KEY_X:          return 0;
+		case BTN_B:      case KEY_Z:          return 1;
+		case BTN_X:      case KEY_S:          return 2;
+		case BTN_Y:      case KEY_A:          return 3;
+		case BTN_START:  case KEY_ENTER:      return 4;
+		case BTN_SELECT: case KEY_RIGHTSHIFT: return 5;
+		case BTN_TL:     case KEY_Q:          return 6;
+		case BTN_TR:     case KEY_W:          return 7;
+		case BTN_MODE:   case KEY_ESC:        return 8;
+		case BTN_THUMBL:                      return 9;
+		case BTN_THUMBR:                      return 10;
+		case BTN_TL2:                         return 11;
+		case BTN_TR2:                         return 12;
+		default:                              return -1;
+	}
+}
+
+static uint8_t dpadBit(int code) {
+	switch(code) {
+		case BTN_DPAD_UP:    case KEY_UP:    return DPAD_UP;
+		case BTN_DPAD_DOWN:  case KEY_DOWN:  return DPAD_DOWN;
+		case BTN_DPAD_LEFT:  case KEY_LEFT:  return DPAD_LEFT;
+		case BTN_DPAD_RIGHT: case KEY_RIGHT: return DPAD_RIGHT;
+		default:                             return 0;
+	}
+}
+
+// Dpad buttons win over the hat, the hat over the stick
+static int16_t sourceAxis(uint8_t dpad, uint8_t negative, uint8_t positive, int16_t hat, int16_t stick) {
+	if((dpad & (negative | positive)) != 0) {
+		return (dpad & positive ? AXIS_FULL : 0) - (dpad & negative ? AXIS_FULL : 0);
+	}
+	return hat != 0 ? hat : stick;
+}
+
+EvdevMonitor::EvdevMonitor(const std::string& devices, bool grab) : Monitor(){
+	this->devices = devices;
+	this->grab = grab;
+}
+
+EvdevMonitor::~EvdevMonitor(){
+	if(running) {
+		running = false;
+		uint64_t wake = 1;
+		if(write(wakeFd, &wake, sizeof(wake)) < 0) LOG_ERROR("eventfd: %s", strerror(errno));
+		reader.join();
+	}
+	for(int s = 0; s < sourceCount; s++) {
+		closeSource(sources[s]);
+	}
+	if(wakeFd != -1) close(wakeFd);
+}
+
+bool EvdevMonitor::init(){
+	if(devices.empty()) {
+		DIR* dir = opendir("/dev/input");
+		if(dir == nullptr) {
+			LOG_ERROR("/dev/input: %s", strerror(errno));
+			return false;
+		}
+		struct dirent* entry;
+		while((entry = readdir(dir)) != nullptr) {
+			if(strncmp(entry->d_name, "event", 5) != 0) continue;
+			openSource(std::string("/dev/input/") + entry->d_name, false);
+		}
+		closedir(dir);
+	} else {
+		size_t start = 0;
+		while(start < devices.size()) {
+			size_t end = devices.find(',', start);
+			if(end == std::string::npos) end = devices.size();
+			std::string path = devices.substr(start, end - start);
+			path.erase(0, path.find_first_not_of(' '));
+			path.erase(path.find_last_not_of(' ') + 1);
+			if(!path.empty()) openSource(path, true);
+			start = end + 1;
+		}
+	}
+
+	if(sourceCount == 0) {
+		LOG_ERROR("No input devices to read, set evdevDevices to pick them");
+		return false;
+	}
+
+	wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(wakeFd == -1) {
+		LOG_ERROR("eventfd: %s", strerror(errno));
+		return false;
+	}
+	running = true;
+	reader = std::thread(&EvdevMonitor::readerLoop, this);
+	return true;
+}
+
+// Sources are read on their own thread as events arrive, their reports are
+// handed on here so the manager only ever runs on the controller loop
+void EvdevMonitor::update(){
+	reports.deliver(*this);
+}
+
+void EvdevMonitor::request(byte func, unsigned int value){
+
+}
+
+bool EvdevMonitor::hasFeatures(int features){
+	return features == 0;
+}
+
+int EvdevMonitor::getSourceCount(){
+	int count = 0;
+	for(int s = 0; s < sourceCount; s++) {
+		if(sources[s].fd != -1) count++;
+	}
+	return count;
+}
+
+// Listed devices only need keys, found ones have to be a gamepad or joystick
+// so keyboards aren't picked up (and grabbed) by surprise
+bool EvdevMonitor::openSource(const std::string& path, bool listed){
+	if(sourceCount >= EVDEV_MAX_SOURCES) {
+		LOG_WARN("Too many input devices, ignoring %s", path.c_str());
+		return false;
+	}
+
+	int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd == -1) {
+		if(listed) LOG_ERROR("%s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	struct libevdev* dev = nullptr;
+	if(libevdev_new_from_fd(fd, &dev) < 0) {
+		if(listed) LOG_ERROR("%s is not an input device", path.c_str());
+		close(fd);
+		return false;
+	}
+
+	const char* name = libevdev_get_name(dev);
+	bool ours = strncmp(name, EVDEV_DEVICE_NAME, strlen(EVDEV_DEVICE_NAME)) == 0;
+	bool pad = libevdev_has_event_code(dev, EV_KEY, BTN_GAMEPAD) || libevdev_has_event_code(dev, EV_KEY, BTN_JOYSTICK);
+	if(ours || !libevdev_has_event_type(dev, EV_KEY) || (!listed && !pad)) {
+		if(listed) LOG_WARN("Not reading %s (%s)%s", name, path.c_str(), ours ? ", it is our own joystick" : "");
+		libevdev_free(dev);
+		close(fd);
+		return false;
+	}
+
+	if(grab && libevdev_grab(dev, LIBEVDEV_GRAB) < 0) {
+		LOG_WARN("Unable to grab %s, other programs will see it too", name);
+	}
+
+	Source& source = sources[sourceCount++];
+	source = Source();
+	source.dev = dev;
+	source.fd = fd;
+	LOG_INFO("Reading input from %s (%s)", name, path.c_str());
+	return true;
+}
+
+void EvdevMonitor::closeSource(Source& source){
+	if(source.fd == -1) return;
+	if(grab) libevdev_grab(source.dev, LIBEVDEV_UNGRAB);
+	libevdev_free(source.dev);
+	close(source.fd);
+	source = Source();
+}
+
+// Sleeps in poll() until a source has events or the destructor wakes it,
+// there is no timeout to poll on
+void EvdevMonitor::readerLoop(){
+	struct pollfd fds[EVDEV_MAX_SOURCES + 1];
+	int index[EVDEV_MAX_SOURCES];
+	while(running) {
+		int count = 0;
+		for(int s = 0; s < sourceCount; s++) {
+			if(sources[s].fd == -1) continue;
+			fds[count].fd = sources[s].fd;
+			fds[count].events = POLLIN;
+			index[count++] = s;
+		}
+		fds[count].fd = wakeFd;
+		fds[count].events = POLLIN;
+
+		if(poll(fds, count + 1, -1) <= 0) continue;
+		for(int i = 0; i < count; i++) {
+			if(fds[i].revents == 0) continue;
+			Source& source = sources[index[i]];
+			if(!readSource(source)) {
+				LOG_WARN("Input device %s went away", libevdev_get_name(source.dev));
+				closeSource(source);
+				report(); // Whatever it was holding is released
+			}
+		}
+	}
+}
+
+// Drains everything queued, false once the device is gone. After a
+// SYN_DROPPED libevdev replays the difference to its last known state.
+bool EvdevMonitor::readSource(Source& source){
+	struct input_event ev;
+	unsigned int flags = LIBEVDEV_READ_FLAG_NORMAL;
+	while(true) {
+		int rc = libevdev_next_event(source.dev, flags, &ev);
+		if(rc == LIBEVDEV_READ_STATUS_SUCCESS || (rc == LIBEVDEV_READ_STATUS_SYNC && flags == LIBEVDEV_READ_FLAG_SYNC)) {
+			handleEvent(source, ev);
+		} else if(rc == LIBEVDEV_READ_STATUS_SYNC) {
+			flags = LIBEVDEV_READ_FLAG_SYNC;
+		} else if(rc == -EAGAIN && flags == LIBEVDEV_READ_FLAG_SYNC) {
+			flags = LIBEVDEV_READ_FLAG_NORMAL;
+		} else {
+			return rc == -EAGAIN;
+		}
+	}
+}
+
+// Events only update the source, the merged state goes out once per
+// SYN_REPORT so a batch is one report however many events it held
+void EvdevMonitor::handleEvent(Source& source, const struct input_event& ev){
+	if(ev.type == EV_KEY) {
+		if(ev.value == 2) return; // Autorepeat
+		int index = buttonIndex(ev.code);
+		uint8_t bit = dpadBit(ev.code);
+		if(index >= 0) {
+			if(ev.value) {
+				source.buttons |= 1u << index;
+			} else {
+				source.buttons &= ~(1u << index);
+			}
+		} else if(bit != 0) {
+			if(ev.value) {
+				source.dpad |= bit;
+			} else {
+				source.dpad &= ~bit;
+			}
+		} else {
+			return;
+		}
+		source.changed = true;
+	} else if(ev.type == EV_ABS) {
+		switch(ev.code) {
+			case ABS_X:     source.stickX = scaleAxis(source, ev.code, ev.value); break;
+			case ABS_Y:     source.stickY = scaleAxis(source, ev.code, ev.value); break;
+			case ABS_HAT0X: source.hatX = ev.value < 0 ? -AXIS_FULL : ev.value > 0 ? AXIS_FULL : 0; break;
+			case ABS_HAT0Y: source.hatY = ev.value < 0 ? -AXIS_FULL : ev.value > 0 ? AXIS_FULL : 0; break;
+			default: return;
+		}
+		source.changed = true;
+	} else if(ev.type == EV_SYN && ev.code == SYN_REPORT && source.changed) {
+		source.changed = false;
+		report();
+	}
+}
+
+// -32767..32767 whatever range the device reports in
+int16_t EvdevMonitor::scaleAxis(Source& source, int code, int value){
+	const struct input_absinfo* info = libevdev_get_abs_info(source.dev, code);
+	if(info == nullptr || info->maximum <= info->minimum) return 0;
+
+	int scaled = (int)((int64_t)(value - info->minimum) * 65534 / (info->maximum - info->minimum)) - 32767;
+	return abs(scaled) < STICK_DEADZONE ? 0 : scaled;
+}
+
+// Merges every source and queues the result for update() if it changed. Buttons are
+// held if any source holds them, each axis goes to the furthest deflection.
+void EvdevMonitor::report(){
+	uint32_t buttons = 0;
+	int16_t x = 0, y = 0;
+	for(int s = 0; s < sourceCount; s++) {
+		const Source& source = sources[s];
+		if(source.fd == -1) continue;
+		buttons |= source.buttons;
+		int16_t sx = sourceAxis(source.dpad, DPAD_LEFT, DPAD_RIGHT, source.hatX, source.stickX);
+		int16_t sy = sourceAxis(source.dpad, DPAD_UP, DPAD_DOWN, source.hatY, source.stickY);
+		if(abs(sx) > abs(x)) x = sx;
+		if(abs(sy) > abs(y)) y = sy;
+	}
+	if(buttons == reportedButtons && x == reportedX && y == reportedY) return;
+	reportedButtons = buttons;
+	reportedX = x;
+	reportedY = y;
+
+	byte buttonValues[EVDEV_BUTTON_COUNT / 8];
+	for(size_t i = 0; i < sizeof(buttonValues); i++) {
+		buttonValues[i] = (buttons >> (i * 8)) & 0xFF;
+	}
+	int16_t axisValues[2] = {x, y};
+	reports.post(0, 0, EVDEV_CONTROLLER, EVDEV_BUTTON_COUNT, buttonValues, 1, axisValues);
+}
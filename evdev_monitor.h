@@ -0,0 +1,68 @@
+#ifndef EVDEV_MONITOR_H
+#define EVDEV_MONITOR_H
+
+#include "monitor.h"
+#include <atomic>
+#include <string>
+#include <thread>
+
+#define EVDEV_MAX_SOURCES  8
+#define EVDEV_CONTROLLER   1  // Every source feeds the first virtual joystick
+#define EVDEV_BUTTON_COUNT 16 // A B X Y Start Select TL TR, then Mode, thumbs and triggers
+#define EVDEV_DEVICE_NAME  "Xemplar PicoTroller" // Our own uinput devices, never read back
+
+struct libevdev;
+struct input_event;
+
+// Reads existing input devices (USB and Bluetooth pads, keyboards) through
+// libevdev and reports them to the manager as one controller, so hotkeys,
+// overlays and remapping work the same as with a Pico. Sources are listed
+// comma separated, or every gamepad and joystick found is used when empty.
+// With grab the sources are taken exclusively so nothing else sees them twice.
+class EvdevMonitor : public Monitor{
+public:
+	EvdevMonitor(const std::string& devices, bool grab = false);
+	~EvdevMonitor();
+
+	bool init() override;
+	void update() override;
+	void request(byte func, unsigned int value) override;
+	bool hasFeatures(int features) override;
+
+	int getSourceCount();
+
+private:
+	// State is kept per source and merged on every report, so a button held
+	// on one pad isn't released by another
+	struct Source {
+		struct libevdev* dev = nullptr;
+		int fd = -1;
+		bool changed = false;
+		uint32_t buttons = 0; // Bit per pipeline button index
+		uint8_t dpad = 0;     // DPAD_* bits from buttons or arrow keys
+		int16_t hatX = 0, hatY = 0, stickX = 0, stickY = 0;
+	};
+
+	std::string devices;
+	bool grab;
+	Source sources[EVDEV_MAX_SOURCES];
+	int sourceCount = 0;
+
+	std::thread reader;
+	std::atomic<bool> running{false};
+	int wakeFd = -1;
+
+	ReportQueue reports; // The reader posts, update() delivers on the controller loop
+	uint32_t reportedButtons = 0;
+	int16_t reportedX = 0, reportedY = 0;
+
+	bool openSource(const std::string& path, bool listed);
+	void closeSource(Source& source);
+	void readerLoop();
+	bool readSource(Source& source);
+	void handleEvent(Source& source, const struct input_event& ev);
+	void report();
+	int16_t scaleAxis(Source& source, int code, int value);
+};
+
+#endif // EVDEV_MONITOR_H
@@ -0,0 +1,57 @@
+#include "flight_recorder.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+FlightRecorder::FlightRecorder() {
+}
+
+void FlightRecorder::setWindow(int seconds) {
+	windowSeconds = seconds;
+}
+
+// Anything the writer may have overwritten while the ring was being copied
+// is dropped, as is anything older than the window
+bool FlightRecorder::dump(const std::string& path, const char* reason) {
+	std::vector<FlightRecord> copy(FLIGHT_RECORDS);
+	uint64_t end = head.load(std::memory_order_acquire);
+	uint64_t first = end > FLIGHT_RECORDS ? end - FLIGHT_RECORDS : 0;
+	for(uint64_t i = first; i < end; ++i) {
+		copy[i - first] = ring[i & (FLIGHT_RECORDS - 1)];
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint64_t after = head.load(std::memory_order_relaxed);
+	uint64_t safe = after >= FLIGHT_RECORDS ? after - FLIGHT_RECORDS + 1 : 0;
+	uint64_t start = std::max(first, safe);
+
+	FlightHeader header;
+	memset(&header, 0, sizeof(header));
+	header.dumpTime = now();
+	uint64_t window = (uint64_t)windowSeconds * 1000000000ULL;
+	uint64_t oldest = header.dumpTime > window ? header.dumpTime - window : 0; // Less than a window since boot
+	while(start < end && copy[start - first].time < oldest) start++;
+
+	header.magic = FLIGHT_MAGIC;
+	header.version = FLIGHT_VERSION;
+	header.recordSize = sizeof(FlightRecord);
+	header.count = end - start;
+	header.skipped = start;
+	snprintf(header.reason, sizeof(header.reason), "%s", reason);
+
+	FILE* out = fopen(path.c_str(), "wb");
+	if(out == nullptr) {
+		perror("FlightRecorder: fopen");
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+	if(header.count > 0) ok = ok && fwrite(&copy[start - first], sizeof(FlightRecord), header.count, out) == header.count;
+	ok = fclose(out) == 0 && ok;
+	if(!ok) {
+		perror("FlightRecorder: write");
+		return false;
+	}
+	std::cout << "Flight recorder: " << header.count << " records written to " << path << std::endl;
+	return true;
+}
@@ -0,0 +1,74 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+#define FLIGHT_RECORDS 65536 // Ring size, a power of two. 1 MB, a minute of steady play.
+#define FLIGHT_MAGIC   0x52465450 // "PTFR"
+#define FLIGHT_VERSION 1
+
+// Record kinds. Slots are players counted from 1.
+#define FLIGHT_FRAME   1 // A report from the monitor, value is its sequence number and code how many bits it has, 0 when unnumbered
+#define FLIGHT_BUTTON  2 // A button changed, code is the button, value 1 pressed
+#define FLIGHT_AXIS    3 // An axis moved, code is axis * 2 for x, axis * 2 + 1 for y
+#define FLIGHT_KEY     4 // Written to uinput, code is the EV_KEY code
+#define FLIGHT_HANDLED 5 // The report was taken by a hotkey, nothing went to uinput
+
+struct FlightRecord {
+	uint64_t time; // CLOCK_MONOTONIC ns, same clock as the evdev timestamps
+	int32_t value;
+	uint16_t code;
+	uint8_t kind;
+	uint8_t slot;
+};
+
+// A dump is this header and then count records, oldest first
+struct FlightHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t recordSize;
+	uint64_t dumpTime; // CLOCK_MONOTONIC ns when it was written
+	uint64_t count;
+	uint64_t skipped; // Records before the first one, overwritten or older than the window
+	char reason[16];
+};
+
+// Always on record of what came in from the monitor and what went out to
+// uinput, for working out after the fact why an input went missing. Written
+// by whichever thread runs the monitor's callback, one at a time, so adding a
+// record is a copy and a release store. A dump copies the ring without
+// stopping the writer and keeps the last window seconds of it.
+class FlightRecorder {
+public:
+	FlightRecorder();
+
+	void setWindow(int seconds);
+	bool dump(const std::string& path, const char* reason);
+
+	static inline uint64_t now() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	inline void record(uint64_t time, int kind, int slot, int code, int value) {
+		uint64_t h = head.load(std::memory_order_relaxed);
+		FlightRecord& r = ring[h & (FLIGHT_RECORDS - 1)];
+		r.time = time;
+		r.value = value;
+		r.code = code;
+		r.kind = kind;
+		r.slot = slot;
+		head.store(h + 1, std::memory_order_release);
+	}
+
+private:
+	std::atomic<uint64_t> head{0};
+	FlightRecord ring[FLIGHT_RECORDS];
+	int windowSeconds = 30;
+};
+
+#endif // FLIGHT_RECORDER_H
@@ -0,0 +1,117 @@
+#include "font.h"
+
+#include <cstring>
+#include <cmath>
+#include "font5x7.h"
+
+#define GLYPH_COUNT (FONT_LAST_CHAR - FONT_FIRST_CHAR + 1)
+#define SUBSAMPLES  4 // Per axis, 16 samples per pixel when anti-aliasing
+
+FontCache::FontCache() {
+	for(int s = 1; s <= FONT_SIZE_COUNT; ++s) {
+		rasterize(s);
+	}
+}
+
+static float sampleBit(int glyph, int col, int row) {
+	if(col < 0 || row < 0 || col >= 5 || row >= 7) return 0;
+	return (font5x7[glyph][col] >> row) & 1;
+}
+
+// Bilinear sample of the 1 bit glyph, treating everything outside as empty
+static float sampleGlyph(int glyph, float u, float v) {
+	u -= 0.5f; // Pixel centers
+	v -= 0.5f;
+	int col = (int)floorf(u);
+	int row = (int)floorf(v);
+	float fu = u - col;
+	float fv = v - row;
+
+	float top = sampleBit(glyph, col, row)     * (1 - fu) + sampleBit(glyph, col + 1, row)     * fu;
+	float bot = sampleBit(glyph, col, row + 1) * (1 - fu) + sampleBit(glyph, col + 1, row + 1) * fu;
+	return top * (1 - fv) + bot * fv;
+}
+
+void FontCache::rasterize(int size) {
+	int w = 5 * size;
+	int h = 7 * size;
+	std::vector<uint8_t>& out = masks[size - 1];
+	out.assign(GLYPH_COUNT * w * h, 0);
+
+	for(int g = 0; g < GLYPH_COUNT; ++g) {
+		uint8_t* mask = out.data() + g * w * h;
+
+		if(size == 1) { // Native size, just expand the bits
+			for(int i = 0; i < 5; ++i) {
+				for(int j = 0; j < 7; ++j) {
+					if(font5x7[g][i] & (1 << j)) mask[j * w + i] = 255;
+				}
+			}
+			continue;
+		}
+
+		// Larger sizes interpolate the bitmap and threshold it at half
+		// coverage, which smooths the diagonals instead of just doubling pixels
+		for(int y = 0; y < h; ++y) {
+			for(int x = 0; x < w; ++x) {
+				int hits = 0;
+				for(int sy = 0; sy < SUBSAMPLES; ++sy) {
+					for(int sx = 0; sx < SUBSAMPLES; ++sx) {
+						float u = (x + (sx + 0.5f) / SUBSAMPLES) / size;
+						float v = (y + (sy + 0.5f) / SUBSAMPLES) / size;
+						if(sampleGlyph(g, u, v) >= 0.5f) hits++;
+					}
+				}
+				mask[y * w + x] = (uint8_t)(hits * 255 / (SUBSAMPLES * SUBSAMPLES));
+			}
+		}
+	}
+}
+
+int FontCache::clampSize(int size) const {
+	if(size < 1) return 1;
+	if(size > FONT_SIZE_COUNT) return FONT_SIZE_COUNT;
+	return size;
+}
+
+const uint8_t* FontCache::getGlyph(char c, int size) const {
+	if(c < FONT_FIRST_CHAR || c > FONT_LAST_CHAR) return nullptr;
+	size = clampSize(size);
+	return masks[size - 1].data() + (c - FONT_FIRST_CHAR) * getGlyphWidth(size) * getGlyphHeight(size);
+}
+
+int FontCache::getGlyphWidth(int size) const {
+	return 5 * clampSize(size);
+}
+
+int FontCache::getGlyphHeight(int size) const {
+	return 7 * clampSize(size);
+}
+
+int FontCache::getAdvance(int size) const {
+	return 6 * clampSize(size); // 5 pixels + 1 pixel space
+}
+
+int FontCache::getLineHeight(int size) const {
+	return 8 * clampSize(size);
+}
+
+// Every glyph has the same advance, so this is one add per character. Cheaper
+// than hashing the string to look it up in a cache.
+int FontCache::getStringWidth(const char* str, int size) const {
+	int advance = getAdvance(size);
+	int startX = 0;
+	int maxX = 0;
+	while(*str) {
+		if(*str == '\n') {
+			if(startX > maxX) maxX = startX;
+			startX = 0;
+		} else {
+			startX += advance;
+		}
+		++str;
+	}
+	if(startX > maxX) maxX = startX;
+
+	return maxX;
+}
@@ -0,0 +1,32 @@
+#ifndef FONT_H
+#define FONT_H
+
+#include <cstdint>
+#include <vector>
+
+#define FONT_SIZE_COUNT   3  // 1x (5x7), 2x and 3x anti-aliased
+#define FONT_FIRST_CHAR   32
+#define FONT_LAST_CHAR    126
+
+// Pre-rasterized glyph masks for the 5x7 font. Every glyph of every size is
+// stored as an 8 bit coverage mask so text can be drawn row by row.
+class FontCache {
+public:
+	FontCache();
+
+	const uint8_t* getGlyph(char c, int size) const;
+	int getGlyphWidth(int size) const;
+	int getGlyphHeight(int size) const;
+	int getAdvance(int size) const;
+	int getLineHeight(int size) const;
+
+	int getStringWidth(const char* str, int size) const;
+
+private:
+	std::vector<uint8_t> masks[FONT_SIZE_COUNT];
+
+	void rasterize(int size);
+	int clampSize(int size) const;
+};
+
+#endif // FONT_H
@@ -1,4 +1,5 @@
 #include "gpio_monitor.h"
+#include "metrics.h"
 #include <chrono>
 #include <cstdlib>
 
@@ -9,6 +10,9 @@
 #define LEFT_BUTTON 10
 #define RIGHT_BUTTON 11
 
+static Counter* samplesMetric = Metrics::counter("picotroller_gpio_samples_total", "Passes reading every configured pin");
+static Counter* reportsMetric = Metrics::counter("picotroller_gpio_reports_total", "Debounced button changes reported");
+
 GpioMonitor::GpioMonitor() : GpioMonitor(Properties("gpio.prop")){
 	
 }
@@ -93,7 +97,8 @@ void GpioMonitor::update(){
 		}
 		
 		if(needUpdate){
-			callback(1, 32, button_values, 4, axis_values);
+			reportsMetric->add();
+			callback(callbackContext, 1, 32, button_values, 4, axis_values);
 		}
 	}
 	for(int i = 0; i < GPIO_BUTTON_COUNT; i++){
@@ -108,6 +113,7 @@ void GpioMonitor::update(){
 			
 		gpio.writePin(buttons[i].pin, buttons[i].state ? 1 : 0);
 	}
+	samplesMetric->add();
 }
 
 void GpioMonitor::request(byte func, unsigned int value){
@@ -0,0 +1,66 @@
+#include "layout.h"
+
+#include "font.h"
+
+Layout::Layout() : Layout(LAYOUT_REF_WIDTH, LAYOUT_REF_HEIGHT) {}
+
+Layout::Layout(int width, int height) {
+	resize(width, height);
+}
+
+void Layout::resize(int width, int height) {
+	this->width = width;
+	this->height = height;
+
+	// Keep the aspect ratio of the design, the smaller axis wins
+	int sx = (width << 8) / LAYOUT_REF_WIDTH;
+	int sy = (height << 8) / LAYOUT_REF_HEIGHT;
+	scale256 = sx < sy ? sx : sy;
+	if(scale256 < 1) scale256 = 1;
+}
+
+int Layout::getWidth() const {
+	return width;
+}
+
+int Layout::getHeight() const {
+	return height;
+}
+
+// Design units to pixels
+int Layout::scale(int value) const {
+	return (value * scale256 + 128) >> 8;
+}
+
+// Largest font size that is still no bigger than the design asked for
+int Layout::fontSize() const {
+	int size = scale256 >> 8;
+	if(size < 1) return 1;
+	if(size > FONT_SIZE_COUNT) return FONT_SIZE_COUNT;
+	return size;
+}
+
+// Position a w x h box (design units) against the given screen edges. x and y
+// are offsets away from the anchored edge, or from the center when centered.
+Rect Layout::place(int anchor, int x, int y, int w, int h) const {
+	Rect r;
+	r.width = scale(w);
+	r.height = scale(h);
+
+	if(anchor & ANCHOR_RIGHT) {
+		r.x = width - scale(x) - r.width;
+	} else if(anchor & ANCHOR_HCENTER) {
+		r.x = (width - r.width) / 2 + scale(x);
+	} else {
+		r.x = scale(x);
+	}
+
+	if(anchor & ANCHOR_BOTTOM) {
+		r.y = height - scale(y) - r.height;
+	} else if(anchor & ANCHOR_VCENTER) {
+		r.y = (height - r.height) / 2 + scale(y);
+	} else {
+		r.y = scale(y);
+	}
+	return r;
+}
@@ -0,0 +1,37 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "surface.h"
+
+#define ANCHOR_LEFT     0x01
+#define ANCHOR_HCENTER  0x02
+#define ANCHOR_RIGHT    0x04
+#define ANCHOR_TOP      0x10
+#define ANCHOR_VCENTER  0x20
+#define ANCHOR_BOTTOM   0x40
+
+// Overlays are designed against this resolution, then laid out for the real one
+#define LAYOUT_REF_WIDTH  320
+#define LAYOUT_REF_HEIGHT 240
+
+class Layout {
+public:
+	Layout();
+	Layout(int width, int height);
+
+	void resize(int width, int height);
+
+	int getWidth() const;
+	int getHeight() const;
+
+	int scale(int value) const;
+	int fontSize() const;
+
+	Rect place(int anchor, int x, int y, int w, int h) const;
+
+private:
+	int width, height;
+	int scale256; // Uniform design unit scale, 8.8 fixed point
+};
+
+#endif // LAYOUT_H
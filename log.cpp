@@ -0,0 +1,130 @@
+#include "log.h"
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+
+#define LOG_IDLE_WAIT  10 // ms the writer sleeps when the queue is empty
+#define LOG_FLUSH_WAIT 200 // ms flush() gives the writer at most
+
+std::atomic<int> Log::verbosity{LOG_LEVEL_INFO};
+
+// Bounded multi producer queue after Vyukov. A slot's seq is its position
+// when free and position + 1 once written, so producers only contend on
+// enqueuePos and the writer never takes a lock at all.
+static LogRecord queue[LOG_QUEUE_SIZE];
+static std::atomic<uint64_t> enqueuePos{0}, dequeuePos{0};
+static std::atomic<uint64_t> dropped{0};
+
+static const char LEVEL_TAGS[] = {'E', 'W', 'I', 'D'};
+
+// Formats and writes everything queued. Errors and warnings go to stderr,
+// the rest to stdout, each line in one write().
+static void drain() {
+	char line[LOG_LINE_SIZE];
+	while(true) {
+		uint64_t pos = dequeuePos.load(std::memory_order_relaxed);
+		LogRecord& record = queue[pos & (LOG_QUEUE_SIZE - 1)];
+		if(record.seq.load(std::memory_order_acquire) != pos + 1) return;
+
+		time_t seconds = record.time / 1000000000LL;
+		struct tm local;
+		localtime_r(&seconds, &local);
+		int len = strftime(line, sizeof(line), "%H:%M:%S", &local);
+		len += snprintf(line + len, sizeof(line) - len, ".%03d %c ", (int)(record.time / 1000000 % 1000), LEVEL_TAGS[record.level]);
+		record.format(line + len, sizeof(line) - len, record.fmt, record.payload);
+		len = strlen(line);
+		if(record.suppressed > 0 && len < (int)sizeof(line)) {
+			len += snprintf(line + len, sizeof(line) - len, " (%d more like this not shown)", record.suppressed);
+		}
+		uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+		if(lost > 0 && len < (int)sizeof(line)) {
+			len += snprintf(line + len, sizeof(line) - len, " (%llu messages lost, the log fell behind)", (unsigned long long)lost);
+		}
+		if(len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+		line[len++] = '\n';
+
+		record.seq.store(pos + LOG_QUEUE_SIZE, std::memory_order_release);
+		dequeuePos.store(pos + 1, std::memory_order_release);
+		if(write(record.level <= LOG_LEVEL_WARN ? STDERR_FILENO : STDOUT_FILENO, line, len) < 0) {} // Nowhere left to complain
+	}
+}
+
+// Started before main() and stopped after it, so nothing logged is lost
+// either side of it
+class LogWriter {
+public:
+	LogWriter() {
+		for(uint64_t i = 0; i < LOG_QUEUE_SIZE; ++i) queue[i].seq.store(i, std::memory_order_relaxed);
+		running = true;
+		worker = std::thread(&LogWriter::run, this);
+	}
+	~LogWriter() {
+		running = false;
+		if(worker.joinable()) worker.join();
+		drain();
+	}
+
+private:
+	std::thread worker;
+	std::atomic<bool> running{false};
+
+	void run() {
+		while(running) {
+			drain();
+			std::this_thread::sleep_for(std::chrono::milliseconds(LOG_IDLE_WAIT));
+		}
+	}
+};
+
+static LogWriter writer;
+
+void Log::setLevel(int level) {
+	verbosity.store(level, std::memory_order_relaxed);
+}
+
+int Log::parseLevel(const std::string& name) {
+	static const char* names[] = {"error", "warn", "info", "debug"};
+	for(int i = 0; i <= LOG_LEVEL_DEBUG; ++i) {
+		if(name == names[i]) return i;
+	}
+	return -1;
+}
+
+void Log::flush() {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(LOG_FLUSH_WAIT);
+	while(dequeuePos.load(std::memory_order_acquire) < enqueuePos.load(std::memory_order_relaxed)) {
+		if(std::chrono::steady_clock::now() > deadline) return;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+// Lets LOG_RATE_LIMIT messages through each second. Approximate when threads
+// race on the window, which is fine for keeping a flood off the terminal.
+bool Log::allow(LogLimit& limit, int64_t now, int& suppressed) {
+	suppressed = 0;
+	int64_t start = limit.windowStart.load(std::memory_order_relaxed);
+	if(now - start >= 1000000000LL && limit.windowStart.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+		suppressed = limit.suppressed.exchange(0, std::memory_order_relaxed);
+		limit.count.store(0, std::memory_order_relaxed);
+	}
+	if(limit.count.fetch_add(1, std::memory_order_relaxed) < LOG_RATE_LIMIT) return true;
+	limit.suppressed.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+// nullptr when the queue is full, the message is counted and dropped
+LogRecord* Log::claim(uint64_t& pos) {
+	pos = enqueuePos.load(std::memory_order_relaxed);
+	while(true) {
+		LogRecord& record = queue[pos & (LOG_QUEUE_SIZE - 1)];
+		int64_t diff = (int64_t)record.seq.load(std::memory_order_acquire) - (int64_t)pos;
+		if(diff == 0) {
+			if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return &record;
+		} else if(diff < 0) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		} else {
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+}
@@ -0,0 +1,146 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+#define LOG_QUEUE_SIZE  256 // Messages waiting for the writer, a power of two
+#define LOG_PAYLOAD     448 // Bytes of arguments one message can carry
+#define LOG_STRING_SIZE 128 // Longest string argument kept, longer ones are cut
+#define LOG_LINE_SIZE   512
+#define LOG_RATE_LIMIT  20  // Messages a second from one call site, the rest are only counted
+
+// printf style logging that never waits on the terminal. A message below the
+// verbosity costs one relaxed load, its arguments aren't even evaluated.
+// Otherwise the arguments are copied into a lock free queue, strings
+// included, and a background thread formats and writes them. A full queue
+// drops the message instead of blocking, and each call site is rate limited.
+// Pass strings as const char*, e.g. path.c_str().
+#define LOG_AT(level, ...) do { \
+	if(Log::enabled(level)) { \
+		static LogLimit logLimit; \
+		if(false) Log::check(__VA_ARGS__); \
+		Log::write(level, logLimit, __VA_ARGS__); \
+	} \
+} while(0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Per call site, shared by every thread that gets there
+struct LogLimit {
+	std::atomic<int64_t> windowStart;
+	std::atomic<int> count, suppressed;
+};
+
+// String arguments are copied, the caller's buffer may be gone by the time
+// the writer gets to them
+struct LogString {
+	char text[LOG_STRING_SIZE];
+
+	LogString(const char* s) {
+		if(s == nullptr) s = "(null)";
+		size_t len = strnlen(s, LOG_STRING_SIZE - 1);
+		memcpy(text, s, len);
+		text[len] = '\0';
+	}
+};
+
+template<typename T> struct LogStored { typedef T type; };
+template<> struct LogStored<char*> { typedef LogString type; };
+template<> struct LogStored<const char*> { typedef LogString type; };
+
+template<int...> struct LogIndices {};
+template<int N, int... I> struct LogBuild : LogBuild<N - 1, N - 1, I...> {};
+template<int... I> struct LogBuild<0, I...> { typedef LogIndices<I...> type; };
+
+inline const char* logArg(const LogString& s) { return s.text; }
+template<typename T> inline const T& logArg(const T& v) { return v; }
+
+typedef void (*LogFormatter)(char* out, size_t size, const char* fmt, const void* payload);
+
+struct LogRecord {
+	std::atomic<uint64_t> seq; // Queue bookkeeping, says whose turn the slot is
+	int level;
+	int suppressed; // Messages the call site's rate limit swallowed before this one
+	int64_t time; // CLOCK_REALTIME ns
+	const char* fmt;
+	LogFormatter format;
+	alignas(8) char payload[LOG_PAYLOAD];
+};
+
+class Log {
+public:
+	static inline bool enabled(int level) {
+		return level <= verbosity.load(std::memory_order_relaxed);
+	}
+
+	static void setLevel(int level);
+	static int parseLevel(const std::string& name); // error, warn, info or debug, -1 if none
+	static void flush(); // Waits, briefly, for everything queued to be written
+
+	// Only there for the compiler to check the format against the arguments
+	__attribute__((format(printf, 1, 2))) static inline void check(const char* fmt, ...) {}
+
+	template<typename... Args>
+	static void write(int level, LogLimit& limit, const char* fmt, const Args&... args) {
+		typedef std::tuple<typename LogStored<typename std::decay<Args>::type>::type...> Payload;
+		static_assert(sizeof(Payload) <= LOG_PAYLOAD, "Too much to log in one message");
+
+		int64_t now = realtimeNs();
+		int suppressed;
+		if(!allow(limit, now, suppressed)) return;
+		uint64_t pos;
+		LogRecord* record = claim(pos);
+		if(record == nullptr) return;
+
+		record->level = level;
+		record->suppressed = suppressed;
+		record->time = now;
+		record->fmt = fmt;
+		record->format = &formatPayload<Payload>;
+		new (record->payload) Payload(args...);
+		record->seq.store(pos + 1, std::memory_order_release);
+	}
+
+private:
+	static std::atomic<int> verbosity;
+
+	static inline int64_t realtimeNs() {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+
+	static bool allow(LogLimit& limit, int64_t now, int& suppressed);
+	static LogRecord* claim(uint64_t& pos);
+
+	template<typename Payload, int... I>
+	static void formatWith(char* out, size_t size, const char* fmt, const Payload& p, LogIndices<I...>) {
+		snprintf(out, size, fmt, logArg(std::get<I>(p))...);
+	}
+	template<typename Payload>
+	static void formatWith(char* out, size_t size, const char* fmt, const Payload&, LogIndices<>) {
+		snprintf(out, size, "%s", fmt);
+	}
+	template<typename Payload>
+	static void formatPayload(char* out, size_t size, const char* fmt, const void* payload) {
+		formatWith(out, size, fmt, *static_cast<const Payload*>(payload), typename LogBuild<std::tuple_size<Payload>::value>::type());
+	}
+};
+
+#endif // LOG_H
@@ -1,3 +1,4 @@
+#include <atomic>
 #include <iostream>
 #include <cstdio>
 #include <thread>
@@ -6,14 +7,27 @@
 #include <libgen.h>
 #include <cstring>
 #include <string>
+#include <sstream>
 #include <sys/reboot.h>
+#include <csignal>
+#include <stdexcept>
 
 #include "overlay.h"
+#include "layout.h"
 #include "pico_monitor.h"
 #include "gpio_monitor.h"
+#include "evdev_monitor.h"
+#include "network_monitor.h"
+#include "multi_monitor.h"
 #include "controller.h"
 #include "GPIO.h"
 #include "properties.h"
+#include "volume.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flight_recorder.h"
+#include "log.h"
+#include "control_server.h"
 
 #define VERSION "0.1"
 
@@ -31,23 +45,64 @@
 
 #define DEBUG_GPIO_OVERLAY false
 
+#define FLIGHT_HOLD 2000 // joyCheck calls holding Select+L+R before a flight recorder dump, about a second
+#define FLIGHT_SIGNAL 1 // Why the flight recorder was asked to dump
+#define FLIGHT_HOTKEY 2
+#define FLIGHT_SOCKET 3
+
+// Overlay images, their paths are worked out once by loadAssetPaths() so
+// drawing a popup doesn't build strings
+#define ASSET_SIDE_PANEL      0
+#define ASSET_BATTERY         1
+#define ASSET_VOLUME_FULL     2
+#define ASSET_VOLUME_MED      3
+#define ASSET_VOLUME_LOW      4
+#define ASSET_VOLUME_MUTE     5
+#define ASSET_BRIGHTNESS_FULL 6
+#define ASSET_BRIGHTNESS_HALF 7
+#define ASSET_BRIGHTNESS_NONE 8
+#define ASSET_FAN             9 // 8 frames
+#define ASSET_COUNT           17
+
 using String = std::string;
 
-int VOLUME_STEP_SIZE = 1, VOLUME_MIN = 0, VOLUME_MAX = 1;
+int VOLUME_STEP_SIZE = 1, VOLUME_MIN = 0, VOLUME_MAX = 1; // Step is in percent
 int SELECT_BUTTON, START_BUTTON, L_BUTTON, R_BUTTON, A_BUTTON, B_BUTTON, X_BUTTON, Y_BUTTON;
 bool joyCheck(ControllerData[], int);
 std::string getLocalFile(const std::string& filename);
 
+const char* ASSET_FILES[ASSET_COUNT] = {
+	"assets/overlay_rp.png", "assets/battery_overlay.png",
+	"assets/volume_full.png", "assets/volume_med.png", "assets/volume_low.png", "assets/volume_mute.png",
+	"assets/brightness_full.png", "assets/brightness_half.png", "assets/brightness_none.png",
+	"assets/fan_0.png", "assets/fan_1.png", "assets/fan_2.png", "assets/fan_3.png",
+	"assets/fan_4.png", "assets/fan_5.png", "assets/fan_6.png", "assets/fan_7.png"
+};
+std::string assetPaths[ASSET_COUNT];
+
+void loadAssetPaths() {
+	for(int i = 0; i < ASSET_COUNT; i++) assetPaths[i] = getLocalFile(ASSET_FILES[i]);
+}
+
 Monitor* monitor = nullptr;
 ControllerManager manager(joyCheck);
 OverlayManager overlay;
+Layout layout;
+VolumeControl volume;
 GPIO gpio;
 
 volatile int overlay_counter = 0, fanCounter = 0, special_counter = 0;
-int last_vol, overlay_id = -1, overlay_dir;
-std::string audDevice;
+int flight_counter = 0;
+std::atomic<int> flightRequested(0); // Dumped from the main loop, signal handlers can't do file IO
+std::atomic<int> last_vol(0); // Set by the controller and mixer watcher threads, drawn by the main loop
+int overlay_id = -1, overlay_dir;
+int shown_overlay_id = -2, shown_value = -1;
+int statusLayer = -1, hudPercent = -1;
+bool hudCharging = false;
+std::string audDevice, audCard;
 
 void controllerLoop() {
+    TRACE_THREAD("controller");
     manager.loop();
 }
 
@@ -77,129 +132,147 @@ int getBatteryPercentage(float voltage) {
 	return perc;
 }
 
-void drawVolumeOverlay(int dir, int value) {
-	overlay.drawPNG(getLocalFile("assets/overlay_rp.png").c_str(), 0, 0);
+// Right hand panel shared by the volume, fan and backlight overlays
+void drawSidePanel(int icon, float ratio) {
+	// The art is a full design size frame, scaled and anchored like the icon and
+	// bar so they stay on its slots. Its panel meets the right edge and the rest
+	// is transparent, so a margin left over on another aspect ratio needs nothing.
+	Rect art = layout.place(ANCHOR_RIGHT | ANCHOR_TOP, 0, 0, LAYOUT_REF_WIDTH, LAYOUT_REF_HEIGHT);
+	overlay.drawPNG(assetPaths[ASSET_SIDE_PANEL].c_str(), art.x, art.y, art.width, art.height, SCALE_BILINEAR);
+	
+	Rect iconRect = layout.place(ANCHOR_RIGHT | ANCHOR_TOP, 7, 39, 24, 24);
+	overlay.drawPNG(assetPaths[icon].c_str(), iconRect.x, iconRect.y, iconRect.width, iconRect.height, SCALE_BILINEAR);
+	
+	Rect bar = layout.place(ANCHOR_RIGHT | ANCHOR_TOP, 8, 65, 22, 120);
+	
+	int fontSize = layout.fontSize();
+	char dStr[8];
+	snprintf(dStr, sizeof(dStr), "%d", (int)(ratio * 100));
+	int xOff = bar.x + (bar.width - overlay.getStringWidth(dStr, fontSize) + 1) / 2;
+	
+	overlay.drawString(dStr, xOff, layout.scale(190), 0xFFFF, 0xF0, fontSize);
 	
+	int inner = bar.height - 2;
+	int h = (inner * ratio);
+	
+	overlay.drawRect(bar.x, bar.y, bar.width, bar.height, 0xFFFF, 0xFF);
+	overlay.fillRect(bar.x + 1, bar.y + 1 + (inner - h), bar.width - 2, h, 0xFFFF, 0xFF);
+}
+
+void drawVolumeOverlay(int dir, int value) {
 	float ratio = (float)(value - VOLUME_MIN) / (VOLUME_MAX - VOLUME_MIN);
 	float percent = ratio * 100;
 	
+	int icon;
 	if(percent > 70){
-		overlay.drawPNG(getLocalFile("assets/volume_full.png").c_str(), 289, 39);
+		icon = ASSET_VOLUME_FULL;
 	} else if(percent > 40){
-		overlay.drawPNG(getLocalFile("assets/volume_med.png").c_str(), 289, 39);
+		icon = ASSET_VOLUME_MED;
 	}  else if(percent > 1){
-		overlay.drawPNG(getLocalFile("assets/volume_low.png").c_str(), 289, 39);
+		icon = ASSET_VOLUME_LOW;
 	} else {
-		overlay.drawPNG(getLocalFile("assets/volume_mute.png").c_str(), 289, 39);
+		icon = ASSET_VOLUME_MUTE;
 	}
 	
-	std::string dStr = std::to_string((int)(percent));
-	int xOff = 293;
-	
-	int strLen = dStr.length();
-	if(strLen == 1) xOff += 5;
-	if(strLen == 2) xOff += 2;
-	
-	overlay.drawString(dStr.c_str(), xOff, 190, 0xFFFF, 0xF0);
-	
-	int h = (118 * ratio);
-	
-	overlay.drawRect(290, 65, 22, 120, 0xFFFF, 0xFF);
-	overlay.fillRect(291, 66 + (118 - h), 20, h, 0xFFFF, 0xFF);
+	drawSidePanel(icon, ratio);
 }
 
 void drawFanOverlay(int value, int change) {
-	overlay.drawPNG(getLocalFile("assets/overlay_rp.png").c_str(), 0, 0);
-	
 	fanCounter = (fanCounter+1) % 8;
 	int fanFrame = fanCounter;
 	
-	std::string path = getLocalFile("assets/fan_" + std::to_string(fanFrame) + ".png");
-	overlay.drawPNG(path.c_str(), 289, 39);
+	int icon = ASSET_FAN + fanFrame;
 	
 	value -= FAN_MIN_VALUE;
 	if(value < 0) value = 0;
 	
 	float ratio = (float)value / (255 - FAN_MIN_VALUE);
-	float percent = ratio * 100;
-	
-	std::string dStr = std::to_string((int)(percent));
-	int xOff = 293;
-	
-	int strLen = dStr.length();
-	if(strLen == 1) xOff += 5;
-	if(strLen == 2) xOff += 2;
-	
-	overlay.drawString(dStr.c_str(), xOff, 190, 0xFFFF, 0xF0);
-	
-	int h = (118 * ratio);
 	
-	overlay.drawRect(290, 65, 22, 120, 0xFFFF, 0xFF);
-	overlay.fillRect(291, 66 + (118 - h), 20, h, 0xFFFF, 0xFF);
+	drawSidePanel(icon, ratio);
 }
 
 void drawBacklightOverlay(int value, int change) {
-	overlay.drawPNG(getLocalFile("assets/overlay_rp.png").c_str(), 0, 0);
-	
 	if(value < 0) value = 0;
 	
 	float ratio = (float)value / 255;
 	float percent = ratio * 100;
 	
+	int icon;
 	if(percent > 75){
-		overlay.drawPNG(getLocalFile("assets/brightness_full.png").c_str(), 289, 39);
+		icon = ASSET_BRIGHTNESS_FULL;
 	} else if(percent > 25){
-		overlay.drawPNG(getLocalFile("assets/brightness_half.png").c_str(), 289, 39);
+		icon = ASSET_BRIGHTNESS_HALF;
 	} else {
-		overlay.drawPNG(getLocalFile("assets/brightness_none.png").c_str(), 289, 39);
+		icon = ASSET_BRIGHTNESS_NONE;
 	}
 	
-	std::string dStr = std::to_string((int)(percent));
-	int xOff = 293;
+	drawSidePanel(icon, ratio);
+}
+
+float getBatteryVoltage(float value) {
+	return (((value / (float)4096) * VREF_ADC) + VOFF) * RESISTOR_RATIO;
+}
+
+void drawBatteryOverlay(int value) {
+	Rect art = layout.place(ANCHOR_HCENTER | ANCHOR_TOP, 0, 0, LAYOUT_REF_WIDTH, LAYOUT_REF_HEIGHT); // Centered like the bar below
+	overlay.drawPNG(assetPaths[ASSET_BATTERY].c_str(), art.x, art.y, art.width, art.height, SCALE_BILINEAR);
 	
-	int strLen = dStr.length();
-	if(strLen == 1) xOff += 5;
-	if(strLen == 2) xOff += 2;
+	float voltage = getBatteryVoltage(value);
+	int percent = getBatteryPercentage(voltage);
 	
-	overlay.drawString(dStr.c_str(), xOff, 190, 0xFFFF, 0xF0);
+	char dStr[40];
+	snprintf(dStr, sizeof(dStr), "%d%% (%.3fv) %s", percent, voltage, manager.pluggedIn ? "Charging" : "Battery");
 	
-	int h = (118 * ratio);
+	int fontSize = layout.fontSize();
+	int xOff = (layout.getWidth() - overlay.getStringWidth(dStr, fontSize)) / 2;
+	overlay.drawString(dStr, xOff, layout.scale(24), 0xFFFF, 0xFF, fontSize);
 	
-	overlay.drawRect(290, 65, 22, 120, 0xFFFF, 0xFF);
-	overlay.fillRect(291, 66 + (118 - h), 20, h, 0xFFFF, 0xFF);
+	Rect bar = layout.place(ANCHOR_HCENTER | ANCHOR_TOP, 0, 2, 234, 16);
+	int inner = bar.width - 2;
+	int width = (float)inner / 100 * percent;
+	overlay.drawRect(bar.x, bar.y, bar.width, bar.height, 0xFFFF, 0xFF);
+	overlay.fillRect(bar.x + 1 + (inner - width), bar.y + 1, width, bar.height - 2, 0xFFFF, 0xFF);
 }
 
-void drawBatteryOverlay(int value) {
-	overlay.drawPNG(getLocalFile("assets/battery_overlay.png").c_str(), 0, 0);
-	
-	float voltage = (((value / (float)4096) * VREF_ADC) + VOFF) * RESISTOR_RATIO;
-	int percent = getBatteryPercentage(voltage);
+// Small always visible battery readout in the top right corner, lives on its
+// own layer so it is only redrawn when the reading changes
+void drawStatusHud() {
+	int percent = getBatteryPercentage(getBatteryVoltage(manager.getBatteryAverage()));
+	bool charging = manager.pluggedIn;
+	if(percent == hudPercent && charging == hudCharging) return;
+	hudPercent = percent;
+	hudCharging = charging;
+	
+	overlay.selectLayer(statusLayer);
+	overlay.clearScreen();
 	
-	char buffer[20];
-    sprintf(buffer, "%d%% (%.3fv)", percent, voltage);
+	char buffer[8];
+	sprintf(buffer, "%d%%", percent);
 	
-	std::string dStr = std::string(buffer) + (manager.pluggedIn ? " Charging" : " Battery");
-	int xOff = (320 - overlay.getStringWidth(dStr.c_str())) / 2;
-	//xOff += (3 - dStr.length()) * 3;
-	overlay.drawString(dStr.c_str(), xOff, 24, 0xFFFF, 0xFF);
+	int fontSize = layout.fontSize();
+	int textWidth = overlay.getStringWidth(buffer, fontSize);
+	Rect hud = layout.place(ANCHOR_RIGHT | ANCHOR_TOP, 2, 2, 40, 9);
+	int textX = hud.width - textWidth;
 	
+	int symbol = charging ? 0 : (percent > 66 ? 2 : (percent > 33 ? 3 : 4)); // Plugged in, full, half or low battery
+	overlay.drawSymbol(symbol, textX - 7, 0, 0xFFFF, 0xFF);
+	overlay.drawString(buffer, textX, 0, 0xFFFF, 0xFF, fontSize);
 	
-	int width = (float)232 / 100 * percent;
-	overlay.drawRect(43, 2, 234, 16, 0xFFFF, 0xFF);
-	overlay.fillRect(44 + (232 - width), 3, width, 14, 0xFFFF, 0xFF);
+	overlay.selectLayer(0);
 }
 
 void render_pin_states(){
 	int size = 10;
 	int xOff = 75;
 	int yOff = 20;
+	int screenWidth = overlay.getWidth();
 	
-	overlay.fillRect(320 - (size * 2 + xOff), yOff, size * 2, size * 20, 0xFFFF, 0xFF);
+	overlay.fillRect(screenWidth - (size * 2 + xOff), yOff, size * 2, size * 20, 0xFFFF, 0xFF);
 	for(int i = 0; i < 40; i++){
-		int x = i < 20 ? 320 - (size * 2 + xOff) : 320 - (size + xOff);
+		int x = i < 20 ? screenWidth - (size * 2 + xOff) : screenWidth - (size + xOff);
 		int y = (i % 20) * size + yOff;
 		
-		int textX = i < 20 ? 320 - ((size * 8) + xOff - 6) : 320 - (xOff - 1);
+		int textX = i < 20 ? screenWidth - ((size * 8) + xOff - 6) : screenWidth - (xOff - 1);
 		
 		bool filled = false;
 		bool dir = false;
@@ -274,77 +347,46 @@ void render_pin_states(){
 	}
 }
 
+// Each step waits for the Pico to confirm the last one, otherwise auto-repeat
+// steps from a value it may not have applied yet and overshoots
+std::atomic<bool> fanPending(false), backlightPending(false);
+
+void onControlReply(void* context, byte func, bool ok, int value) {
+	if(ok && func == 5) manager.fanValue = value;
+	if(ok && func == 7) manager.backlightValue = value;
+	*static_cast<std::atomic<bool>*>(context) = false;
+}
+
 void controlBrightness(int value) {
+	if(backlightPending) return;
 	if(value > AXIS_DEADZONE) { //Adjust Down
-		manager.monitorRequest(7, manager.backlightValue - BACK_STEP_SIZE);
+		backlightPending = true;
+		manager.monitorRequest(7, manager.backlightValue - BACK_STEP_SIZE, onControlReply, &backlightPending);
 	} else if(value < -AXIS_DEADZONE) { //Adjust Up
-		manager.monitorRequest(7, manager.backlightValue + BACK_STEP_SIZE);
+		backlightPending = true;
+		manager.monitorRequest(7, manager.backlightValue + BACK_STEP_SIZE, onControlReply, &backlightPending);
 	}
 }
 
 void controlFan(int value) {
+	if(fanPending) return;
 	if(value > AXIS_DEADZONE) { //Adjust Down
-		manager.monitorRequest(5, manager.fanValue - FAN_STEP_SIZE);
+		fanPending = true;
+		manager.monitorRequest(5, manager.fanValue - FAN_STEP_SIZE, onControlReply, &fanPending);
 	} else if(value < -AXIS_DEADZONE) { //Adjust Up
-		manager.monitorRequest(5, manager.fanValue + FAN_STEP_SIZE);
+		fanPending = true;
+		manager.monitorRequest(5, manager.fanValue + FAN_STEP_SIZE, onControlReply, &fanPending);
 	}
 }
 
-std::string removeSubstring(const std::string& str, const std::string& sub) {
-    std::string result = str;
-    size_t pos;
-
-    // Find the substring in the string and erase it
-    while ((pos = result.find(sub)) != std::string::npos) {
-        result.erase(pos, sub.length());
-    }
-
-    return result;
-}
-
 void controlVolume(int value) {
-    std::string command;
-    if(value < -AXIS_DEADZONE) {
-        command = "amixer sset '" + audDevice + "',0 " + std::to_string(VOLUME_STEP_SIZE) + "+";
-    } else if(value > AXIS_DEADZONE) {
-        command = "amixer sset '" + audDevice + "',0 " + std::to_string(VOLUME_STEP_SIZE) + "-";
-    } else {
-        command = "amixer sset '" + audDevice + "',0 0+";
-    }
-
-    // Execute the command and handle the output
-    FILE* pipe = popen(command.c_str(), "r");
-    if(!pipe) return;
-
-    char buffer[128];
-    std::string result = "";
-    while(fgets(buffer, 128, pipe) != NULL) {
-        result += buffer;
-    }
-    pclose(pipe);
-
-	result = removeSubstring(result, "Playback");
-
-	size_t pos = result.find("Limits:");
-	if(pos != std::string::npos) {
-        std::sscanf(result.c_str() + pos, "Limits: %d - %d", &VOLUME_MIN, &VOLUME_MAX);
-    } else {
-		
-	}
-	VOLUME_STEP_SIZE = (VOLUME_MAX - VOLUME_MIN) / 100;
-	
-    // Parse the output to find the current volume level
-    pos = result.find("Front Left:");
-    int currVol = 0;
-    if(pos != std::string::npos) {
-        std::sscanf(result.c_str() + pos, "Front Left: %d", &currVol);
-    } else {
-		pos = result.find("Mono:");
-		if(pos != std::string::npos) {
-			std::sscanf(result.c_str() + pos, "Mono: %d", &currVol);
-        }
+	if(value < -AXIS_DEADZONE) {
+		last_vol = volume.step(VOLUME_STEP_SIZE);
+	} else if(value > AXIS_DEADZONE) {
+		last_vol = volume.step(-VOLUME_STEP_SIZE);
+	} else {
+		last_vol = volume.getVolume();
 	}
-	last_vol = currVol;
 }
 
 bool joyCheck(ControllerData controllers[], int c) {
@@ -362,8 +404,9 @@ bool joyCheck(ControllerData controllers[], int c) {
 	
 	if(selectPressed && startPressed && rPressed && lPressed) {
 		special_counter++;
-		std::cout << special_counter << std::endl;
+		LOG_DEBUG("Reboot combo held %d", special_counter);
 		if(special_counter >= 1000) {
+		    Log::flush();
 		    sync(); // Flush filesystem buffers
             reboot(RB_AUTOBOOT);
 			exit(0);
@@ -372,6 +415,7 @@ bool joyCheck(ControllerData controllers[], int c) {
 	} else if(selectPressed && xPressed && rPressed && lPressed) {
 		special_counter++;
 		if(special_counter >= 1000) {
+	        Log::flush();
 	        sync(); // Flush filesystem buffers
             reboot(RB_POWER_OFF);
 			exit(0);
@@ -379,6 +423,15 @@ bool joyCheck(ControllerData controllers[], int c) {
         return true;
 	}
 	
+	// Its own counter, so holding it on the way to the reboot combo doesn't
+	// give the reboot a head start
+	if(selectPressed && rPressed && lPressed && !startPressed && !xPressed) {
+		if(++flight_counter == FLIGHT_HOLD) flightRequested = FLIGHT_HOTKEY;
+		special_counter = 0;
+		return true;
+	}
+	flight_counter = 0;
+	
 	if(selectPressed && bPressed) {
 		if(special_counter == 0) {
 			overlay_id = 0;
@@ -468,32 +521,236 @@ bool joyCheck(ControllerData controllers[], int c) {
 }
 
 void drawOverlay(){
-	overlay.clearScreen();
+	TRACE_SCOPE("drawOverlay");
+	// Only redraw the popup when what it shows changed, the fan keeps spinning
+	int value = -1;
 	switch(overlay_id){
-		case 0: //Battery
-			drawBatteryOverlay(manager.getBatteryAverage());
-		    break;
-		case 1: //Volume
-			drawVolumeOverlay(0, last_vol);
-		    break;
-		case 2: //Fan
-			drawFanOverlay(manager.fanValue, 0);
-		    break;
-		case 4: //Brightness
-			drawBacklightOverlay(manager.backlightValue, 0);
-		    break;
-	}
-	
-	if(DEBUG_GPIO_OVERLAY){
-		render_pin_states();
+		case 0: value = (int)manager.getBatteryAverage() * 2 + (manager.pluggedIn ? 1 : 0); break;
+		case 1: value = last_vol; break;
+		case 4: value = manager.backlightValue; break;
+	}
+	bool changed = overlay_id != shown_overlay_id || value != shown_value || overlay_id == 2 || DEBUG_GPIO_OVERLAY;
+	shown_overlay_id = overlay_id;
+	shown_value = value;
+	
+	if(changed){
+		overlay.clearScreen();
+		switch(overlay_id){
+			case 0: //Battery
+				drawBatteryOverlay(manager.getBatteryAverage());
+				break;
+			case 1: //Volume
+				drawVolumeOverlay(0, last_vol);
+				break;
+			case 2: //Fan
+				drawFanOverlay(manager.fanValue, 0);
+				break;
+			case 4: //Brightness
+				drawBacklightOverlay(manager.backlightValue, 0);
+				break;
+		}
+		
+		if(DEBUG_GPIO_OVERLAY){
+			render_pin_states();
+		}
+	}
+	
+	if(statusLayer != -1){
+		drawStatusHud();
 	}
 	overlay.commit();
 }
 
+void requestFlightDump(int){
+	flightRequested = FLIGHT_SIGNAL;
+}
+
+#ifdef PICOTROLLER_TRACE
+// Dumped from the main loop, a signal handler can't do file IO
+static std::atomic<bool> traceRequested(false);
+static void requestTrace(int){
+	traceRequested = true;
+}
+#endif
+
 int strcmp(std::string a, std::string b){
 	return strcmp(a.c_str(), b.c_str());
 }
 
+// Control socket commands, the protocol is in the README
+#define TELEMETRY_COUNT 5
+const char* TELEMETRY_NAMES[TELEMETRY_COUNT] = {"battery", "charging", "fan", "backlight", "volume"};
+
+int volumePercent(int value) {
+	return (value - VOLUME_MIN) * 100 / (VOLUME_MAX - VOLUME_MIN);
+}
+
+// -1 for what this setup doesn't have
+void readTelemetry(int values[TELEMETRY_COUNT]) {
+	bool battery = monitor->hasFeatures(FEATURE_BATTERY);
+	values[0] = battery ? getBatteryPercentage(getBatteryVoltage(manager.getBatteryAverage())) : -1;
+	values[1] = battery ? manager.pluggedIn : -1;
+	values[2] = monitor->hasFeatures(FEATURE_FAN) ? manager.fanValue : -1;
+	values[3] = monitor->hasFeatures(FEATURE_BACKLIGHT) ? manager.backlightValue : -1;
+	values[4] = volume.isOpen() ? volumePercent(last_vol) : -1;
+}
+
+bool controlState(void* context, const std::vector<std::string>& args, std::string& reply) {
+	int only = args.size() > 1 ? atoi(args[1].c_str()) : 0;
+	if(args.size() > 1 && (only < 1 || only > MAX_JOYSTICKS)) {
+		reply = "players are 1 to " + std::to_string(MAX_JOYSTICKS);
+		return false;
+	}
+	ControllerData players[MAX_JOYSTICKS];
+	manager.getControllers(players);
+	for(int i = 0; i < MAX_JOYSTICKS; i++) {
+		const ControllerData& data = players[i];
+		if(only != 0 ? only != i + 1 : data.button_count == 0 && data.axis_count == 0) continue;
+		reply += "player " + std::to_string(i + 1) + " buttons ";
+		for(int b = 0; b < data.button_count; b++) reply += data.button_states[b] ? '1' : '0';
+		reply += " axes";
+		for(int a = 0; a < data.axis_count; a++) reply += " " + std::to_string(data.axis[a].x) + "," + std::to_string(data.axis[a].y);
+		reply += "\n";
+	}
+	return true;
+}
+
+bool controlTelemetry(void* context, const std::vector<std::string>& args, std::string& reply) {
+	int values[TELEMETRY_COUNT];
+	readTelemetry(values);
+	for(int i = 0; i < TELEMETRY_COUNT; i++) {
+		if(values[i] != -1) reply += std::string(TELEMETRY_NAMES[i]) + " " + std::to_string(values[i]) + "\n";
+	}
+	return true;
+}
+
+bool controlSet(void* context, const std::vector<std::string>& args, std::string& reply) {
+	if(args.size() != 3) {
+		reply = "usage: set fan|backlight|volume value";
+		return false;
+	}
+	int value = atoi(args[2].c_str());
+	if(strcmp(args[1], "volume") == 0) {
+		if(!volume.isOpen() || value < 0 || value > 100) {
+			reply = volume.isOpen() ? "volume is 0 to 100" : "no mixer open";
+			return false;
+		}
+		last_vol = volume.set(VOLUME_MIN + (VOLUME_MAX - VOLUME_MIN) * value / 100);
+		return true;
+	}
+	
+	bool fan = strcmp(args[1], "fan") == 0;
+	if(!fan && strcmp(args[1], "backlight") != 0) {
+		reply = "can't set " + args[1];
+		return false;
+	}
+	if(!monitor->hasFeatures(fan ? FEATURE_FAN : FEATURE_BACKLIGHT) || value < 0 || value > 255) {
+		reply = monitor->hasFeatures(fan ? FEATURE_FAN : FEATURE_BACKLIGHT) ? args[1] + " is 0 to 255" : "the monitor has no " + args[1];
+		return false;
+	}
+	std::atomic<bool>& pending = fan ? fanPending : backlightPending;
+	if(pending) {
+		reply = "busy, the last change isn't confirmed yet";
+		return false;
+	}
+	pending = true;
+	manager.monitorRequest(fan ? 5 : 7, value, onControlReply, &pending); // Subscribers see the value once the Pico confirms it
+	return true;
+}
+
+// Picks up what can change without a restart: logLevel, the hotkey buttons and
+// the mixer. The monitor and its settings need a restart.
+bool controlReload(void* context, const std::vector<std::string>& args, std::string& reply) {
+	Properties fresh;
+	try {
+		fresh.load(getLocalFile("config.prop"));
+	} catch(const std::exception& e) {
+		reply = e.what();
+		return false;
+	}
+	int level = Log::parseLevel(fresh.get("logLevel", "info"));
+	if(level >= 0) Log::setLevel(level);
+	
+	SELECT_BUTTON = fresh.getInt("BUTTON_SELECT", SELECT_BUTTON);
+	START_BUTTON  = fresh.getInt("BUTTON_START", START_BUTTON);
+	L_BUTTON = fresh.getInt("BUTTON_L", L_BUTTON);
+	R_BUTTON = fresh.getInt("BUTTON_R", R_BUTTON);
+	A_BUTTON = fresh.getInt("BUTTON_FAN", A_BUTTON);
+	B_BUTTON = fresh.getInt("BUTTON_BATTERY", B_BUTTON);
+	X_BUTTON = fresh.getInt("BUTTON_VOLUME", X_BUTTON);
+	Y_BUTTON = fresh.getInt("BUTTON_BACKLIGHT", Y_BUTTON);
+	
+	std::string card = fresh.get("audioCard", audCard), device = fresh.get("audioDevice", audDevice);
+	if(strcmp(card, audCard) != 0 || strcmp(device, audDevice) != 0) {
+		audCard = card;
+		audDevice = device;
+		if(strcmp(audDevice, "") == 0 || !volume.open(audCard, audDevice)) {
+			volume.close();
+			reply = "no mixer " + audDevice + " on " + audCard;
+			return false;
+		}
+		VOLUME_MIN = volume.getMin();
+		VOLUME_MAX = volume.getMax();
+		last_vol = volume.getVolume();
+	}
+	if(level < 0) {
+		reply = "unknown logLevel, the rest was applied";
+		return false;
+	}
+	return true;
+}
+
+bool controlFlight(void* context, const std::vector<std::string>& args, std::string& reply) {
+	flightRequested = FLIGHT_SOCKET;
+	reply = "writing " + *static_cast<std::string*>(context) + "\n";
+	return true;
+}
+
+bool controlTrace(void* context, const std::vector<std::string>& args, std::string& reply) {
+#ifdef PICOTROLLER_TRACE
+	traceRequested = true;
+	reply = "writing " + *static_cast<std::string*>(context) + "\n";
+	return true;
+#else
+	reply = "built without TRACE=1";
+	return false;
+#endif
+}
+
+// Tells subscribers what changed since the last pass of the main loop
+ControllerData publishedState[MAX_JOYSTICKS];
+int publishedTelemetry[TELEMETRY_COUNT] = {-1, -1, -1, -1, -1};
+
+void publishChanges(ControlServer& control) {
+	char line[64];
+	ControllerData players[MAX_JOYSTICKS];
+	manager.getControllers(players);
+	for(int i = 0; i < MAX_JOYSTICKS; i++) {
+		const ControllerData& now = players[i];
+		ControllerData& last = publishedState[i];
+		for(int b = 0; b < now.button_count; b++) {
+			if(now.button_states[b] == last.button_states[b]) continue;
+			snprintf(line, sizeof(line), "button %d %d %d", i + 1, b, now.button_states[b] ? 1 : 0);
+			control.publish(line);
+		}
+		for(int a = 0; a < now.axis_count; a++) {
+			if(now.axis[a].x == last.axis[a].x && now.axis[a].y == last.axis[a].y) continue;
+			snprintf(line, sizeof(line), "axis %d %d %d %d", i + 1, a, now.axis[a].x, now.axis[a].y);
+			control.publish(line);
+		}
+		last = now;
+	}
+	
+	int values[TELEMETRY_COUNT];
+	readTelemetry(values);
+	for(int i = 0; i < TELEMETRY_COUNT; i++) {
+		if(values[i] == publishedTelemetry[i]) continue;
+		publishedTelemetry[i] = values[i];
+		snprintf(line, sizeof(line), "%s %d", TELEMETRY_NAMES[i], values[i]);
+		control.publish(line);
+	}
+}
+
 #define HOLD_DELAY 100
 int holdCounter = 0;
 int getHeldPin(int pins[]){
@@ -849,13 +1106,39 @@ bool configureAudio(Properties* config){
 int main(int argc, char* argv[]) {
     std::cout << "Xemplar PicoTroller v" << VERSION << std::endl;
 	
+	layout.resize(overlay.getWidth(), overlay.getHeight());
+	
 	Properties config;
 	config.load(getLocalFile("config.prop"));
+	loadAssetPaths();
 	config.addWhenMissing(true);
 	audDevice               = config.get("audioDevice", ""); //Could be PCM, Headphone, or maybe something else
+	audCard                 = config.get("audioCard", "default"); //ALSA mixer device, hw:Dummy for snd-dummy
 	bool initialized        = config.getBool("initialized", false);
 	std::string monitorType = config.get("monitor", ""); //0 for unset, 1 for pico, 2 for gpio
     std::string interface   = config.get("interface", "/dev/serial0");
+	std::string captureFile = config.get("captureFile", ""); //Raw serial traffic goes here for tools/replay
+	int picoProtocol        = config.getInt("protocol", 2); //1 forces the original full state frames
+	bool picoCobs           = config.getBool("cobs", true); //Zero delimited frames with protocol 2
+	int picoBaud            = config.getInt("baud", 115200); //Fastest serial speed to try with the Pico
+	std::string serialRead  = config.get("serialRead", "poll"); //poll or thread
+	bool lowLatency         = config.getBool("lowLatency", true); //Ask the UART driver not to batch input
+	bool telemetry          = config.getBool("telemetry", true); //Have the Pico push battery, fan and backlight changes
+	std::string evdevDevices = config.get("evdevDevices", ""); //Comma separated event devices, every gamepad when blank
+	bool evdevGrab          = config.getBool("evdevGrab", false); //Take the evdev sources exclusively
+	int networkPort         = config.getInt("networkPort", NET_DEFAULT_PORT); //UDP port wireless controllers send to
+	int networkJitter       = config.getInt("networkJitter", 0); //ms to hold datagrams to even out Wi-Fi bunching
+	std::string networkAddress = config.get("networkAddress", "127.0.0.1"); //Address to listen on, the Wi-Fi interface's or 0.0.0.0 for controllers to reach it
+	std::string multiSources = config.get("multiSources", "pico:1"); //type:slot list for monitor=multi, e.g. pico:1,network:2
+	std::string stateFeed   = config.get("stateFeed", ""); //Shared memory name to publish controller state under, e.g. /picotroller
+	std::string metricsFile = config.get("metricsFile", ""); //Text snapshot of the counters rewritten here, e.g. /run/picotroller.metrics
+	std::string metricsSocket = config.get("metricsSocket", ""); //Unix socket that answers each connection with a snapshot
+	int metricsInterval     = config.getInt("metricsInterval", 1000); //ms between rewrites of metricsFile
+	std::string traceFile   = config.get("traceFile", "/tmp/picotroller.trace.json"); //Where SIGUSR2 dumps the trace, with make TRACE=1
+	int flightSeconds       = config.getInt("flightRecorder", 30); //Seconds of input a flight recorder dump keeps, 0 turns it off
+	std::string flightFile  = config.get("flightFile", "/tmp/picotroller.flight"); //Where SIGUSR1 or holding Select+L+R dumps it
+	std::string logLevel    = config.get("logLevel", "info"); //error, warn, info or debug, debug adds frame dumps
+	std::string controlSocket = config.get("controlSocket", ""); //Unix socket taking commands, e.g. /run/picotroller.control
 	
 	SELECT_BUTTON = config.getInt("BUTTON_SELECT", -1);
 	START_BUTTON  = config.getInt("BUTTON_START", -1);
@@ -866,11 +1149,17 @@ int main(int argc, char* argv[]) {
 	X_BUTTON = config.getInt("BUTTON_VOLUME", -1);
 	Y_BUTTON = config.getInt("BUTTON_BACKLIGHT", -1);
 	
+	if(Log::parseLevel(logLevel) >= 0) {
+		Log::setLevel(Log::parseLevel(logLevel));
+	} else {
+		std::cerr << "Unknown logLevel " << logLevel << ", keeping info" << std::endl;
+	}
+
 	if(strcmp(monitorType, "") == 0){
-		std::cout << "No monitor has been selected, please enter one of the following: gpio, pico (or leave blank to exit)" << std::endl;
+		std::cout << "No monitor has been selected, please enter one of the following: gpio, pico, evdev, network, multi (or leave blank to exit)" << std::endl;
 		std::getline(std::cin, monitorType);
 		
-		if(strcmp(monitorType, "gpio") == 0 || strcmp(monitorType, "pico") == 0){
+		if(strcmp(monitorType, "gpio") == 0 || strcmp(monitorType, "pico") == 0 || strcmp(monitorType, "evdev") == 0 || strcmp(monitorType, "network") == 0 || strcmp(monitorType, "multi") == 0){
 			config.set("monitor", monitorType); 
 		} else {
 			if(strcmp(monitorType, "") == 0){
@@ -883,7 +1172,8 @@ int main(int argc, char* argv[]) {
 		}
 	}
 	
-	if(strcmp(monitorType, "gpio") == 0 && 
+	bool gpioSource = strcmp(monitorType, "gpio") == 0 || (strcmp(monitorType, "multi") == 0 && multiSources.find("gpio") != std::string::npos);
+	if(gpioSource && 
 				(config.getInt("PIN_SELECT", -1) == -1 || 
 				 config.getInt("PIN_START",  -1) == -1 || 
 				 config.getInt("PIN_UP",     -1) == -1 || 
@@ -901,24 +1191,87 @@ int main(int argc, char* argv[]) {
 		if(!configureGPIOMonitor(&config)) return 0;
 	}
 	
-	if(strcmp(monitorType, "gpio") == 0){
-		monitor = new GpioMonitor(config);
-	} else if(strcmp(monitorType, "pico") == 0){
-		if(strcmp(interface, "") == 0){
-			std::cout << "Serial interface must be defined before running pico monitor. Exiting..." << std::endl;
-			return 0;
+	auto createMonitor = [&](const std::string& type) -> Monitor* {
+		if(strcmp(type, "gpio") == 0){
+			return new GpioMonitor(config);
+		} else if(strcmp(type, "pico") == 0){
+			if(strcmp(interface, "") == 0){
+				std::cout << "Serial interface must be defined before running pico monitor. Exiting..." << std::endl;
+				return nullptr;
+			}
+			PicoMonitor* pico = new PicoMonitor(interface);
+			if(strcmp(captureFile, "") != 0) pico->setCapture(captureFile);
+			pico->setPreferredProtocol(picoProtocol, picoCobs);
+			pico->setBaudRate(picoBaud);
+			pico->setTelemetry(telemetry);
+			if(strcmp(serialRead, "thread") == 0 || strcmp(serialRead, "frame") == 0) { // frame was dropped, it added latency
+				pico->setReadMode(SERIAL_MODE_BLOCKING, lowLatency);
+			} else {
+				pico->setReadMode(SERIAL_MODE_POLL, lowLatency);
+			}
+			return pico;
+		} else if(strcmp(type, "evdev") == 0){
+			return new EvdevMonitor(evdevDevices, evdevGrab);
+		} else if(strcmp(type, "network") == 0){
+			return new NetworkMonitor(networkPort, networkJitter, networkAddress);
 		}
-		monitor = new PicoMonitor(interface);
+		std::cout << "Unknown monitor " << type << ". Exiting..." << std::endl;
+		return nullptr;
+	};
+	
+	if(strcmp(monitorType, "multi") == 0){
+		// type:slot pairs, the slot defaults to the one after the last source's
+		MultiMonitor* multi = new MultiMonitor();
+		std::stringstream list(multiSources);
+		std::string entry;
+		int slot = 1;
+		while(std::getline(list, entry, ',')){
+			size_t colon = entry.find(':');
+			if(colon != std::string::npos) slot = atoi(entry.substr(colon + 1).c_str());
+			Monitor* source = createMonitor(entry.substr(0, colon));
+			if(source == nullptr) return 0;
+			if(!multi->add(source, slot)){
+				std::cout << "Can't add " << entry << ", at most " << MULTI_MAX_SOURCES << " sources in slots 1 to 4. Exiting..." << std::endl;
+				return 0;
+			}
+			slot++;
+		}
+		monitor = multi;
+	} else {
+		monitor = createMonitor(monitorType);
+		if(monitor == nullptr) return 0;
 	}
 	
 	config.setBool("initialized", true);
 	config.flush();
 	
+	static StateFeed feed;
+	if(strcmp(stateFeed, "") != 0 && feed.open(stateFeed)){
+		manager.setStateFeed(&feed);
+	}
+	
+	static FlightRecorder recorder;
+	if(flightSeconds > 0){
+		recorder.setWindow(flightSeconds);
+		manager.setFlightRecorder(&recorder);
+		signal(SIGUSR1, requestFlightDump);
+	}
+	
+	static MetricsExporter metrics;
+	if(strcmp(metricsFile, "") != 0 || strcmp(metricsSocket, "") != 0){
+		metrics.start(metricsFile, metricsSocket, metricsInterval);
+	}
+	
 	manager.setMonitor(monitor);
 	manager.initMonitor();
 
     std::thread controllerThread(controllerLoop);
 	
+#ifdef PICOTROLLER_TRACE
+	TRACE_THREAD("main");
+	signal(SIGUSR2, requestTrace);
+#endif
+	
 	if(SELECT_BUTTON == -1 || 
 		START_BUTTON == -1 || 
 		    L_BUTTON == -1 || 
@@ -932,10 +1285,31 @@ int main(int argc, char* argv[]) {
 		configureAudio(&config);
 	}
 	
+	volume.onChange = [](int value) { last_vol = value; }; //Picks up changes from other programs, set before the watcher starts
+	if(strcmp(audDevice, "") != 0 && volume.open(audCard, audDevice)){
+		VOLUME_MIN = volume.getMin();
+		VOLUME_MAX = volume.getMax();
+	}
 	controlVolume(0); //Obtains initial volume
 	
+	if(config.getBool("statusHud", false) && monitor->hasFeatures(FEATURE_BATTERY)){
+		Rect hud = layout.place(ANCHOR_RIGHT | ANCHOR_TOP, 2, 2, 40, 9);
+		statusLayer = overlay.createLayer(hud.x, hud.y, hud.width, hud.height, -1); // Under layer 0, the popups cover it
+	}
+	config.flush();
+	
 	overlay.clearScreen();
 	overlay.commit();
+	
+	static ControlServer control;
+	if(strcmp(controlSocket, "") != 0 && control.open(controlSocket)){
+		control.addCommand("state", "[player]", controlState, nullptr);
+		control.addCommand("telemetry", "", controlTelemetry, nullptr);
+		control.addCommand("set", "fan|backlight|volume value", controlSet, nullptr);
+		control.addCommand("reload", "", controlReload, nullptr);
+		if(flightSeconds > 0) control.addCommand("flight", "", controlFlight, &flightFile);
+		control.addCommand("trace", "", controlTrace, &traceFile);
+	}
 
     // Main loop
     while(true) {
@@ -943,11 +1317,18 @@ int main(int argc, char* argv[]) {
 		if(overlay_counter >= OVERLAY_TIMEOUT) {
 			overlay_id = -1;
 			overlay_counter = -1;
-			overlay.clearScreen();
-			overlay.commit();
 		}
 		
 		drawOverlay();
+		if(control.isOpen()){
+			control.poll();
+			publishChanges(control);
+		}
+		int flightReason = flightRequested.exchange(0);
+		if(flightReason != 0 && flightSeconds > 0) recorder.dump(flightFile, flightReason == FLIGHT_HOTKEY ? "hotkey" : flightReason == FLIGHT_SOCKET ? "socket" : "signal");
+#ifdef PICOTROLLER_TRACE
+		if(traceRequested.exchange(false)) Trace::dump(traceFile);
+#endif
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 
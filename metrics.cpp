@@ -0,0 +1,223 @@
+#include "metrics.h"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define METRIC_COUNTER   1
+#define METRIC_GAUGE     2
+#define METRIC_HISTOGRAM 3
+
+#define EXPORT_MAX_WAIT 250 // ms the exporter sleeps at most, so stop() is quick
+
+struct Entry {
+	int type;
+	const char* name;
+	const char* help;
+	void* metric;
+};
+
+struct Registry {
+	std::mutex lock;
+	Entry entries[METRICS_MAX];
+	std::atomic<int> count{0};
+};
+
+// Made on first use, modules register from their own static initialisers
+static Registry& registry() {
+	static Registry r;
+	return r;
+}
+
+// A full registry hands out a spare that is updated but never exported,
+// callers never have to check for null
+static void* add(int type, const char* name, const char* help) {
+	Registry& r = registry();
+	std::lock_guard<std::mutex> guard(r.lock);
+	int count = r.count.load(std::memory_order_relaxed);
+	for(int i = 0; i < count; ++i) {
+		if(strcmp(r.entries[i].name, name) == 0) {
+			if(r.entries[i].type == type) return r.entries[i].metric;
+			std::cerr << "Metric " << name << " registered twice with different types" << std::endl;
+			break;
+		}
+	}
+
+	void* metric;
+	switch(type) {
+		case METRIC_COUNTER: metric = new Counter(); break;
+		case METRIC_GAUGE:   metric = new Gauge(); break;
+		default:             metric = new Histogram(); break;
+	}
+	if(count >= METRICS_MAX) {
+		std::cerr << "Too many metrics, " << name << " won't be exported" << std::endl;
+		return metric;
+	}
+	r.entries[count] = {type, name, help, metric};
+	r.count.store(count + 1, std::memory_order_release);
+	return metric;
+}
+
+Counter* Metrics::counter(const char* name, const char* help) {
+	return static_cast<Counter*>(add(METRIC_COUNTER, name, help));
+}
+
+Gauge* Metrics::gauge(const char* name, const char* help) {
+	return static_cast<Gauge*>(add(METRIC_GAUGE, name, help));
+}
+
+Histogram* Metrics::histogram(const char* name, const char* help) {
+	return static_cast<Histogram*>(add(METRIC_HISTOGRAM, name, help));
+}
+
+// Histogram buckets come out cumulative, the way Prometheus wants them. Each
+// value is read on its own, so a histogram's sum can be a few records ahead
+// of its buckets.
+std::string Metrics::snapshot() {
+	Registry& r = registry();
+	int count = r.count.load(std::memory_order_acquire);
+	std::string out;
+	char line[256];
+	for(int i = 0; i < count; ++i) {
+		const Entry& e = r.entries[i];
+		static const char* types[] = {"", "counter", "gauge", "histogram"};
+		snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", e.name, e.help, e.name, types[e.type]);
+		out += line;
+
+		if(e.type == METRIC_COUNTER) {
+			uint64_t v = static_cast<Counter*>(e.metric)->value.load(std::memory_order_relaxed);
+			snprintf(line, sizeof(line), "%s %llu\n", e.name, (unsigned long long)v);
+			out += line;
+		} else if(e.type == METRIC_GAUGE) {
+			int64_t v = static_cast<Gauge*>(e.metric)->value.load(std::memory_order_relaxed);
+			snprintf(line, sizeof(line), "%s %lld\n", e.name, (long long)v);
+			out += line;
+		} else {
+			Histogram* h = static_cast<Histogram*>(e.metric);
+			uint64_t total = 0;
+			for(int b = 0; b < METRICS_BUCKETS; ++b) {
+				total += h->buckets[b].load(std::memory_order_relaxed);
+				if(b == METRICS_BUCKETS - 1) {
+					snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", e.name, (unsigned long long)total);
+				} else {
+					snprintf(line, sizeof(line), "%s_bucket{le=\"%llu\"} %llu\n", e.name, 2ULL << b, (unsigned long long)total);
+				}
+				out += line;
+			}
+			snprintf(line, sizeof(line), "%s_sum %llu\n%s_count %llu\n", e.name,
+			         (unsigned long long)h->sum.load(std::memory_order_relaxed), e.name, (unsigned long long)total);
+			out += line;
+		}
+	}
+	return out;
+}
+
+MetricsExporter::MetricsExporter() {
+}
+
+MetricsExporter::~MetricsExporter() {
+	stop();
+}
+
+// Either destination may be blank. The socket answers every connection with
+// one snapshot and closes it, so `socat - UNIX-CONNECT:path` is a client.
+bool MetricsExporter::start(const std::string& file, const std::string& socketPath, int intervalMs) {
+	stop();
+	this->file = file;
+	this->socketPath = socketPath;
+	this->intervalMs = intervalMs > 0 ? intervalMs : 1000;
+
+	if(!socketPath.empty()) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(socketPath.size() >= sizeof(addr.sun_path)) {
+			std::cerr << "Metrics socket path too long: " << socketPath << std::endl;
+			return false;
+		}
+		strcpy(addr.sun_path, socketPath.c_str());
+
+		listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(listenFd == -1) {
+			perror("MetricsExporter: socket");
+			return false;
+		}
+		unlink(socketPath.c_str()); // Left over from a previous run
+		if(bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listenFd, 4) == -1) {
+			perror("MetricsExporter: bind");
+			close(listenFd);
+			listenFd = -1;
+			return false;
+		}
+	}
+
+	running = true;
+	worker = std::thread(&MetricsExporter::run, this);
+	return true;
+}
+
+void MetricsExporter::stop() {
+	running = false;
+	if(worker.joinable()) worker.join();
+	if(listenFd != -1) {
+		close(listenFd);
+		unlink(socketPath.c_str());
+		listenFd = -1;
+	}
+	if(!file.empty()) unlink(file.c_str());
+}
+
+void MetricsExporter::run() {
+	auto nextWrite = std::chrono::steady_clock::now();
+	while(running) {
+		auto now = std::chrono::steady_clock::now();
+		if(!file.empty() && now >= nextWrite) {
+			writeFile(Metrics::snapshot());
+			nextWrite = now + std::chrono::milliseconds(intervalMs);
+		}
+
+		int wait = EXPORT_MAX_WAIT;
+		if(!file.empty()) {
+			int untilWrite = std::chrono::duration_cast<std::chrono::milliseconds>(nextWrite - now).count() + 1;
+			if(untilWrite < wait) wait = untilWrite;
+		}
+		if(listenFd == -1) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+			continue;
+		}
+
+		struct pollfd pfd = {listenFd, POLLIN, 0};
+		if(poll(&pfd, 1, wait) > 0 && (pfd.revents & POLLIN)) serve(Metrics::snapshot());
+	}
+}
+
+// Written next to the file and renamed over it, readers never see half of one
+bool MetricsExporter::writeFile(const std::string& text) {
+	std::string tmp = file + ".tmp";
+	FILE* out = fopen(tmp.c_str(), "w");
+	if(out == nullptr) {
+		perror("MetricsExporter: fopen");
+		return false;
+	}
+	bool ok = fwrite(text.data(), 1, text.size(), out) == text.size();
+	ok = fclose(out) == 0 && ok;
+	if(!ok || rename(tmp.c_str(), file.c_str()) == -1) {
+		perror("MetricsExporter: write");
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Never waits on a slow client, a snapshot fits in the socket buffer
+void MetricsExporter::serve(const std::string& text) {
+	int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+	if(client == -1) return;
+	send(client, text.data(), text.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(client);
+}
@@ -0,0 +1,74 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#define METRICS_MAX     64 // Metrics the registry can hold, all made at startup
+#define METRICS_BUCKETS 16 // Histogram bucket i counts values under 2^(i+1)
+
+// Every update is one relaxed atomic, no locks and no lookups. The modules
+// keep the pointers the registry hands out and update through those.
+struct Counter {
+	std::atomic<uint64_t> value{0};
+	void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+};
+
+struct Gauge {
+	std::atomic<int64_t> value{0};
+	void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+};
+
+struct Histogram {
+	std::atomic<uint64_t> buckets[METRICS_BUCKETS];
+	std::atomic<uint64_t> sum{0}; // The count is the buckets added up
+
+	Histogram() {
+		for(int i = 0; i < METRICS_BUCKETS; ++i) buckets[i].store(0, std::memory_order_relaxed);
+	}
+	void record(uint64_t v) {
+		int bucket = v < 2 ? 0 : 63 - __builtin_clzll(v);
+		if(bucket >= METRICS_BUCKETS) bucket = METRICS_BUCKETS - 1;
+		buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(v, std::memory_order_relaxed);
+	}
+};
+
+// Process wide registry. Asking for a name twice returns the same metric, so
+// two monitors of one kind add up. Registering takes a lock, do it once and
+// keep the pointer. Nothing registered is ever freed.
+class Metrics {
+public:
+	static Counter* counter(const char* name, const char* help);
+	static Gauge* gauge(const char* name, const char* help);
+	static Histogram* histogram(const char* name, const char* help);
+
+	// Prometheus text format, safe while the metrics are being updated
+	static std::string snapshot();
+};
+
+// Publishes snapshots for whoever wants to look: rewritten into a file every
+// interval, and to each connection on a Unix socket. Runs on its own thread.
+class MetricsExporter {
+public:
+	MetricsExporter();
+	~MetricsExporter();
+
+	bool start(const std::string& file, const std::string& socketPath, int intervalMs);
+	void stop();
+
+private:
+	std::string file, socketPath;
+	int intervalMs = 1000;
+	int listenFd = -1;
+	std::thread worker;
+	std::atomic<bool> running{false};
+
+	void run();
+	bool writeFile(const std::string& text);
+	void serve(const std::string& text);
+};
+
+#endif // METRICS_H
@@ -1,8 +1,64 @@
 #include "monitor.h"
+#include <cstring>
 
 Monitor::Monitor(){
 }
 
 Monitor::~Monitor(){
 	
-}
\ No newline at end of file
+}
+// Monitors that can't confirm anything fail the completion straight away
+void Monitor::request(byte func, unsigned int value, RequestCallback done, void* context){
+	request(func, value);
+	if(done != nullptr) done(context, func, false, 0);
+}
+
+
+// Called from the reader's thread, sequence is what Monitor::sequence should
+// read while the report is delivered
+void ReportQueue::post(uint32_t sequence, int sequenceBits, byte controller, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values){
+	if(button_count > REPORT_MAX_BUTTONS) button_count = REPORT_MAX_BUTTONS;
+	if(axis_count > REPORT_MAX_AXES) axis_count = REPORT_MAX_AXES;
+
+	std::lock_guard<std::mutex> guard(lock);
+	if(count == REPORT_QUEUE_SIZE) {
+		head = (head + 1) % REPORT_QUEUE_SIZE;
+		count--;
+		dropped++;
+	}
+	Report& report = queue[(head + count++) % REPORT_QUEUE_SIZE];
+	report.controller = controller;
+	report.button_count = button_count;
+	report.axis_count = axis_count;
+	report.sequence = sequence;
+	report.sequenceBits = sequenceBits;
+	memcpy(report.buttons, button_values, (button_count + 7) / 8);
+	memcpy(report.axes, axis_values, axis_count * 2 * sizeof(int16_t));
+}
+
+int ReportQueue::take(Report out[REPORT_QUEUE_SIZE]){
+	std::lock_guard<std::mutex> guard(lock);
+	int taken = count;
+	for(int i = 0; i < taken; i++) {
+		out[i] = queue[(head + i) % REPORT_QUEUE_SIZE];
+	}
+	head = 0;
+	count = 0;
+	return taken;
+}
+
+void ReportQueue::deliver(Monitor& to){
+	Report reports[REPORT_QUEUE_SIZE];
+	int taken = take(reports);
+	for(int i = 0; i < taken; i++) {
+		const Report& report = reports[i];
+		to.sequence = report.sequence;
+		to.sequenceBits = report.sequenceBits;
+		to.callback(to.callbackContext, report.controller, report.button_count, report.buttons, report.axis_count, report.axes);
+	}
+}
+
+unsigned long ReportQueue::getDropped(){
+	std::lock_guard<std::mutex> guard(lock);
+	return dropped;
+}
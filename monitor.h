@@ -2,15 +2,26 @@
 #define MONITOR_H
 
 #include <cstdint>
-#include <functional>
+#include <mutex>
 
 #define FEATURE_FAN         0x02
 #define FEATURE_BATTERY     0x04
 #define FEATURE_BACKLIGHT   0x08
 
-using MonitorCallback = std::function<void(unsigned char, unsigned char, const unsigned char*, unsigned char, const short int*)>;
+#define REPORT_QUEUE_SIZE  64 // Reports a reader thread can have waiting for update()
+#define REPORT_MAX_BUTTONS 32 // Same limits as ControllerData
+#define REPORT_MAX_AXES    4
+
 typedef uint8_t byte;
 
+// Each report from the monitor, context is the callbackContext set with it.
+// A plain function so delivering a report never goes through an allocation.
+typedef void (*MonitorCallback)(void* context, byte controller, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values);
+
+// Completion for a request, ok is false if no reply came in time. value is
+// what the monitor confirmed, e.g. the fan speed after clamping.
+typedef void (*RequestCallback)(void* context, byte func, bool ok, int value);
+
 struct AxisData {
   int16_t x, y;
 };
@@ -32,9 +43,42 @@ public:
 	virtual bool init() = 0;
 	virtual void update() = 0;
 	virtual void request(byte func, unsigned int value) = 0;
+	virtual void request(byte func, unsigned int value, RequestCallback done, void* context);
 	virtual bool hasFeatures(int features) = 0;
-	MonitorCallback callback;
+	MonitorCallback callback = nullptr;
+	void* callbackContext = nullptr;
+	
+	// Number of the frame the report being delivered came in, for the flight
+	// recorder. Set before each callback by monitors whose frames carry one.
+	uint32_t sequence = 0;
+	int sequenceBits = 0; // 0 when the frames aren't numbered
+private:
+};
+
+// Carries reports from a thread a monitor reads on to the thread calling its
+// update(), the only one the callback may run on since the manager isn't
+// thread safe. When update() falls behind the oldest report goes, the newest
+// state is what matters.
+class ReportQueue {
+public:
+	struct Report {
+		byte controller, button_count, axis_count;
+		uint32_t sequence;
+		int sequenceBits;
+		byte buttons[REPORT_MAX_BUTTONS / 8];
+		int16_t axes[REPORT_MAX_AXES * 2];
+	};
+
+	void post(uint32_t sequence, int sequenceBits, byte controller, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values);
+	int take(Report out[REPORT_QUEUE_SIZE]); // Copies out everything waiting, the lock is never held across a callback
+	void deliver(Monitor& to); // Runs the callback for everything waiting
+	unsigned long getDropped();
+
 private:
+	std::mutex lock;
+	Report queue[REPORT_QUEUE_SIZE];
+	int head = 0, count = 0;
+	unsigned long dropped = 0;
 };
 
 #endif // MONITOR_H
\ No newline at end of file
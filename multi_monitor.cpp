@@ -0,0 +1,205 @@
+#include "multi_monitor.h"
+#include "trace.h"
+#include "log.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+
+#define MULTI_UPDATE_INTERVAL 500 // us between a source's updates, same as the controller loop
+#define MULTI_STALL_TIME      50  // ms inside one update before a source counts as stalled
+#define MULTI_MAX_SLOTS       4   // Virtual joysticks the manager can make
+
+static int64_t nowMs() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The status feature a request needs answering, 0 if it isn't one
+static int featureFor(byte func) {
+	switch(func) {
+		case REQUEST_READ_BATTERY:    return FEATURE_BATTERY;
+		case REQUEST_READ_FAN:
+		case REQUEST_WRITE_FAN:       return FEATURE_FAN;
+		case REQUEST_READ_BACKLIGHT:
+		case REQUEST_WRITE_BACKLIGHT: return FEATURE_BACKLIGHT;
+		default:                      return 0;
+	}
+}
+
+// The feature a controller 0 report is about, see monitorJoystick()
+static int featureOf(byte button_count, const byte* buttons) {
+	byte flags = button_count > 0 ? buttons[0] : 0;
+	if(flags & STATUS_FAN) return FEATURE_FAN;
+	if(flags & STATUS_BACKLIGHT) return FEATURE_BACKLIGHT;
+	return FEATURE_BATTERY;
+}
+
+MultiMonitor::MultiMonitor() : Monitor(){
+}
+
+MultiMonitor::~MultiMonitor(){
+	running = false;
+	for(int s = 0; s < sourceCount; s++) {
+		if(sources[s].worker.joinable()) sources[s].worker.join();
+		delete sources[s].monitor;
+	}
+}
+
+bool MultiMonitor::add(Monitor* monitor, int firstSlot){
+	if(sourceCount >= MULTI_MAX_SOURCES || firstSlot < 1 || firstSlot > MULTI_MAX_SLOTS) return false;
+
+	Source& source = sources[sourceCount++];
+	source.monitor = monitor;
+	source.firstSlot = firstSlot;
+
+	const int features[] = {FEATURE_BATTERY, FEATURE_FAN, FEATURE_BACKLIGHT};
+	for(int feature : features) {
+		bool owned = false;
+		for(int s = 0; s < sourceCount - 1; s++) {
+			owned |= (sources[s].status & feature) != 0;
+		}
+		if(!owned && monitor->hasFeatures(feature)) source.status |= feature;
+	}
+
+	monitor->callback = onReport;
+	monitor->callbackContext = &source;
+	return true;
+}
+
+// Called from whichever thread the source reports on
+void MultiMonitor::onReport(void* context, byte controller, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values){
+	Source* source = static_cast<Source*>(context);
+	source->reports.post(source->monitor->sequence, source->monitor->sequenceBits, controller, button_count, button_values, axis_count, axis_values);
+}
+
+// Only starts the workers, each source initialises on its own so one that
+// takes a while to find its hardware doesn't delay the rest
+bool MultiMonitor::init(){
+	running = true;
+	for(int s = 0; s < sourceCount; s++) {
+		sources[s].worker = std::thread(&MultiMonitor::run, this, s);
+	}
+	return sourceCount > 0;
+}
+
+void MultiMonitor::run(int index){
+	Source& source = sources[index];
+#ifdef PICOTROLLER_TRACE
+	char name[TRACE_NAME_SIZE];
+	snprintf(name, sizeof(name), "source %d", index + 1);
+	TRACE_THREAD(name);
+#endif
+	if(!source.monitor->init()) {
+		LOG_WARN("Input source %d failed to start, still trying", index + 1);
+	}
+	while(running) {
+		source.tickStart = nowMs();
+		source.monitor->update();
+		source.tickStart = 0;
+		std::this_thread::sleep_for(std::chrono::microseconds(MULTI_UPDATE_INTERVAL));
+	}
+}
+
+// Hands on everything the sources posted since the last call
+void MultiMonitor::update(){
+	int64_t now = nowMs();
+	for(int s = 0; s < sourceCount; s++) {
+		checkStall(s, now);
+		forward(sources[s]);
+	}
+}
+
+void MultiMonitor::checkStall(int index, int64_t now){
+	Source& source = sources[index];
+	int64_t start = source.tickStart;
+	bool stalled = start != 0 && now - start > MULTI_STALL_TIME;
+	if(stalled == source.stalled) return;
+
+	source.stalled = stalled;
+	if(stalled) {
+		source.stalls++;
+		LOG_WARN("Input source %d stalled, the others carry on", index + 1);
+	} else {
+		LOG_INFO("Input source %d is back", index + 1);
+	}
+}
+
+// Copies the queue out so the source is never kept waiting on the manager
+void MultiMonitor::forward(Source& source){
+	ReportQueue::Report reports[REPORT_QUEUE_SIZE];
+	int count = source.reports.take(reports);
+	for(int i = 0; i < count; i++) {
+		const ReportQueue::Report& report = reports[i];
+		int slot = 0;
+		if(report.controller == 0) {
+			if(!(source.status & featureOf(report.button_count, report.buttons))) continue;
+		} else {
+			slot = source.firstSlot + report.controller - 1;
+			if(slot > MULTI_MAX_SLOTS) continue;
+		}
+		sequence = report.sequence;
+		sequenceBits = report.sequenceBits;
+		callback(callbackContext, slot, report.button_count, report.buttons, report.axis_count, report.axes);
+	}
+}
+
+// Status requests go to the source that owns the feature, controller reads
+// to the source that owns the slot, anything else to the first status source
+MultiMonitor::Source* MultiMonitor::route(byte func, unsigned int& value){
+	int feature = featureFor(func);
+	if(feature != 0) {
+		for(int s = 0; s < sourceCount; s++) {
+			if(sources[s].status & feature) return &sources[s];
+		}
+		return nullptr;
+	}
+
+	if(func == REQUEST_READ_CONTROLLER) {
+		int slot = value + 1;
+		Source* owner = nullptr;
+		for(int s = 0; s < sourceCount; s++) {
+			if(sources[s].firstSlot <= slot && (owner == nullptr || sources[s].firstSlot > owner->firstSlot)) owner = &sources[s];
+		}
+		if(owner != nullptr) value = slot - owner->firstSlot;
+		return owner;
+	}
+
+	for(int s = 0; s < sourceCount; s++) {
+		if(sources[s].status) return &sources[s];
+	}
+	return sourceCount > 0 ? &sources[0] : nullptr;
+}
+
+void MultiMonitor::request(byte func, unsigned int value){
+	Source* source = route(func, value);
+	if(source != nullptr) source->monitor->request(func, value);
+}
+
+void MultiMonitor::request(byte func, unsigned int value, RequestCallback done, void* context){
+	Source* source = route(func, value);
+	if(source != nullptr) {
+		source->monitor->request(func, value, done, context);
+	} else if(done != nullptr) {
+		done(context, func, false, 0);
+	}
+}
+
+bool MultiMonitor::hasFeatures(int features){
+	for(int s = 0; s < sourceCount; s++) {
+		for(int bit = 1; bit <= features; bit <<= 1) {
+			if((features & bit) && sources[s].monitor->hasFeatures(bit)) features &= ~bit;
+		}
+	}
+	return features == 0;
+}
+
+int MultiMonitor::getSourceCount(){
+	return sourceCount;
+}
+
+unsigned long MultiMonitor::getStalls(int source){
+	return source < sourceCount ? sources[source].stalls : 0;
+}
+
+unsigned long MultiMonitor::getDropped(int source){
+	return source < sourceCount ? sources[source].reports.getDropped() : 0;
+}
@@ -0,0 +1,65 @@
+#ifndef MULTI_MONITOR_H
+#define MULTI_MONITOR_H
+
+#include "monitor.h"
+#include "pico_protocol.h"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#define MULTI_MAX_SOURCES 4
+
+// Runs several monitors at once, e.g. the Pico for player 1 and a network
+// controller for player 2. Each source's controllers 1, 2, ... become slots
+// firstSlot, firstSlot + 1, ... Battery, fan and backlight each belong to the
+// first source with that feature, which is where requests for it go and the
+// only source whose controller 0 reports about it are passed on.
+//
+// Every source is started and updated on its own thread and only posts its
+// reports to a ReportQueue, which update() hands on from the controller loop. A source that
+// blocks, say a Pico handshake waiting out its timeouts, holds up nobody but
+// itself.
+class MultiMonitor : public Monitor{
+public:
+	MultiMonitor();
+	~MultiMonitor();
+
+	bool add(Monitor* source, int firstSlot); // Takes ownership
+
+	bool init() override;
+	void update() override;
+	void request(byte func, unsigned int value) override;
+	void request(byte func, unsigned int value, RequestCallback done, void* context) override;
+	bool hasFeatures(int features) override;
+
+	int getSourceCount();
+	unsigned long getStalls(int source);
+	unsigned long getDropped(int source);
+
+private:
+	struct Source {
+		Monitor* monitor = nullptr;
+		int firstSlot = 1;
+		int status = 0; // Features it owns, its controller 0 reports on these are passed on
+		std::thread worker;
+
+		ReportQueue reports;
+
+		std::atomic<int64_t> tickStart{0}; // ms, 0 between updates
+		bool stalled = false;
+		unsigned long stalls = 0;
+	};
+
+	Source sources[MULTI_MAX_SOURCES];
+	int sourceCount = 0;
+	std::atomic<bool> running{false};
+
+	static void onReport(void* context, byte controller, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values);
+	void run(int index);
+	void checkStall(int index, int64_t now);
+	void forward(Source& source);
+	Source* route(byte func, unsigned int& value);
+};
+
+#endif // MULTI_MONITOR_H
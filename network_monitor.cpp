@@ -0,0 +1,344 @@
+#include "network_monitor.h"
+#include "log.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define NET_CLIENT_TIMEOUT  2000  // ms of silence before a client is forgotten
+#define NET_STATUS_INTERVAL 1000  // ms between battery requests, also tells clients we're here
+#define NET_OFFSET_WINDOW   10000 // ms, the clock offset is re-measured over this to follow drift
+#define NET_RESTART_WINDOW  1024  // A seq this far behind means the client started over
+
+static int64_t nowUs() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t readLE32(const uint8_t* data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+NetworkMonitor::NetworkMonitor(int port, int jitterMs, const std::string& address) : Monitor(){
+	this->port = port;
+	this->jitterUs = jitterMs * 1000;
+	this->address = address;
+	for(int& owner : owners) owner = -1;
+}
+
+NetworkMonitor::~NetworkMonitor(){
+	if(sock != -1) close(sock);
+}
+
+bool NetworkMonitor::init(){
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(sock == -1) {
+		LOG_ERROR("NetworkMonitor: socket: %s", strerror(errno));
+		return false;
+	}
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(!address.empty() && inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+		LOG_ERROR("NetworkMonitor: Invalid address %s", address.c_str());
+		close(sock);
+		sock = -1;
+		return false;
+	}
+	if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		LOG_ERROR("NetworkMonitor: Unable to bind: %s", strerror(errno));
+		close(sock);
+		sock = -1;
+		return false;
+	}
+	socklen_t addrLen = sizeof(addr);
+	if(getsockname(sock, (struct sockaddr*)&addr, &addrLen) == 0) port = ntohs(addr.sin_port); // Port 0 picks one
+
+	memset(messages, 0, sizeof(messages));
+	for(int i = 0; i < NET_BATCH; i++) {
+		vectors[i].iov_base = buffers[i];
+		vectors[i].iov_len = sizeof(buffers[i]);
+		messages[i].msg_hdr.msg_iov = &vectors[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+		messages[i].msg_hdr.msg_name = &sources[i];
+	}
+
+	LOG_INFO("Listening for controllers on UDP %s:%d", address.empty() ? "0.0.0.0" : address.c_str(), port);
+	return true;
+}
+
+// Drains the socket a batch at a time, then lets out whatever the jitter
+// buffers are done holding
+void NetworkMonitor::update(){
+	if(sock == -1) return;
+	int64_t now = nowUs();
+
+	int count;
+	do {
+		for(int i = 0; i < NET_BATCH; i++) {
+			messages[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+			messages[i].msg_hdr.msg_flags = 0;
+		}
+		count = recvmmsg(sock, messages, NET_BATCH, MSG_DONTWAIT, nullptr);
+		if(count <= 0) break;
+		batches++;
+
+		for(int i = 0; i < count; i++) {
+			received++;
+			size_t len = messages[i].msg_len;
+			if(len > MAX_NET_DATAGRAM || (messages[i].msg_hdr.msg_flags & MSG_TRUNC) || len < NET_HEADER_SIZE || buffers[i][0] != NET_MAGIC) {
+				malformed++;
+				continue;
+			}
+			Client* client = findClient(sources[i], now);
+			if(client == nullptr) {
+				refused++;
+				continue;
+			}
+			receive(*client, buffers[i], len, now);
+		}
+	} while(count == NET_BATCH);
+	if(count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) LOG_ERROR("recvmmsg: %s", strerror(errno));
+
+	for(Client& client : clients) {
+		if(!client.active) continue;
+		release(client, now);
+		if(now - client.lastSeen > NET_CLIENT_TIMEOUT * 1000LL) {
+			LOG_INFO("Controller at %s:%d went quiet", inet_ntoa(client.addr.sin_addr), ntohs(client.addr.sin_port));
+			drop(client);
+		}
+	}
+
+	if(now - statusStamp >= NET_STATUS_INTERVAL * 1000LL) {
+		statusStamp = now;
+		request(REQUEST_READ_BATTERY, 0);
+	}
+}
+
+// Every client that's still talking gets it
+void NetworkMonitor::request(byte func, unsigned int value){
+	for(const Client& client : clients) {
+		if(client.active) sendTo(client, func, value);
+	}
+}
+
+// A wireless controller answers battery requests the way the Pico does, it
+// has no fan or backlight
+bool NetworkMonitor::hasFeatures(int features){
+	const int have = FEATURE_BATTERY;
+	features &= ~have;
+
+	return features == 0;
+}
+
+int NetworkMonitor::getPort(){
+	return port;
+}
+
+NetworkMonitor::Stats NetworkMonitor::getStats(){
+	Stats stats;
+	stats.received = received;
+	stats.delivered = delivered;
+	stats.stale = stale;
+	stats.lost = lost;
+	stats.crcErrors = crcErrors;
+	stats.malformed = malformed;
+	stats.overflows = overflows;
+	stats.refused = refused;
+	stats.taken = taken;
+	stats.batches = batches;
+	stats.clients = 0;
+	for(const Client& client : clients) {
+		if(client.active) stats.clients++;
+	}
+	return stats;
+}
+
+NetworkMonitor::Client* NetworkMonitor::findClient(const struct sockaddr_in& addr, int64_t now){
+	Client* unused = nullptr;
+	for(Client& client : clients) {
+		if(!client.active) {
+			if(unused == nullptr) unused = &client;
+			continue;
+		}
+		if(client.addr.sin_addr.s_addr == addr.sin_addr.s_addr && client.addr.sin_port == addr.sin_port) return &client;
+	}
+	if(unused == nullptr) return nullptr;
+
+	unused->active = true;
+	unused->addr = addr;
+	unused->lastSeen = now;
+	unused->haveSeq = false;
+	unused->windowStart = 0;
+	unused->heldCount = 0;
+	unused->warned = 0;
+	LOG_INFO("Controller connected from %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	return unused;
+}
+
+// Stale datagrams are dropped on arrival, the frames inside are only checked
+// once they're delivered
+void NetworkMonitor::receive(Client& client, const uint8_t* data, size_t len, int64_t now){
+	uint32_t seq = readLE32(data + 1);
+	uint32_t time = readLE32(data + 5);
+	client.lastSeen = now;
+
+	if(client.haveSeq && (int32_t)(seq - client.lastSeq) < -NET_RESTART_WINDOW) {
+		client.haveSeq = false; // Restarted, its clock probably did too
+		client.windowStart = 0;
+		client.heldCount = 0;
+	}
+	if(isStale(client, seq)) {
+		stale++;
+		return;
+	}
+	if(jitterUs == 0) {
+		deliver(client, seq, data, len);
+		return;
+	}
+
+	// The fastest datagram so far sets how far the client's clock is behind
+	// ours, everything is held until its send time plus the jitter delay
+	if(client.windowStart == 0) {
+		client.clientTime = time;
+		client.offset = client.windowOffset = now - client.clientTime;
+		client.windowStart = now;
+	} else {
+		client.clientTime += (int32_t)(time - client.lastTime);
+	}
+	client.lastTime = time;
+
+	int64_t offset = now - client.clientTime;
+	if(offset < client.offset) client.offset = offset;
+	if(offset < client.windowOffset) client.windowOffset = offset;
+	if(now - client.windowStart > NET_OFFSET_WINDOW * 1000LL) {
+		client.offset = client.windowOffset;
+		client.windowOffset = offset;
+		client.windowStart = now;
+	}
+
+	hold(client, seq, client.clientTime + client.offset + jitterUs, data, len);
+}
+
+// Keeps the held datagrams in sequence order. A full buffer lets the oldest
+// out early rather than dropping anything.
+void NetworkMonitor::hold(Client& client, uint32_t seq, int64_t due, const uint8_t* data, size_t len){
+	int pos = client.heldCount;
+	while(pos > 0 && (int32_t)(seq - client.held[pos - 1].seq) < 0) pos--;
+	if(pos > 0 && client.held[pos - 1].seq == seq) {
+		stale++; // Duplicate
+		return;
+	}
+
+	if(client.heldCount == NET_JITTER_SLOTS) {
+		overflows++;
+		if(pos == 0) { // Older than everything held, so stale once the oldest goes
+			stale++;
+			return;
+		}
+		deliver(client, client.held[0].seq, client.held[0].data, client.held[0].len);
+		memmove(&client.held[0], &client.held[1], (client.heldCount - 1) * sizeof(Datagram));
+		client.heldCount--;
+		pos--;
+	}
+
+	memmove(&client.held[pos + 1], &client.held[pos], (client.heldCount - pos) * sizeof(Datagram));
+	Datagram& datagram = client.held[pos];
+	datagram.seq = seq;
+	datagram.due = due;
+	datagram.len = len;
+	memcpy(datagram.data, data, len);
+	client.heldCount++;
+}
+
+void NetworkMonitor::release(Client& client, int64_t now){
+	int count = 0;
+	while(count < client.heldCount && client.held[count].due <= now) {
+		const Datagram& datagram = client.held[count++];
+		deliver(client, datagram.seq, datagram.data, datagram.len);
+	}
+	if(count == 0) return;
+	client.heldCount -= count;
+	memmove(&client.held[0], &client.held[count], client.heldCount * sizeof(Datagram));
+}
+
+bool NetworkMonitor::isStale(Client& client, uint32_t seq){
+	return client.haveSeq && (int32_t)(seq - client.lastSeq) <= 0;
+}
+
+// Gaps in seq count as lost, late arrivals behind them are stale
+void NetworkMonitor::deliver(Client& client, uint32_t seq, const uint8_t* data, size_t len){
+	if(client.haveSeq) lost += seq - client.lastSeq - 1;
+	client.haveSeq = true;
+	client.lastSeq = seq;
+	delivered++;
+
+	sequence = seq;
+	sequenceBits = 32;
+	size_t pos = NET_HEADER_SIZE;
+	while(pos < len) {
+		int consumed = checkStateFrame(data + pos, len - pos);
+		if(consumed == -2) {
+			crcErrors++;
+			return;
+		}
+		if(consumed <= 0) {
+			malformed++;
+			return;
+		}
+
+		ControllerState state;
+		int controller = decodeStatePayload(data + pos + 1, consumed - 4, state);
+		if(controller < 0 || controller >= NET_MAX_FRAMES) {
+			malformed++;
+			return;
+		}
+		pos += consumed;
+		if(controller != 0) { // The status is per client, the controllers aren't
+			int index = &client - clients;
+			if(owners[controller] != -1 && owners[controller] != index) {
+				taken++;
+				if(!(client.warned & (1 << controller))) {
+					client.warned |= 1 << controller;
+					LOG_WARN("Controller at %s:%d sends controller %d, which another client already has", inet_ntoa(client.addr.sin_addr), ntohs(client.addr.sin_port), controller);
+				}
+				continue;
+			}
+			owners[controller] = index;
+			client.buttonCounts[controller] = state.button_count;
+			client.axisCounts[controller] = state.axis_count;
+		}
+		callback(callbackContext, controller, state.button_count, state.buttons, state.axis_count, state.axes);
+	}
+}
+
+// Lets go of everything the client was holding so its controllers don't stay
+// pressed, then sends an empty report to say they're unplugged, and frees
+// them for other clients
+void NetworkMonitor::drop(Client& client){
+	int index = &client - clients;
+	const byte buttons[MAX_FRAME_BUTTONS / 8] = {0};
+	const int16_t axes[MAX_FRAME_AXES * 2] = {0};
+	sequenceBits = 0;
+	for(int controller = 1; controller < NET_MAX_FRAMES; controller++) {
+		if(owners[controller] != index) continue;
+		owners[controller] = -1;
+		callback(callbackContext, controller, client.buttonCounts[controller], buttons, client.axisCounts[controller], axes);
+		callback(callbackContext, controller, 0, buttons, 0, axes);
+	}
+	client.active = false;
+}
+
+void NetworkMonitor::sendTo(const Client& client, byte func, unsigned int value){
+	uint8_t frame[REQUEST_FRAME_SIZE];
+	encodeRequest(frame, func, value);
+	if(sendto(sock, frame, sizeof(frame), MSG_DONTWAIT, (const struct sockaddr*)&client.addr, sizeof(client.addr)) == -1 && errno != EAGAIN) {
+		LOG_ERROR("NetworkMonitor: sendto: %s", strerror(errno));
+	}
+}
@@ -0,0 +1,99 @@
+#ifndef NETWORK_MONITOR_H
+#define NETWORK_MONITOR_H
+
+#include "monitor.h"
+#include "pico_protocol.h"
+#include <cstdint>
+#include <string>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define NET_DEFAULT_PORT 4810
+#define NET_MAX_CLIENTS  4
+#define NET_BATCH        16 // Datagrams taken per recvmmsg
+#define NET_JITTER_SLOTS 32 // Datagrams a client can have held back
+
+// Takes state frames from wireless clients over UDP, the same v1 frames the
+// Pico sends wrapped in a datagram with a sequence number and the client's
+// clock (see pico_protocol.h). Polled from update() like the Pico's serial
+// port, each call drains the socket in batches.
+//
+// With a jitter delay each client's datagrams are held until their send time
+// plus the delay, measured against the fastest one seen, and released in
+// sequence order. That evens out Wi-Fi bunching at the cost of the delay. At
+// 0 they are delivered as they arrive. Either way a datagram that isn't newer
+// than the last one delivered is dropped as stale.
+//
+// The first client to send a controller owns it until it goes quiet, frames
+// for it from any other client are refused. A client that goes quiet has its
+// controllers released, all buttons up and axes centred.
+class NetworkMonitor : public Monitor{
+public:
+	struct Stats {
+		unsigned long received, delivered, stale, lost, crcErrors, malformed, overflows, refused, taken, batches;
+		int clients;
+	};
+
+	NetworkMonitor(int port = NET_DEFAULT_PORT, int jitterMs = 0, const std::string& address = "");
+	~NetworkMonitor();
+
+	bool init() override;
+	void update() override;
+	void request(byte func, unsigned int value) override;
+	bool hasFeatures(int features) override;
+
+	int getPort();
+	Stats getStats();
+
+private:
+	struct Datagram {
+		uint32_t seq;
+		int64_t due; // us on the steady clock
+		uint16_t len;
+		uint8_t data[MAX_NET_DATAGRAM];
+	};
+
+	struct Client {
+		bool active = false;
+		struct sockaddr_in addr;
+		int64_t lastSeen = 0;
+		bool haveSeq = false;
+		uint32_t lastSeq = 0; // Last one delivered
+		uint32_t lastTime = 0;
+		int64_t clientTime = 0; // lastTime unwrapped
+		int64_t offset = 0, windowOffset = 0, windowStart = 0; // Host minus client clock, fastest seen
+		Datagram held[NET_JITTER_SLOTS]; // Sorted by seq
+		int heldCount = 0;
+		uint8_t buttonCounts[NET_MAX_FRAMES], axisCounts[NET_MAX_FRAMES]; // Last sent for each controller it owns
+		int warned = 0; // Bit per controller refused, so it's only logged once
+	};
+
+	int port;
+	int jitterUs;
+	std::string address;
+	int sock = -1;
+
+	Client clients[NET_MAX_CLIENTS];
+	int owners[NET_MAX_FRAMES]; // Index of the client sending each controller, -1 for none
+	int64_t statusStamp = 0;
+
+	// recvmmsg buffers, one spare byte to spot oversized datagrams
+	struct mmsghdr messages[NET_BATCH];
+	struct iovec vectors[NET_BATCH];
+	struct sockaddr_in sources[NET_BATCH];
+	uint8_t buffers[NET_BATCH][MAX_NET_DATAGRAM + 1];
+
+	unsigned long received = 0, delivered = 0, stale = 0, lost = 0;
+	unsigned long crcErrors = 0, malformed = 0, overflows = 0, refused = 0, taken = 0, batches = 0;
+
+	Client* findClient(const struct sockaddr_in& addr, int64_t now);
+	void receive(Client& client, const uint8_t* data, size_t len, int64_t now);
+	void hold(Client& client, uint32_t seq, int64_t due, const uint8_t* data, size_t len);
+	void release(Client& client, int64_t now);
+	bool isStale(Client& client, uint32_t seq);
+	void deliver(Client& client, uint32_t seq, const uint8_t* data, size_t len);
+	void drop(Client& client);
+	void sendTo(const Client& client, byte func, unsigned int value);
+};
+
+#endif // NETWORK_MONITOR_H
@@ -1,100 +1,314 @@
 #include "overlay.h"
 
-#include <iostream>
 #include <cstring>
+#include <cerrno>
 #include <cmath>
 #include <vector>
-#include "font5x7.h"
+#include <chrono>
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+#include "span.h"
 #include "symbols5x7.h"
 #include "lodepng.h"
 
+static OverlayHeader* header = nullptr;
 static Updater* updater = nullptr;
-static ColorBuffer* colorBufferLink = nullptr;
-static TransparencyBuffer* transparencyBufferLink = nullptr;
-
-OverlayManager::OverlayManager() {
-	int shmidUpdater = shmget(SHM_KEY_UPDATE, sizeof(Updater), 0666 | IPC_CREAT);
-    if(shmidUpdater == -1) {
-        perror("shmget (update)");
-        exit(0);
+static uint16_t* colorBufferLink = nullptr;
+static uint8_t* transparencyBufferLink = nullptr;
+
+static Counter* commitsMetric  = Metrics::counter("picotroller_overlay_commits_total", "Overlay commits that had something to copy out");
+static Counter* rowsMetric     = Metrics::counter("picotroller_overlay_rows_total", "Damaged rows composed and copied to the display");
+static Histogram* commitMetric = Metrics::histogram("picotroller_overlay_commit_us", "Time to compose and copy out one commit in microseconds");
+
+static void* attachSegment(key_t key, size_t size, const char* name) {
+    int shmid = shmget(key, size, 0666 | IPC_CREAT);
+    if(shmid == -1 && errno == EINVAL) {
+        // A segment from a different resolution is still around, replace it
+        int oldId = shmget(key, 0, 0666);
+        if(oldId != -1) shmctl(oldId, IPC_RMID, nullptr);
+        shmid = shmget(key, size, 0666 | IPC_CREAT);
     }
-	
-    int shmidColor = shmget(SHM_KEY_COLOR, sizeof(ColorBuffer), 0666 | IPC_CREAT);
-    if(shmidColor == -1) {
-        perror("shmget (color)");
+    if(shmid == -1) {
+        LOG_ERROR("shmget (%s): %s", name, strerror(errno));
         exit(0);
     }
 
-    int shmidTransparency = shmget(SHM_KEY_TRANSPARENCY, sizeof(TransparencyBuffer), 0666 | IPC_CREAT);
-    if(shmidTransparency == -1) {
-        perror("shmget (transparency)");
+    void* link = shmat(shmid, nullptr, 0);
+    if(link == (void*)-1) {
+        LOG_ERROR("shmat (%s): %s", name, strerror(errno));
         exit(0);
     }
+    return link;
+}
 
-    // Attach to the shared memory segments
-	updater = (Updater*)shmat(shmidUpdater, nullptr, 0);
-    if(updater == (void*)-1) {
-        perror("shmat (updater)");
-        exit(0);
-    }
-	
-    colorBufferLink = (ColorBuffer*)shmat(shmidColor, nullptr, 0);
-    if(colorBufferLink == (void*)-1) {
-        perror("shmat (color)");
+static void detachSegment(const void* link, const char* name) {
+    if(shmdt(link) == -1) {
+        LOG_ERROR("shmdt (%s): %s", name, strerror(errno));
         exit(0);
     }
+}
+
+OverlayManager::OverlayManager() {
+    header = (OverlayHeader*)attachSegment(SHM_KEY_HEADER, sizeof(OverlayHeader), "header");
+    negotiateSurface();
+
+    updater = (Updater*)attachSegment(SHM_KEY_UPDATE, sizeof(Updater), "update");
+    colorBufferLink = (uint16_t*)attachSegment(SHM_KEY_COLOR, screenWidth * screenHeight * sizeof(uint16_t), "color");
+    transparencyBufferLink = (uint8_t*)attachSegment(SHM_KEY_TRANSPARENCY, screenWidth * screenHeight * sizeof(uint8_t), "transparency");
+
+    output.resize(screenWidth, screenHeight);
+    createLayer(0, 0, screenWidth, screenHeight, 0);
+    selectLayer(0);
 
-    transparencyBufferLink = (TransparencyBuffer*)shmat(shmidTransparency, nullptr, 0);
-    if(transparencyBufferLink == (void*)-1) {
-        perror("shmat (transparency)");
-        exit(0);
-    }
-	
-	
     initializeBuffers();
 }
 OverlayManager::~OverlayManager() {
-	if(shmdt(colorBufferLink) == -1) {
-        perror("shmdt (color)");
-        exit(0);
-    }
+    detachSegment(colorBufferLink, "color");
+    detachSegment(transparencyBufferLink, "transparency");
+    detachSegment(updater, "update");
+    detachSegment(header, "header");
+}
 
-    if(shmdt(transparencyBufferLink) == -1) {
-        perror("shmdt (transparency)");
-        exit(0);
-    }
-	
-	if(shmdt(updater) == -1) {
-        perror("shmdt (update)");
-        exit(0);
+// Use the surface fbcp-nexus published, or publish the default one
+void OverlayManager::negotiateSurface() {
+    screenWidth = DEFAULT_SCREEN_WIDTH;
+    screenHeight = DEFAULT_SCREEN_HEIGHT;
+
+    if(header->magic == OVERLAY_MAGIC && header->version == OVERLAY_VERSION) {
+        bool validSize = header->width > 0 && header->width <= MAX_SCREEN_SIZE &&
+                         header->height > 0 && header->height <= MAX_SCREEN_SIZE;
+        if(header->format == OVERLAY_FORMAT_RGB565_A8 && validSize) {
+            screenWidth = header->width;
+            screenHeight = header->height;
+            return;
+        }
+        LOG_WARN("Unsupported overlay surface (format %d, %dx%d), using defaults", (int)header->format, (int)header->width, (int)header->height);
     }
+
+    header->magic = 0;
+    header->version = OVERLAY_VERSION;
+    header->format = OVERLAY_FORMAT_RGB565_A8;
+    header->width = screenWidth;
+    header->height = screenHeight;
+    __sync_synchronize();
+    header->magic = OVERLAY_MAGIC;
+}
+
+int OverlayManager::getWidth() {
+    return screenWidth;
+}
+
+int OverlayManager::getHeight() {
+    return screenHeight;
 }
 
 // Function to initialize the buffers with default values
 void OverlayManager::initializeBuffers() {
-    const uint16_t black = 0x0000;
-    const uint8_t transparent = 0;
-    for(int y = 0; y < SCREEN_HEIGHT; ++y) {
-        for(int x = 0; x < SCREEN_WIDTH; ++x) {
-            colorBuffer.buffer[y * SCREEN_WIDTH + x] = black;
-            transparencyBuffer.buffer[y * SCREEN_WIDTH + x] = transparent;
-        }
-    }
+    clearScreen();
+	addDamage({0, 0, screenWidth, screenHeight});
 	commit();
 }
 
+// Flattens the damaged parts of the layers and copies just those rows out
 void OverlayManager::commit() {
-	memcpy(transparencyBufferLink->buffer, transparencyBuffer.buffer, sizeof(transparencyBuffer.buffer));
-	memcpy(colorBufferLink->buffer, colorBuffer.buffer, sizeof(colorBuffer.buffer));
+	for(size_t i = 0; i < layers.size(); ++i) {
+		if(layers[i].dirty.width == 0) continue;
+		if(layers[i].visible) {
+			Rect r = layers[i].dirty;
+			r.x += layers[i].x;
+			r.y += layers[i].y;
+			addDamage(r);
+		}
+		layers[i].dirty = {0, 0, 0, 0};
+	}
+	if(damageCount == 0) return;
+
+	TRACE_SCOPE("commit");
+	auto start = std::chrono::steady_clock::now();
+	for(int i = 0; i < damageCount; ++i) {
+		const Rect& r = damage[i];
+		rowsMetric->add(r.height);
+		compose(r);
+		for(int y = r.y; y < r.y + r.height; ++y) {
+			int offset = y * screenWidth + r.x;
+			memcpy(transparencyBufferLink + offset, output.alpha.data() + offset, r.width * sizeof(uint8_t));
+			memcpy(colorBufferLink + offset, output.color.data() + offset, r.width * sizeof(uint16_t));
+		}
+	}
+	damageCount = 0;
 	
 	updater->update = true;
+	commitsMetric->add();
+	commitMetric->record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+void OverlayManager::compose(const Rect& r) {
+	for(int y = r.y; y < r.y + r.height; ++y) {
+		int offset = y * screenWidth + r.x;
+		fillSpan(output.color.data() + offset, output.alpha.data() + offset, r.width, 0, 0);
+	}
+
+	for(size_t i = 0; i < drawOrder.size(); ++i) {
+		const Layer& layer = layers[drawOrder[i]];
+		if(!layer.visible || layer.opacity == 0) continue;
+
+		int x0 = r.x > layer.x ? r.x : layer.x;
+		int y0 = r.y > layer.y ? r.y : layer.y;
+		int x1 = r.x + r.width < layer.x + layer.surface.width ? r.x + r.width : layer.x + layer.surface.width;
+		int y1 = r.y + r.height < layer.y + layer.surface.height ? r.y + r.height : layer.y + layer.surface.height;
+		if(x0 >= x1 || y0 >= y1) continue;
+
+		for(int y = y0; y < y1; ++y) {
+			int dstOffset = y * screenWidth + x0;
+			int srcOffset = (y - layer.y) * layer.surface.width + (x0 - layer.x);
+			blendSpan(output.color.data() + dstOffset, output.alpha.data() + dstOffset,
+			          layer.surface.color.data() + srcOffset, layer.surface.alpha.data() + srcOffset, x1 - x0, layer.opacity);
+		}
+	}
+}
+
+// Adds a screen area to redraw on the next commit, merging overlapping areas
+void OverlayManager::addDamage(Rect r) {
+	int x1 = r.x + r.width > screenWidth ? screenWidth : r.x + r.width;
+	int y1 = r.y + r.height > screenHeight ? screenHeight : r.y + r.height;
+	r.x = r.x < 0 ? 0 : r.x;
+	r.y = r.y < 0 ? 0 : r.y;
+	r.width = x1 - r.x;
+	r.height = y1 - r.y;
+	if(r.width <= 0 || r.height <= 0) return;
+
+	bool merged = true;
+	while(merged) {
+		merged = false;
+		for(int i = 0; i < damageCount; ++i) {
+			const Rect& d = damage[i];
+			if(r.x > d.x + d.width || d.x > r.x + r.width || r.y > d.y + d.height || d.y > r.y + r.height) continue;
+
+			// Overlapping or touching, grow r and drop d
+			int ux1 = r.x + r.width > d.x + d.width ? r.x + r.width : d.x + d.width;
+			int uy1 = r.y + r.height > d.y + d.height ? r.y + r.height : d.y + d.height;
+			r.x = r.x < d.x ? r.x : d.x;
+			r.y = r.y < d.y ? r.y : d.y;
+			r.width = ux1 - r.x;
+			r.height = uy1 - r.y;
+			damage[i] = damage[--damageCount];
+			merged = true;
+			break;
+		}
+	}
+
+	if(damageCount == MAX_DAMAGE_RECTS) { // Out of slots, fold everything into the last one
+		Rect& d = damage[damageCount - 1];
+		int ux1 = r.x + r.width > d.x + d.width ? r.x + r.width : d.x + d.width;
+		int uy1 = r.y + r.height > d.y + d.height ? r.y + r.height : d.y + d.height;
+		d.x = r.x < d.x ? r.x : d.x;
+		d.y = r.y < d.y ? r.y : d.y;
+		d.width = ux1 - d.x;
+		d.height = uy1 - d.y;
+		return;
+	}
+	damage[damageCount++] = r;
+}
+
+// Records what the current draw call touched, in layer coordinates
+void OverlayManager::markDirty(int x, int y, int w, int h) {
+	int x1 = x + w > width ? width : x + w;
+	int y1 = y + h > height ? height : y + h;
+	x = x < 0 ? 0 : x;
+	y = y < 0 ? 0 : y;
+	if(x >= x1 || y >= y1) return;
+
+	Rect& d = layers[currentLayer].dirty;
+	if(d.width == 0) {
+		d = {x, y, x1 - x, y1 - y};
+		return;
+	}
+	int dx1 = d.x + d.width > x1 ? d.x + d.width : x1;
+	int dy1 = d.y + d.height > y1 ? d.y + d.height : y1;
+	d.x = d.x < x ? d.x : x;
+	d.y = d.y < y ? d.y : y;
+	d.width = dx1 - d.x;
+	d.height = dy1 - d.y;
+}
+
+void OverlayManager::damageLayer(const Layer& layer) {
+	if(layer.visible) addDamage({layer.x, layer.y, layer.surface.width, layer.surface.height});
+}
+
+void OverlayManager::sortLayers() {
+	drawOrder.clear();
+	for(size_t i = 0; i < layers.size(); ++i) {
+		size_t pos = drawOrder.size();
+		while(pos > 0 && layers[drawOrder[pos - 1]].z > layers[i].z) pos--;
+		drawOrder.insert(drawOrder.begin() + pos, (int)i);
+	}
+}
+
+int OverlayManager::createLayer(int x, int y, int w, int h, int z) {
+	Layer layer;
+	layer.surface.resize(w, h);
+	layer.x = x;
+	layer.y = y;
+	layer.z = z;
+	layers.push_back(layer);
+	sortLayers();
+
+	selectLayer(currentLayer < 0 ? 0 : currentLayer); // push_back may have moved the surfaces
+	return (int)layers.size() - 1;
+}
+
+void OverlayManager::selectLayer(int id) {
+	if(id < 0 || id >= (int)layers.size()) return;
+	currentLayer = id;
+	Surface& surface = layers[id].surface;
+	width = surface.width;
+	height = surface.height;
+	colorBuffer = surface.color.data();
+	transparencyBuffer = surface.alpha.data();
+}
+
+void OverlayManager::setLayerPosition(int id, int x, int y) {
+	if(id < 0 || id >= (int)layers.size()) return;
+	Layer& layer = layers[id];
+	if(layer.x == x && layer.y == y) return;
+	damageLayer(layer);
+	layer.x = x;
+	layer.y = y;
+	damageLayer(layer);
+}
+
+void OverlayManager::setLayerOpacity(int id, uint8_t opacity) {
+	if(id < 0 || id >= (int)layers.size()) return;
+	if(layers[id].opacity == opacity) return;
+	layers[id].opacity = opacity;
+	damageLayer(layers[id]);
+}
+
+void OverlayManager::setLayerVisible(int id, bool visible) {
+	if(id < 0 || id >= (int)layers.size()) return;
+	Layer& layer = layers[id];
+	if(layer.visible == visible) return;
+	layer.visible = true;
+	damageLayer(layer);
+	layer.visible = visible;
+}
+
+void OverlayManager::setLayerZ(int id, int z) {
+	if(id < 0 || id >= (int)layers.size()) return;
+	if(layers[id].z == z) return;
+	layers[id].z = z;
+	sortLayers();
+	damageLayer(layers[id]);
 }
 
 void OverlayManager::clearScreen() {
-	fillRect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, 0, 0);
+	fillRect(0, 0, width, height, 0, 0);
 }
 
 void OverlayManager::drawLine(int x0, int y0, int x1, int y1, uint16_t color, uint8_t transparency) {
+    markDirty(x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, abs(x1 - x0) + 1, abs(y1 - y0) + 1);
+
     int dx = abs(x1 - x0);
     int dy = abs(y1 - y0);
     int sx = (x0 < x1) ? 1 : -1;
@@ -102,9 +316,9 @@ void OverlayManager::drawLine(int x0, int y0, int x1, int y1, uint16_t color, ui
     int err = dx - dy;
 
     while(true) {
-        if(x0 >= 0 && x0 < SCREEN_WIDTH && y0 >= 0 && y0 < SCREEN_HEIGHT) {
-            colorBuffer.buffer[y0 * SCREEN_WIDTH + x0] = color;
-            transparencyBuffer.buffer[y0 * SCREEN_WIDTH + x0] = transparency;
+        if(x0 >= 0 && x0 < width && y0 >= 0 && y0 < height) {
+            colorBuffer[y0 * width + x0] = color;
+            transparencyBuffer[y0 * width + x0] = transparency;
         }
 
         if(x0 == x1 && y0 == y1) break;
@@ -121,92 +335,80 @@ void OverlayManager::drawLine(int x0, int y0, int x1, int y1, uint16_t color, ui
 	
 }
 
-void OverlayManager::drawRect(int x, int y, int width, int height, uint16_t color, uint8_t transparency) {
+void OverlayManager::drawRect(int x, int y, int w, int h, uint16_t color, uint8_t transparency) {
+    if(w <= 0 || h <= 0) return;
+
     // Draw top and bottom
-    for(int i = 0; i < width; ++i) {
-        if(x + i < SCREEN_WIDTH) {
-            if(y >= 0 && y < SCREEN_HEIGHT) {
-                colorBuffer.buffer[y * SCREEN_WIDTH + (x + i)] = color;
-                transparencyBuffer.buffer[y * SCREEN_WIDTH + (x + i)] = transparency;
-            }
-            if(y + height - 1 >= 0 && y + height - 1 < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(y + height - 1) * SCREEN_WIDTH + (x + i)] = color;
-                transparencyBuffer.buffer[(y + height - 1) * SCREEN_WIDTH + (x + i)] = transparency;
-            }
-        }
-    }
+    fillRect(x, y, w, 1, color, transparency);
+    fillRect(x, y + h - 1, w, 1, color, transparency);
 
     // Draw sides
-    for(int i = 0; i < height; ++i) {
-        if(y + i < SCREEN_HEIGHT) {
-            if(x >= 0 && x < SCREEN_WIDTH) {
-                colorBuffer.buffer[(y + i) * SCREEN_WIDTH + x] = color;
-                transparencyBuffer.buffer[(y + i) * SCREEN_WIDTH + x] = transparency;
-            }
-            if(x + width - 1 >= 0 && x + width - 1 < SCREEN_WIDTH) {
-                colorBuffer.buffer[(y + i) * SCREEN_WIDTH + (x + width - 1)] = color;
-                transparencyBuffer.buffer[(y + i) * SCREEN_WIDTH + (x + width - 1)] = transparency;
-            }
-        }
-    }
+    fillRect(x, y, 1, h, color, transparency);
+    fillRect(x + w - 1, y, 1, h, color, transparency);
 }
 
-void OverlayManager::fillRect(int x, int y, int width, int height, uint16_t color, uint8_t transparency) {
-    for(int i = 0; i < height; ++i) {
-        for(int j = 0; j < width; ++j) {
-            if(x + j < SCREEN_WIDTH && y + i < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(y + i) * SCREEN_WIDTH + (x + j)] = color;
-                transparencyBuffer.buffer[(y + i) * SCREEN_WIDTH + (x + j)] = transparency;
-            }
-        }
+void OverlayManager::fillRect(int x, int y, int w, int h, uint16_t color, uint8_t transparency) {
+    // Clip to the screen once, then fill whole rows
+    int x0 = x < 0 ? 0 : x;
+    int y0 = y < 0 ? 0 : y;
+    int x1 = x + w > width ? width : x + w;
+    int y1 = y + h > height ? height : y + h;
+    if(x0 >= x1 || y0 >= y1) return;
+    markDirty(x0, y0, x1 - x0, y1 - y0);
+
+    for(int row = y0; row < y1; ++row) {
+        int offset = row * width + x0;
+        fillSpan(colorBuffer + offset, transparencyBuffer + offset, x1 - x0, color, transparency);
     }
 }
 
 void OverlayManager::drawCircle(int centerX, int centerY, int radius, uint16_t color, uint8_t transparency) {
+    markDirty(centerX - radius, centerY - radius, radius * 2 + 1, radius * 2 + 1);
+
     int x = radius;
     int y = 0;
     int decisionOver2 = 1 - x; // Decision criterion divided by 2 evaluated at x=r, y=0
 
     while(y <= x) {
         // Draw 8 octants
-        if(centerX + x >= 0 && centerX + x < SCREEN_WIDTH) {
-            if(centerY + y >= 0 && centerY + y < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(centerY + y) * SCREEN_WIDTH + (centerX + x)] = color;
-                transparencyBuffer.buffer[(centerY + y) * SCREEN_WIDTH + (centerX + x)] = transparency;
+        if(centerX + x >= 0 && centerX + x < width) {
+            if(centerY + y >= 0 && centerY + y < height) {
+                colorBuffer[(centerY + y) * width + (centerX + x)] = color;
+                transparencyBuffer[(centerY + y) * width + (centerX + x)] = transparency;
             }
-            if(centerY - y >= 0 && centerY - y < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(centerY - y) * SCREEN_WIDTH + (centerX + x)] = color;
-                transparencyBuffer.buffer[(centerY - y) * SCREEN_WIDTH + (centerX + x)] = transparency;
+            if(centerY - y >= 0 && centerY - y < height) {
+                colorBuffer[(centerY - y) * width + (centerX + x)] = color;
+                transparencyBuffer[(centerY - y) * width + (centerX + x)] = transparency;
             }
         }
-        if(centerX - x >= 0 && centerX - x < SCREEN_WIDTH) {
-            if(centerY + y >= 0 && centerY + y < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(centerY + y) * SCREEN_WIDTH + (centerX - x)] = color;
-                transparencyBuffer.buffer[(centerY + y) * SCREEN_WIDTH + (centerX - x)] = transparency;
+        if(centerX - x >= 0 && centerX - x < width) {
+            if(centerY + y >= 0 && centerY + y < height) {
+                colorBuffer[(centerY + y) * width + (centerX - x)] = color;
+                transparencyBuffer[(centerY + y) * width + (centerX - x)] = transparency;
             }
-            if(centerY - y >= 0 && centerY - y < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(centerY - y) * SCREEN_WIDTH + (centerX - x)] = color;
-                transparencyBuffer.buffer[(centerY - y) * SCREEN_WIDTH + (centerX - x)] = transparency;
+            if(centerY - y >= 0 && centerY - y < height) {
+                colorBuffer[(centerY - y) * width + (centerX - x)] = color;
+                transparencyBuffer[(centerY - y) * width + (centerX - x)] = transparency;
             }
         }
-        if(centerX + y >= 0 && centerX + y < SCREEN_WIDTH) {
-            if(centerY + x >= 0 && centerY + x < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(centerY + x) * SCREEN_WIDTH + (centerX + y)] = color;
-                transparencyBuffer.buffer[(centerY + x) * SCREEN_WIDTH + (centerX + y)] = transparency;
+        if(centerX + y >= 0 && centerX + y < width) {
+            if(centerY + x >= 0 && centerY + x < height) {
+                colorBuffer[(centerY + x) * width + (centerX + y)] = color;
+                transparencyBuffer[(centerY + x) * width + (centerX + y)] = transparency;
             }
-            if(centerY - x >= 0 && centerY - x < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(centerY - x) * SCREEN_WIDTH + (centerX + y)] = color;
-                transparencyBuffer.buffer[(centerY - x) * SCREEN_WIDTH + (centerX + y)] = transparency;
+            if(centerY - x >= 0 && centerY - x < height) {
+                colorBuffer[(centerY - x) * width + (centerX + y)] = color;
+                transparencyBuffer[(centerY - x) * width + (centerX + y)] = transparency;
             }
         }
-        if(centerX - y >= 0 && centerX - y < SCREEN_WIDTH) {
-            if(centerY + x >= 0 && centerY + x < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(centerY + x) * SCREEN_WIDTH + (centerX - y)] = color;
-                transparencyBuffer.buffer[(centerY + x) * SCREEN_WIDTH + (centerX - y)] = transparency;
+        if(centerX - y >= 0 && centerX - y < width) {
+            if(centerY + x >= 0 && centerY + x < height) {
+                colorBuffer[(centerY + x) * width + (centerX - y)] = color;
+                transparencyBuffer[(centerY + x) * width + (centerX - y)] = transparency;
             }
-            if(centerY - x >= 0 && centerY - x < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(centerY - x) * SCREEN_WIDTH + (centerX - y)] = color;
-                transparencyBuffer.buffer[(centerY - x) * SCREEN_WIDTH + (centerX - y)] = transparency;
+            if(centerY - x >= 0 && centerY - x < height) {
+                colorBuffer[(centerY - x) * width + (centerX - y)] = color;
+                transparencyBuffer[(centerY - x) * width + (centerX - y)] = transparency;
             }
         }
         y++;
@@ -220,32 +422,34 @@ void OverlayManager::drawCircle(int centerX, int centerY, int radius, uint16_t c
 }
 
 void OverlayManager::fillCircle(int centerX, int centerY, int radius, uint16_t color, uint8_t transparency) {
+    markDirty(centerX - radius, centerY - radius, radius * 2 + 1, radius * 2 + 1);
+
     int x = radius;
     int y = 0;
     int decisionOver2 = 1 - x; // Decision criterion divided by 2 evaluated at x=r, y=0
 
     while(y <= x) {
         for(int i = centerX - x; i <= centerX + x; ++i) {
-            if(i >= 0 && i < SCREEN_WIDTH) {
-                if(centerY + y >= 0 && centerY + y < SCREEN_HEIGHT) {
-                    colorBuffer.buffer[(centerY + y) * SCREEN_WIDTH + i] = color;
-                    transparencyBuffer.buffer[(centerY + y) * SCREEN_WIDTH + i] = transparency;
+            if(i >= 0 && i < width) {
+                if(centerY + y >= 0 && centerY + y < height) {
+                    colorBuffer[(centerY + y) * width + i] = color;
+                    transparencyBuffer[(centerY + y) * width + i] = transparency;
                 }
-                if(centerY - y >= 0 && centerY - y < SCREEN_HEIGHT) {
-                    colorBuffer.buffer[(centerY - y) * SCREEN_WIDTH + i] = color;
-                    transparencyBuffer.buffer[(centerY - y) * SCREEN_WIDTH + i] = transparency;
+                if(centerY - y >= 0 && centerY - y < height) {
+                    colorBuffer[(centerY - y) * width + i] = color;
+                    transparencyBuffer[(centerY - y) * width + i] = transparency;
                 }
             }
         }
         for(int i = centerX - y; i <= centerX + y; ++i) {
-            if(i >= 0 && i < SCREEN_WIDTH) {
-                if(centerY + x >= 0 && centerY + x < SCREEN_HEIGHT) {
-                    colorBuffer.buffer[(centerY + x) * SCREEN_WIDTH + i] = color;
-                    transparencyBuffer.buffer[(centerY + x) * SCREEN_WIDTH + i] = transparency;
+            if(i >= 0 && i < width) {
+                if(centerY + x >= 0 && centerY + x < height) {
+                    colorBuffer[(centerY + x) * width + i] = color;
+                    transparencyBuffer[(centerY + x) * width + i] = transparency;
                 }
-                if(centerY - x >= 0 && centerY - x < SCREEN_HEIGHT) {
-                    colorBuffer.buffer[(centerY - x) * SCREEN_WIDTH + i] = color;
-                    transparencyBuffer.buffer[(centerY - x) * SCREEN_WIDTH + i] = transparency;
+                if(centerY - x >= 0 && centerY - x < height) {
+                    colorBuffer[(centerY - x) * width + i] = color;
+                    transparencyBuffer[(centerY - x) * width + i] = transparency;
                 }
             }
         }
@@ -271,6 +475,10 @@ void OverlayManager::fillTriangle(int x0, int y0, int x1, int y1, int x2, int y2
     if(y1 > y2) { swap(y1, y2); swap(x1, x2); }
     if(y0 > y1) { swap(y0, y1); swap(x0, x1); }
 
+    int minX = x0 < x1 ? (x0 < x2 ? x0 : x2) : (x1 < x2 ? x1 : x2);
+    int maxX = x0 > x1 ? (x0 > x2 ? x0 : x2) : (x1 > x2 ? x1 : x2);
+    markDirty(minX, y0, maxX - minX + 1, y2 - y0 + 1);
+
     int total_height = y2 - y0;
     for(int i = 0; i < total_height; i++) {
         bool second_half = i > y1 - y0 || y1 == y0;
@@ -281,151 +489,116 @@ void OverlayManager::fillTriangle(int x0, int y0, int x1, int y1, int x2, int y2
         int B = second_half ? x1 + (x2 - x1) * beta : x0 + (x1 - x0) * beta;
         if(A > B) swap(A, B);
         for(int j = A; j <= B; j++) {
-            if(j >= 0 && j < SCREEN_WIDTH && y0 + i >= 0 && y0 + i < SCREEN_HEIGHT) {
-                colorBuffer.buffer[(y0 + i) * SCREEN_WIDTH + j] = color;
-                transparencyBuffer.buffer[(y0 + i) * SCREEN_WIDTH + j] = transparency;
+            if(j >= 0 && j < width && y0 + i >= 0 && y0 + i < height) {
+                colorBuffer[(y0 + i) * width + j] = color;
+                transparencyBuffer[(y0 + i) * width + j] = transparency;
             }
         }
     }
 }
 
-void OverlayManager::drawChar(char c, int x, int y, uint16_t color, uint8_t transparency) {
-    if(c < 32 || c > 126) return; // Only support ASCII 32 to 126
+void OverlayManager::drawChar(char c, int x, int y, uint16_t color, uint8_t transparency, int size) {
+    const uint8_t* mask = font.getGlyph(c, size);
+    if(mask == nullptr) return; // Only support ASCII 32 to 126
 
-    for(int i = 0; i < 5; ++i) { // 5 columns
-        uint8_t col = font5x7[c - 32][i];
-        for(int j = 0; j < 7; ++j) { // 7 rows
-            if(col & (1 << j)) {
-                int drawX = x + i;
-                int drawY = y + j;
-                if(drawX >= 0 && drawX < SCREEN_WIDTH && drawY >= 0 && drawY < SCREEN_HEIGHT) {
-                    colorBuffer.buffer[drawY * SCREEN_WIDTH + drawX] = color;
-                    transparencyBuffer.buffer[drawY * SCREEN_WIDTH + drawX] = transparency;
-                }
-            }
-        }
+    int w = font.getGlyphWidth(size);
+    int h = font.getGlyphHeight(size);
+
+    // Clip the glyph once, then blit whole rows
+    int left = x < 0 ? -x : 0;
+    int right = x + w > width ? width - x : w;
+    if(left >= right) return;
+    markDirty(x, y, w, h);
+
+    for(int j = 0; j < h; ++j) {
+        int drawY = y + j;
+        if(drawY < 0 || drawY >= height) continue;
+
+        int offset = drawY * width + x + left;
+        maskSpan(colorBuffer + offset, transparencyBuffer + offset, mask + j * w + left, right - left, color, transparency);
     }
 }
 
 void OverlayManager::drawSymbol(int s, int x, int y, uint16_t color, uint8_t transparency) {
-    if(s > 10) return; // Only support ASCII 32 to 126
+    if(s < 0 || s >= (int)(sizeof(symbol5x7) / sizeof(symbol5x7[0]))) return; // Only support the defined symbols
+    markDirty(x, y, 5, 7);
 
     for(int i = 0; i < 5; ++i) { // 5 columns
-        uint8_t col = symbol5x7[s - 32][i];
+        uint8_t col = symbol5x7[s][i];
         for(int j = 0; j < 7; ++j) { // 7 rows
             if(col & (1 << j)) {
                 int drawX = x + i;
                 int drawY = y + j;
-                if(drawX >= 0 && drawX < SCREEN_WIDTH && drawY >= 0 && drawY < SCREEN_HEIGHT) {
-                    colorBuffer.buffer[drawY * SCREEN_WIDTH + drawX] = color;
-                    transparencyBuffer.buffer[drawY * SCREEN_WIDTH + drawX] = transparency;
+                if(drawX >= 0 && drawX < width && drawY >= 0 && drawY < height) {
+                    colorBuffer[drawY * width + drawX] = color;
+                    transparencyBuffer[drawY * width + drawX] = transparency;
                 }
             }
         }
     }
 }
 
-void OverlayManager::drawString(const char* str, int x, int y, uint16_t color, uint8_t transparency) {
+void OverlayManager::drawString(const char* str, int x, int y, uint16_t color, uint8_t transparency, int size) {
     int startX = x;
+    int advance = font.getAdvance(size);
+    int lineHeight = font.getLineHeight(size);
     while(*str) {
         if(*str == '\n') {
             x = startX;
-            y += 8; // Move to the next line
+            y += lineHeight; // Move to the next line
         } else {
-            drawChar(*str, x, y, color, transparency);
-            x += 6; // Move to the next character position (5 pixels + 1 pixel space)
+            drawChar(*str, x, y, color, transparency, size);
+            x += advance; // Move to the next character position
         }
         ++str;
     }
 }
 
-int OverlayManager::getStringWidth(const char* str) {
-	int startX = 0;
-	int maxX = 0;
-    while(*str) {
-        if(*str == '\n') {
-			if(startX > maxX) maxX = startX;
-            startX = 0;
-        } else {
-            startX += 6;
-        }
-        ++str;
-    }
-	if(startX > maxX) maxX = startX;
-	
-	return maxX;
+int OverlayManager::getStringWidth(const char* str, int size) {
+	return font.getStringWidth(str, size);
+}
+
+int OverlayManager::getLineHeight(int size) {
+	return font.getLineHeight(size);
 }
 
 void OverlayManager::drawPNG(const char* filename, int posX, int posY) {
-    std::vector<unsigned char> image; // The raw pixels
-    unsigned width, height;
+    const Surface* image = loadImage(filename);
+    if(image == nullptr) return;
 
-    // Decode the PNG
-    lodepng::decode(image, width, height, filename);
-	drawPNG(filename, posX, posY, width, height);
+	blitSurface(*image, posX, posY, image->width, image->height, SCALE_NEAREST);
+}
+
+void OverlayManager::drawPNG(const char* filename, int posX, int posY, int targetWidth, int targetHeight, int mode) {
+    const Surface* image = loadImage(filename);
+    if(image == nullptr) return;
+
+	blitSurface(*image, posX, posY, targetWidth, targetHeight, mode);
 }
 
-void OverlayManager::drawPNG(const char* filename, int posX, int posY, int targetWidth, int targetHeight) {
+// Decodes a PNG once and keeps it around as RGB565 + A8. One that can't be
+// decoded is kept as an empty surface, so it's only read and reported once.
+const Surface* OverlayManager::loadImage(const char* filename) {
+    imageKey.assign(filename); // Keeps its buffer once it has held the longest name
+    auto it = images.find(imageKey);
+    if(it != images.end()) return it->second.width > 0 ? &it->second : nullptr;
+
     std::vector<unsigned char> image; // The raw pixels
-    unsigned width, height;
+    unsigned imageWidth, imageHeight;
 
     // Decode the PNG
-    unsigned error = lodepng::decode(image, width, height, filename);
+    unsigned error = lodepng::decode(image, imageWidth, imageHeight, filename);
 
-    // Check for errors
+    Surface& surface = images[imageKey];
     if(error) {
-        std::cerr << "Error decoding PNG: " << lodepng_error_text(error) << std::endl;
-        return;
+        LOG_ERROR("Unable to decode %s: %s", filename, lodepng_error_text(error));
+        return nullptr;
     }
+    surface.load(image.data(), imageWidth, imageHeight);
+    return &surface;
+}
 
-    // Draw the image with scaling
-    for(int y = 0; y < targetHeight; ++y) {
-        for(int x = 0; x < targetWidth; ++x) {
-            int srcX = x * width / targetWidth;
-            int srcY = y * height / targetHeight;
-
-            if(posX + x < SCREEN_WIDTH && posY + y < SCREEN_HEIGHT) {
-                unsigned idx = 4 * (srcY * width + srcX);
-                uint8_t r = image[idx];
-                uint8_t g = image[idx + 1];
-                uint8_t b = image[idx + 2];
-                uint8_t a = image[idx + 3];
-				
-				if (a != 0) { // 0 means fully transparent
-					uint16_t newColor = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3); // Convert to RGB565
-					uint16_t existingColor = colorBuffer.buffer[(posY + y) * SCREEN_WIDTH + (posX + x)];
-
-					if (a == 255) { // Fully opaque, directly copy the color
-						colorBuffer.buffer[(posY + y) * SCREEN_WIDTH + (posX + x)] = newColor;
-						transparencyBuffer.buffer[(posY + y) * SCREEN_WIDTH + (posX + x)] = 255;
-					} else {
-						// Decompose colors into RGB components
-						uint16_t existingRed = (existingColor >> 11) & 0x1F;
-						uint16_t existingGreen = (existingColor >> 5) & 0x3F;
-						uint16_t existingBlue = existingColor & 0x1F;
-						uint8_t  existingAlpha = transparencyBuffer.buffer[(posY + y) * SCREEN_WIDTH + (posX + x)];
-
-						uint16_t newRed = (newColor >> 11) & 0x1F;
-						uint16_t newGreen = (newColor >> 5) & 0x3F;
-						uint16_t newBlue = newColor & 0x1F;
-
-						// Blend the colors using integer arithmetic
-						uint16_t finalRed = ((newRed * a) + (existingRed * (255 - existingAlpha))) >> 8;
-						uint16_t finalGreen = ((newGreen * a) + (existingGreen * (255 - existingAlpha))) >> 8;
-						uint16_t finalBlue = ((newBlue * a) + (existingBlue * (255 - existingAlpha))) >> 8;
-					
-						uint16_t calcAlpha = transparencyBuffer.buffer[(posY + y) * SCREEN_WIDTH + (posX + x)] + a;
-						uint8_t  finalAlpha = calcAlpha > 255 ? 255 : calcAlpha;
-
-						// Recompose the final color
-						uint16_t finalColor = (finalRed << 11) | (finalGreen << 5) | (finalBlue);
-
-						// Write the blended color back to the framebuffer
-						colorBuffer.buffer[(posY + y) * SCREEN_WIDTH + (posX + x)] = finalColor;
-						transparencyBuffer.buffer[(posY + y) * SCREEN_WIDTH + (posX + x)] = finalAlpha;
-					}
-				}
-            }
-        }
-    }
+void OverlayManager::blitSurface(const Surface& src, int posX, int posY, int targetWidth, int targetHeight, int mode) {
+	Rect drawn = blitter.blit(layers[currentLayer].surface, src, posX, posY, targetWidth, targetHeight, mode);
+	if(drawn.width > 0) markDirty(drawn.x, drawn.y, drawn.width, drawn.height);
 }
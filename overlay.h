@@ -1,34 +1,88 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "shared_memory.h"
+#include "font.h"
+#include "surface.h"
+#include "blit.h"
+
+#define MAX_DAMAGE_RECTS 8
 
 class OverlayManager {
 public:
     OverlayManager();
     ~OverlayManager();
-	
+
 	void commit();
 	void clearScreen();
 	void drawLine(int x0, int y0, int x1, int y1, uint16_t color, uint8_t transparency);
-	void drawRect(int x, int y, int width, int height, uint16_t color, uint8_t transparency);
-	void fillRect(int x, int y, int width, int height, uint16_t color, uint8_t transparency);
+	void drawRect(int x, int y, int w, int h, uint16_t color, uint8_t transparency);
+	void fillRect(int x, int y, int w, int h, uint16_t color, uint8_t transparency);
 	void drawCircle(int centerX, int centerY, int radius, uint16_t color, uint8_t transparency);
 	void fillCircle(int centerX, int centerY, int radius, uint16_t color, uint8_t transparency);
 	void drawTriangle(int x0, int y0, int x1, int y1, int x2, int y2, uint16_t color, uint8_t transparency);
 	void fillTriangle(int x0, int y0, int x1, int y1, int x2, int y2, uint16_t color, uint8_t transparency);
-	void drawChar(char c, int x, int y, uint16_t color, uint8_t transparency);
+	void drawChar(char c, int x, int y, uint16_t color, uint8_t transparency, int size = 1);
 	void drawSymbol(int s, int x, int y, uint16_t color, uint8_t transparency);
-	void drawString(const char* str, int x, int y, uint16_t color, uint8_t transparency);
+	void drawString(const char* str, int x, int y, uint16_t color, uint8_t transparency, int size = 1);
 	void drawPNG(const char* filename, int posX, int posY);
-	void drawPNG(const char* filename, int posX, int posY, int targetWidth, int targetHeight);
-	
-	
-	int getStringWidth(const char* str);
-	
+	void drawPNG(const char* filename, int posX, int posY, int targetWidth, int targetHeight, int mode = SCALE_NEAREST);
+	void blitSurface(const Surface& src, int posX, int posY, int targetWidth, int targetHeight, int mode);
+
+	// Layers are composited in z order on commit(), lowest first. Layer 0 always
+	// exists at z 0 and covers the whole screen, a negative z goes under it.
+	// Drawing goes to whichever layer is selected.
+	int createLayer(int x, int y, int w, int h, int z);
+	void selectLayer(int id);
+	void setLayerPosition(int id, int x, int y);
+	void setLayerOpacity(int id, uint8_t opacity);
+	void setLayerVisible(int id, bool visible);
+	void setLayerZ(int id, int z);
+
+	int getWidth();
+	int getHeight();
+	int getStringWidth(const char* str, int size = 1);
+	int getLineHeight(int size = 1);
+
 private:
+	struct Layer {
+		Surface surface;
+		int x = 0, y = 0, z = 0;
+		uint8_t opacity = 255;
+		bool visible = true;
+		Rect dirty = {0, 0, 0, 0}; // Changed area since the last commit, layer coordinates
+	};
+
+	void negotiateSurface();
 	void initializeBuffers();
-	
-	ColorBuffer colorBuffer;
-    TransparencyBuffer transparencyBuffer;
+	const Surface* loadImage(const char* filename);
+
+	void markDirty(int x, int y, int w, int h);
+	void addDamage(Rect r);
+	void damageLayer(const Layer& layer);
+	void compose(const Rect& r);
+	void sortLayers();
+
+	int screenWidth, screenHeight;
+	Surface output; // Flattened layers, what gets copied to shared memory
+	std::vector<Layer> layers;
+	std::vector<int> drawOrder;
+	Rect damage[MAX_DAMAGE_RECTS];
+	int damageCount = 0;
+
+	// The selected layer's surface, every draw call works on these
+	int currentLayer = -1;
+	int width = 0, height = 0;
+	uint16_t* colorBuffer = nullptr;
+	uint8_t* transparencyBuffer = nullptr;
+
+	FontCache font;
+
+	std::map<std::string, Surface> images;
+	std::string imageKey; // Lookups go through it so finding a loaded image doesn't allocate
+
+	Blitter blitter;
 };
@@ -1,224 +1,808 @@
 #include "pico_monitor.h"
-#include <iostream>
+#include "pico_protocol.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
 #include <cstdio>
 #include <ostream>
+#include <cerrno>
 #include <cstring>
-#include <fcntl.h>
-#include <termios.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include <unistd.h>
 
-#define DEBUG false
-#define ONE_LINE false
+#define STATUS_INTERVAL 50 // ms between polls of anything not pushed
+#define NEGOTIATE_TIMEOUT 200 // ms
+#define RESYNC_INTERVAL 50 // ms before asking again for a key frame that never came
 
-#define STATUS_TIMEOUT 100
+#define PING_COUNT 20
+#define PING_TIMEOUT 100 // ms
+#define BAUD_SETTLE_TIME 5 // ms for the Pico to restart its UART
+#define BAUD_MAX_ERROR_RATE 0.05f // Lost or damaged pings a speed may have
+
+#define REQUEST_TIMEOUT 100 // ms for a status reply
+
+#define TELEMETRY_RENEW 1000 // ms, well inside the Pico's ALIVE_TIMEOUT so it doubles as the keepalive
+#define TELEMETRY_STALE 2500 // ms without a push or renewal ack before polling again
+
+// Interval and change threshold each channel is subscribed with. The battery
+// ADC is noisy, the fan and backlight only move when asked to.
+static const struct {
+	int interval;
+	uint16_t threshold;
+} TELEMETRY_SETTINGS[TELEMETRY_CHANNELS] = {
+	{1000, 8}, // TELEMETRY_BATTERY
+	{100, 1},  // TELEMETRY_FAN
+	{100, 1},  // TELEMETRY_BACKLIGHT
+};
+
+static const byte TELEMETRY_READS[TELEMETRY_CHANNELS] = {REQUEST_READ_BATTERY, REQUEST_READ_FAN, REQUEST_READ_BACKLIGHT};
+
+#define READER_WAKE_INTERVAL 100 // ms between checks for being stopped
+
+#define LINK_TIMEOUT 2000 // ms without a valid frame, telemetry renewals alone bring one a second
+#define RECONNECT_MIN_DELAY 20 // ms, doubled after each failed attempt
+#define RECONNECT_MAX_DELAY 1000
+
+static const int BAUD_LADDER[] = {230400, 460800, 921600, 1000000};
+
+static Counter* framesMetric       = Metrics::counter("picotroller_pico_frames_total", "Valid frames parsed from the Pico");
+static Counter* crcMetric          = Metrics::counter("picotroller_pico_crc_errors_total", "Frames with a bad CRC");
+static Counter* framingMetric      = Metrics::counter("picotroller_pico_framing_errors_total", "COBS frames that didn't decode to a frame");
+static Counter* droppedMetric      = Metrics::counter("picotroller_pico_dropped_frames_total", "Delta frames lost, each costs a key frame request");
+static Counter* reconnectsMetric   = Metrics::counter("picotroller_pico_reconnects_total", "Attempts to reopen the serial link");
+static Counter* timeoutsMetric     = Metrics::counter("picotroller_pico_request_timeouts_total", "Status requests that got no reply");
+static Gauge* linkUpMetric         = Metrics::gauge("picotroller_pico_link_up", "1 while frames are arriving from the Pico");
+static Gauge* queueDepthMetric     = Metrics::gauge("picotroller_pico_queue_depth", "Commands waiting for room on the serial port");
+static Histogram* roundTripMetric  = Metrics::histogram("picotroller_pico_request_rtt_us", "Status request round trips in microseconds");
 
 PicoMonitor::PicoMonitor(std::string port) : Monitor() {
 	this->port = port;
 }
 PicoMonitor::~PicoMonitor() {
-    close(serial_fd);
+	stopReader();
 }
 	
 bool PicoMonitor::init() {
-	serial_fd = openSerialPort(port.c_str());
-	if(serial_fd == -1) {
-        return false;
-    }
-	
-	statusUpdate();
+	reconnecting = true; // Until the first frame, so a missing Pico is retried like a lost one
+	reconnectDelay = RECONNECT_MIN_DELAY;
+	lostAt = std::chrono::steady_clock::now();
+	if(!openLink()) return false;
+	startReader();
 	return true;
 }
 
 void PicoMonitor::update() {
-	readSerial();
-	if(update_counter == 0) statusUpdate(); 
-		
-	update_counter++;
-	if(update_counter > STATUS_TIMEOUT) update_counter = 0;
+	reports.deliver(*this); // What the reader thread parsed since the last call
+	if(linkDown) {
+		reconnect();
+		return;
+	}
+	
+	std::lock_guard<std::mutex> guard(stateLock);
+	if(!readerRunning) readSerial();
+	
+	auto now = std::chrono::steady_clock::now();
+	if(reconnecting && lastFrame > reopenedAt) {
+		reconnecting = false;
+		reconnectDelay = RECONNECT_MIN_DELAY;
+		linkUpMetric->set(1);
+		lastRecoveryMs = std::chrono::duration_cast<std::chrono::milliseconds>(lastFrame - lostAt).count();
+		if(reconnects > 0) LOG_INFO("Pico link restored after %d ms", lastRecoveryMs);
+	}
+	if(now - lastFrame > std::chrono::milliseconds(LINK_TIMEOUT)) {
+		linkTimeouts++;
+		markLinkDown("no valid frames");
+		return;
+	}
+	
+	expireRequests();
+	size_t depth = getQueueDepth();
+	queueDepthMetric->set(depth);
+	if(now - statusStamp >= std::chrono::milliseconds(STATUS_INTERVAL)) {
+		statusUpdate();
+	} else if(depth > 0) {
+		flushCommands(0); // Whatever the port couldn't take last time
+	}
+}
+
+// Opens the port and runs the whole handshake, the same way after a reset or
+// a replugged cable as at startup
+bool PicoMonitor::openLink() {
+	std::lock_guard<std::mutex> guard(stateLock);
+	resetLinkState();
+	if(!serial.open(port, SERIAL_BASE_BAUD)) {
+		linkDown = true;
+		return false;
+	}
+	
+	if(targetBaud != SERIAL_BASE_BAUD) findPico();
+	if(preferredProtocol != PROTOCOL_V1) negotiate();
+	if(targetBaud > serial.getBaud()) stepUpBaud();
+	
+	if(lowLatency && !serial.setLowLatency(true) && reconnects == 0) {
+		LOG_WARN("Low latency mode not supported by %s", port.c_str());
+	}
+	
+	reopenedAt = lastFrame = std::chrono::steady_clock::now();
+	statusUpdate();
+	return !linkDown;
+}
+
+void PicoMonitor::startReader() {
+	if(readMode != SERIAL_MODE_POLL && serial.setReadMode(readMode)) {
+		readerRunning = true;
+		reader = std::thread(&PicoMonitor::readerLoop, this);
+	}
+}
+
+// Whatever the old connection negotiated is gone with it
+void PicoMonitor::resetLinkState() {
+	linkDown = false;
+	buffer_len = 0;
+	protocol = PROTOCOL_V1;
+	cobs = negotiated = false;
+	for(int c = 0; c <= MAX_CONTROLLERS; c++) {
+		haveKey[c] = resyncPending[c] = false;
+	}
+	for(int c = 0; c < TELEMETRY_CHANNELS; c++) {
+		telemetry[c].live = false;
+	}
+	statusStamp = subscribeStamp = std::chrono::steady_clock::time_point();
+	
+	std::lock_guard<std::mutex> write(writeLock);
+	commands.clear();
+}
+
+// Safe from the reader thread, update() does the reconnecting
+void PicoMonitor::markLinkDown(const char* reason) {
+	if(linkDown.exchange(true)) return;
+	linkUpMetric->set(0);
+	LOG_ERROR("Pico link lost: %s", reason);
+}
+
+// Retries with a doubling delay, reset once a valid frame arrives. Called
+// from update() so the backoff never blocks more than one handshake.
+void PicoMonitor::reconnect() {
+	auto now = std::chrono::steady_clock::now();
+	if(!reconnecting) {
+		reconnecting = true;
+		lostAt = now;
+		nextAttempt = now;
+	}
+	if(now < nextAttempt) return;
+	
+	stopReader();
+	serial.close();
+	reconnects++;
+	reconnectsMetric->add();
+	if(openLink()) {
+		startReader();
+	}
+	nextAttempt = now + std::chrono::milliseconds(reconnectDelay);
+	reconnectDelay = std::min(reconnectDelay * 2, RECONNECT_MAX_DELAY);
+}
+
+PicoMonitor::LinkStats PicoMonitor::getLinkStats() {
+	std::lock_guard<std::mutex> guard(stateLock);
+	LinkStats stats;
+	stats.up = !linkDown && !reconnecting;
+	stats.crcErrors = crcErrors;
+	stats.framingErrors = framingErrors;
+	stats.skippedBytes = skippedBytes;
+	stats.overflowResets = overflowResets;
+	stats.dropped = dropped;
+	stats.reconnects = reconnects;
+	stats.linkTimeouts = linkTimeouts;
+	stats.lastRecoveryMs = lastRecoveryMs;
+	return stats;
 }
 
 void PicoMonitor::readSerial() {
     byte temp_buffer[512];
     ssize_t len;
-    while((len = read(serial_fd, temp_buffer, sizeof(temp_buffer))) > 0) {
-        if(buffer_len + len > sizeof(buffer)) {
-            // Handle overflow
-            std::cerr << "Buffer overflow" << std::endl;
-            buffer_len = 0;
-            continue;
+    while((len = serial.read(temp_buffer, sizeof(temp_buffer))) > 0) {
+        TRACE_SCOPE("serial rx");
+        {
+            std::lock_guard<std::mutex> guard(writeLock);
+            capture.write(CAPTURE_RX, temp_buffer, len);
         }
-        memcpy(buffer + buffer_len, temp_buffer, len);
-        buffer_len += len;
-        processBuffer();
+        feed(temp_buffer, len);
     }
+    if(len == 0 || (errno != EAGAIN && errno != EINTR)) markLinkDown(len == 0 ? "hangup" : strerror(errno));
+}
+
+// One read per wakeup takes whatever has arrived by then
+void PicoMonitor::readerLoop() {
+    TRACE_THREAD("pico reader");
+    byte temp_buffer[512];
+    while(readerRunning) {
+        if(!serial.waitReadable(READER_WAKE_INTERVAL)) continue;
+        ssize_t len = serial.read(temp_buffer, sizeof(temp_buffer));
+        if(len < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if(len <= 0) { // Gone, update() reopens it
+            markLinkDown(len == 0 ? "hangup" : strerror(errno));
+            return;
+        }
+        TRACE_SCOPE("serial rx");
+        {
+            std::lock_guard<std::mutex> guard(writeLock);
+            capture.write(CAPTURE_RX, temp_buffer, len);
+        }
+        std::lock_guard<std::mutex> guard(stateLock);
+        feed(temp_buffer, len);
+    }
+}
+
+void PicoMonitor::stopReader() {
+    readerRunning = false;
+    if(reader.joinable()) reader.join();
+}
+
+// Runs bytes through the parser as if they had just been read, which is all
+// replaying a capture needs
+void PicoMonitor::feed(const byte* data, size_t len) {
+    if(buffer_len + len > sizeof(buffer)) {
+        LOG_WARN("Serial buffer overflow, %zu unparsed bytes dropped", buffer_len);
+        overflowResets++;
+        buffer_len = 0;
+        return;
+    }
+    memcpy(buffer + buffer_len, data, len);
+    buffer_len += len;
+    processBuffer();
+}
+
+// Tees everything read from and written to the Pico into a capture file
+bool PicoMonitor::setCapture(const std::string& path) {
+    return capture.open(path);
 }
 
 void PicoMonitor::processBuffer() {
+    TRACE_SCOPE("parse");
     size_t i = 0;
+    unsigned long frames = validFrames;
+    while(i < buffer_len && !cobs) {
+        // Find the start of a message, v1 and v2 frames can be interleaved
+        // while the protocol is being switched
+        if(buffer[i] != FRAME_START && buffer[i] != FRAME_V2_START) {
+            ++i;
+            skippedBytes++;
+            continue;
+        }
+
+        int consumed = buffer[i] == FRAME_START ? parseV1(buffer + i, buffer_len - i) : parseV2(buffer + i, buffer_len - i);
+        if(consumed == 0) break; // Incomplete, wait for more bytes
+        if(consumed < 0) { // Not a frame after all, rescan from the next byte
+            ++i;
+            skippedBytes++;
+            continue;
+        }
+        i += consumed;
+        validFrames++;
+    }
+
+    // The ack switching to COBS may have been in the middle of this buffer
+    if(cobs) i = processCobs(i);
+    if(validFrames != frames) {
+        lastFrame = std::chrono::steady_clock::now();
+        framesMetric->add(validFrames - frames);
+    }
+
+    // Shift the buffer to remove processed part
+    buffer_len -= i;
+    memmove(buffer, buffer + i, buffer_len);
+}
+
+// Every frame ends at the next zero byte, so a damaged one costs exactly
+// itself. Returns how far the buffer was consumed.
+size_t PicoMonitor::processCobs(size_t i) {
+    byte frame[MAX_V2_FRAME];
     while(i < buffer_len) {
-        // Find the start of a message
-        if(buffer[i] != '{') {
-            if(i < 64) {
-                ++i;
-                continue;
+        byte* end = static_cast<byte*>(memchr(buffer + i, FRAME_DELIMITER, buffer_len - i));
+        if(end == nullptr) {
+            // No delimiter yet, unless this is already longer than any frame
+            if(buffer_len - i > MAX_COBS_FRAME) {
+                framingErrors++;
+                framingMetric->add();
+                skippedBytes += buffer_len - i;
+                i = buffer_len;
             }
-            // Shift the buffer to remove processed part
-            buffer_len -= i;
-            memmove(buffer, buffer + i, buffer_len);
-            i = 0;
-            continue;
+            break;
         }
 
-        // Check if there is enough space for at least the header
-        size_t message_start = i + 1;
-        if(message_start + 2 >= buffer_len) break;
+        size_t len = end - (buffer + i);
+        if(len > 0) {
+            int decoded = cobsDecode(buffer + i, len, frame, sizeof(frame));
+            int consumed = -1;
+            if(decoded > 0 && frame[0] == FRAME_V2_START) consumed = parseV2(frame, decoded);
+            if(decoded > 0 && frame[0] == FRAME_START) consumed = parseV1(frame, decoded);
+            if(consumed != decoded) {
+                framingErrors++;
+                framingMetric->add();
+                skippedBytes += len + 1;
+            } else {
+                validFrames++;
+            }
+        }
+        i += len + 1;
+    }
+    return i;
+}
 
-        byte button_count = buffer[message_start + 1];
-        size_t button_value_count = (button_count + 7) / 8;
-        size_t axis_count_pos = message_start + 2 + button_value_count;
+// Each parser returns the frame length, 0 when more bytes are needed or -1
+// when the start byte turned out to be payload or the CRC doesn't match
+int PicoMonitor::parseV1(const byte* frame, size_t len) {
+    // Check if there is enough space for the header, button values and axis count
+    if(len < 3) return 0;
+    size_t button_value_count = (frame[2] + 7) / 8;
+    size_t axis_count_pos = 3 + button_value_count;
+    if(axis_count_pos >= len) return 0;
 
-        // Check if there is enough space for the button values and axis count
-        if(axis_count_pos >= buffer_len) break;
+    size_t message_end = axis_count_pos + 1 + frame[axis_count_pos] * 4;
+    // Check if there is enough space for the entire message and if it ends with '}' with a 2 byte crc
+    if(message_end + 2 >= len) return 0;
+    if(frame[message_end] != FRAME_END) return -1;
 
-        byte axis_count = buffer[axis_count_pos];
-        size_t message_end = axis_count_pos + 1 + axis_count * 4;
+    uint16_t calc_crc = crc16_ccitt_xmodem(frame, message_end + 1);
+    uint16_t sent_crc = frame[message_end + 1] + (frame[message_end + 2] << 8);
+    if(calc_crc != sent_crc) {
+        crcErrors++;
+        crcMetric->add();
+        return -1;
+    }
 
-        // Check if there is enough space for the entire message and if it ends with '}' with a 2 byte crc
-        if(message_end + 2 >= buffer_len) break;
-		if(buffer[message_end] != '}') {
-			buffer_len -= 3;
-            memmove(buffer, buffer + 3, buffer_len);
-            continue;
-		}
+    if(Log::enabled(LOG_LEVEL_DEBUG)) printFrame(frame, message_end + 3);
 
-		uint16_t calc_crc = crc16_ccitt_xmodem(buffer + message_start - 1, message_end + 2 - message_start);
-		uint16_t sent_crc = buffer[message_end + 1] + (buffer[message_end + 2] << 8);
-		
-		if(calc_crc != sent_crc) {
-			buffer_len -=1;
-			memmove(buffer, buffer + 1, buffer_len);
-		}
+    ControllerState state;
+    int controller = decodeStatePayload(frame + 1, message_end - 1, state);
+    if(controller < 0) return -1;
+
+    frameSequenceBits = 0; // v1 frames aren't numbered
+    handleState(controller, state);
+    return message_end + 3;
+}
 
-        // Valid message found, extract and process it
-        size_t message_len = message_end - message_start;
-        byte* message = buffer + message_start;
+int PicoMonitor::parseV2(const byte* frame, size_t len) {
+    if(len < V2_HEADER_SIZE) return 0;
+    size_t payload_len = frame[3];
+    size_t message_end = V2_HEADER_SIZE + payload_len;
+    if(message_end + 2 >= len) return 0;
+    if(frame[message_end] != FRAME_V2_END) return -1;
 
-        if(DEBUG) {
-            if(ONE_LINE) std::cout << "\033[A";
-            std::cout << "\rExtracted message: ";
-            for(size_t j = 0; j < message_len; ++j) {
-                std::cout << std::hex << static_cast<int>(message[j]) << " " << std::dec;
+    uint16_t calc_crc = crc16_ccitt_xmodem(frame, message_end + 1);
+    uint16_t sent_crc = frame[message_end + 1] + (frame[message_end + 2] << 8);
+    if(calc_crc != sent_crc) {
+        crcErrors++;
+        crcMetric->add();
+        return -1;
+    }
+
+    if(Log::enabled(LOG_LEVEL_DEBUG)) printFrame(frame, message_end + 3);
+
+    byte type = frame[1];
+    byte seq = frame[2];
+    const byte* payload = frame + V2_HEADER_SIZE;
+    if(payload_len < 1 || payload[0] > MAX_CONTROLLERS) return -1;
+    int controller = payload[0];
+
+    if(type == FRAME_KEY) {
+        ControllerState state;
+        if(decodeStatePayload(payload, payload_len, state) < 0) return -1;
+        if(controller == 0) { // Status replies, no sequence
+            handleState(0, state);
+            return message_end + 3;
+        }
+        states[controller] = state;
+        haveKey[controller] = true;
+        resyncPending[controller] = false;
+        nextSeq[controller] = seq + 1;
+        frameSequence = seq;
+        frameSequenceBits = 8;
+        handleState(controller, states[controller]);
+    } else if(type == FRAME_DELTA) {
+        if(controller == 0) return -1;
+        if(!haveKey[controller] || seq != nextSeq[controller]) {
+            // Lost something, this delta is relative to a state we never saw
+            if(haveKey[controller]) {
+                dropped++;
+                droppedMetric->add();
             }
-            std::cout << std::endl;
+            haveKey[controller] = false;
+            requestKeyFrame(controller);
+            return message_end + 3;
         }
+        if(applyDeltaPayload(payload, payload_len, states[controller]) < 0) return -1;
+        nextSeq[controller] = seq + 1;
+        frameSequence = seq;
+        frameSequenceBits = 8;
+        handleState(controller, states[controller]);
+    }
+    return message_end + 3;
+}
 
-        // Ensure there's enough data for a valid message
-        if(message_len >= 3) {
-            byte controller_index = message[0];
-            byte button_count = message[1];
-            size_t button_value_count = (button_count + 7) / 8;
-            byte* button_values = message + 2;
-            byte axis_count = message[2 + button_value_count];
-
-            if(message_len >= 2 + button_value_count + 1 + axis_count * 4) {
-                int16_t axis_values[axis_count * 2];
-                for(size_t j = 0; j < axis_count; ++j) {
-                    axis_values[j * 2] = static_cast<int16_t>((message[3 + button_value_count + j * 4] << 8) | message[4 + button_value_count + j * 4]);
-                    axis_values[j * 2 + 1] = static_cast<int16_t>((message[5 + button_value_count + j * 4] << 8) | message[6 + button_value_count + j * 4]);
-                }
-                callback(controller_index, button_count, button_values, axis_count, axis_values);
-            }
+void PicoMonitor::handleState(int controller, const ControllerState& state) {
+    if(controller == 0 && (state.buttons[0] & (STATUS_PROTOCOL | STATUS_PING | STATUS_BAUD))) {
+        handleLinkReply(state.buttons[0], state.axes[0], state.axes[1]);
+        return;
+    }
+    if(readerRunning) {
+        reports.post(frameSequence, frameSequenceBits, controller, state.button_count, state.buttons, state.axis_count, state.axes);
+    } else {
+        sequence = frameSequence;
+        sequenceBits = frameSequenceBits;
+        callback(callbackContext, controller, state.button_count, state.buttons, state.axis_count, state.axes);
+    }
+    if(controller != 0) return;
+    
+    byte flags = state.buttons[0];
+    if(flags & STATUS_PUSH) {
+        int channel = (flags & STATUS_FAN) ? TELEMETRY_FAN : (flags & STATUS_BACKLIGHT) ? TELEMETRY_BACKLIGHT : TELEMETRY_BATTERY;
+        telemetry[channel].live = true;
+        telemetry[channel].lastPush = std::chrono::steady_clock::now();
+    } else {
+        int kind = (flags & STATUS_FAN) ? REPLY_FAN : (flags & STATUS_BACKLIGHT) ? REPLY_BACKLIGHT : REPLY_BATTERY;
+        completeRequest(kind, state.axes[0]);
+    }
+}
+
+// Replies to the link setup requests, none of them are for the callback
+void PicoMonitor::handleLinkReply(byte flags, int16_t x, int16_t y) {
+    if(flags & STATUS_PROTOCOL) setProtocol(x, (uint16_t)y);
+    if(flags & STATUS_BAUD) baudAck = (uint16_t)x;
+    if(flags & STATUS_PING) {
+        uint16_t offset = (uint16_t)x - pingBase;
+        if(offset < 32 && (pingMask & (1u << offset))) {
+            pingMask &= ~(1u << offset); // Count each ping once
+            pingReplies++;
         }
+    }
+}
 
-        // Shift remaining buffer
-        buffer_len -= (message_end + 1);
-        memmove(buffer, buffer + message_end + 1, buffer_len);
-        i = 0;
+void PicoMonitor::printFrame(const byte* frame, size_t len) {
+    char hex[LOG_STRING_SIZE];
+    size_t used = 0;
+    for(size_t j = 0; j < len && used + 4 <= sizeof(hex); ++j) {
+        used += snprintf(hex + used, sizeof(hex) - used, "%x ", frame[j]);
     }
+    hex[used] = '\0';
+    LOG_DEBUG("Extracted message: %s", hex);
 }
 
-uint16_t PicoMonitor::crc16_ccitt_xmodem(const uint8_t* data, size_t length) {
-    uint16_t crc = 0x0000; // Initial value
-    const uint16_t polynomial = 0x1021; // Polynomial used in CRC-16-CCITT
+// One request in flight per controller, the deltas that arrive before the key
+// frame shouldn't each trigger another. Retried if the key frame got lost too.
+void PicoMonitor::requestKeyFrame(int controller) {
+    auto now = std::chrono::steady_clock::now();
+    if(resyncPending[controller] && now - resyncStamp[controller] < std::chrono::milliseconds(RESYNC_INTERVAL)) return;
+    resyncPending[controller] = true;
+    resyncStamp[controller] = now;
+    request(REQUEST_READ_CONTROLLER, controller - 1);
+}
 
-    for(size_t i = 0; i < length; ++i) {
-        crc ^= (data[i] << 8); // XOR byte into the high order byte of CRC
+// Called with the Pico's ack, everything after it is in the new format
+void PicoMonitor::setProtocol(int version, int flags) {
+    protocol = version;
+    cobs = version == PROTOCOL_V2 && (flags & PROTOCOL_FLAG_COBS);
+    negotiated = true;
+    for(int c = 0; c <= MAX_CONTROLLERS; ++c) {
+        haveKey[c] = false;
+    }
+}
 
-        for(uint8_t j = 0; j < 8; ++j) {
-            if(crc & 0x8000) {
-                crc = (crc << 1) ^ polynomial;
-            } else {
-                crc = crc << 1;
-            }
+// Asks the Pico for v2 and waits briefly for the ack, firmware that predates
+// it ignores the request and the link stays on v1
+void PicoMonitor::negotiate() {
+    negotiated = false;
+    cobs = false; // Until the ack says otherwise the Pico sends plain frames
+    request(REQUEST_SET_PROTOCOL, preferredProtocol | (preferCobs ? PROTOCOL_FLAG_COBS : 0));
+
+    pumpUntil(negotiated, NEGOTIATE_TIMEOUT);
+    if(protocol != preferredProtocol) {
+        LOG_WARN("Pico didn't accept protocol v%d, using v%d", preferredProtocol, protocol);
+    } else if(preferCobs && !cobs) {
+        LOG_WARN("Pico doesn't support COBS framing");
+    }
+}
+
+// Reads and parses for up to timeoutMs, returning early once done is set by a
+// reply. Only used while setting up the link, before update() takes over.
+void PicoMonitor::pumpUntil(const bool& done, int timeoutMs) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while(!done && std::chrono::steady_clock::now() < deadline) {
+        readSerial();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Sends count pings and returns how many came back intact
+int PicoMonitor::ping(int count, int timeoutMs) {
+    if(count > 32) count = 32;
+    pingBase += 32;
+    pingMask = count == 32 ? 0xFFFFFFFF : (1u << count) - 1;
+    pingReplies = 0;
+    for(int i = 0; i < count; ++i) {
+        queue(REQUEST_PING, (uint16_t)(pingBase + i));
+    }
+    flushCommands(timeoutMs);
+
+    bool done = false;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while(!done && std::chrono::steady_clock::now() < deadline) {
+        readSerial();
+        done = pingMask == 0;
+        if(!done) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return pingReplies;
+}
+
+// A host restarted within ALIVE_TIMEOUT finds the Pico still at the faster
+// speed, so look for it there before assuming the base rate
+void PicoMonitor::findPico() {
+    if(ping(1, PING_TIMEOUT) == 1) return;
+    for(int baud : BAUD_LADDER) {
+        if(baud > targetBaud) break;
+        serial.setBaud(baud);
+        serial.flushInput();
+        if(ping(1, PING_TIMEOUT) == 1) {
+            LOG_INFO("Found the Pico at %d baud", baud);
+            return;
         }
     }
+    serial.setBaud(SERIAL_BASE_BAUD);
+}
+
+// Moves up the ladder one speed at a time until targetBaud, stopping at the
+// last speed that passed its pings
+void PicoMonitor::stepUpBaud() {
+    for(int baud : BAUD_LADDER) {
+        if(baud <= serial.getBaud()) continue;
+        if(baud > targetBaud) break;
+        if(!tryBaud(baud)) break;
+    }
+    if(targetBaud > serial.getBaud() && std::find(std::begin(BAUD_LADDER), std::end(BAUD_LADDER), targetBaud) == std::end(BAUD_LADDER)) {
+        tryBaud(targetBaud); // Off ladder speeds are tried last
+    }
+    LOG_INFO("Pico link at %d baud", serial.getBaud());
+}
+
+bool PicoMonitor::tryBaud(int baud) {
+    int previous = serial.getBaud();
+
+    baudAck = -1;
+    request(REQUEST_SET_BAUD, baud);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PING_TIMEOUT);
+    while(baudAck == -1 && std::chrono::steady_clock::now() < deadline) {
+        readSerial();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if(baudAck != baud / 100) return false; // Refused, or firmware without REQUEST_SET_BAUD
 
-    return crc;
+    flushCommands(PING_TIMEOUT); // Nothing may still be queued for the old speed
+    serial.drain();
+    if(!serial.setBaud(baud)) {
+        // The Pico moved anyway, wait for it to give up and come back
+        std::this_thread::sleep_for(std::chrono::milliseconds(BAUD_CONFIRM_TIMEOUT + 50));
+        serial.setBaud(previous);
+        return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(BAUD_SETTLE_TIME));
+    serial.flushInput();
+
+    // A damaged reply fails its CRC and never counts, so lost pings cover
+    // both kinds of error
+    int errors = PING_COUNT - ping(PING_COUNT, PING_TIMEOUT);
+    if(errors > PING_COUNT * BAUD_MAX_ERROR_RATE) {
+        LOG_WARN("%d baud failed %d of %d pings, staying at %d", baud, errors, PING_COUNT, previous);
+        std::this_thread::sleep_for(std::chrono::milliseconds(BAUD_CONFIRM_TIMEOUT + 50));
+        serial.setBaud(previous);
+        serial.flushInput();
+        return false;
+    }
+
+    request(REQUEST_CONFIRM_BAUD, baud);
+    return true;
+}
+
+// SERIAL_MODE_BLOCKING starts a reader thread once the link is up, SERIAL_MODE_POLL leaves reading to update()
+void PicoMonitor::setReadMode(int mode, bool lowLatency) {
+    readMode = mode;
+    this->lowLatency = lowLatency;
+}
+
+void PicoMonitor::setBaudRate(int baud) {
+    targetBaud = baud;
+}
+
+int PicoMonitor::getBaudRate() {
+    return serial.getBaud();
+}
+
+void PicoMonitor::setPreferredProtocol(int version, bool cobs) {
+    preferredProtocol = version;
+    preferCobs = cobs;
+}
+
+int PicoMonitor::getProtocol() {
+    return protocol;
 }
 
 void PicoMonitor::request(byte func, unsigned int value){
-	byte buffer[7];
-	buffer[0] = '{';
-	buffer[1] = (byte)(func & 0xFF);
-	buffer[2] = (byte)((value >> 0) & 0xFF);
-	buffer[3] = (byte)((value >> 8) & 0xFF);
-	buffer[4] = (byte)((value >> 16) & 0xFF);
-	buffer[5] = (byte)((value >> 24) & 0xFF);
-	buffer[6] = '}';
-	write(serial_fd, buffer, sizeof(buffer));
+	queue(func, value);
+	flushCommands(0);
 }
 
-void PicoMonitor::statusUpdate() {
-	uint8_t write_data[8];
-	write_data[0] = '{';
-	write_data[1] = 2; //Read Battery Value
-	write_data[2] = 0;
-	write_data[3] = 0;
-	write_data[4] = 0;
-	write_data[5] = 0;
-	write_data[6] = '}';
-	write(serial_fd, write_data, sizeof(write_data));
+void PicoMonitor::request(byte func, unsigned int value, RequestCallback done, void* context){
+	queue(func, value, done, context);
+	flushCommands(0);
+}
+
+static int replyKind(byte func) {
+	switch(func) {
+		case REQUEST_READ_BATTERY: return REPLY_BATTERY;
+		case REQUEST_READ_FAN:
+		case REQUEST_WRITE_FAN: return REPLY_FAN;
+		case REQUEST_READ_BACKLIGHT:
+		case REQUEST_WRITE_BACKLIGHT: return REPLY_BACKLIGHT;
+	}
+	return -1;
+}
+
+// Every request with a status reply is tracked, callback or not, otherwise
+// its reply would complete someone else's
+void PicoMonitor::queue(byte func, unsigned int value, RequestCallback done, void* context) {
+	int kind = replyKind(func);
+	if(kind < 0) {
+		std::lock_guard<std::mutex> guard(writeLock);
+		commands.push(func, value);
+		if(done != nullptr) done(context, func, false, 0); // Nothing to wait for
+		return;
+	}
 	
-	write_data[1] = 4; //Read Fan Value
-	write(serial_fd, write_data, sizeof(write_data));
+	std::unique_lock<std::mutex> guard(requestLock);
+	size_t& count = inFlightCount[kind];
+	bool queued = false, merged = false;
+	if(count < MAX_IN_FLIGHT) { // Refused otherwise, its reply couldn't be matched up
+		std::lock_guard<std::mutex> write(writeLock);
+		uint64_t coalesced = commands.coalesced;
+		queued = commands.push(func, value);
+		merged = commands.coalesced != coalesced;
+	}
 	
-	write_data[1] = 6; //Read Backlight Value
-	write(serial_fd, write_data, sizeof(write_data));
+	InFlight* entry = nullptr;
+	if(merged) { // Replaces the newest request for the same thing, which hasn't gone out yet
+		for(size_t i = count; i-- > 0;) {
+			InFlight& f = inFlight[kind][(inFlightHead[kind] + i) % MAX_IN_FLIGHT];
+			if(f.func == func) {
+				entry = &f;
+				break;
+			}
+		}
+	}
+	if(entry == nullptr && queued) {
+		entry = &inFlight[kind][(inFlightHead[kind] + count++) % MAX_IN_FLIGHT];
+	}
+	if(entry == nullptr) {
+		guard.unlock();
+		if(done != nullptr) done(context, func, false, 0);
+		return;
+	}
+	InFlight replaced = *entry;
+	entry->func = func;
+	entry->sent = std::chrono::steady_clock::now();
+	entry->done = done;
+	entry->context = context;
+	guard.unlock();
 	
-	for(int i = 0; i < 4; i++) {
-		request(1, i); //Read Controller States
+	if(merged && replaced.done != nullptr) replaced.done(replaced.context, func, false, 0); // Superseded
+}
+
+void PicoMonitor::completeRequest(int kind, int value) {
+	std::unique_lock<std::mutex> guard(requestLock);
+	if(inFlightCount[kind] == 0) return; // Unasked for, or already timed out
+	InFlight f = inFlight[kind][inFlightHead[kind]];
+	inFlightHead[kind] = (inFlightHead[kind] + 1) % MAX_IN_FLIGHT;
+	inFlightCount[kind]--;
+	
+	auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - f.sent).count();
+	int bucket = 0;
+	while(bucket < RTT_BUCKETS - 1 && rtt >= (2LL << bucket)) bucket++;
+	roundTrips[f.func][bucket]++;
+	guard.unlock();
+	roundTripMetric->record(rtt);
+	
+	if(f.done != nullptr) f.done(f.context, f.func, true, value);
+}
+
+void PicoMonitor::expireRequests() {
+	auto now = std::chrono::steady_clock::now();
+	for(int kind = 0; kind < REPLY_KINDS; ++kind) {
+		std::unique_lock<std::mutex> guard(requestLock);
+		while(inFlightCount[kind] > 0) {
+			InFlight f = inFlight[kind][inFlightHead[kind]];
+			if(now - f.sent < std::chrono::milliseconds(REQUEST_TIMEOUT)) break;
+			inFlightHead[kind] = (inFlightHead[kind] + 1) % MAX_IN_FLIGHT;
+			inFlightCount[kind]--;
+			requestTimeouts++;
+			timeoutsMetric->add();
+			
+			if(f.done == nullptr) continue;
+			guard.unlock();
+			f.done(f.context, f.func, false, 0);
+			guard.lock();
+		}
 	}
 }
 
-int PicoMonitor::openSerialPort(const char* portName) {
-    int fd = open(portName, O_RDWR | O_NOCTTY | O_NDELAY);
-    if(fd == -1) {
-        perror("openSerialPort: Unable to open port");
-        return -1;
-    }
+void PicoMonitor::getRoundTrips(byte func, uint32_t* buckets) {
+	std::lock_guard<std::mutex> guard(requestLock);
+	for(int i = 0; i < RTT_BUCKETS; ++i) {
+		buckets[i] = func <= REQUEST_CONFIRM_BAUD ? roundTrips[func][i] : 0;
+	}
+}
 
-    struct termios options;
-    tcgetattr(fd, &options);
+unsigned long PicoMonitor::getRequestTimeouts() {
+	std::lock_guard<std::mutex> guard(requestLock);
+	return requestTimeouts;
+}
 
-    // Set baud rate to 115200
-    cfsetispeed(&options, B115200);
-    cfsetospeed(&options, B115200);
+// Sends whatever is queued, waiting up to timeoutMs for room if the port is
+// backed up. False if anything is still queued afterwards.
+bool PicoMonitor::flushCommands(int timeoutMs) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+	while(true) {
+		{
+			std::lock_guard<std::mutex> guard(writeLock);
+			commands.flush(serial, &capture);
+			if(commands.empty()) return true;
+		}
+		int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if(left <= 0 || !serial.waitWritable(left)) return false;
+	}
+}
 
-    // Set 8 data bits, no parity, 1 stop bit
-    options.c_cflag &= ~PARENB; // Clear parity bit, disabling parity (most common)
-    options.c_cflag &= ~CSTOPB; // Clear stop field, only one stop bit (most common)
-    options.c_cflag &= ~CSIZE; // Clear all bits that set the data size
-    options.c_cflag |= CS8; // 8 bits per byte (most common)
-    options.c_cflag &= ~CRTSCTS; // Disable RTS/CTS hardware flow control (most common)
-    options.c_cflag |= CREAD | CLOCAL; // Turn on READ & ignore ctrl lines (CLOCAL = 1)
+size_t PicoMonitor::getQueueDepth() {
+	std::lock_guard<std::mutex> guard(writeLock);
+	return commands.depth();
+}
 
-    // Set raw input
-    cfmakeraw(&options);
+// Polls whatever the Pico isn't pushing. Runs every STATUS_INTERVAL however
+// fast update() is called.
+void PicoMonitor::statusUpdate() {
+	auto now = std::chrono::steady_clock::now();
+	statusStamp = now;
+	if(telemetryEnabled && now - subscribeStamp >= std::chrono::milliseconds(TELEMETRY_RENEW)) {
+		subscribe();
+	}
+	
+	for(int c = 0; c < TELEMETRY_CHANNELS; c++) {
+		bool live = telemetry[c].live && now - telemetry[c].lastPush < std::chrono::milliseconds(TELEMETRY_STALE);
+		if(!live) queue(TELEMETRY_READS[c], 0); // Old firmware, or the subscription was lost
+	}
+	
+	if(protocol == PROTOCOL_V1) { //v2 has key frames instead
+		for(int i = 0; i < MAX_CONTROLLERS; i++) {
+			queue(REQUEST_READ_CONTROLLER, i); //Read Controller States
+		}
+	} else {
+		for(int c = 1; c <= MAX_CONTROLLERS; c++) {
+			if(resyncPending[c]) requestKeyFrame(c); //Key frame request got lost
+		}
+	}
+	flushCommands(0);
+}
 
-    // Set the new options for the port
-    tcsetattr(fd, TCSANOW, &options);
+// Also renews the subscriptions, firmware without REQUEST_SUBSCRIBE ignores it
+// and keeps getting polled
+void PicoMonitor::subscribe() {
+	subscribeStamp = std::chrono::steady_clock::now();
+	for(int c = 0; c < TELEMETRY_CHANNELS; c++) {
+		queue(REQUEST_SUBSCRIBE, encodeSubscription(c, TELEMETRY_SETTINGS[c].interval, TELEMETRY_SETTINGS[c].threshold));
+	}
+}
 
-    return fd;
+void PicoMonitor::setTelemetry(bool enable) {
+	telemetryEnabled = enable;
 }
 
 bool PicoMonitor::hasFeatures(int features){
@@ -2,10 +2,35 @@
 #define PICO_MONITOR_H
 
 #include "monitor.h"
+#include "capture.h"
+#include "command_queue.h"
+#include "pico_protocol.h"
+#include "serial_port.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <string>
+#include <thread>
+
+#define MAX_CONTROLLERS 4
+
+#define REPLY_BATTERY   0 // Status replies requests are matched against
+#define REPLY_FAN       1
+#define REPLY_BACKLIGHT 2
+#define REPLY_KINDS     3
+
+#define MAX_IN_FLIGHT 8 // Per reply kind
+#define RTT_BUCKETS   16 // Bucket i counts round trips under 2^(i+1) us
 
 class PicoMonitor : public Monitor{
 public:	
+	struct LinkStats {
+		bool up;
+		unsigned long crcErrors, framingErrors, skippedBytes, overflowResets, dropped;
+		unsigned long reconnects, linkTimeouts;
+		int lastRecoveryMs; // From losing the link to the first frame after reopening it
+	};
+	
 	PicoMonitor(std::string port);
 	~PicoMonitor();
 	
@@ -14,20 +39,124 @@ public:
 	bool init() override;
 	void update() override;
 	void request(byte func, unsigned int value) override;
+	void request(byte func, unsigned int value, RequestCallback done, void* context) override;
 	bool hasFeatures(int features) override;
 	
+	void setPreferredProtocol(int version, bool cobs = true);
+	void setBaudRate(int baud);
+	int getBaudRate();
+	void setReadMode(int mode, bool lowLatency = true);
+	void setTelemetry(bool enable);
+	int getProtocol();
+	bool setCapture(const std::string& path);
+	size_t getQueueDepth();
+	LinkStats getLinkStats();
+	void getRoundTrips(byte func, uint32_t* buckets);
+	unsigned long getRequestTimeouts();
+	void feed(const byte* data, size_t len);
+	
 private:
-	int serial_fd, update_counter;
+	SerialPort serial;
+	std::chrono::steady_clock::time_point statusStamp, subscribeStamp;
     byte buffer[2048];  // Buffer to store incomplete messages
     size_t buffer_len = 0;
 	std::string port;
+	CaptureWriter capture;
+	CommandQueue commands;
+	
+	int protocol = PROTOCOL_V1, preferredProtocol = PROTOCOL_V2;
+	bool cobs = false, preferCobs = true, negotiated = false;
+	ControllerState states[MAX_CONTROLLERS + 1]; // Last v2 state, deltas apply to it
+	bool haveKey[MAX_CONTROLLERS + 1] = {false};
+	bool resyncPending[MAX_CONTROLLERS + 1] = {false};
+	byte nextSeq[MAX_CONTROLLERS + 1] = {0};
+	std::chrono::steady_clock::time_point resyncStamp[MAX_CONTROLLERS + 1];
+	
+	unsigned long dropped = 0, crcErrors = 0, framingErrors = 0;
+	unsigned long skippedBytes = 0, overflowResets = 0, validFrames = 0;
+	
+	// Link watchdog. The link is down after a read error, a hangup or
+	// LINK_TIMEOUT without a valid frame, and update() reopens it with backoff.
+	std::atomic<bool> linkDown{false};
+	bool reconnecting = false;
+	std::chrono::steady_clock::time_point lastFrame, lostAt, reopenedAt, nextAttempt;
+	int reconnectDelay = 0;
+	unsigned long reconnects = 0, linkTimeouts = 0;
+	int lastRecoveryMs = -1;
+	
+	// Pushed telemetry, a channel is only polled while it isn't live
+	struct Subscription {
+		bool live;
+		std::chrono::steady_clock::time_point lastPush;
+	};
+	Subscription telemetry[TELEMETRY_CHANNELS] = {};
+	bool telemetryEnabled = true;
+	
+	int targetBaud = SERIAL_BASE_BAUD;
+	int baudAck = 0;
+	uint16_t pingBase = 0;
+	uint32_t pingMask = 0; // Pings still waiting for a reply
+	int pingReplies = 0;
+	
+	// With a blocking read mode the parser runs on its own thread, woken by
+	// the tty as bytes arrive instead of by update(). Its reports are queued
+	// for update() to deliver, the manager only runs on the controller loop.
+	int readMode = SERIAL_MODE_POLL;
+	bool lowLatency = true;
+	std::thread reader;
+	std::atomic<bool> readerRunning{false};
+	std::mutex stateLock; // Parser and resync state, shared with update()
+	std::mutex writeLock; // Command queue, serial writes and the capture file
+	ReportQueue reports;
+	uint32_t frameSequence = 0; // Of the frame being parsed, becomes sequence when it's delivered
+	int frameSequenceBits = 0;
+	
+	// Requests waiting for their status reply. The Pico answers in order, so
+	// each reply completes the oldest request of its kind.
+	struct InFlight {
+		byte func;
+		std::chrono::steady_clock::time_point sent;
+		RequestCallback done;
+		void* context;
+	};
+	InFlight inFlight[REPLY_KINDS][MAX_IN_FLIGHT] = {};
+	size_t inFlightHead[REPLY_KINDS] = {0}, inFlightCount[REPLY_KINDS] = {0};
+	uint32_t roundTrips[REQUEST_CONFIRM_BAUD + 1][RTT_BUCKETS] = {{0}};
+	unsigned long requestTimeouts = 0;
+	std::mutex requestLock; // Taken before writeLock, never after
 	
 	void statusUpdate();
-	int openSerialPort(const char* portName);
-	uint16_t crc16_ccitt_xmodem(const uint8_t* data, size_t length);
+	void subscribe();
+	void queue(byte func, unsigned int value, RequestCallback done = nullptr, void* context = nullptr);
+	void completeRequest(int kind, int value);
+	void expireRequests();
+	bool flushCommands(int timeoutMs);
 	
     void readSerial();
+	void readerLoop();
+	void startReader();
+	void stopReader();
+	
+	bool openLink();
+	void resetLinkState();
+	void markLinkDown(const char* reason);
+	void reconnect();
 	void processBuffer();
+	size_t processCobs(size_t i);
+	int parseV1(const byte* frame, size_t len);
+	int parseV2(const byte* frame, size_t len);
+	void handleState(int controller, const ControllerState& state);
+	void handleLinkReply(byte flags, int16_t x, int16_t y);
+	void printFrame(const byte* frame, size_t len);
+	
+	void negotiate();
+	void pumpUntil(const bool& done, int timeoutMs);
+	int ping(int count, int timeoutMs);
+	void findPico();
+	void stepUpBaud();
+	bool tryBaud(int baud);
+	void setProtocol(int version, int flags);
+	void requestKeyFrame(int controller);
 }; 
 
 #endif // PICO_MONITOR_H
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include "pico_protocol.h"
+
+#include <cstring>
+
+uint16_t crc16_ccitt_xmodem(const uint8_t* data, size_t length) {
+	uint16_t crc = 0x0000; // Initial value
+	const uint16_t polynomial = 0x1021; // Polynomial used in CRC-16-CCITT
+
+	for(size_t i = 0; i < length; ++i) {
+		crc ^= (data[i] << 8); // XOR byte into the high order byte of CRC
+
+		for(uint8_t j = 0; j < 8; ++j) {
+			if(crc & 0x8000) {
+				crc = (crc << 1) ^ polynomial;
+			} else {
+				crc = crc << 1;
+			}
+		}
+	}
+
+	return crc;
+}
+
+// Builds a complete state frame, out needs MAX_STATE_FRAME bytes. Axis values
+// are x, y pairs. Returns the frame length including the CRC.
+size_t encodeStateFrame(uint8_t* out, uint8_t controller, uint8_t button_count, const uint8_t* button_values, uint8_t axis_count, const int16_t* axis_values) {
+	if(button_count > MAX_FRAME_BUTTONS) button_count = MAX_FRAME_BUTTONS;
+	if(axis_count > MAX_FRAME_AXES) axis_count = MAX_FRAME_AXES;
+
+	size_t len = 0;
+	out[len++] = FRAME_START;
+	out[len++] = controller;
+	out[len++] = button_count;
+	for(int i = 0; i < (button_count + 7) / 8; ++i) {
+		out[len++] = button_values[i];
+	}
+	out[len++] = axis_count;
+	for(int i = 0; i < axis_count * 2; ++i) {
+		out[len++] = (axis_values[i] >> 8) & 0xFF;
+		out[len++] = axis_values[i] & 0xFF;
+	}
+	out[len++] = FRAME_END;
+
+	uint16_t crc = crc16_ccitt_xmodem(out, len);
+	out[len++] = crc & 0xFF; // Low byte of CRC
+	out[len++] = (crc >> 8) & 0xFF; // High byte of CRC
+	return len;
+}
+
+size_t encodeRequest(uint8_t* out, uint8_t func, uint32_t value) {
+	out[0] = FRAME_START;
+	out[1] = func;
+	out[2] = (value >> 0) & 0xFF;
+	out[3] = (value >> 8) & 0xFF;
+	out[4] = (value >> 16) & 0xFF;
+	out[5] = (value >> 24) & 0xFF;
+	out[6] = FRAME_END;
+	return REQUEST_FRAME_SIZE;
+}
+
+// { channel, interval / TELEMETRY_INTERVAL_UNIT, threshold lo, threshold hi },
+// an interval of 0 unsubscribes
+uint32_t encodeSubscription(uint8_t channel, int intervalMs, uint16_t threshold) {
+	int interval = (intervalMs + TELEMETRY_INTERVAL_UNIT - 1) / TELEMETRY_INTERVAL_UNIT;
+	if(interval > 0xFF) interval = 0xFF;
+	return channel | (uint32_t)interval << 8 | (uint32_t)threshold << 16;
+}
+
+// Checks for a whole v1 state frame at the start of data. Returns its length
+// including the CRC, 0 if data ends before it does, -1 if it isn't one and
+// -2 if only the CRC is wrong.
+int checkStateFrame(const uint8_t* data, size_t len) {
+	if(len < 3) return 0;
+	if(data[0] != FRAME_START) return -1;
+	size_t axis_count_pos = 3 + (data[2] + 7) / 8;
+	if(axis_count_pos >= len) return 0;
+
+	size_t message_end = axis_count_pos + 1 + data[axis_count_pos] * 4;
+	if(message_end + 2 >= len) return 0;
+	if(data[message_end] != FRAME_END) return -1;
+
+	uint16_t crc = data[message_end + 1] | (data[message_end + 2] << 8);
+	if(crc16_ccitt_xmodem(data, message_end + 1) != crc) return -2;
+	return message_end + 3;
+}
+
+size_t encodeNetHeader(uint8_t* out, uint32_t seq, uint32_t timeUs) {
+	out[0] = NET_MAGIC;
+	for(int i = 0; i < 4; ++i) {
+		out[1 + i] = (seq >> (i * 8)) & 0xFF;
+		out[5 + i] = (timeUs >> (i * 8)) & 0xFF;
+	}
+	return NET_HEADER_SIZE;
+}
+
+static size_t finishV2Frame(uint8_t* out, uint8_t type, uint8_t seq, size_t payloadLen) {
+	out[0] = FRAME_V2_START;
+	out[1] = type;
+	out[2] = seq;
+	out[3] = payloadLen;
+
+	size_t len = V2_HEADER_SIZE + payloadLen;
+	out[len++] = FRAME_V2_END;
+	uint16_t crc = crc16_ccitt_xmodem(out, len);
+	out[len++] = crc & 0xFF;
+	out[len++] = (crc >> 8) & 0xFF;
+	return len;
+}
+
+// out needs MAX_V2_FRAME bytes
+size_t encodeKeyFrame(uint8_t* out, uint8_t seq, uint8_t controller, const ControllerState& state) {
+	uint8_t* p = out + V2_HEADER_SIZE;
+	size_t len = 0;
+	p[len++] = controller;
+	p[len++] = state.button_count;
+	for(int i = 0; i < (state.button_count + 7) / 8; ++i) {
+		p[len++] = state.buttons[i];
+	}
+	p[len++] = state.axis_count;
+	for(int i = 0; i < state.axis_count * 2; ++i) {
+		p[len++] = (state.axes[i] >> 8) & 0xFF;
+		p[len++] = state.axes[i] & 0xFF;
+	}
+	return finishV2Frame(out, FRAME_KEY, seq, len);
+}
+
+// Only the button bytes and axis values that differ from previous, 0 when
+// nothing changed. Counts have to match, a new layout needs a key frame.
+size_t encodeDeltaFrame(uint8_t* out, uint8_t seq, uint8_t controller, const ControllerState& previous, const ControllerState& state) {
+	uint8_t* p = out + V2_HEADER_SIZE;
+	size_t len = 0;
+	p[len++] = controller;
+
+	size_t maskPos = len++;
+	uint8_t mask = 0;
+	for(int i = 0; i < (state.button_count + 7) / 8; ++i) {
+		if(state.buttons[i] == previous.buttons[i]) continue;
+		mask |= 1 << i;
+		p[len++] = state.buttons[i];
+	}
+	p[maskPos] = mask;
+
+	maskPos = len++;
+	uint8_t axisMask = 0;
+	for(int i = 0; i < state.axis_count * 2; ++i) {
+		if(state.axes[i] == previous.axes[i]) continue;
+		axisMask |= 1 << i;
+		p[len++] = (state.axes[i] >> 8) & 0xFF;
+		p[len++] = state.axes[i] & 0xFF;
+	}
+	p[maskPos] = axisMask;
+
+	if(mask == 0 && axisMask == 0) return 0;
+	return finishV2Frame(out, FRAME_DELTA, seq, len);
+}
+
+// Parses a v1 body (also the v2 key payload) starting at the controller byte.
+// Returns the controller index, or -1 if it doesn't fit len or the limits.
+int decodeStatePayload(const uint8_t* payload, size_t len, ControllerState& state) {
+	if(len < 3) return -1;
+	uint8_t button_count = payload[1];
+	size_t button_bytes = (button_count + 7) / 8;
+	if(button_count > MAX_FRAME_BUTTONS || len < 3 + button_bytes) return -1;
+	uint8_t axis_count = payload[2 + button_bytes];
+	if(axis_count > MAX_FRAME_AXES || len != 3 + button_bytes + axis_count * 4u) return -1;
+
+	state.button_count = button_count;
+	state.axis_count = axis_count;
+	memcpy(state.buttons, payload + 2, button_bytes);
+	const uint8_t* a = payload + 3 + button_bytes;
+	for(int i = 0; i < axis_count * 2; ++i) {
+		state.axes[i] = (int16_t)((a[i * 2] << 8) | a[i * 2 + 1]);
+	}
+	return payload[0];
+}
+
+// Applies a delta payload onto the last known state, -1 if it's malformed
+int applyDeltaPayload(const uint8_t* payload, size_t len, ControllerState& state) {
+	size_t pos = 0;
+	if(len < 3) return -1;
+	int controller = payload[pos++];
+
+	uint8_t mask = payload[pos++];
+	for(int i = 0; i < MAX_FRAME_BUTTONS / 8; ++i) {
+		if(!(mask & (1 << i))) continue;
+		if(pos >= len) return -1;
+		state.buttons[i] = payload[pos++];
+	}
+
+	if(pos >= len) return -1;
+	uint8_t axisMask = payload[pos++];
+	for(int i = 0; i < MAX_FRAME_AXES * 2; ++i) {
+		if(!(axisMask & (1 << i))) continue;
+		if(pos + 2 > len) return -1;
+		state.axes[i] = (int16_t)((payload[pos] << 8) | payload[pos + 1]);
+		pos += 2;
+	}
+	return pos == len ? controller : -1;
+}
+
+// Consistent overhead byte stuffing, every zero in data is replaced by the
+// distance to the next one so the output has none. Doesn't add the
+// delimiter, out needs len + len / 254 + 1 bytes.
+size_t cobsEncode(const uint8_t* data, size_t len, uint8_t* out) {
+	size_t codePos = 0, pos = 1;
+	uint8_t code = 1;
+	for(size_t i = 0; i < len; ++i) {
+		if(data[i] != 0) {
+			out[pos++] = data[i];
+			code++;
+		}
+		if(data[i] == 0 || code == 0xFF) {
+			out[codePos] = code;
+			codePos = pos++;
+			code = 1;
+		}
+	}
+	out[codePos] = code;
+	return pos;
+}
+
+// Decodes one frame without its delimiter, returns the length or -1 if it
+// couldn't have come from cobsEncode() or doesn't fit outSize
+int cobsDecode(const uint8_t* data, size_t len, uint8_t* out, size_t outSize) {
+	size_t pos = 0, outLen = 0;
+	while(pos < len) {
+		uint8_t code = data[pos++];
+		if(code == 0 || pos + code - 1 > len) return -1;
+		for(int i = 1; i < code; ++i) {
+			if(data[pos] == 0 || outLen >= outSize) return -1;
+			out[outLen++] = data[pos++];
+		}
+		if(code != 0xFF && pos < len) {
+			if(outLen >= outSize) return -1;
+			out[outLen++] = 0;
+		}
+	}
+	return outLen;
+}
@@ -0,0 +1,122 @@
+#ifndef PICO_PROTOCOL_H
+#define PICO_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Wire format shared by PicoMonitor, PicoSketch.ino and the tools.
+//
+// State frame (Pico -> host):
+//   '{' controller button_count button_bytes[(button_count + 7) / 8]
+//       axis_count (x_hi x_lo y_hi y_lo)[axis_count] '}' crc_lo crc_hi
+//   The CRC-16/XMODEM covers everything from '{' to '}'.
+//
+// Request frame (host -> Pico):
+//   '{' func value_b0 value_b1 value_b2 value_b3 '}'
+//
+// Version 2 frames (Pico -> host, once REQUEST_SET_PROTOCOL was acknowledged):
+//   '[' type seq len payload[len] ']' crc_lo crc_hi
+//   FRAME_KEY payload is a v1 body: controller button_count buttons axis_count axes
+//   FRAME_DELTA payload: controller byte_mask changed_button_bytes
+//                        axis_mask changed_axis_values (bit 2i = x, 2i + 1 = y)
+//   seq counts per controller, a gap means a delta was lost and the host asks
+//   for a key frame with REQUEST_READ_CONTROLLER. The Pico also sends one
+//   every KEYFRAME_INTERVAL and falls back to v1 when the host goes quiet.
+//
+// Network datagram (wireless client -> host, UDP):
+//   'N' seq_b0..seq_b3 time_b0..time_b3 state_frame[1..NET_MAX_FRAMES]
+//   seq counts datagrams per client, anything not newer than the last one
+//   delivered is stale. time is the client's clock in microseconds, only
+//   differences matter. Each state frame is a whole v1 frame with its CRC.
+//   Requests go back to the client as request frames, one per datagram.
+
+#define FRAME_START '{'
+#define FRAME_END   '}'
+#define FRAME_V2_START '['
+#define FRAME_V2_END   ']'
+
+#define FRAME_KEY   1
+#define FRAME_DELTA 2
+
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+
+#define KEYFRAME_INTERVAL 1000 // ms
+
+// With v2 the Pico can COBS encode every frame it sends and end it with a
+// zero byte, which can't appear anywhere else. Requested and acked (in the
+// axis y value) alongside the version.
+#define PROTOCOL_FLAG_COBS 0x100
+#define FRAME_DELIMITER    0x00
+
+#define REQUEST_READ_CONTROLLER 1 // Value is the controller index - 1
+#define REQUEST_READ_BATTERY    2
+#define REQUEST_READ_FAN        4
+#define REQUEST_WRITE_FAN       5
+#define REQUEST_READ_BACKLIGHT  6
+#define REQUEST_WRITE_BACKLIGHT 7
+#define REQUEST_SET_PROTOCOL    8 // Version | flags, acked with a v1 status frame before switching
+#define REQUEST_SET_BAUD        9 // Acked at the old speed, reverted unless confirmed in time
+#define REQUEST_PING            10 // Echoes the low 16 bits of the value
+#define REQUEST_CONFIRM_BAUD    11
+#define REQUEST_SUBSCRIBE       12 // Value from encodeSubscription(), acked with a push of the current value
+
+#define REQUEST_FRAME_SIZE 7
+
+// Controller 0 carries status instead of input, the first button byte says
+// which value the axis holds
+#define STATUS_CHARGING  0x01
+#define STATUS_FAN       0x02
+#define STATUS_BACKLIGHT 0x04
+#define STATUS_PROTOCOL  0x08 // Axis holds the protocol now in use
+#define STATUS_PING      0x10 // Axis x holds the ping value
+#define STATUS_BAUD      0x20 // Axis x holds the new speed / 100, 0 if refused
+#define STATUS_PUSH      0x40 // Sent for a subscription, not in reply to a request
+
+// Telemetry the Pico pushes once subscribed, only when the value moved by at
+// least the threshold and no sooner than the interval since the last push.
+// Subscriptions end when the host goes quiet, so the host renews them.
+#define TELEMETRY_BATTERY   0 // Also pushed when charging starts or stops
+#define TELEMETRY_FAN       1
+#define TELEMETRY_BACKLIGHT 2
+#define TELEMETRY_CHANNELS  3
+#define TELEMETRY_INTERVAL_UNIT 10 // ms, the interval travels in one byte
+
+#define BAUD_CONFIRM_TIMEOUT 500 // ms the Pico waits for REQUEST_CONFIRM_BAUD
+
+#define MAX_FRAME_BUTTONS 32
+#define MAX_FRAME_AXES    4
+#define MAX_STATE_FRAME   (3 + MAX_FRAME_BUTTONS / 8 + 1 + MAX_FRAME_AXES * 4 + 1 + 2)
+#define MAX_V2_FRAME      (4 + 1 + 1 + MAX_FRAME_BUTTONS / 8 + 1 + MAX_FRAME_AXES * 4 + 1 + 2)
+#define V2_HEADER_SIZE    4 // '[' type seq len
+#define MAX_COBS_FRAME    (MAX_V2_FRAME + MAX_V2_FRAME / 254 + 1)
+
+#define NET_MAGIC         'N'
+#define NET_HEADER_SIZE   9
+#define NET_MAX_FRAMES    5 // Four controllers and the status
+#define MAX_NET_DATAGRAM  (NET_HEADER_SIZE + NET_MAX_FRAMES * MAX_STATE_FRAME)
+
+struct ControllerState {
+	uint8_t button_count = 0;
+	uint8_t axis_count = 0;
+	uint8_t buttons[MAX_FRAME_BUTTONS / 8] = {0};
+	int16_t axes[MAX_FRAME_AXES * 2] = {0};
+};
+
+uint16_t crc16_ccitt_xmodem(const uint8_t* data, size_t length);
+
+size_t encodeStateFrame(uint8_t* out, uint8_t controller, uint8_t button_count, const uint8_t* button_values, uint8_t axis_count, const int16_t* axis_values);
+size_t encodeRequest(uint8_t* out, uint8_t func, uint32_t value);
+uint32_t encodeSubscription(uint8_t channel, int intervalMs, uint16_t threshold);
+int checkStateFrame(const uint8_t* data, size_t len);
+size_t encodeNetHeader(uint8_t* out, uint32_t seq, uint32_t timeUs);
+
+size_t encodeKeyFrame(uint8_t* out, uint8_t seq, uint8_t controller, const ControllerState& state);
+size_t encodeDeltaFrame(uint8_t* out, uint8_t seq, uint8_t controller, const ControllerState& previous, const ControllerState& state);
+int decodeStatePayload(const uint8_t* payload, size_t len, ControllerState& state);
+int applyDeltaPayload(const uint8_t* payload, size_t len, ControllerState& state);
+
+size_t cobsEncode(const uint8_t* data, size_t len, uint8_t* out);
+int cobsDecode(const uint8_t* data, size_t len, uint8_t* out, size_t outSize);
+
+#endif // PICO_PROTOCOL_H
@@ -0,0 +1,181 @@
+/*
+ * Client for the controller state feed joystick_emulator publishes when
+ * stateFeed is set in config.prop. Header only and plain C, copy it next to
+ * an emulator and read input without going through evdev:
+ *
+ *   struct ptstate_client client;
+ *   if(ptstate_open(&client, "/picotroller") == 0) {
+ *       struct ptstate_snapshot snap;
+ *       ptstate_read(&client, &snap);          // Current state, no syscall
+ *       ptstate_wait(&client, snap.seq, 100);  // Sleep until it changes
+ *       struct ptstate_event ev;
+ *       while(ptstate_next_event(&client, &ev)) { ... }
+ *       ptstate_close(&client);
+ *   }
+ *
+ * The snapshot is guarded by a seqlock, odd while the driver is writing it,
+ * so a read never blocks the driver and retries if it raced a write. Every
+ * change is also queued as an event in a single producer, single consumer
+ * ring, only one process should take events. The sequence number doubles as
+ * the futex word waiters sleep on. Needs -lrt with glibc older than 2.34.
+ */
+#ifndef PICOTROLLER_STATE_H
+#define PICOTROLLER_STATE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define PTSTATE_MAGIC   0x54534350 /* "PCST" */
+#define PTSTATE_VERSION 1
+#define PTSTATE_SLOTS   4
+#define PTSTATE_AXES    4
+#define PTSTATE_RING    256 /* Events, a power of two */
+
+#define PTSTATE_EVENT_BUTTON  1 /* index is the button, value 0 or 1 */
+#define PTSTATE_EVENT_AXIS    2 /* index is axis * 2 for x, axis * 2 + 1 for y */
+#define PTSTATE_EVENT_PLUGGED 3 /* value is whether the slot is in use */
+
+struct ptstate_controller {
+	uint8_t plugged_in;
+	uint8_t button_count;
+	uint8_t axis_count;
+	uint8_t reserved;
+	uint32_t buttons; /* Bit i is button i */
+	int16_t axes[PTSTATE_AXES * 2]; /* x, y pairs */
+};
+
+struct ptstate_event {
+	uint64_t time_ns; /* CLOCK_MONOTONIC */
+	uint8_t slot;
+	uint8_t type;
+	uint8_t index;
+	uint8_t reserved;
+	int32_t value;
+};
+
+struct ptstate_shared {
+	uint32_t magic; /* Written last, the rest is valid once it's there */
+	uint16_t version;
+	uint16_t slots;
+	uint32_t seq;     /* Seqlock and futex word */
+	uint32_t waiters; /* Clients inside ptstate_wait(), the driver only wakes when non zero */
+	uint64_t updated_ns;
+	uint64_t updates;
+	struct ptstate_controller controllers[PTSTATE_SLOTS];
+
+	uint64_t head; /* Events written, only the driver moves it */
+	uint64_t tail; /* Events taken, only the client moves it */
+	uint64_t dropped; /* Events lost because the ring was full */
+	struct ptstate_event ring[PTSTATE_RING];
+};
+
+struct ptstate_snapshot {
+	uint32_t seq;
+	uint64_t updated_ns;
+	struct ptstate_controller controllers[PTSTATE_SLOTS];
+};
+
+struct ptstate_client {
+	struct ptstate_shared* shared;
+	int fd;
+};
+
+static inline uint64_t ptstate_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* 0 on success, -1 if the feed isn't there or isn't one we understand */
+static inline int ptstate_open(struct ptstate_client* client, const char* name) {
+	client->shared = NULL;
+	client->fd = shm_open(name, O_RDWR, 0);
+	if(client->fd == -1) return -1;
+
+	void* map = mmap(NULL, sizeof(struct ptstate_shared), PROT_READ | PROT_WRITE, MAP_SHARED, client->fd, 0);
+	if(map == MAP_FAILED) {
+		close(client->fd);
+		client->fd = -1;
+		return -1;
+	}
+	client->shared = (struct ptstate_shared*)map;
+	if(__atomic_load_n(&client->shared->magic, __ATOMIC_ACQUIRE) != PTSTATE_MAGIC || client->shared->version != PTSTATE_VERSION) {
+		munmap(map, sizeof(struct ptstate_shared));
+		close(client->fd);
+		client->shared = NULL;
+		client->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static inline void ptstate_close(struct ptstate_client* client) {
+	if(client->shared != NULL) munmap(client->shared, sizeof(struct ptstate_shared));
+	if(client->fd != -1) close(client->fd);
+	client->shared = NULL;
+	client->fd = -1;
+}
+
+/* Copies a consistent snapshot, spinning only while a write is in progress */
+static inline void ptstate_read(struct ptstate_client* client, struct ptstate_snapshot* out) {
+	struct ptstate_shared* s = client->shared;
+	uint32_t before, after;
+	do {
+		before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if(before & 1) continue;
+		out->updated_ns = s->updated_ns;
+		memcpy(out->controllers, s->controllers, sizeof(out->controllers));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	} while((before & 1) || before != after);
+	out->seq = before;
+}
+
+/* Sleeps until seq moves past the given one or timeout_ms passes, -1 waits
+ * forever. Returns 1 if it changed, 0 on timeout. */
+static inline int ptstate_wait(struct ptstate_client* client, uint32_t seq, int timeout_ms) {
+	struct ptstate_shared* s = client->shared;
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+
+	__atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) == seq) {
+		if(syscall(SYS_futex, &s->seq, FUTEX_WAIT, seq, timeout_ms < 0 ? NULL : &timeout, NULL, 0) == -1 && timeout_ms >= 0) {
+			if(__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) != seq) break;
+			__atomic_fetch_sub(&s->waiters, 1, __ATOMIC_SEQ_CST);
+			return 0; /* Timed out, or a signal, let the caller decide */
+		}
+	}
+	__atomic_fetch_sub(&s->waiters, 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+/* Takes the oldest queued event, 0 if there are none */
+static inline int ptstate_next_event(struct ptstate_client* client, struct ptstate_event* out) {
+	struct ptstate_shared* s = client->shared;
+	uint64_t tail = __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+	if(tail == __atomic_load_n(&s->head, __ATOMIC_ACQUIRE)) return 0;
+	*out = s->ring[tail & (PTSTATE_RING - 1)];
+	__atomic_store_n(&s->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Throws away queued events, e.g. after a snapshot made them moot */
+static inline void ptstate_skip_events(struct ptstate_client* client) {
+	struct ptstate_shared* s = client->shared;
+	__atomic_store_n(&s->tail, __atomic_load_n(&s->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+static inline int ptstate_button(const struct ptstate_snapshot* snap, int slot, int button) {
+	return (snap->controllers[slot].buttons >> button) & 1;
+}
+
+#endif /* PICOTROLLER_STATE_H */
@@ -0,0 +1,175 @@
+#include "serial_port.h"
+#include "log.h"
+
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+
+SerialPort::SerialPort() {
+}
+
+SerialPort::~SerialPort() {
+	close();
+}
+
+bool SerialPort::open(const std::string& path, int baud) {
+	close();
+	fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NDELAY);
+	if(fd == -1) {
+		LOG_ERROR("SerialPort: Unable to open port: %s", strerror(errno));
+		return false;
+	}
+
+	struct termios2 options;
+	if(ioctl(fd, TCGETS2, &options) == -1) {
+		LOG_ERROR("TCGETS2: %s", strerror(errno));
+		close();
+		return false;
+	}
+
+	// Raw 8N1, no flow control, what cfmakeraw() would do
+	options.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY);
+	options.c_oflag &= ~OPOST;
+	options.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	options.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+	options.c_cflag |= CS8 | CREAD | CLOCAL;
+	options.c_cc[VMIN] = 1; // With O_NDELAY an empty read is EAGAIN, so 0 always means hangup
+	options.c_cc[VTIME] = 0;
+	if(ioctl(fd, TCSETS2, &options) == -1) {
+		LOG_ERROR("TCSETS2: %s", strerror(errno));
+		close();
+		return false;
+	}
+
+	if(!setBaud(baud)) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void SerialPort::close() {
+	if(fd != -1) ::close(fd);
+	fd = -1;
+	baud = 0;
+	mode = SERIAL_MODE_POLL;
+}
+
+bool SerialPort::isOpen() {
+	return fd != -1;
+}
+
+bool SerialPort::setBaud(int baud) {
+	struct termios2 options;
+	if(ioctl(fd, TCGETS2, &options) == -1) {
+		LOG_ERROR("TCGETS2: %s", strerror(errno));
+		return false;
+	}
+
+	options.c_cflag &= ~CBAUD;
+	options.c_cflag |= BOTHER;
+	options.c_cflag &= ~(CBAUD << IBSHIFT); // Input follows the output speed
+	options.c_ispeed = baud;
+	options.c_ospeed = baud;
+	if(ioctl(fd, TCSETS2, &options) == -1) {
+		LOG_ERROR("Unable to set %d baud: %s", baud, strerror(errno));
+		return false;
+	}
+
+	this->baud = baud;
+	return true;
+}
+
+int SerialPort::getBaud() {
+	return baud;
+}
+
+int SerialPort::getFd() {
+	return fd;
+}
+
+// VMIN and VTIME only matter once O_NDELAY is off, so blocking clears it.
+// VMIN stays at 1: frames vary in length and VTIME counts in tenths of a
+// second, so waiting for more than a byte strands the tail of a frame.
+bool SerialPort::setReadMode(int mode) {
+	struct termios2 options;
+	if(ioctl(fd, TCGETS2, &options) == -1) {
+		LOG_ERROR("TCGETS2: %s", strerror(errno));
+		return false;
+	}
+
+	options.c_cc[VMIN] = 1;
+	options.c_cc[VTIME] = 0;
+	if(ioctl(fd, TCSETS2, &options) == -1) {
+		LOG_ERROR("TCSETS2: %s", strerror(errno));
+		return false;
+	}
+
+	int flags = fcntl(fd, F_GETFL);
+	flags = mode == SERIAL_MODE_POLL ? flags | O_NDELAY : flags & ~O_NDELAY;
+	if(fcntl(fd, F_SETFL, flags) == -1) {
+		LOG_ERROR("fcntl: %s", strerror(errno));
+		return false;
+	}
+
+	this->mode = mode;
+	return true;
+}
+
+int SerialPort::getReadMode() {
+	return mode;
+}
+
+// Asks the UART driver to push received bytes to the tty layer straight away
+// instead of batching them. Not every driver has it, a pty doesn't.
+bool SerialPort::setLowLatency(bool enable) {
+	struct serial_struct serial;
+	if(ioctl(fd, TIOCGSERIAL, &serial) == -1) return false;
+
+	if(enable) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+	} else {
+		serial.flags &= ~ASYNC_LOW_LATENCY;
+	}
+	return ioctl(fd, TIOCSSERIAL, &serial) != -1;
+}
+
+// Sleeps until there is something to read, false on timeout. Lets a blocking
+// reader come up for air to check whether it should stop. A hangup or error
+// also counts as readable so the following read() reports it.
+bool SerialPort::waitReadable(int timeoutMs) {
+	struct pollfd pfd = {fd, POLLIN, 0};
+	return poll(&pfd, 1, timeoutMs) > 0;
+}
+
+bool SerialPort::waitWritable(int timeoutMs) {
+	struct pollfd pfd = {fd, POLLOUT, 0};
+	return poll(&pfd, 1, timeoutMs) > 0;
+}
+
+ssize_t SerialPort::read(uint8_t* data, size_t len) {
+	return ::read(fd, data, len);
+}
+
+ssize_t SerialPort::write(const uint8_t* data, size_t len) {
+	return ::write(fd, data, len);
+}
+
+ssize_t SerialPort::writev(const struct iovec* iov, int count) {
+	return ::writev(fd, iov, count);
+}
+
+// Blocks until everything written has left the UART, so a speed change
+// doesn't garble the tail of the last frame
+void SerialPort::drain() {
+	ioctl(fd, TCSBRK, 1);
+}
+
+void SerialPort::flushInput() {
+	ioctl(fd, TCFLSH, TCIFLUSH);
+}
@@ -0,0 +1,51 @@
+#ifndef SERIAL_PORT_H
+#define SERIAL_PORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+struct iovec;
+
+#define SERIAL_BASE_BAUD 115200 // What the Pico starts at and falls back to
+
+// How read() waits for data
+#define SERIAL_MODE_POLL     0 // Never blocks, the caller polls
+#define SERIAL_MODE_BLOCKING 1 // Blocks until at least one byte has arrived
+
+// Raw 8N1 serial port. The speed is set through termios2 with BOTHER so any
+// rate the UART can divide down to works, not just the Bxxx constants. That
+// needs <asm/termbits.h>, which can't share a translation unit with
+// <termios.h>, hence its own file.
+class SerialPort {
+public:
+	SerialPort();
+	~SerialPort();
+
+	bool open(const std::string& path, int baud = SERIAL_BASE_BAUD);
+	void close();
+	bool isOpen();
+
+	bool setBaud(int baud);
+	int getBaud();
+	int getFd();
+	bool setReadMode(int mode);
+	int getReadMode();
+	bool setLowLatency(bool enable);
+	bool waitReadable(int timeoutMs);
+	bool waitWritable(int timeoutMs);
+
+	ssize_t read(uint8_t* data, size_t len);
+	ssize_t write(const uint8_t* data, size_t len);
+	ssize_t writev(const struct iovec* iov, int count);
+	void drain();
+	void flushInput();
+
+private:
+	int fd = -1;
+	int baud = 0;
+	int mode = SERIAL_MODE_POLL;
+};
+
+#endif // SERIAL_PORT_H
@@ -2,22 +2,34 @@
 #define SHARED_MEMORY_H
 
 #include <cstdint>
+#include <sys/types.h>
 
-const int SCREEN_WIDTH = 320; // Example width, replace with actual
-const int SCREEN_HEIGHT = 240; // Example height, replace with actual
+const int DEFAULT_SCREEN_WIDTH = 320;  // Used when fbcp-nexus hasn't published a header
+const int DEFAULT_SCREEN_HEIGHT = 240;
+const int MAX_SCREEN_SIZE = 4096;
 
+const key_t SHM_KEY_HEADER = 1021; // Shared memory key for the surface header
 const key_t SHM_KEY_UPDATE = 1022; // Shared memory key for color buffer
 const key_t SHM_KEY_COLOR = 1023; // Shared memory key for color buffer
 const key_t SHM_KEY_TRANSPARENCY = SHM_KEY_COLOR + 20; // Shared memory key for transparency buffer
 
-struct ColorBuffer {
-    uint16_t buffer[SCREEN_WIDTH * SCREEN_HEIGHT]; // 16-bit color depth per pixel
-};
+#define OVERLAY_MAGIC    0x594C564F // "OVLY"
+#define OVERLAY_VERSION  1
+
+#define OVERLAY_FORMAT_RGB565_A8 1 // uint16_t color buffer + uint8_t transparency buffer
 
-struct TransparencyBuffer {
-    uint8_t buffer[SCREEN_WIDTH * SCREEN_HEIGHT]; // 8-bit transparency per pixel
+// Describes the overlay surface. Whoever creates the segment first fills it
+// in, magic is written last so a half written header is never picked up.
+struct OverlayHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t format;
+	uint16_t width, height;
 };
 
+// The color buffer holds width * height uint16_t pixels, the transparency
+// buffer width * height uint8_t values, both row major with no padding.
+
 struct Updater{
 	bool update;
 };
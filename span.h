@@ -0,0 +1,72 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <cstdint>
+#include <cstring>
+
+// Row kernels shared by the overlay drawing code. Every kernel works on one
+// horizontal run of already clipped pixels, so callers only clip once per row.
+
+// Blend two RGB565 colors, weight is the amount of src (0 - 255)
+static inline uint16_t blend565(uint16_t dst, uint16_t src, uint8_t weight) {
+	// Spread the channels so all three can be blended with a single multiply
+	uint32_t d = (dst | ((uint32_t)dst << 16)) & 0x07E0F81F;
+	uint32_t s = (src | ((uint32_t)src << 16)) & 0x07E0F81F;
+	uint32_t w = (weight + 4) >> 3; // 0 - 32
+	uint32_t r = (d + (((s - d) * w) >> 5)) & 0x07E0F81F;
+	return (uint16_t)(r | (r >> 16));
+}
+
+// Alpha of src composited over dst
+static inline uint8_t blendAlpha(uint8_t dst, uint8_t src) {
+	return (uint8_t)(src + ((dst * (255 - src) + 127) / 255));
+}
+
+// Straight alpha "over" for a single pixel. Covering a transparent pixel
+// takes the source color as is instead of mixing in whatever color was there.
+static inline void overPixel(uint16_t& color, uint8_t& alpha, uint16_t srcColor, uint8_t srcAlpha) {
+	uint8_t outAlpha = blendAlpha(alpha, srcAlpha);
+	uint8_t weight = alpha == 0 ? 255 : (uint8_t)((srcAlpha * 255 + (outAlpha >> 1)) / outAlpha);
+	color = blend565(color, srcColor, weight);
+	alpha = outAlpha;
+}
+
+// Fill a run with a solid color and transparency
+static inline void fillSpan(uint16_t* color, uint8_t* alpha, int len, uint16_t c, uint8_t a) {
+	for(int i = 0; i < len; ++i) {
+		color[i] = c;
+	}
+	memset(alpha, a, len);
+}
+
+// Draw a solid color through an 8 bit coverage mask. Fully covered pixels are
+// overwritten like the old bitmap font did, edges are blended.
+static inline void maskSpan(uint16_t* color, uint8_t* alpha, const uint8_t* mask, int len, uint16_t c, uint8_t a) {
+	for(int i = 0; i < len; ++i) {
+		uint8_t m = mask[i];
+		if(m == 0) continue;
+		if(m == 255) {
+			color[i] = c;
+			alpha[i] = a;
+		} else {
+			overPixel(color[i], alpha[i], c, (uint8_t)((m * a + 127) / 255));
+		}
+	}
+}
+
+// Composite an RGB565 + A8 run over the destination, optionally faded
+static inline void blendSpan(uint16_t* color, uint8_t* alpha, const uint16_t* srcColor, const uint8_t* srcAlpha, int len, uint8_t opacity = 255) {
+	for(int i = 0; i < len; ++i) {
+		uint8_t a = srcAlpha[i];
+		if(opacity != 255) a = (uint8_t)((a * opacity + 127) / 255);
+		if(a == 0) continue;
+		if(a == 255) {
+			color[i] = srcColor[i];
+			alpha[i] = 255;
+		} else {
+			overPixel(color[i], alpha[i], srcColor[i], a);
+		}
+	}
+}
+
+#endif // SPAN_H
@@ -0,0 +1,141 @@
+#include "state_feed.h"
+#include <iostream>
+#include <cstdio>
+#include <climits>
+
+StateFeed::StateFeed() {
+}
+
+StateFeed::~StateFeed() {
+	close();
+}
+
+// Starts from a clean segment even if a previous run left one behind,
+// magic goes in last so clients never map a half made one
+bool StateFeed::open(const std::string& name) {
+	close();
+	fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0666);
+	if(fd == -1) {
+		perror("StateFeed: shm_open");
+		return false;
+	}
+	fchmod(fd, 0666); // Emulators rarely run as root, and umask got a say above
+	if(ftruncate(fd, sizeof(struct ptstate_shared)) == -1) {
+		perror("StateFeed: ftruncate");
+		close();
+		return false;
+	}
+	void* map = mmap(nullptr, sizeof(struct ptstate_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		perror("StateFeed: mmap");
+		close();
+		return false;
+	}
+
+	shared = static_cast<struct ptstate_shared*>(map);
+	__atomic_store_n(&shared->magic, 0, __ATOMIC_RELAXED);
+	memset(shared, 0, sizeof(struct ptstate_shared));
+	shared->version = PTSTATE_VERSION;
+	shared->slots = PTSTATE_SLOTS;
+	__atomic_store_n(&shared->magic, PTSTATE_MAGIC, __ATOMIC_RELEASE);
+	this->name = name;
+	return true;
+}
+
+// Unlinked so a client that opens it later knows the driver is gone
+void StateFeed::close() {
+	if(shared != nullptr) munmap(shared, sizeof(struct ptstate_shared));
+	if(fd != -1) {
+		::close(fd);
+		shm_unlink(name.c_str());
+	}
+	shared = nullptr;
+	fd = -1;
+}
+
+bool StateFeed::isOpen() {
+	return shared != nullptr;
+}
+
+uint64_t StateFeed::getDropped() {
+	return shared != nullptr ? __atomic_load_n(&shared->dropped, __ATOMIC_RELAXED) : 0;
+}
+
+// Queues an event for every difference from what was last published, then
+// swaps the snapshot in under the seqlock. Nothing happens, not even a
+// sequence bump, if the state didn't change.
+void StateFeed::publish(int slot, const ControllerData& data) {
+	if(shared == nullptr || slot < 0 || slot >= PTSTATE_SLOTS) return;
+
+	struct ptstate_controller next;
+	memset(&next, 0, sizeof(next));
+	next.plugged_in = 1;
+	next.button_count = data.button_count > 32 ? 32 : data.button_count;
+	next.axis_count = data.axis_count > PTSTATE_AXES ? PTSTATE_AXES : data.axis_count;
+	for(int i = 0; i < next.button_count; i++) {
+		if(data.button_states[i]) next.buttons |= 1u << i;
+	}
+	for(int i = 0; i < next.axis_count; i++) {
+		next.axes[i * 2] = data.axis[i].x;
+		next.axes[i * 2 + 1] = data.axis[i].y;
+	}
+
+	const struct ptstate_controller& last = shared->controllers[slot];
+	if(memcmp(&next, &last, sizeof(next)) == 0) return;
+
+	uint64_t now = ptstate_now_ns();
+	if(!last.plugged_in) pushEvent(now, slot, PTSTATE_EVENT_PLUGGED, 0, 1);
+	uint32_t changed = next.buttons ^ last.buttons;
+	for(int i = 0; changed != 0; i++, changed >>= 1) {
+		if(changed & 1) pushEvent(now, slot, PTSTATE_EVENT_BUTTON, i, (next.buttons >> i) & 1);
+	}
+	for(int i = 0; i < PTSTATE_AXES * 2; i++) {
+		if(next.axes[i] != last.axes[i]) pushEvent(now, slot, PTSTATE_EVENT_AXIS, i, next.axes[i]);
+	}
+	store(now, slot, next);
+}
+
+// For a slot its source dropped. Clients see it unplugged and zeroed, with
+// one event for the unplugging rather than a release for every button.
+void StateFeed::unpublish(int slot) {
+	if(shared == nullptr || slot < 0 || slot >= PTSTATE_SLOTS) return;
+	if(!shared->controllers[slot].plugged_in) return;
+
+	struct ptstate_controller next;
+	memset(&next, 0, sizeof(next));
+	uint64_t now = ptstate_now_ns();
+	pushEvent(now, slot, PTSTATE_EVENT_PLUGGED, 0, 0);
+	store(now, slot, next);
+}
+
+// Swaps the slot in under the seqlock and wakes anyone waiting on it
+void StateFeed::store(uint64_t now, int slot, const struct ptstate_controller& next) {
+	uint32_t seq = shared->seq;
+	__atomic_store_n(&shared->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	shared->controllers[slot] = next;
+	shared->updated_ns = now;
+	shared->updates++;
+	__atomic_store_n(&shared->seq, seq + 2, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&shared->waiters, __ATOMIC_SEQ_CST) > 0) {
+		syscall(SYS_futex, &shared->seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	}
+}
+
+// Never waits for the client, a full ring just counts what didn't fit
+void StateFeed::pushEvent(uint64_t now, int slot, int type, int index, int value) {
+	uint64_t head = shared->head;
+	if(head - __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE) >= PTSTATE_RING) {
+		__atomic_store_n(&shared->dropped, shared->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	struct ptstate_event& ev = shared->ring[head & (PTSTATE_RING - 1)];
+	ev.time_ns = now;
+	ev.slot = slot;
+	ev.type = type;
+	ev.index = index;
+	ev.reserved = 0;
+	ev.value = value;
+	__atomic_store_n(&shared->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,33 @@
+#ifndef STATE_FEED_H
+#define STATE_FEED_H
+
+#include "monitor.h"
+#include "picotroller_state.h"
+#include <string>
+
+// Publishes controller state to POSIX shared memory for emulators that would
+// rather not go through evdev, picotroller_state.h is the layout and the
+// client. Only one thread may publish, the one the monitor reports on.
+class StateFeed {
+public:
+	StateFeed();
+	~StateFeed();
+
+	bool open(const std::string& name);
+	void close();
+	bool isOpen();
+
+	void publish(int slot, const ControllerData& data);
+	void unpublish(int slot);
+	uint64_t getDropped();
+
+private:
+	std::string name;
+	int fd = -1;
+	struct ptstate_shared* shared = nullptr;
+
+	void store(uint64_t now, int slot, const struct ptstate_controller& next);
+	void pushEvent(uint64_t now, int slot, int type, int index, int value);
+};
+
+#endif // STATE_FEED_H
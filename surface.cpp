@@ -0,0 +1,39 @@
+#include "surface.h"
+
+// RGBA8 pixels in, RGB565 + A8 out
+void Surface::load(const unsigned char* rgba, int w, int h) {
+	resize(w, h);
+	for(int i = 0; i < w * h; ++i) {
+		uint8_t r = rgba[i * 4];
+		uint8_t g = rgba[i * 4 + 1];
+		uint8_t b = rgba[i * 4 + 2];
+		color[i] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3); // Convert to RGB565
+		alpha[i] = rgba[i * 4 + 3];
+	}
+
+	// Give fully transparent pixels the color of an opaque neighbour, so
+	// bilinear filtering doesn't pull dark fringes into the edges
+	std::vector<uint16_t> padded = color;
+	for(int y = 0; y < h; ++y) {
+		for(int x = 0; x < w; ++x) {
+			if(alpha[y * w + x] != 0) continue;
+			if(x > 0 && alpha[y * w + x - 1] != 0) padded[y * w + x] = color[y * w + x - 1];
+			else if(x < w - 1 && alpha[y * w + x + 1] != 0) padded[y * w + x] = color[y * w + x + 1];
+			else if(y > 0 && alpha[(y - 1) * w + x] != 0) padded[y * w + x] = color[(y - 1) * w + x];
+			else if(y < h - 1 && alpha[(y + 1) * w + x] != 0) padded[y * w + x] = color[(y + 1) * w + x];
+		}
+	}
+	color.swap(padded);
+
+	int minX = w, minY = h, maxX = -1, maxY = -1;
+	for(int y = 0; y < h; ++y) {
+		for(int x = 0; x < w; ++x) {
+			if(alpha[y * w + x] == 0) continue;
+			if(x < minX) minX = x;
+			if(x > maxX) maxX = x;
+			if(y < minY) minY = y;
+			maxY = y;
+		}
+	}
+	bounds = maxX < 0 ? Rect{0, 0, 0, 0} : Rect{minX, minY, maxX - minX + 1, maxY - minY + 1};
+}
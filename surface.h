@@ -0,0 +1,34 @@
+#ifndef SURFACE_H
+#define SURFACE_H
+
+#include <cstdint>
+#include <vector>
+
+#define SCALE_NEAREST  0
+#define SCALE_BILINEAR 1
+
+struct Rect {
+	int x, y, width, height;
+};
+
+// An RGB565 + A8 image, the same layout as the overlay buffers
+struct Surface {
+	int width = 0, height = 0;
+	std::vector<uint16_t> color;
+	std::vector<uint8_t> alpha;
+	Rect bounds = {0, 0, 0, 0}; // Holds every pixel whose alpha isn't 0, blits skip the rest
+
+	void resize(int w, int h) {
+		width = w;
+		height = h;
+		color.assign(w * h, 0);
+		alpha.assign(w * h, 0);
+		bounds = {0, 0, w, h}; // Until whoever fills it knows better
+	}
+
+	// Converts w x h RGBA8 pixels, as lodepng decodes them, and works out
+	// the bounds
+	void load(const unsigned char* rgba, int w, int h);
+};
+
+#endif // SURFACE_H
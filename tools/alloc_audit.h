@@ -0,0 +1,75 @@
+#ifndef ALLOC_AUDIT_H
+#define ALLOC_AUDIT_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <execinfo.h>
+#include <unistd.h>
+
+// Replaces the global operator new with one that counts, for tools checking
+// that a path stays off the heap once it has warmed up. Include it from
+// exactly one file of a tool. The first few allocations made between
+// auditStart() and auditStop() print a backtrace to stderr, addr2line turns
+// the addresses into lines.
+
+#define AUDIT_BACKTRACES 4 // Allocations whose backtrace is printed
+#define AUDIT_DEPTH      16
+
+static std::atomic<bool> auditActive(false);
+static std::atomic<uint64_t> auditCount(0);
+
+static inline void auditStart() {
+	auditCount = 0;
+	auditActive = true;
+}
+
+// Allocations since auditStart()
+static inline uint64_t auditStop() {
+	auditActive = false;
+	return auditCount;
+}
+
+static inline void auditNote() {
+	if(!auditActive.load(std::memory_order_relaxed)) return;
+	if(auditCount.fetch_add(1) >= AUDIT_BACKTRACES) return;
+
+	auditActive = false; // backtrace() allocates the first time it runs
+	void* frames[AUDIT_DEPTH];
+	int depth = backtrace(frames, AUDIT_DEPTH);
+	static const char header[] = "Allocation while auditing:\n";
+	if(write(STDERR_FILENO, header, sizeof(header) - 1) < 0) {}
+	backtrace_symbols_fd(frames, depth, STDERR_FILENO);
+	auditActive = true;
+}
+
+void* operator new(std::size_t size) {
+	auditNote();
+	void* p = malloc(size > 0 ? size : 1);
+	if(p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](std::size_t size) {
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+	auditNote();
+	return malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+#endif // ALLOC_AUDIT_H
@@ -0,0 +1,33 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <vector>
+
+// Small helpers shared by the tools, monotonic time is what evdev gets stamped
+// with once EVIOCSCLOCKID is set so everything compares directly.
+
+static inline int64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void sleepUntilNs(int64_t deadline) {
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000000LL;
+	ts.tv_nsec = deadline % 1000000000LL;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) != 0) {}
+}
+
+// Nearest rank percentile, sorts the samples in place
+static inline int64_t percentile(std::vector<int64_t>& samples, double p) {
+	if(samples.empty()) return 0;
+	std::sort(samples.begin(), samples.end());
+	size_t rank = (size_t)(p * (samples.size() - 1) + 0.5);
+	return samples[std::min(rank, samples.size() - 1)];
+}
+
+#endif // BENCH_H
@@ -0,0 +1,180 @@
+// Compares the scaled blits against the per-pixel division loop they replaced.
+//
+//   blit_bench [-n blits] [-l limit] [-a assets]
+//
+// Times Blitter::blit() in both modes, and the old drawPNG() loop that
+// divided for every pixel and read the decoded RGBA8 straight from lodepng,
+// on a generated 320x240 image with soft edges and on the 320x240 popup art.
+// Each is shrunk by a row, to three quarters and doubled, as they are on
+// screens other than 320x240, and drawn at the top right where the side
+// panel art is, onto a private 320x240 surface so nothing reaches the
+// display. The old loop only ever drew the decoded image, so the decode
+// isn't timed for it either. Reports the median blit of each and fails if
+// bilinear costs more than limit (2 by default) times the old loop. Run it
+// from the repository so it finds assets/, or pass -a.
+
+#include "bench.h"
+#include "../blit.h"
+#include "../lodepng.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#define SCREEN_WIDTH  320
+#define SCREEN_HEIGHT 240
+
+#define MODE_OLD 2 // After SCALE_NEAREST and SCALE_BILINEAR
+
+struct Image {
+	std::vector<unsigned char> rgba;
+	unsigned width = 0, height = 0;
+	Surface surface;
+};
+
+static Surface screen;
+static Blitter blitter;
+static std::vector<int64_t> samples[3]; // By mode
+
+// The nearest neighbour loop drawPNG() used before images were cached as
+// RGB565 + A8, kept as it was apart from drawing on a Surface
+static void oldBlit(const Image& image, int posX, int posY, int targetWidth, int targetHeight) {
+	int width = screen.width, height = screen.height;
+	uint16_t* colorBuffer = screen.color.data();
+	uint8_t* transparencyBuffer = screen.alpha.data();
+	unsigned imageWidth = image.width, imageHeight = image.height;
+	for(int y = 0; y < targetHeight; ++y) {
+		for(int x = 0; x < targetWidth; ++x) {
+			int srcX = x * imageWidth / targetWidth;
+			int srcY = y * imageHeight / targetHeight;
+
+			if(posX + x < width && posY + y < height) {
+				unsigned idx = 4 * (srcY * imageWidth + srcX);
+				uint8_t r = image.rgba[idx];
+				uint8_t g = image.rgba[idx + 1];
+				uint8_t b = image.rgba[idx + 2];
+				uint8_t a = image.rgba[idx + 3];
+
+				if(a != 0) {
+					uint16_t newColor = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+					uint16_t existingColor = colorBuffer[(posY + y) * width + (posX + x)];
+
+					if(a == 255) {
+						colorBuffer[(posY + y) * width + (posX + x)] = newColor;
+						transparencyBuffer[(posY + y) * width + (posX + x)] = 255;
+					} else {
+						uint16_t existingRed = (existingColor >> 11) & 0x1F;
+						uint16_t existingGreen = (existingColor >> 5) & 0x3F;
+						uint16_t existingBlue = existingColor & 0x1F;
+						uint8_t  existingAlpha = transparencyBuffer[(posY + y) * width + (posX + x)];
+
+						uint16_t newRed = (newColor >> 11) & 0x1F;
+						uint16_t newGreen = (newColor >> 5) & 0x3F;
+						uint16_t newBlue = newColor & 0x1F;
+
+						uint16_t finalRed = ((newRed * a) + (existingRed * (255 - existingAlpha))) >> 8;
+						uint16_t finalGreen = ((newGreen * a) + (existingGreen * (255 - existingAlpha))) >> 8;
+						uint16_t finalBlue = ((newBlue * a) + (existingBlue * (255 - existingAlpha))) >> 8;
+
+						uint16_t calcAlpha = transparencyBuffer[(posY + y) * width + (posX + x)] + a;
+						uint8_t  finalAlpha = calcAlpha > 255 ? 255 : calcAlpha;
+
+						colorBuffer[(posY + y) * width + (posX + x)] = (finalRed << 11) | (finalGreen << 5) | (finalBlue);
+						transparencyBuffer[(posY + y) * width + (posX + x)] = finalAlpha;
+					}
+				}
+			}
+		}
+	}
+}
+
+// Colour gradients under an alpha that fades out towards the edges, so the
+// blend takes every path
+static void generate(Image& image, int w, int h) {
+	image.width = w;
+	image.height = h;
+	image.rgba.assign(w * h * 4, 0);
+	for(int y = 0; y < h; ++y) {
+		for(int x = 0; x < w; ++x) {
+			unsigned char* p = &image.rgba[(y * w + x) * 4];
+			int edge = std::min(std::min(x, w - 1 - x), std::min(y, h - 1 - y));
+			p[0] = x * 255 / w;
+			p[1] = y * 255 / h;
+			p[2] = (x + y) & 255;
+			p[3] = edge >= 32 ? 255 : edge * 8;
+		}
+	}
+	image.surface.load(image.rgba.data(), w, h);
+}
+
+static bool load(Image& image, const std::string& file) {
+	unsigned error = lodepng::decode(image.rgba, image.width, image.height, file);
+	if(error) {
+		std::cerr << "Unable to decode " << file << ": " << lodepng_error_text(error) << std::endl;
+		return false;
+	}
+	image.surface.load(image.rgba.data(), image.width, image.height);
+	return true;
+}
+
+// The three take turns so they all see the same cache and clock speed
+static bool run(const char* name, const Image& image, const Rect& to, int blits, double limit) {
+	for(int mode = 0; mode < 3; ++mode) samples[mode].clear();
+	for(int i = 0; i < blits * 3; ++i) {
+		int mode = i % 3;
+		int64_t start = nowNs();
+		if(mode == MODE_OLD) {
+			oldBlit(image, to.x, to.y, to.width, to.height);
+		} else {
+			blitter.blit(screen, image.surface, to.x, to.y, to.width, to.height, mode);
+		}
+		samples[mode].push_back(nowNs() - start);
+	}
+	int64_t old = percentile(samples[MODE_OLD], 0.5);
+	int64_t nearest = percentile(samples[SCALE_NEAREST], 0.5);
+	int64_t bilinear = percentile(samples[SCALE_BILINEAR], 0.5);
+	double ratio = old > 0 ? (double)bilinear / old : 0;
+	printf("%-20s %4dx%-4d %10.1f %10.1f %10.1f %7.2fx\n", name, to.width, to.height, old / 1000.0, nearest / 1000.0, bilinear / 1000.0, ratio);
+	return ratio <= limit;
+}
+
+int main(int argc, char* argv[]) {
+	int blits = 200;
+	double limit = 2;
+	std::string assets = "assets";
+	int opt;
+	while((opt = getopt(argc, argv, "n:l:a:h")) != -1) {
+		switch(opt) {
+			case 'n': blits = atoi(optarg); break;
+			case 'l': limit = atof(optarg); break;
+			case 'a': assets = optarg; break;
+			default:
+				std::cerr << "Usage: " << argv[0] << " [-n blits] [-l limit] [-a assets]" << std::endl;
+				return 1;
+		}
+	}
+	if(blits < 1) blits = 1;
+
+	screen.resize(SCREEN_WIDTH, SCREEN_HEIGHT);
+	Image generated, sidePanel, battery;
+	generate(generated, 320, 240);
+	if(!load(sidePanel, assets + "/overlay_rp.png") || !load(battery, assets + "/battery_overlay.png")) return 1;
+
+	printf("%d blits on a %dx%d surface, median us\n", blits, SCREEN_WIDTH, SCREEN_HEIGHT);
+	printf("%-20s %9s %10s %10s %10s %8s\n", "image", "to", "old", "nearest", "bilinear", "vs old");
+	bool ok = true;
+	const Rect sizes[] = {{0, 0, 320, 239}, {0, 0, 240, 180}, {0, 0, 640, 480}};
+	for(Rect to : sizes) {
+		to.x = std::max(0, SCREEN_WIDTH - to.width); // On the right like the side panel, the old loop can't clip the left
+		ok &= run("generated", generated, to, blits, limit);
+		ok &= run("overlay_rp.png", sidePanel, to, blits, limit);
+		ok &= run("battery_overlay.png", battery, to, blits, limit);
+	}
+
+	if(!ok) std::cerr << "Bilinear costs more than " << limit << "x the old nearest loop" << std::endl;
+	return ok ? 0 : 1;
+}
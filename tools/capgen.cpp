@@ -0,0 +1,158 @@
+// Writes a made-up serial capture for replay, so the allocation audit and
+// golden diffs don't depend on a capture from a real Pico.
+//
+//   capgen [-p protocol] [-c] [-n frames] [-r rate] [-s seed] capture
+//
+// Two controllers take turns pressing and releasing buttons and moving their
+// sticks, one frame at a time at the given rate, with a battery reply every
+// second. With -p 2, the default, the capture opens with the host's protocol
+// request and the Pico's v1 ack, then each controller sends a key frame and
+// deltas after it, and a new key frame every KEYFRAME_INTERVAL ms the way the
+// firmware does. -c COBS encodes the v2 frames. -p 1 writes v1 state frames
+// throughout. The same options always write the same capture, e.g.
+//
+//   tools/capgen -c /tmp/v2.cap && tools/replay -a /tmp/v2.cap
+
+#include "../capture.h"
+#include "../pico_protocol.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+#define GEN_CONTROLLERS 2
+#define GEN_BUTTONS     12
+#define GEN_AXES        2
+#define STATUS_INTERVAL 1000 // ms between battery replies
+
+struct GenConfig {
+	int protocol = PROTOCOL_V2;
+	bool cobs = false;
+	int frames = 5000;
+	int rate = 1000;
+	uint32_t seed = 1;
+};
+
+static uint32_t nextRandom(uint32_t& state) {
+	state = state * 1103515245u + 12345u;
+	return state >> 16;
+}
+
+// A button flips or a stick moves, never nothing, so every delta has
+// something in it
+static void step(ControllerState& state, uint32_t& random) {
+	uint32_t r = nextRandom(random);
+	if(r & 1) {
+		int button = (r >> 1) % GEN_BUTTONS;
+		state.buttons[button / 8] ^= 1 << (button % 8);
+	} else {
+		int axis = (r >> 1) % (GEN_AXES * 2);
+		int16_t value = (int16_t)((int)((r >> 4) % 513) - 256);
+		state.axes[axis] = value != state.axes[axis] ? value : -value - 1;
+	}
+}
+
+static void writeFrame(CaptureWriter& capture, const GenConfig& config, const uint8_t* frame, size_t len, int64_t time) {
+	if(config.protocol == PROTOCOL_V2 && config.cobs) {
+		uint8_t encoded[MAX_COBS_FRAME + 1];
+		size_t encodedLen = cobsEncode(frame, len, encoded);
+		encoded[encodedLen++] = FRAME_DELIMITER;
+		capture.write(CAPTURE_RX, encoded, encodedLen, time);
+	} else {
+		capture.write(CAPTURE_RX, frame, len, time);
+	}
+}
+
+static void usage(const char* name) {
+	std::cerr << "Usage: " << name << " [-p protocol] [-c] [-n frames] [-r rate] [-s seed] capture" << std::endl;
+	std::cerr << "  -p  1 or 2 (default 2)" << std::endl;
+	std::cerr << "  -c  COBS encode the v2 frames" << std::endl;
+	std::cerr << "  -n  controller frames to write (default 5000)" << std::endl;
+	std::cerr << "  -r  frames per second (default 1000)" << std::endl;
+	std::cerr << "  -s  seed for the button presses and stick moves (default 1)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	GenConfig config;
+	int opt;
+	while((opt = getopt(argc, argv, "p:cn:r:s:h")) != -1) {
+		switch(opt) {
+			case 'p': config.protocol = atoi(optarg) == PROTOCOL_V1 ? PROTOCOL_V1 : PROTOCOL_V2; break;
+			case 'c': config.cobs = true; break;
+			case 'n': config.frames = atoi(optarg); break;
+			case 'r': config.rate = atoi(optarg); break;
+			case 's': config.seed = strtoul(optarg, nullptr, 0); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(optind >= argc || config.rate < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	CaptureWriter capture;
+	if(!capture.open(argv[optind])) return 1;
+
+	uint8_t frame[MAX_V2_FRAME];
+	size_t len;
+	if(config.protocol == PROTOCOL_V2) {
+		// Ask for v2 and ack it in plain v1, as the Pico does before switching
+		int flags = config.cobs ? PROTOCOL_FLAG_COBS : 0;
+		len = encodeRequest(frame, REQUEST_SET_PROTOCOL, PROTOCOL_V2 | flags);
+		capture.write(CAPTURE_TX, frame, len, 0);
+		ControllerState ack;
+		ack.button_count = 8;
+		ack.axis_count = 1;
+		ack.buttons[0] = STATUS_PROTOCOL;
+		ack.axes[0] = PROTOCOL_V2;
+		ack.axes[1] = flags;
+		len = encodeStateFrame(frame, 0, ack.button_count, ack.buttons, ack.axis_count, ack.axes);
+		capture.write(CAPTURE_RX, frame, len, 0);
+	}
+
+	ControllerState states[GEN_CONTROLLERS + 1], sent[GEN_CONTROLLERS + 1];
+	uint8_t seq[GEN_CONTROLLERS + 1] = {0};
+	int64_t keyframeAt[GEN_CONTROLLERS + 1] = {0};
+	for(int c = 1; c <= GEN_CONTROLLERS; ++c) {
+		states[c].button_count = GEN_BUTTONS;
+		states[c].axis_count = GEN_AXES;
+	}
+	ControllerState battery;
+	battery.button_count = 8;
+	battery.axis_count = 1;
+
+	uint32_t random = config.seed;
+	int64_t statusAt = 0;
+	for(int i = 0; i < config.frames; ++i) {
+		int64_t time = (int64_t)i * 1000000 / config.rate;
+		if(time >= statusAt) {
+			statusAt = time + STATUS_INTERVAL * 1000LL;
+			capture.write(CAPTURE_TX, frame, encodeRequest(frame, REQUEST_READ_BATTERY, 0), time);
+			battery.axes[0] = 900 - (int)(time / 1000000) % 100;
+			if(config.protocol == PROTOCOL_V1) {
+				len = encodeStateFrame(frame, 0, battery.button_count, battery.buttons, battery.axis_count, battery.axes);
+			} else {
+				len = encodeKeyFrame(frame, 0, 0, battery);
+			}
+			writeFrame(capture, config, frame, len, time);
+		}
+
+		int c = 1 + i % GEN_CONTROLLERS;
+		step(states[c], random);
+		if(config.protocol == PROTOCOL_V1) {
+			len = encodeStateFrame(frame, c, states[c].button_count, states[c].buttons, states[c].axis_count, states[c].axes);
+		} else if(time >= keyframeAt[c]) {
+			len = encodeKeyFrame(frame, seq[c]++, c, states[c]);
+			keyframeAt[c] = time + KEYFRAME_INTERVAL * 1000LL;
+		} else {
+			len = encodeDeltaFrame(frame, seq[c]++, c, sent[c], states[c]);
+		}
+		sent[c] = states[c];
+		writeFrame(capture, config, frame, len, time);
+	}
+
+	capture.close();
+	std::cout << "Wrote " << config.frames << " v" << config.protocol << (config.cobs && config.protocol == PROTOCOL_V2 ? " COBS" : "")
+	          << " frames to " << argv[optind] << std::endl;
+	return 0;
+}
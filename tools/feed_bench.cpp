@@ -0,0 +1,105 @@
+// Measures the shared memory state feed from the client's side.
+//
+//   feed_bench [-r rate] [-n updates] [-s name]
+//
+// A publisher thread drives a StateFeed the way ControllerManager does,
+// toggling a button and moving an axis on every update. The client maps the
+// feed separately through picotroller_state.h, like an emulator would, and
+// sleeps in ptstate_wait() for each change. Reports the cost of one snapshot
+// read, how long after a publish the client was running again, and whether
+// every change also arrived as events.
+
+#include "bench.h"
+#include "../state_feed.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#define READ_LOOPS 1000000
+
+static void publisher(StateFeed& feed, int rate, int updates, std::atomic<bool>& done) {
+	ControllerData data;
+	memset(&data, 0, sizeof(data));
+	data.button_count = 8;
+	data.axis_count = 1;
+
+	int64_t interval = 1000000000LL / rate;
+	int64_t next = nowNs() + 50000000LL; // Let the client get to its first wait
+	for(int i = 1; i <= updates; ++i) {
+		sleepUntilNs(next);
+		data.button_states[0] = i & 1;
+		data.axis[0].x = (int16_t)i;
+		feed.publish(0, data);
+		next += interval;
+	}
+	done = true;
+}
+
+int main(int argc, char* argv[]) {
+	int rate = 1000, updates = 5000;
+	const char* name = "/picotroller_bench";
+	int opt;
+	while((opt = getopt(argc, argv, "r:n:s:h")) != -1) {
+		switch(opt) {
+			case 'r': rate = atoi(optarg); break;
+			case 'n': updates = atoi(optarg); break;
+			case 's': name = optarg; break;
+			default:
+				std::cerr << "Usage: " << argv[0] << " [-r rate] [-n updates] [-s name]" << std::endl;
+				return 1;
+		}
+	}
+	if(rate < 1 || updates < 1) return 1;
+
+	StateFeed feed;
+	if(!feed.open(name)) return 1;
+	struct ptstate_client client;
+	if(ptstate_open(&client, name) != 0) {
+		std::cerr << "Unable to open the feed as a client" << std::endl;
+		return 1;
+	}
+
+	struct ptstate_snapshot snap;
+	int64_t start = nowNs();
+	for(int i = 0; i < READ_LOOPS; ++i) {
+		ptstate_read(&client, &snap);
+	}
+	int64_t readNs = (nowNs() - start) / READ_LOOPS;
+
+	std::atomic<bool> done(false);
+	std::thread feeder(publisher, std::ref(feed), rate, updates, std::ref(done));
+
+	std::vector<int64_t> wake;
+	uint64_t events = 0, missed = 0;
+	uint32_t seq = snap.seq;
+	int lastX = 0;
+	while(!done || snap.seq != __atomic_load_n(&client.shared->seq, __ATOMIC_ACQUIRE)) {
+		if(!ptstate_wait(&client, seq, 100)) continue;
+		int64_t now = nowNs();
+		ptstate_read(&client, &snap);
+		seq = snap.seq;
+		wake.push_back(now - (int64_t)snap.updated_ns);
+		if(snap.controllers[0].axes[0] != lastX + 1) missed += snap.controllers[0].axes[0] - lastX - 1;
+		lastX = snap.controllers[0].axes[0];
+
+		struct ptstate_event ev;
+		while(ptstate_next_event(&client, &ev)) events++;
+	}
+	feeder.join();
+
+	std::cout << "Snapshot read: " << readNs << " ns" << std::endl;
+	std::cout << updates << " updates at " << rate << "/s, client woke " << wake.size() << " times, "
+	          << missed << " updates coalesced into a later wakeup" << std::endl;
+	std::cout << "Publish to client running: p50 " << percentile(wake, 0.5) / 1000 << " us, p99 "
+	          << percentile(wake, 0.99) / 1000 << " us, max " << (wake.empty() ? 0 : wake.back() / 1000) << " us" << std::endl;
+	std::cout << events << " events (" << updates * 2 + 1 << " expected), " << feed.getDropped() << " dropped" << std::endl;
+
+	ptstate_close(&client);
+	return 0;
+}
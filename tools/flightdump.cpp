@@ -0,0 +1,196 @@
+// Decodes a flight recorder dump (flightFile in config.prop).
+//
+//   flightdump [-p player] [-r] dump
+//
+// Prints how long each player's reports took to reach uinput, frames the
+// monitor's sequence numbers say never arrived, and a press and release
+// timeline for every button with what became of each change: written to
+// uinput, taken by a hotkey or dropped. Taps shorter than a 60 Hz frame are
+// flagged, a game polling once a frame can miss them. -r lists every record.
+
+#include "bench.h"
+#include "../flight_recorder.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <vector>
+#include <unistd.h>
+
+#define MAX_PLAYERS 4
+#define FRAME_60HZ  16667000LL // ns
+
+struct Change {
+	uint64_t time;
+	bool pressed;
+	int outcome; // OUTCOME_*
+	int64_t latency; // ns from the report to uinput
+};
+
+#define OUTCOME_UINPUT  0
+#define OUTCOME_HOTKEY  1
+#define OUTCOME_NOTHING 2
+
+struct Report {
+	bool open = false;
+	uint64_t time = 0, lastKey = 0;
+	int keys = 0;
+	bool handled = false;
+	std::vector<std::pair<int, bool>> changes; // Button, pressed
+};
+
+struct Player {
+	uint64_t reports = 0, lost = 0, handled = 0, silent = 0;
+	bool haveSeq = false;
+	uint32_t lastSeq = 0;
+	int lastBits = 0;
+	Report report;
+	std::vector<int64_t> latency;
+	std::map<int, std::vector<Change>> buttons;
+};
+
+static const char* KIND_NAMES[] = {"?", "frame", "button", "axis", "key", "hotkey"};
+
+static void closeReport(Player& player) {
+	Report& r = player.report;
+	if(!r.open) return;
+	int outcome = r.handled ? OUTCOME_HOTKEY : r.keys > 0 ? OUTCOME_UINPUT : OUTCOME_NOTHING;
+	int64_t latency = r.keys > 0 ? (int64_t)(r.lastKey - r.time) : 0;
+	if(r.keys > 0) player.latency.push_back(latency);
+	if(r.handled) player.handled++;
+	if(outcome == OUTCOME_NOTHING) player.silent += r.changes.size();
+	for(auto& c : r.changes) {
+		player.buttons[c.first].push_back({r.time, c.second, outcome, latency});
+	}
+	r = Report();
+}
+
+static void frame(Player& player, const FlightRecord& rec) {
+	closeReport(player);
+	player.reports++;
+	player.report.open = true;
+	player.report.time = rec.time;
+
+	uint32_t seq = (uint32_t)rec.value;
+	if(rec.code > 0 && player.haveSeq && player.lastBits == rec.code) {
+		uint32_t mask = rec.code >= 32 ? 0xFFFFFFFFu : (1u << rec.code) - 1;
+		player.lost += (seq - player.lastSeq - 1) & mask;
+	}
+	player.haveSeq = rec.code > 0;
+	player.lastSeq = seq;
+	player.lastBits = rec.code;
+}
+
+static double ms(int64_t ns) {
+	return ns / 1000000.0;
+}
+
+static void printTimeline(Player& player, uint64_t dumpTime) {
+	for(auto& entry : player.buttons) {
+		std::cout << "  Button " << entry.first << std::endl;
+		const Change* press = nullptr;
+		for(const Change& c : entry.second) {
+			printf("    %9.3f s  %-7s", -(double)(dumpTime - c.time) / 1e9, c.pressed ? "press" : "release");
+			if(c.outcome == OUTCOME_UINPUT) printf("  uinput after %.3f ms", ms(c.latency));
+			if(c.outcome == OUTCOME_HOTKEY) printf("  taken by a hotkey");
+			if(c.outcome == OUTCOME_NOTHING) printf("  no uinput event");
+			if(!c.pressed && press != nullptr) {
+				int64_t held = c.time - press->time;
+				printf("  held %.1f ms", ms(held));
+				if(held < FRAME_60HZ) printf(", shorter than a 60 Hz frame");
+			}
+			printf("\n");
+			press = c.pressed ? &c : nullptr;
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	int only = 0;
+	bool raw = false;
+	int opt;
+	while((opt = getopt(argc, argv, "p:rh")) != -1) {
+		switch(opt) {
+			case 'p': only = atoi(optarg); break;
+			case 'r': raw = true; break;
+			default:
+				std::cerr << "Usage: " << argv[0] << " [-p player] [-r] dump" << std::endl;
+				return 1;
+		}
+	}
+	if(optind >= argc) {
+		std::cerr << "Usage: " << argv[0] << " [-p player] [-r] dump" << std::endl;
+		return 1;
+	}
+
+	FILE* in = fopen(argv[optind], "rb");
+	if(in == nullptr) {
+		perror(argv[optind]);
+		return 1;
+	}
+	FlightHeader header;
+	if(fread(&header, sizeof(header), 1, in) != 1 || header.magic != FLIGHT_MAGIC) {
+		std::cerr << argv[optind] << " isn't a flight recorder dump" << std::endl;
+		return 1;
+	}
+	if(header.version != FLIGHT_VERSION || header.recordSize != sizeof(FlightRecord)) {
+		std::cerr << "Dump is version " << header.version << ", this reads version " << FLIGHT_VERSION << std::endl;
+		return 1;
+	}
+	std::vector<FlightRecord> records(header.count);
+	if(header.count > 0 && fread(records.data(), sizeof(FlightRecord), header.count, in) != header.count) {
+		std::cerr << "Dump is cut short" << std::endl;
+		return 1;
+	}
+	fclose(in);
+
+	header.reason[sizeof(header.reason) - 1] = '\0';
+	double span = records.empty() ? 0 : (header.dumpTime - records.front().time) / 1e9;
+	printf("Dumped on %s, %llu records over the last %.1f s, %llu earlier ones not kept\n\n", header.reason,
+	       (unsigned long long)header.count, span, (unsigned long long)header.skipped);
+
+	Player players[MAX_PLAYERS + 1];
+	for(const FlightRecord& rec : records) {
+		if(rec.slot < 1 || rec.slot > MAX_PLAYERS) continue;
+		if(only != 0 && rec.slot != only) continue;
+		if(raw) {
+			printf("%12.6f  player %d  %-7s %5u %7d\n", -(double)(header.dumpTime - rec.time) / 1e9, rec.slot,
+			       KIND_NAMES[rec.kind <= FLIGHT_HANDLED ? rec.kind : 0], rec.code, rec.value);
+		}
+
+		Player& player = players[rec.slot];
+		switch(rec.kind) {
+			case FLIGHT_FRAME:
+				frame(player, rec);
+				break;
+			case FLIGHT_BUTTON:
+				if(player.report.open) player.report.changes.push_back({rec.code, rec.value != 0});
+				break;
+			case FLIGHT_KEY:
+				player.report.keys++;
+				player.report.lastKey = rec.time;
+				break;
+			case FLIGHT_HANDLED:
+				player.report.handled = true;
+				break;
+		}
+	}
+	if(raw) printf("\n");
+
+	for(int slot = 1; slot <= MAX_PLAYERS; ++slot) {
+		Player& player = players[slot];
+		closeReport(player);
+		if(player.reports == 0) continue;
+
+		std::vector<int64_t>& lat = player.latency;
+		int64_t max = lat.empty() ? 0 : *std::max_element(lat.begin(), lat.end());
+		printf("Player %d: %llu reports, %llu frames lost, %llu taken by hotkeys, %llu button changes with no uinput event\n", slot,
+		       (unsigned long long)player.reports, (unsigned long long)player.lost, (unsigned long long)player.handled, (unsigned long long)player.silent);
+		printf("  Report to uinput: p50 %.3f ms, p99 %.3f ms, max %.3f ms over %zu writes\n",
+		       ms(percentile(lat, 0.5)), ms(percentile(lat, 0.99)), ms(max), lat.size());
+		printTimeline(player, header.dumpTime);
+		printf("\n");
+	}
+	return 0;
+}
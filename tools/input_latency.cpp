@@ -0,0 +1,257 @@
+// End to end input latency, from a state frame leaving the Pico to the evdev
+// event coming out of the virtual joystick.
+//
+//   input_latency [-x] [-l link] [-b baud] [-r rates] [-n frames] [-L budget_ms]
+//
+// By default the host side (PicoMonitor + ControllerManager) runs in this
+// process against the simulator, so only /dev/uinput access is needed. With
+// -x it waits for a separately started joystick_emulator whose `interface`
+// property points at the link instead.
+//
+// Every frame toggles button A on controller 1. Event timestamps are taken by
+// the kernel on CLOCK_MONOTONIC, so the numbers exclude this tool's own wakeup.
+
+#include "pico_sim.h"
+#include "bench.h"
+#include "../controller.h"
+#include "../pico_monitor.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define DEVICE_NAME "Xemplar PicoTroller 0"
+#define MAX_EVENTS  (1 << 20)
+#define DRAIN_TIME  200 // ms to wait for stragglers after a phase
+
+struct KeyEvent {
+	int64_t time;
+	int value;
+};
+
+static std::vector<KeyEvent> events(MAX_EVENTS);
+static std::atomic<size_t> eventCount(0);
+static std::atomic<int> overflows(0);
+static std::atomic<bool> reading(true);
+
+static bool passThrough(ControllerData[], int) {
+	return false;
+}
+
+static int findInputDevice(const char* name, int timeoutMs) {
+	int64_t deadline = nowNs() + timeoutMs * 1000000LL;
+	do {
+		for(int i = 0; i < 64; ++i) {
+			char path[32];
+			snprintf(path, sizeof(path), "/dev/input/event%d", i);
+			int fd = open(path, O_RDONLY | O_NONBLOCK);
+			if(fd == -1) continue;
+
+			char devName[256] = {0};
+			if(ioctl(fd, EVIOCGNAME(sizeof(devName) - 1), devName) >= 0 && strcmp(devName, name) == 0) {
+				return fd;
+			}
+			close(fd);
+		}
+		usleep(50000); // udev may not have made the node yet
+	} while(nowNs() < deadline);
+	return -1;
+}
+
+static void readEvents(int fd) {
+	struct input_event ev[64];
+	struct pollfd pfd = {fd, POLLIN, 0};
+	while(reading) {
+		if(poll(&pfd, 1, 50) <= 0) continue;
+		ssize_t len = read(fd, ev, sizeof(ev));
+		if(len <= 0) continue;
+
+		for(size_t i = 0; i < len / sizeof(struct input_event); ++i) {
+			if(ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED) overflows++;
+			if(ev[i].type != EV_KEY || ev[i].code != BTN_A) continue;
+
+			size_t n = eventCount.load(std::memory_order_relaxed);
+			if(n >= MAX_EVENTS) continue;
+			events[n].time = (int64_t)ev[i].time.tv_sec * 1000000000LL + ev[i].time.tv_usec * 1000LL;
+			events[n].value = ev[i].value;
+			eventCount.store(n + 1, std::memory_order_release);
+		}
+	}
+}
+
+// Keeps answering the host's status requests while waiting
+static void serviceUntil(PicoSimulator& sim, int64_t deadline) {
+	int64_t now;
+	while((now = nowNs()) < deadline) {
+		int64_t left = (deadline - now) / 1000000;
+		sim.service(left > 0 ? (int)left : 0);
+	}
+}
+
+struct PhaseResult {
+	int rate;
+	double achievedRate;
+	size_t sent, delivered;
+	int64_t p50, p99, p999, max;
+};
+
+static PhaseResult runPhase(PicoSimulator& sim, int rate, size_t frames) {
+	// Start from a known released button
+	sim.setButton(1, 0, false);
+	sim.sendState(1);
+	serviceUntil(sim, nowNs() + DRAIN_TIME * 1000000LL);
+	eventCount.store(0);
+
+	std::vector<int64_t> sendTimes(frames);
+	int64_t interval = 1000000000LL / rate;
+	int64_t start = nowNs();
+	int64_t next = start;
+	for(size_t i = 0; i < frames; ++i) {
+		while(nowNs() < next) {
+			int64_t left = next - nowNs();
+			if(left > 1000000) {
+				sim.service((int)(left / 1000000) - 1);
+			} else {
+				sim.service(0);
+			}
+		}
+
+		sim.setButton(1, 0, (i & 1) == 0); // Even frames press, odd ones release
+		sendTimes[i] = nowNs();
+		sim.sendState(1);
+		next += interval;
+	}
+	int64_t end = nowNs();
+	serviceUntil(sim, end + DRAIN_TIME * 1000000LL);
+
+	// Events arrive in order, a lost frame shows up as a skipped value
+	std::vector<int64_t> latencies;
+	latencies.reserve(frames);
+	size_t n = eventCount.load(std::memory_order_acquire);
+	size_t frame = 0;
+	for(size_t e = 0; e < n && frame < frames; ++e) {
+		int expected = (frame & 1) == 0;
+		while(frame < frames && expected != events[e].value) {
+			frame++;
+			expected = (frame & 1) == 0;
+		}
+		if(frame >= frames) break;
+		latencies.push_back(events[e].time - sendTimes[frame]);
+		frame++;
+	}
+
+	PhaseResult r;
+	r.rate = rate;
+	r.achievedRate = frames * 1e9 / (end - start);
+	r.sent = frames;
+	r.delivered = latencies.size();
+	r.p50 = percentile(latencies, 0.5);
+	r.p99 = percentile(latencies, 0.99);
+	r.p999 = percentile(latencies, 0.999);
+	r.max = latencies.empty() ? 0 : latencies.back();
+	return r;
+}
+
+static void usage(const char* name) {
+	std::cerr << "Usage: " << name << " [-x] [-l link] [-b baud] [-r rates] [-n frames] [-L budget_ms]" << std::endl;
+	std::cerr << "  -x  measure an already running joystick_emulator instead of an in-process host" << std::endl;
+	std::cerr << "  -l  symlink to create for the pty (default /tmp/ttyPICO)" << std::endl;
+	std::cerr << "  -b  pace frames like a UART at this baud rate (default 0, unpaced)" << std::endl;
+	std::cerr << "  -r  comma separated frame rates to try (default 100,250,500,1000,2000,4000,8000)" << std::endl;
+	std::cerr << "  -n  frames per rate (default 2000)" << std::endl;
+	std::cerr << "  -L  p99 latency a rate has to stay under to count as sustainable (default 10)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	const char* link = "/tmp/ttyPICO";
+	std::string rateList = "100,250,500,1000,2000,4000,8000";
+	bool external = false;
+	int baud = 0, frames = 2000, budgetMs = 10;
+
+	int opt;
+	while((opt = getopt(argc, argv, "xl:b:r:n:L:h")) != -1) {
+		switch(opt) {
+			case 'x': external = true; break;
+			case 'l': link = optarg; break;
+			case 'b': baud = atoi(optarg); break;
+			case 'r': rateList = optarg; break;
+			case 'n': frames = atoi(optarg); break;
+			case 'L': budgetMs = atoi(optarg); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(frames <= 0 || (size_t)frames > MAX_EVENTS) frames = 2000;
+
+	std::vector<int> rates;
+	std::stringstream list(rateList);
+	std::string item;
+	while(std::getline(list, item, ',')) {
+		int rate = atoi(item.c_str());
+		if(rate > 0) rates.push_back(rate);
+	}
+
+	PicoSimulator sim;
+	if(!sim.open(link)) return 1;
+	sim.setBaud(baud);
+
+	if(external) {
+		std::cout << "Start joystick_emulator with interface=" << sim.getPortName() << std::endl;
+		while(!sim.isAlive()) sim.service(100);
+	} else {
+		// Never torn down, the loop thread has no way to stop
+		ControllerManager* manager = new ControllerManager(passThrough);
+		PicoMonitor* monitor = new PicoMonitor(sim.getPortName());
+		manager->setMonitor(monitor);
+		if(manager->initMonitor() != 0) return 1;
+		std::thread(&ControllerManager::loop, manager).detach();
+	}
+
+	int fd = findInputDevice(DEVICE_NAME, 5000);
+	if(fd == -1) {
+		std::cerr << "Unable to find the " DEVICE_NAME " input device" << std::endl;
+		return 1;
+	}
+	int clock = CLOCK_MONOTONIC;
+	if(ioctl(fd, EVIOCSCLOCKID, &clock) == -1) perror("EVIOCSCLOCKID");
+	std::thread reader(readEvents, fd);
+
+	serviceUntil(sim, nowNs() + 500 * 1000000LL); // Let the host settle
+
+	std::cout << "    rate   achieved  delivered      p50      p99    p99.9      max  (us)" << std::endl;
+	double sustainable = 0;
+	for(int rate : rates) {
+		PhaseResult r = runPhase(sim, rate, frames);
+		double delivered = r.sent ? 100.0 * r.delivered / r.sent : 0;
+		std::cout << std::setw(8) << r.rate
+		          << std::setw(11) << std::fixed << std::setprecision(0) << r.achievedRate
+		          << std::setw(10) << std::setprecision(1) << delivered << "%"
+		          << std::setw(9) << r.p50 / 1000
+		          << std::setw(9) << r.p99 / 1000
+		          << std::setw(9) << r.p999 / 1000
+		          << std::setw(9) << r.max / 1000 << std::endl;
+
+		if(delivered >= 99.9 && r.p99 <= budgetMs * 1000000LL && r.achievedRate > sustainable) {
+			sustainable = r.achievedRate;
+		}
+	}
+
+	std::cout << "Max sustainable: " << std::setprecision(0) << sustainable << " frames/s (p99 under " << budgetMs << " ms, 99.9% delivered)" << std::endl;
+	if(overflows > 0) std::cout << "evdev buffer overflowed " << overflows << " times, numbers above are suspect" << std::endl;
+	if(sim.stalls > 0) std::cout << "Host stopped draining the pty " << sim.stalls << " times" << std::endl;
+
+	reading = false;
+	reader.join();
+	close(fd);
+	return 0;
+}
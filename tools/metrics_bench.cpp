@@ -0,0 +1,86 @@
+// What instrumentation costs the hot paths.
+//
+//   metrics_bench [-n updates] [-t threads] [-s socket]
+//
+// Times counter, gauge and histogram updates from one thread, then again
+// with several threads hammering the same counter, the worst case for a
+// metric shared by a reader thread and the controller loop. With -s it also
+// serves the registry on a Unix socket until interrupted, for checking what
+// a scraper would see.
+
+#include "bench.h"
+#include "../metrics.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+static Counter* counter = Metrics::counter("bench_updates_total", "Updates made by metrics_bench");
+static Gauge* gauge = Metrics::gauge("bench_last_value", "Last value metrics_bench set");
+static Histogram* histogram = Metrics::histogram("bench_values", "Values metrics_bench recorded");
+
+static int64_t perUpdate(int64_t start, long updates) {
+	return (nowNs() - start) * 1000 / updates; // ps, one update is a handful of ns
+}
+
+static void print(const char* what, int64_t ps) {
+	std::cout << what << ps / 1000 << "." << (ps % 1000) / 100 << " ns" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	long updates = 50000000;
+	int threads = 4;
+	std::string socketPath;
+	int opt;
+	while((opt = getopt(argc, argv, "n:t:s:h")) != -1) {
+		switch(opt) {
+			case 'n': updates = atol(optarg); break;
+			case 't': threads = atoi(optarg); break;
+			case 's': socketPath = optarg; break;
+			default:
+				std::cerr << "Usage: " << argv[0] << " [-n updates] [-t threads] [-s socket]" << std::endl;
+				return 1;
+		}
+	}
+	if(updates < 1 || threads < 1) return 1;
+
+	int64_t start = nowNs();
+	for(long i = 0; i < updates; ++i) counter->add();
+	print("Counter add:          ", perUpdate(start, updates));
+
+	start = nowNs();
+	for(long i = 0; i < updates; ++i) gauge->set(i);
+	print("Gauge set:            ", perUpdate(start, updates));
+
+	start = nowNs();
+	for(long i = 0; i < updates; ++i) histogram->record(i & 0xFFFF);
+	print("Histogram record:     ", perUpdate(start, updates));
+
+	long each = updates / threads;
+	std::vector<std::thread> workers;
+	start = nowNs();
+	for(int t = 0; t < threads; ++t) {
+		workers.emplace_back([each] {
+			for(long i = 0; i < each; ++i) counter->add();
+		});
+	}
+	for(auto& w : workers) w.join();
+	std::cout << "Shared counter, " << threads << " threads: ";
+	print("", perUpdate(start, each));
+
+	if(socketPath.empty()) {
+		std::cout << std::endl << Metrics::snapshot();
+		return 0;
+	}
+
+	MetricsExporter exporter;
+	if(!exporter.start("", socketPath, 1000)) return 1;
+	std::cout << "Serving on " << socketPath << ", ^C to stop" << std::endl;
+	while(true) {
+		counter->add();
+		usleep(1000);
+	}
+}
@@ -0,0 +1,230 @@
+// Loopback test for NetworkMonitor, latency and loss handling without Wi-Fi.
+//
+//   netsend [-r rate] [-n frames] [-j jitters] [-l loss] [-d delayed] [-D delay] [-u dups] [-p poll]
+//
+// A sender thread plays a wireless controller on 127.0.0.1, one datagram per
+// frame, and answers the monitor's battery requests. It can drop, delay and
+// duplicate datagrams to stand in for a bad link. The monitor runs in this
+// process and is updated every poll interval like the controller loop does.
+//
+// Every frame carries its number in the axes so the receiving side can tell
+// how long it took, and whether anything came out of order. One run per
+// jitter delay in the list.
+
+#include "bench.h"
+#include "../network_monitor.h"
+#include "../pico_protocol.h"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DRAIN_TIME 200 // ms to keep updating after the last frame
+
+struct SendConfig {
+	int rate = 1000;
+	int frames = 5000;
+	double loss = 0, delayed = 0, duplicated = 0;
+	int delayMs = 5;
+	int pollUs = 500;
+};
+
+struct Pending {
+	int64_t at;
+	uint32_t seq;
+	bool operator<(const Pending& other) const { return at > other.at; }
+};
+
+struct RunResult {
+	std::vector<int64_t> latency;
+	int64_t lastSeq = -1;
+	int outOfOrder = 0;
+	std::atomic<int> requests{0}, dropped{0};
+};
+
+static std::vector<std::atomic<int64_t>>* sentAt;
+
+static size_t buildDatagram(uint8_t* out, uint32_t seq, bool battery) {
+	size_t len = encodeNetHeader(out, seq, (uint32_t)(nowNs() / 1000));
+	uint8_t buttons[1] = {(uint8_t)(seq & 1)};
+	int16_t axes[2] = {(int16_t)(seq & 0x7FFF), (int16_t)((seq >> 15) & 0x7FFF)};
+	len += encodeStateFrame(out + len, 1, 8, buttons, 1, axes);
+	if(battery) {
+		uint8_t status[1] = {0};
+		int16_t level[2] = {900, 0};
+		len += encodeStateFrame(out + len, 0, 8, status, 1, level);
+	}
+	return len;
+}
+
+static void sender(int port, const SendConfig& config, RunResult& result) {
+	int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(sock == -1 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror("sender socket");
+		return;
+	}
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<double> chance(0, 1);
+	std::priority_queue<Pending> later;
+	bool battery = false;
+	int64_t interval = 1000000000LL / config.rate;
+	int64_t next = nowNs() + 10000000LL;
+
+	for(int i = 0; i < config.frames || !later.empty(); ) {
+		int64_t wake = i < config.frames ? next : later.top().at;
+		if(!later.empty() && later.top().at < wake) wake = later.top().at;
+		sleepUntilNs(wake);
+
+		uint8_t request[REQUEST_FRAME_SIZE];
+		while(recv(sock, request, sizeof(request), 0) == REQUEST_FRAME_SIZE) {
+			result.requests++;
+			if(request[1] == REQUEST_READ_BATTERY) battery = true;
+		}
+
+		uint8_t datagram[MAX_NET_DATAGRAM];
+		int64_t now = nowNs();
+		while(!later.empty() && later.top().at <= now) {
+			send(sock, datagram, buildDatagram(datagram, later.top().seq, false), 0);
+			later.pop();
+		}
+		if(i >= config.frames || now < next) continue;
+
+		uint32_t seq = i++;
+		next += interval;
+		(*sentAt)[seq] = now;
+		if(chance(rng) < config.loss) {
+			result.dropped++;
+			continue;
+		}
+		if(chance(rng) < config.duplicated) later.push({now + 1000000LL, seq});
+		if(chance(rng) < config.delayed) {
+			later.push({now + config.delayMs * 1000000LL, seq});
+			continue;
+		}
+		send(sock, datagram, buildDatagram(datagram, seq, battery), 0);
+		battery = false;
+	}
+	close(sock);
+}
+
+static void receiveFrame(void* context, byte controller, byte, const byte*, byte, const int16_t* axes) {
+	RunResult& result = *static_cast<RunResult*>(context);
+	if(controller != 1) return;
+	int64_t now = nowNs();
+	uint32_t seq = (uint16_t)axes[0] | ((uint32_t)(uint16_t)axes[1] << 15);
+	if((int64_t)seq <= result.lastSeq) result.outOfOrder++;
+	result.lastSeq = seq;
+	result.latency.push_back(now - (*sentAt)[seq]);
+}
+
+static bool runJitter(int jitterMs, const SendConfig& config) {
+	NetworkMonitor monitor(0, jitterMs, "127.0.0.1");
+	RunResult result;
+	monitor.callback = receiveFrame;
+	monitor.callbackContext = &result;
+	if(!monitor.init()) return false;
+
+	for(auto& t : *sentAt) t = 0;
+	std::atomic<bool> sending(true);
+	std::thread feeder([&] {
+		sender(monitor.getPort(), config, result);
+		sending = false;
+	});
+
+	int64_t deadline = 0;
+	int64_t next = nowNs();
+	while(true) {
+		if(!sending) {
+			if(deadline == 0) deadline = nowNs() + DRAIN_TIME * 1000000LL;
+			if(nowNs() > deadline) break;
+		}
+		next += config.pollUs * 1000LL;
+		sleepUntilNs(next);
+		monitor.update();
+	}
+	feeder.join();
+
+	NetworkMonitor::Stats stats = monitor.getStats();
+	std::vector<int64_t>& lat = result.latency;
+	int64_t p50 = percentile(lat, 0.5), p99 = percentile(lat, 0.99);
+	int64_t max = lat.empty() ? 0 : lat.back();
+	std::cout << std::setw(8) << jitterMs
+	          << std::setw(10) << lat.size()
+	          << std::setw(8) << result.dropped
+	          << std::setw(8) << stats.lost
+	          << std::setw(8) << stats.stale
+	          << std::setw(8) << result.outOfOrder
+	          << std::setw(10) << stats.batches
+	          << std::setw(10) << p50 / 1000 << std::setw(10) << p99 / 1000 << std::setw(10) << max / 1000
+	          << std::setw(6) << result.requests << std::endl;
+	return true;
+}
+
+static void usage(const char* name) {
+	std::cerr << "Usage: " << name << " [-r rate] [-n frames] [-j jitters] [-l loss] [-d delayed] [-D delay] [-u dups] [-p poll]" << std::endl;
+	std::cerr << "  -r  frames per second (default 1000)" << std::endl;
+	std::cerr << "  -n  frames per run (default 5000)" << std::endl;
+	std::cerr << "  -j  comma separated jitter delays in ms, one run each (default 0,5)" << std::endl;
+	std::cerr << "  -l  fraction of datagrams to drop (default 0)" << std::endl;
+	std::cerr << "  -d  fraction of datagrams to hold back (default 0)" << std::endl;
+	std::cerr << "  -D  how long to hold them back in ms (default 5)" << std::endl;
+	std::cerr << "  -u  fraction of datagrams to send twice (default 0)" << std::endl;
+	std::cerr << "  -p  microseconds between monitor updates (default 500)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	SendConfig config;
+	std::string jitters = "0,5";
+	int opt;
+	while((opt = getopt(argc, argv, "r:n:j:l:d:D:u:p:h")) != -1) {
+		switch(opt) {
+			case 'r': config.rate = atoi(optarg); break;
+			case 'n': config.frames = atoi(optarg); break;
+			case 'j': jitters = optarg; break;
+			case 'l': config.loss = atof(optarg); break;
+			case 'd': config.delayed = atof(optarg); break;
+			case 'D': config.delayMs = atoi(optarg); break;
+			case 'u': config.duplicated = atof(optarg); break;
+			case 'p': config.pollUs = atoi(optarg); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(config.rate < 1 || config.frames < 1 || config.pollUs < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<std::atomic<int64_t>> times(config.frames);
+	sentAt = &times;
+
+	std::cout << config.frames << " frames at " << config.rate << "/s, " << config.loss * 100 << "% dropped, "
+	          << config.delayed * 100 << "% held back " << config.delayMs << " ms, " << config.duplicated * 100 << "% sent twice" << std::endl << std::endl;
+	std::cout << std::setw(8) << "jitter" << std::setw(10) << "frames" << std::setw(8) << "dropped"
+	          << std::setw(8) << "lost" << std::setw(8) << "stale" << std::setw(8) << "order"
+	          << std::setw(10) << "batches" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+	          << std::setw(10) << "max us" << std::setw(6) << "reqs" << std::endl;
+
+	std::stringstream list(jitters);
+	std::string item;
+	while(std::getline(list, item, ',')) {
+		if(!runJitter(atoi(item.c_str()), config)) return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,116 @@
+// Checks that drawing the popups stays off the heap once warmed up.
+//
+//   overlay_audit [-n frames] [-a assets]
+//
+// Draws what the driver's fan, volume and battery popups and the status HUD
+// draw, frame after frame, through the shared memory overlay the way the main
+// loop does. The first round of each warms up the image cache and scratch
+// buffers, then every following frame is counted and any heap allocation is
+// a failure. Run it from the repository so assets/ is found, or pass -a.
+
+#include "bench.h"
+#include "alloc_audit.h"
+#include "../overlay.h"
+#include "../layout.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#define FAN_FRAMES 8
+
+static OverlayManager* overlay;
+static Layout layout;
+static std::string sidePanel, battery, icons[FAN_FRAMES + 1];
+
+// Same calls as drawSidePanel() in main.cpp
+static void drawPanel(const std::string& icon, int percent) {
+	Rect art = layout.place(ANCHOR_RIGHT | ANCHOR_TOP, 0, 0, LAYOUT_REF_WIDTH, LAYOUT_REF_HEIGHT);
+	overlay->drawPNG(sidePanel.c_str(), art.x, art.y, art.width, art.height, SCALE_BILINEAR);
+	Rect iconRect = layout.place(ANCHOR_RIGHT | ANCHOR_TOP, 7, 39, 24, 24);
+	overlay->drawPNG(icon.c_str(), iconRect.x, iconRect.y, iconRect.width, iconRect.height, SCALE_BILINEAR);
+
+	Rect bar = layout.place(ANCHOR_RIGHT | ANCHOR_TOP, 8, 65, 22, 120);
+	int fontSize = layout.fontSize();
+	char text[8];
+	snprintf(text, sizeof(text), "%d", percent);
+	int xOff = bar.x + (bar.width - overlay->getStringWidth(text, fontSize) + 1) / 2;
+	overlay->drawString(text, xOff, layout.scale(190), 0xFFFF, 0xF0, fontSize);
+
+	int inner = bar.height - 2;
+	int h = inner * percent / 100;
+	overlay->drawRect(bar.x, bar.y, bar.width, bar.height, 0xFFFF, 0xFF);
+	overlay->fillRect(bar.x + 1, bar.y + 1 + (inner - h), bar.width - 2, h, 0xFFFF, 0xFF);
+}
+
+// Same calls as drawBatteryOverlay() and drawStatusHud()
+static void drawBattery(int hud, int percent) {
+	Rect art = layout.place(ANCHOR_HCENTER | ANCHOR_TOP, 0, 0, LAYOUT_REF_WIDTH, LAYOUT_REF_HEIGHT);
+	overlay->drawPNG(battery.c_str(), art.x, art.y, art.width, art.height, SCALE_BILINEAR);
+	char text[40];
+	snprintf(text, sizeof(text), "%d%% (%.3fv) %s", percent, 3.2 + percent / 100.0, "Battery");
+	int fontSize = layout.fontSize();
+	overlay->drawString(text, (layout.getWidth() - overlay->getStringWidth(text, fontSize)) / 2, layout.scale(24), 0xFFFF, 0xFF, fontSize);
+
+	overlay->selectLayer(hud);
+	overlay->clearScreen();
+	snprintf(text, sizeof(text), "%d%%", percent);
+	overlay->drawSymbol(2, 0, 0, 0xFFFF, 0xFF);
+	overlay->drawString(text, 8, 0, 0xFFFF, 0xFF, fontSize);
+	overlay->selectLayer(0);
+}
+
+// One frame of the popup the main loop shows, a new value every frame
+static void drawFrame(int frame, int hud) {
+	overlay->clearScreen();
+	int percent = frame % 101;
+	switch((frame / FAN_FRAMES) % 3) {
+		case 0: drawPanel(icons[frame % FAN_FRAMES], percent); break;
+		case 1: drawPanel(icons[FAN_FRAMES], percent); break;
+		case 2: drawBattery(hud, percent); break;
+	}
+	overlay->commit();
+}
+
+int main(int argc, char* argv[]) {
+	int frames = 3000;
+	std::string assets = "assets";
+	int opt;
+	while((opt = getopt(argc, argv, "n:a:h")) != -1) {
+		switch(opt) {
+			case 'n': frames = atoi(optarg); break;
+			case 'a': assets = optarg; break;
+			default:
+				std::cerr << "Usage: " << argv[0] << " [-n frames] [-a assets]" << std::endl;
+				return 1;
+		}
+	}
+
+	sidePanel = assets + "/overlay_rp.png";
+	battery = assets + "/battery_overlay.png";
+	for(int i = 0; i < FAN_FRAMES; ++i) icons[i] = assets + "/fan_" + std::to_string(i) + ".png";
+	icons[FAN_FRAMES] = assets + "/volume_full.png";
+
+	overlay = new OverlayManager();
+	layout.resize(overlay->getWidth(), overlay->getHeight());
+	Rect hudRect = layout.place(ANCHOR_RIGHT | ANCHOR_TOP, 2, 2, 40, 9);
+	int hud = overlay->createLayer(hudRect.x, hudRect.y, hudRect.width, hudRect.height, -1);
+
+	int warmup = FAN_FRAMES * 3;
+	for(int frame = 0; frame < warmup; ++frame) drawFrame(frame, hud);
+
+	auditStart();
+	int64_t start = nowNs();
+	for(int frame = warmup; frame < warmup + frames; ++frame) drawFrame(frame, hud);
+	int64_t elapsed = nowNs() - start;
+	uint64_t allocations = auditStop();
+
+	std::cout << frames << " frames, " << elapsed / 1000 / (frames > 0 ? frames : 1) << " us each" << std::endl;
+	std::cout << allocations << " heap allocations after warming up" << std::endl;
+	overlay->clearScreen();
+	overlay->commit();
+	delete overlay;
+	return allocations > 0 ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+// A virtual gamepad for trying the evdev monitor without one.
+//
+//   padsim [-r steps] [-n rounds] [-q]
+//
+// Creates "PicoTroller Test Pad" through uinput and presses each face,
+// shoulder and menu button in turn, then each hat direction, then each
+// direction of the left stick, releasing every input half a step later. Run
+// joystick_emulator with monitor=evdev and evtest on "Xemplar PicoTroller 0"
+// to watch them come out the other side.
+
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/uinput.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define DEVICE_NAME "PicoTroller Test Pad"
+#define STICK_MAX   32767
+
+struct Step {
+	const char* name;
+	int type, code, value;
+};
+
+static const Step STEPS[] = {
+	{"A", EV_KEY, BTN_A, 1},
+	{"B", EV_KEY, BTN_B, 1},
+	{"X", EV_KEY, BTN_X, 1},
+	{"Y", EV_KEY, BTN_Y, 1},
+	{"Start", EV_KEY, BTN_START, 1},
+	{"Select", EV_KEY, BTN_SELECT, 1},
+	{"TL", EV_KEY, BTN_TL, 1},
+	{"TR", EV_KEY, BTN_TR, 1},
+	{"hat up", EV_ABS, ABS_HAT0Y, -1},
+	{"hat down", EV_ABS, ABS_HAT0Y, 1},
+	{"hat left", EV_ABS, ABS_HAT0X, -1},
+	{"hat right", EV_ABS, ABS_HAT0X, 1},
+	{"stick up", EV_ABS, ABS_Y, -STICK_MAX},
+	{"stick down", EV_ABS, ABS_Y, STICK_MAX},
+	{"stick left", EV_ABS, ABS_X, -STICK_MAX},
+	{"stick right", EV_ABS, ABS_X, STICK_MAX},
+};
+
+static void emit(int fd, int type, int code, int value) {
+	struct input_event ev[2];
+	memset(ev, 0, sizeof(ev));
+	ev[0].type = type;
+	ev[0].code = code;
+	ev[0].value = value;
+	ev[1].type = EV_SYN;
+	ev[1].code = SYN_REPORT;
+	if(write(fd, ev, sizeof(ev)) < 0) perror("write (uinput)");
+}
+
+static void setAbs(int fd, int code, int min, int max) {
+	struct uinput_abs_setup abs;
+	memset(&abs, 0, sizeof(abs));
+	abs.code = code;
+	abs.absinfo.minimum = min;
+	abs.absinfo.maximum = max;
+	ioctl(fd, UI_ABS_SETUP, &abs);
+}
+
+static int createPad() {
+	int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	if(fd < 0) {
+		perror("Unable to open /dev/uinput");
+		return -1;
+	}
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_EVBIT, EV_ABS);
+	for(const Step& step : STEPS) {
+		if(step.type == EV_KEY) ioctl(fd, UI_SET_KEYBIT, step.code);
+		if(step.type == EV_ABS) ioctl(fd, UI_SET_ABSBIT, step.code);
+	}
+	setAbs(fd, ABS_X, -STICK_MAX, STICK_MAX);
+	setAbs(fd, ABS_Y, -STICK_MAX, STICK_MAX);
+	setAbs(fd, ABS_HAT0X, -1, 1);
+	setAbs(fd, ABS_HAT0Y, -1, 1);
+
+	struct uinput_setup usetup;
+	memset(&usetup, 0, sizeof(usetup));
+	usetup.id.bustype = BUS_VIRTUAL;
+	usetup.id.vendor = 0x5348;
+	usetup.id.product = 0x01FF;
+	snprintf(usetup.name, UINPUT_MAX_NAME_SIZE, DEVICE_NAME);
+	if(ioctl(fd, UI_DEV_SETUP, &usetup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+		perror("Unable to create the pad");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void usage(const char* name) {
+	std::cerr << "Usage: " << name << " [-r steps] [-n rounds] [-q]" << std::endl;
+	std::cerr << "  -r  steps per second (default 2)" << std::endl;
+	std::cerr << "  -n  rounds through every input, 0 to run until killed (default 1)" << std::endl;
+	std::cerr << "  -q  don't print each step" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	int rate = 2, rounds = 1;
+	bool quiet = false;
+	int opt;
+	while((opt = getopt(argc, argv, "r:n:qh")) != -1) {
+		switch(opt) {
+			case 'r': rate = atoi(optarg); break;
+			case 'n': rounds = atoi(optarg); break;
+			case 'q': quiet = true; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(rate < 1 || rounds < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int fd = createPad();
+	if(fd == -1) return 1;
+	std::cout << "Created " << DEVICE_NAME << std::endl;
+
+	int64_t interval = 1000000000LL / rate;
+	int64_t next = nowNs() + 1000000000LL; // Give the evdev monitor time to find it
+	for(int round = 0; rounds == 0 || round < rounds; ++round) {
+		for(const Step& step : STEPS) {
+			sleepUntilNs(next);
+			if(!quiet) std::cout << step.name << std::endl;
+			emit(fd, step.type, step.code, step.value);
+			sleepUntilNs(next + interval / 2);
+			emit(fd, step.type, step.code, 0);
+			next += interval;
+		}
+	}
+
+	sleepUntilNs(next);
+	ioctl(fd, UI_DEV_DESTROY);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,408 @@
+#include "pico_sim.h"
+#include "bench.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define FAN_MIN_VALUE 125
+#define SERIAL_READ_TIMEOUT 100 // ms
+#define WRITE_STALL_TIMEOUT 100 // ms
+
+PicoSimulator::PicoSimulator() : rng(4321) {
+	for(int c = 0; c < SIM_CONTROLLERS; ++c) {
+		controllers[c].button_count = 8;
+		controllers[c].axis_count = 1;
+	}
+}
+
+PicoSimulator::~PicoSimulator() {
+	close();
+}
+
+bool PicoSimulator::open(const char* linkPath) {
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		perror("posix_openpt");
+		close();
+		return false;
+	}
+	portName = ptsname(master);
+
+	// Raw until the host applies its own settings, otherwise the line
+	// discipline echoes requests back at it
+	struct termios options;
+	tcgetattr(master, &options);
+	cfmakeraw(&options);
+	tcsetattr(master, TCSANOW, &options);
+
+	// Hold the slave open so the master doesn't report a hangup between
+	// host runs
+	slave = ::open(portName.c_str(), O_RDWR | O_NOCTTY);
+
+	if(linkPath != nullptr) {
+		unlink(linkPath);
+		if(symlink(portName.c_str(), linkPath) == -1) {
+			perror("symlink");
+		} else {
+			linkName = linkPath;
+		}
+	}
+	return true;
+}
+
+void PicoSimulator::close() {
+	if(!linkName.empty()) unlink(linkName.c_str());
+	linkName.clear();
+	if(slave != -1) ::close(slave);
+	if(master != -1) ::close(master);
+	slave = master = -1;
+}
+
+const char* PicoSimulator::getPortName() {
+	return linkName.empty() ? portName.c_str() : linkName.c_str();
+}
+
+void PicoSimulator::setBaud(int baud) {
+	this->baud = pacedBaud = baud;
+}
+
+void PicoSimulator::setMaxReliableBaud(int baud) {
+	maxReliableBaud = baud;
+}
+
+int PicoSimulator::getLinkBaud() {
+	return linkBaud;
+}
+
+void PicoSimulator::setLinkBaud(int baud) {
+	linkBaud = baud;
+	if(pacedBaud > 0) this->baud = baud == SIM_BASE_BAUD ? pacedBaud : baud;
+	reading = false; // Whatever was half read is garbage now
+}
+
+void PicoSimulator::setDropRate(double rate) {
+	dropRate = rate;
+}
+
+void PicoSimulator::setCorruptRate(double rate) {
+	corruptRate = rate;
+}
+
+int PicoSimulator::getProtocol() {
+	return protocol;
+}
+
+// Reads whatever the host sent and answers it, waits up to timeoutMs for the
+// first byte. Returns the number of requests handled.
+int PicoSimulator::service(int timeoutMs) {
+	if(baudConfirmBy != 0 && nowNs() >= baudConfirmBy) { // Host never heard us at the new speed
+		baudConfirmBy = 0;
+		setLinkBaud(confirmedBaud);
+	}
+	sendKeyframes();
+	pushTelemetry();
+
+	struct pollfd pfd = {master, POLLIN, 0};
+	if(poll(&pfd, 1, timeoutMs) <= 0 || !(pfd.revents & POLLIN)) return 0;
+
+	int handled = 0;
+	uint8_t temp[512];
+	ssize_t len;
+	while((len = read(master, temp, sizeof(temp))) > 0) {
+		int64_t now = nowNs();
+		if(now - lastByteAt > SERIAL_READ_TIMEOUT * 1000000LL) reading = false;
+		if(now - lastByteAt > SIM_ALIVE_TIMEOUT * 1000000LL) { // Host restarted
+			protocol = PROTOCOL_V1;
+			cobs = false;
+		}
+		lastByteAt = now;
+
+		for(ssize_t i = 0; i < len; ++i) {
+			uint8_t b = temp[i];
+			if(!reading && b == FRAME_START) {
+				reading = true;
+				readIndex = 0;
+			}
+			if(!reading) continue;
+
+			if(readIndex >= SIM_READ_BUFFER) { // The firmware would scribble past its buffer here
+				reading = false;
+				continue;
+			}
+			readBuffer[readIndex++] = b;
+
+			if(b == FRAME_END && readIndex > 6) {
+				reading = false;
+				uint32_t value = readBuffer[2] | (readBuffer[3] << 8) | (readBuffer[4] << 16) | ((uint32_t)readBuffer[5] << 24);
+				processCommand(readBuffer[1], value);
+				handled++;
+			}
+		}
+	}
+	return handled;
+}
+
+void PicoSimulator::processCommand(int func, uint32_t value) {
+	if(func >= 0 && func < 13) requests[func]++;
+
+	switch(func) {
+		case REQUEST_READ_CONTROLLER:
+			sendKey((value % 4) + 1);
+			break;
+		case REQUEST_READ_BATTERY:
+			sendStatus(0, battery);
+			break;
+		case REQUEST_WRITE_FAN:
+			setFanSpeed(value);
+			// fall through
+		case REQUEST_READ_FAN:
+			sendStatus(STATUS_FAN, fan);
+			break;
+		case REQUEST_WRITE_BACKLIGHT:
+			backlight = value >= 255 ? 255 : value;
+			// fall through
+		case REQUEST_READ_BACKLIGHT:
+			sendStatus(STATUS_BACKLIGHT, backlight);
+			break;
+		case REQUEST_SET_PROTOCOL: {
+			// The ack always goes out in plain v1 so any host can read it
+			int version = (value & 0xFF) == PROTOCOL_V2 ? PROTOCOL_V2 : PROTOCOL_V1;
+			int flags = version == PROTOCOL_V2 ? value & PROTOCOL_FLAG_COBS : 0;
+			protocol = PROTOCOL_V1;
+			cobs = false;
+			ControllerState& c = controllers[0];
+			c.buttons[0] = STATUS_PROTOCOL | (charging ? STATUS_CHARGING : 0);
+			c.axes[0] = version;
+			c.axes[1] = flags;
+			sendState(0);
+			protocol = version;
+			cobs = flags & PROTOCOL_FLAG_COBS;
+			for(int c = 0; c < SIM_CONTROLLERS; ++c) {
+				keyframeAt[c] = 0; // Host starts without a baseline
+			}
+			break;
+		}
+		case REQUEST_SET_BAUD: {
+			// Acked at the old speed, the host switches once it has the ack
+			bool ok = value >= SIM_BASE_BAUD && value <= SIM_MAX_BAUD;
+			sendLinkStatus(STATUS_BAUD, ok ? value / 100 : 0);
+			if(ok) {
+				setLinkBaud(value);
+				baudConfirmBy = nowNs() + BAUD_CONFIRM_TIMEOUT * 1000000LL;
+			}
+			break;
+		}
+		case REQUEST_PING:
+			sendLinkStatus(STATUS_PING, value & 0xFFFF);
+			break;
+		case REQUEST_CONFIRM_BAUD:
+			if(baudConfirmBy != 0 && (int)value == linkBaud) {
+				confirmedBaud = linkBaud;
+				baudConfirmBy = 0;
+			}
+			break;
+		case REQUEST_SUBSCRIBE: {
+			int channel = value & 0xFF;
+			if(channel >= TELEMETRY_CHANNELS) break;
+			Subscription& sub = subscriptions[channel];
+			sub.interval = ((value >> 8) & 0xFF) * TELEMETRY_INTERVAL_UNIT * 1000000LL;
+			sub.threshold = (value >> 16) & 0xFFFF;
+			sub.active = sub.interval > 0;
+			if(sub.active) pushChannel(channel);
+			break;
+		}
+	}
+}
+
+int PicoSimulator::telemetryValue(int channel) {
+	switch(channel) {
+		case TELEMETRY_FAN: return fan;
+		case TELEMETRY_BACKLIGHT: return backlight;
+	}
+	return battery;
+}
+
+void PicoSimulator::pushChannel(int channel) {
+	Subscription& sub = subscriptions[channel];
+	sub.lastValue = telemetryValue(channel);
+	sub.lastCharging = charging;
+	sub.lastSent = nowNs();
+	uint8_t flags = STATUS_PUSH;
+	if(channel == TELEMETRY_FAN) flags |= STATUS_FAN;
+	if(channel == TELEMETRY_BACKLIGHT) flags |= STATUS_BACKLIGHT;
+	sendStatus(flags, sub.lastValue);
+	pushes++;
+}
+
+void PicoSimulator::pushTelemetry() {
+	int64_t now = nowNs();
+	for(int c = 0; c < TELEMETRY_CHANNELS; ++c) {
+		Subscription& sub = subscriptions[c];
+		if(!sub.active || now - sub.lastSent < sub.interval) continue;
+		bool moved = abs(telemetryValue(c) - sub.lastValue) >= sub.threshold;
+		if(c == TELEMETRY_BATTERY && charging != sub.lastCharging) moved = true;
+		if(moved) pushChannel(c);
+	}
+}
+
+// Same clamping as setFanSpeed() in the firmware
+void PicoSimulator::setFanSpeed(int speed) {
+	if(speed >= 255) {
+		fan = 255;
+	} else if(speed <= FAN_MIN_VALUE) {
+		fan = speed < fan ? 0 : FAN_MIN_VALUE;
+	} else {
+		fan = speed;
+	}
+}
+
+void PicoSimulator::sendStatus(uint8_t flags, int value) {
+	ControllerState& c = controllers[0];
+	c.buttons[0] = flags | (charging ? STATUS_CHARGING : 0);
+	c.axes[0] = c.axes[1] = value;
+	sendState(0);
+}
+
+void PicoSimulator::sendLinkStatus(uint8_t flags, int value) {
+	ControllerState& c = controllers[0];
+	c.buttons[0] = flags | (charging ? STATUS_CHARGING : 0);
+	c.axes[0] = value;
+	c.axes[1] = 0;
+	sendState(0);
+}
+
+// Sends the controller's current state the way the firmware does when it
+// changes, a delta in v2 unless a key frame is due
+bool PicoSimulator::sendState(int controller) {
+	if(controller < 0 || controller >= SIM_CONTROLLERS) return false;
+	if(protocol == PROTOCOL_V1 || controller == 0 || nowNs() >= keyframeAt[controller]) {
+		return sendKey(controller);
+	}
+
+	ControllerState& c = controllers[controller];
+	uint8_t frame[MAX_V2_FRAME];
+	size_t len = encodeDeltaFrame(frame, seq[controller], controller, sent[controller], c);
+	if(len == 0) return true; // Nothing changed
+	seq[controller]++;
+	sent[controller] = c;
+	return writeFrame(frame, len);
+}
+
+bool PicoSimulator::sendKey(int controller) {
+	if(controller < 0 || controller >= SIM_CONTROLLERS) return false;
+	ControllerState& c = controllers[controller];
+	active[controller] = true;
+
+	uint8_t frame[MAX_V2_FRAME];
+	size_t len;
+	if(protocol == PROTOCOL_V1) {
+		len = encodeStateFrame(frame, controller, c.button_count, c.buttons, c.axis_count, c.axes);
+	} else {
+		len = encodeKeyFrame(frame, seq[controller]++, controller, c);
+		sent[controller] = c;
+		keyframeAt[controller] = nowNs() + KEYFRAME_INTERVAL * 1000000LL;
+	}
+	return writeFrame(frame, len);
+}
+
+void PicoSimulator::sendKeyframes() {
+	if(protocol != PROTOCOL_V2) return;
+	int64_t now = nowNs();
+	for(int c = 1; c < SIM_CONTROLLERS; ++c) {
+		if(active[c] && now >= keyframeAt[c]) sendKey(c);
+	}
+}
+
+bool PicoSimulator::writeFrame(const uint8_t* data, size_t len) {
+	// Status replies always arrive, only input frames get lost
+	int controller = data[0] == FRAME_START ? data[1] : data[V2_HEADER_SIZE];
+	if(dropRate > 0 && controller != 0 && std::uniform_real_distribution<double>(0, 1)(rng) < dropRate) {
+		framesDropped++;
+		return true;
+	}
+
+	uint8_t encoded[MAX_COBS_FRAME + 1];
+	if(cobs) {
+		len = cobsEncode(data, len, encoded);
+		encoded[len++] = FRAME_DELIMITER;
+		data = encoded;
+	}
+
+	double damage = corruptRate;
+	if(maxReliableBaud > 0 && linkBaud > maxReliableBaud) damage += SIM_UNRELIABLE_RATE;
+	if(damage > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < damage) {
+		if(data != encoded) {
+			memcpy(encoded, data, len);
+			data = encoded;
+		}
+		encoded[rng() % len] = rng();
+		framesCorrupted++;
+	}
+
+	if(baud > 0) {
+		// The frame is only complete on the host once its last byte has
+		// been clocked out, 10 bits per byte with start and stop bits
+		int64_t now = nowNs();
+		int64_t start = wireFreeAt > now ? wireFreeAt : now;
+		wireFreeAt = start + (int64_t)len * 10 * 1000000000LL / baud;
+		sleepUntilNs(wireFreeAt);
+	}
+
+	size_t done = 0;
+	while(done < len) {
+		ssize_t n = write(master, data + done, len - done);
+		if(n > 0) {
+			done += n;
+			continue;
+		}
+		if(n < 0 && errno != EAGAIN && errno != EINTR) {
+			perror("write (pty)");
+			return false;
+		}
+
+		// Host isn't draining the pty
+		struct pollfd pfd = {master, POLLOUT, 0};
+		if(poll(&pfd, 1, WRITE_STALL_TIMEOUT) <= 0) {
+			stalls++;
+			return false;
+		}
+	}
+
+	framesSent++;
+	bytesSent += len;
+	return true;
+}
+
+void PicoSimulator::setButton(int controller, int button, bool state) {
+	if(controller < 1 || controller >= SIM_CONTROLLERS || button < 0 || button >= 32) return;
+	uint8_t& b = controllers[controller].buttons[button / 8];
+	if(state) {
+		b |= 1 << (button % 8);
+	} else {
+		b &= ~(1 << (button % 8));
+	}
+}
+
+void PicoSimulator::setButtons(int controller, uint32_t bits) {
+	if(controller < 1 || controller >= SIM_CONTROLLERS) return;
+	for(int i = 0; i < 4; ++i) {
+		controllers[controller].buttons[i] = (bits >> (i * 8)) & 0xFF;
+	}
+}
+
+void PicoSimulator::setAxis(int controller, int axis, int16_t x, int16_t y) {
+	if(controller < 1 || controller >= SIM_CONTROLLERS || axis < 0 || axis >= 4) return;
+	controllers[controller].axes[axis * 2] = x;
+	controllers[controller].axes[axis * 2 + 1] = y;
+}
+
+// The firmware turns the fan and backlight off when the host goes quiet
+bool PicoSimulator::isAlive() {
+	return lastByteAt != 0 && nowNs() - lastByteAt < SIM_ALIVE_TIMEOUT * 1000000LL;
+}
@@ -0,0 +1,110 @@
+#ifndef PICO_SIM_H
+#define PICO_SIM_H
+
+#include <cstdint>
+#include <random>
+#include <string>
+
+#include "../pico_protocol.h"
+
+#define SIM_CONTROLLERS   5 // 0 is the status controller, like the firmware
+#define SIM_READ_BUFFER   256
+#define SIM_ALIVE_TIMEOUT 2000 // ms, same as ALIVE_TIMEOUT in PicoSketch.ino
+#define SIM_BASE_BAUD     115200
+#define SIM_MAX_BAUD      3000000 // Same range PicoSketch.ino accepts
+#define SIM_UNRELIABLE_RATE 0.3 // Frames damaged above the highest reliable speed
+
+// Plays the Pico side of the serial protocol on a pseudo-terminal, so the host
+// can be pointed at the slave end instead of /dev/serial0. Requests are parsed
+// the same way PicoSketch.ino does it and answered with CRC'd state frames.
+class PicoSimulator {
+public:
+	PicoSimulator();
+	~PicoSimulator();
+
+	bool open(const char* linkPath = nullptr);
+	void close();
+	const char* getPortName();
+
+	// Paces writes as if the frames went over a UART at this rate, 0 for none.
+	// Follows the host when it negotiates a faster speed.
+	void setBaud(int baud);
+	// Above this speed the line gets noisy, so the host has to fall back
+	void setMaxReliableBaud(int baud);
+	int getLinkBaud();
+	// Throws away this fraction of input frames, like a noisy line would
+	void setDropRate(double rate);
+	// Overwrites one random byte in this fraction of frames
+	void setCorruptRate(double rate);
+	int getProtocol();
+
+	int service(int timeoutMs);
+	bool sendState(int controller);
+
+	void setButton(int controller, int button, bool state);
+	void setButtons(int controller, uint32_t bits);
+	void setAxis(int controller, int axis, int16_t x, int16_t y);
+	bool isAlive();
+
+	int battery = 2800;
+	bool charging = false;
+	int fan = 0;
+	int backlight = 255;
+
+	uint64_t framesSent = 0, bytesSent = 0, stalls = 0, framesDropped = 0, framesCorrupted = 0;
+	uint64_t requests[13] = {0};
+	uint64_t pushes = 0;
+
+private:
+	int master = -1, slave = -1;
+	std::string portName, linkName;
+	ControllerState controllers[SIM_CONTROLLERS];
+
+	// Protocol v2 bookkeeping, what the host was last sent per controller
+	int protocol = PROTOCOL_V1;
+	bool cobs = false;
+	ControllerState sent[SIM_CONTROLLERS];
+	uint8_t seq[SIM_CONTROLLERS] = {0};
+	bool active[SIM_CONTROLLERS] = {false};
+	int64_t keyframeAt[SIM_CONTROLLERS] = {0};
+
+	double dropRate = 0, corruptRate = 0;
+	std::mt19937 rng;
+
+	int baud = 0;
+	int64_t wireFreeAt = 0;
+
+	// Speed the host asked for, reverted unless it confirms in time
+	int linkBaud = SIM_BASE_BAUD, confirmedBaud = SIM_BASE_BAUD, maxReliableBaud = 0;
+	int pacedBaud = 0;
+	int64_t baudConfirmBy = 0;
+
+	// Telemetry subscriptions, same rules as pushTelemetry() in the firmware
+	struct Subscription {
+		bool active;
+		int64_t interval;
+		int threshold, lastValue;
+		bool lastCharging;
+		int64_t lastSent;
+	};
+	Subscription subscriptions[TELEMETRY_CHANNELS] = {};
+
+	uint8_t readBuffer[SIM_READ_BUFFER];
+	int readIndex = 0;
+	bool reading = false;
+	int64_t lastByteAt = 0;
+
+	void processCommand(int func, uint32_t value);
+	bool sendKey(int controller);
+	void sendKeyframes();
+	void sendStatus(uint8_t flags, int value);
+	void sendLinkStatus(uint8_t flags, int value);
+	void setFanSpeed(int speed);
+	void setLinkBaud(int baud);
+	int telemetryValue(int channel);
+	void pushChannel(int channel);
+	void pushTelemetry();
+	bool writeFrame(const uint8_t* data, size_t len);
+};
+
+#endif // PICO_SIM_H
@@ -0,0 +1,169 @@
+// Stand-in for the Pico on a pseudo-terminal. Point the host's `interface`
+// property at the link path and it can't tell the difference.
+//
+//   picosim [-l link] [-b baud] [-r rate] [-c controller] [-d drop] [-e corrupt] [-m baud] [-s script [-R]]
+//
+// Without -r or -s it only answers requests. Script lines are
+//   delay_ms controller buttons_hex x y
+// and blank lines or lines starting with # are skipped.
+
+#include "pico_sim.h"
+#include "bench.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+struct ScriptStep {
+	int delayMs;
+	int controller;
+	uint32_t buttons;
+	int16_t x, y;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void handleSignal(int) {
+	running = 0;
+}
+
+static bool loadScript(const char* path, std::vector<ScriptStep>& steps) {
+	std::ifstream file(path);
+	if(!file.is_open()) {
+		std::cerr << "Unable to open script " << path << std::endl;
+		return false;
+	}
+
+	std::string line;
+	int number = 0;
+	while(std::getline(file, line)) {
+		number++;
+		if(line.empty() || line[0] == '#') continue;
+
+		std::istringstream in(line);
+		ScriptStep step;
+		int x, y;
+		in >> step.delayMs >> step.controller >> std::hex >> step.buttons >> std::dec >> x >> y;
+		if(in.fail()) {
+			std::cerr << path << ":" << number << ": expected delay_ms controller buttons_hex x y" << std::endl;
+			return false;
+		}
+		step.x = x;
+		step.y = y;
+		steps.push_back(step);
+	}
+	return true;
+}
+
+static void usage(const char* name) {
+	std::cerr << "Usage: " << name << " [-l link] [-b baud] [-r rate] [-c controller] [-d drop] [-e corrupt] [-m baud] [-s script [-R]]" << std::endl;
+	std::cerr << "  -l  symlink to create for the pty (default /tmp/ttyPICO)" << std::endl;
+	std::cerr << "  -b  pace frames like a UART at this baud rate (default 115200, 0 for none)" << std::endl;
+	std::cerr << "  -r  send random input at this many frames per second" << std::endl;
+	std::cerr << "  -c  controller the random input goes to (default 1)" << std::endl;
+	std::cerr << "  -d  fraction of input frames to lose, 0.01 drops one in a hundred" << std::endl;
+	std::cerr << "  -e  fraction of frames to damage one byte in" << std::endl;
+	std::cerr << "  -m  highest speed the link stays clean at when the host asks for more" << std::endl;
+	std::cerr << "  -s  play input from a script" << std::endl;
+	std::cerr << "  -R  repeat the script until interrupted" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	const char* link = "/tmp/ttyPICO";
+	const char* scriptPath = nullptr;
+	int baud = 115200, maxBaud = 0, rate = 0, controller = 1;
+	double drop = 0, corrupt = 0;
+	bool repeat = false;
+
+	int opt;
+	while((opt = getopt(argc, argv, "l:b:r:c:d:e:m:s:Rh")) != -1) {
+		switch(opt) {
+			case 'l': link = optarg; break;
+			case 'b': baud = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'c': controller = atoi(optarg); break;
+			case 'd': drop = atof(optarg); break;
+			case 'e': corrupt = atof(optarg); break;
+			case 'm': maxBaud = atoi(optarg); break;
+			case 's': scriptPath = optarg; break;
+			case 'R': repeat = true; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	std::vector<ScriptStep> script;
+	if(scriptPath != nullptr && !loadScript(scriptPath, script)) return 1;
+
+	PicoSimulator sim;
+	if(!sim.open(link)) return 1;
+	sim.setBaud(baud);
+	sim.setDropRate(drop);
+	sim.setCorruptRate(corrupt);
+	sim.setMaxReliableBaud(maxBaud);
+	std::cout << "Simulating a Pico on " << sim.getPortName() << std::endl;
+
+	signal(SIGINT, handleSignal);
+	signal(SIGTERM, handleSignal);
+
+	std::mt19937 rng(1234);
+	size_t step = 0;
+	int64_t interval = rate > 0 ? 1000000000LL / rate : 0;
+	int64_t next = nowNs() + (script.empty() ? 0 : script[0].delayMs * 1000000LL);
+	bool wasAlive = false;
+
+	while(running) {
+		bool scripted = step < script.size();
+		bool timed = scripted || rate > 0;
+
+		int64_t now = nowNs();
+		if(timed && now >= next) {
+			if(scripted) {
+				const ScriptStep& s = script[step++];
+				sim.setButtons(s.controller, s.buttons);
+				sim.setAxis(s.controller, 0, s.x, s.y);
+				sim.sendState(s.controller);
+				if(step == script.size() && repeat) step = 0;
+				next = now + (step < script.size() ? script[step].delayMs * 1000000LL : 0);
+			} else {
+				// Flip one button or move the dpad, like a person mashing
+				int what = rng() % 10;
+				if(what < 8) {
+					sim.setButton(controller, what, rng() & 1);
+				} else {
+					static const int16_t dirs[3] = {-32000, 0, 32000};
+					sim.setAxis(controller, 0, dirs[rng() % 3], dirs[rng() % 3]);
+				}
+				sim.sendState(controller);
+				next += interval;
+				if(next < now) next = now; // Don't burst to catch up
+			}
+		}
+
+		int waitMs = 100;
+		if(timed) {
+			int64_t left = next - nowNs();
+			waitMs = left > 0 ? (int)(left / 1000000) : 0;
+		}
+		sim.service(waitMs);
+
+		if(sim.isAlive() != wasAlive) {
+			wasAlive = !wasAlive;
+			std::cout << (wasAlive ? "Host connected" : "Host went quiet, the Pico would power down now") << std::endl;
+		}
+	}
+
+	std::cout << std::endl << "Frames sent: " << sim.framesSent << " (" << sim.bytesSent << " bytes, " << sim.stalls << " stalls, " << sim.framesDropped << " dropped, " << sim.framesCorrupted << " corrupted)" << std::endl;
+	std::cout << "Requests: controller " << sim.requests[1] << ", battery " << sim.requests[2]
+	          << ", fan " << sim.requests[4] << "/" << sim.requests[5]
+	          << ", backlight " << sim.requests[6] << "/" << sim.requests[7]
+	          << ", protocol v" << sim.getProtocol() << std::endl;
+	return 0;
+}
@@ -0,0 +1,153 @@
+// Feeds a serial capture (captureFile in config.prop) back through PicoMonitor
+// and ControllerManager without any hardware or uinput.
+//
+//   replay [-r] [-a] [-n runs] [-o golden] capture
+//
+// Every event the manager would have sent to uinput goes to the golden file,
+// one "frame device type code value" line each, so two builds can be diffed on
+// the same traffic. Without -r the capture is fed as fast as possible and the
+// parse rate is reported. -a feeds it twice and fails if the second time
+// touches the heap, the serial to uinput path shouldn't once warmed up.
+
+#include "bench.h"
+#include "alloc_audit.h"
+#include "../capture.h"
+#include "../controller.h"
+#include "../pico_monitor.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+struct ReplayStats {
+	uint64_t frames = 0, events = 0;
+	uint64_t rxBytes = 0, txBytes = 0, records = 0;
+	uint64_t allocations = 0;
+	FILE* golden = nullptr;
+	MonitorCallback forward = nullptr; // The manager's, frames are counted on the way
+	void* forwardContext = nullptr;
+};
+
+static bool passThrough(ControllerData[], int) {
+	return false;
+}
+
+static void recordEvent(void* context, int device, int type, int code, int value) {
+	ReplayStats* stats = static_cast<ReplayStats*>(context);
+	stats->events++;
+	if(stats->golden != nullptr) {
+		fprintf(stats->golden, "%llu %d %d %d %d\n", (unsigned long long)stats->frames, device, type, code, value);
+	}
+}
+
+// Counts frames on the way through so events can be tied back to them
+static void countFrame(void* context, byte controller, byte button_count, const byte* button_values, byte axis_count, const int16_t* axis_values) {
+	ReplayStats* stats = static_cast<ReplayStats*>(context);
+	stats->frames++;
+	stats->forward(stats->forwardContext, controller, button_count, button_values, axis_count, axis_values);
+}
+
+// With audit the capture goes through twice, the first pass warms up the
+// buffers and only the second is counted, stats included
+static bool replay(const char* path, bool realTime, bool audit, ReplayStats& stats) {
+	ControllerManager manager(passThrough, false);
+	PicoMonitor monitor("");
+	manager.setMonitor(&monitor);
+	manager.setEventSink(recordEvent, &stats);
+	stats.forward = monitor.callback;
+	stats.forwardContext = monitor.callbackContext;
+	monitor.callback = countFrame;
+	monitor.callbackContext = &stats;
+
+	FILE* golden = stats.golden;
+	for(int pass = 0; pass < (audit ? 2 : 1); ++pass) {
+		CaptureReader reader;
+		if(!reader.open(path)) return false;
+		if(pass == 1) {
+			stats.frames = stats.events = stats.rxBytes = stats.txBytes = stats.records = 0;
+			stats.golden = nullptr; // Already written once
+			auditStart();
+		}
+
+		CaptureRecord record;
+		int64_t start = nowNs();
+		while(reader.next(record)) {
+			stats.records++;
+			if(record.direction == CAPTURE_TX) {
+				stats.txBytes += record.length;
+				continue;
+			}
+			if(realTime) sleepUntilNs(start + record.time * 1000);
+			stats.rxBytes += record.length;
+			monitor.feed(record.data, record.length);
+		}
+		if(pass == 1) stats.allocations = auditStop();
+	}
+	stats.golden = golden;
+	return true;
+}
+
+static void usage(const char* name) {
+	std::cerr << "Usage: " << name << " [-r] [-a] [-n runs] [-o golden] capture" << std::endl;
+	std::cerr << "  -r  replay at the recorded speed instead of as fast as possible" << std::endl;
+	std::cerr << "  -a  replay twice and fail if the second pass allocates" << std::endl;
+	std::cerr << "  -n  replay this many times and report the best run (default 1)" << std::endl;
+	std::cerr << "  -o  write every emitted event to this file" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	const char* goldenPath = nullptr;
+	bool realTime = false, audit = false;
+	int runs = 1;
+
+	int opt;
+	while((opt = getopt(argc, argv, "ran:o:h")) != -1) {
+		switch(opt) {
+			case 'r': realTime = true; break;
+			case 'a': audit = true; break;
+			case 'n': runs = atoi(optarg); break;
+			case 'o': goldenPath = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if(runs < 1) runs = 1;
+	const char* path = argv[optind];
+
+	ReplayStats stats;
+	int64_t best = 0;
+	for(int run = 0; run < runs; ++run) {
+		stats = ReplayStats();
+		if(run == 0 && goldenPath != nullptr) { // Only the first run, they're identical
+			stats.golden = fopen(goldenPath, "w");
+			if(stats.golden == nullptr) {
+				perror(goldenPath);
+				return 1;
+			}
+		}
+
+		int64_t start = nowNs();
+		if(!replay(path, realTime, audit, stats)) return 1;
+		int64_t elapsed = nowNs() - start;
+		if(run == 0 || elapsed < best) best = elapsed;
+
+		if(stats.golden != nullptr) fclose(stats.golden);
+	}
+
+	std::cout << stats.records << " records, " << stats.rxBytes << " bytes from the Pico, " << stats.txBytes << " to it" << std::endl;
+	std::cout << stats.frames << " frames, " << stats.events << " events" << std::endl;
+	if(!realTime && best > 0) {
+		std::cout << "Best of " << runs << ": " << best / 1000 << " us, "
+		          << (stats.frames ? best / (int64_t)stats.frames : 0) << " ns/frame, "
+		          << stats.rxBytes * 1000.0 / best << " MB/s" << std::endl;
+	}
+	if(audit) {
+		std::cout << stats.allocations << " heap allocations after warming up" << std::endl;
+		if(stats.allocations > 0) return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,213 @@
+// Compares the ways PicoMonitor can wait for serial input, over a pty.
+//
+//   serial_bench [-r rate] [-n frames] [-f size] [-k chunk] [-b baud]
+//
+// A writer thread plays the Pico on the master end, sending fixed size frames
+// at the given rate, each split into chunks spaced out the way a UART at the
+// given baud rate would deliver them. The reader runs on the slave end through
+// SerialPort once per mode:
+//
+//   poll      non-blocking reads every 500us, what ControllerManager::loop does
+//   blocking  a thread sleeping in poll()/read() with VMIN 1
+//
+// For each mode it reports wakeups per frame, the CPU time the reader burnt
+// and how long after its last byte was written each frame was read.
+
+#include "bench.h"
+#include "../serial_port.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#define POLL_INTERVAL 500 // us, the controller loop's sleep
+#define DRAIN_TIME    200 // ms to wait for stragglers
+
+struct BenchConfig {
+	int rate = 1000;
+	int frames = 5000;
+	int frameSize = 12;
+	int chunk = 0; // Whole frames
+	int baud = 115200;
+};
+
+struct ModeResult {
+	uint64_t wakeups = 0, bytes = 0;
+	int64_t cpuNs = 0;
+	std::vector<int64_t> latency;
+};
+
+static int64_t threadCpuNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void writeAll(int fd, const uint8_t* data, size_t len) {
+	while(len > 0) {
+		ssize_t n = write(fd, data, len);
+		if(n > 0) {
+			data += n;
+			len -= n;
+		} else if(n < 0 && errno != EINTR && errno != EAGAIN) {
+			perror("write (pty)");
+			return;
+		}
+	}
+}
+
+// Sends every frame, stamping just before its last byte goes out
+static void writer(int master, const BenchConfig& config, std::vector<int64_t>& sentAt) {
+	std::vector<uint8_t> frame(config.frameSize, 0x55);
+	int chunk = config.chunk > 0 ? config.chunk : config.frameSize;
+	int64_t byteNs = config.baud > 0 ? 10 * 1000000000LL / config.baud : 0;
+	int64_t interval = 1000000000LL / config.rate;
+	int64_t next = nowNs() + 10000000LL;
+
+	for(int i = 0; i < config.frames; ++i) {
+		sleepUntilNs(next);
+		int64_t wire = next;
+		for(int offset = 0; offset < config.frameSize; offset += chunk) {
+			int len = std::min(chunk, config.frameSize - offset);
+			wire += len * byteNs;
+			sleepUntilNs(wire); // The chunk has only just been clocked in
+			if(offset + len == config.frameSize) sentAt[i] = nowNs();
+			writeAll(master, frame.data() + offset, len);
+		}
+		next += interval;
+	}
+}
+
+static bool runMode(const char* slavePath, int master, int mode, const BenchConfig& config, ModeResult& result) {
+	SerialPort port;
+	if(!port.open(slavePath, config.baud > 0 ? config.baud : SERIAL_BASE_BAUD)) return false;
+	if(mode != SERIAL_MODE_POLL && !port.setReadMode(mode)) return false;
+
+	uint8_t drain[4096];
+	while(read(master, drain, sizeof(drain)) > 0) {} // Nothing left from the last mode
+
+	std::vector<int64_t> sentAt(config.frames, 0);
+	std::atomic<bool> writing(true);
+	std::thread feeder([&] {
+		writer(master, config, sentAt);
+		writing = false;
+	});
+
+	uint64_t total = (uint64_t)config.frames * config.frameSize;
+	std::vector<int64_t> readAt(config.frames, 0);
+	uint8_t buffer[4096];
+	int64_t cpuStart = threadCpuNs();
+	int64_t deadline = 0;
+
+	while(result.bytes < total) {
+		if(!writing) {
+			if(deadline == 0) deadline = nowNs() + DRAIN_TIME * 1000000LL;
+			if(nowNs() > deadline) break;
+		}
+
+		ssize_t len;
+		if(mode == SERIAL_MODE_POLL) {
+			std::this_thread::sleep_for(std::chrono::microseconds(POLL_INTERVAL));
+			result.wakeups++;
+			len = port.read(buffer, sizeof(buffer));
+		} else {
+			if(!port.waitReadable(DRAIN_TIME)) continue;
+			result.wakeups++;
+			len = port.read(buffer, sizeof(buffer));
+		}
+		if(len <= 0) continue;
+
+		int64_t now = nowNs();
+		uint64_t before = result.bytes;
+		result.bytes += len;
+		for(uint64_t f = before / config.frameSize; f < result.bytes / config.frameSize; ++f) {
+			readAt[f] = now;
+		}
+	}
+	result.cpuNs = threadCpuNs() - cpuStart;
+	feeder.join();
+
+	for(int i = 0; i < config.frames; ++i) {
+		if(readAt[i] != 0) result.latency.push_back(readAt[i] - sentAt[i]);
+	}
+	return true;
+}
+
+static void usage(const char* name) {
+	std::cerr << "Usage: " << name << " [-r rate] [-n frames] [-f size] [-k chunk] [-b baud]" << std::endl;
+	std::cerr << "  -r  frames per second (default 1000)" << std::endl;
+	std::cerr << "  -n  frames per mode (default 5000)" << std::endl;
+	std::cerr << "  -f  bytes per frame (default 12)" << std::endl;
+	std::cerr << "  -k  deliver each frame in chunks of this many bytes (default whole frames)" << std::endl;
+	std::cerr << "  -b  space the chunks as a UART at this baud rate would (default 115200, 0 for none)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	BenchConfig config;
+	int opt;
+	while((opt = getopt(argc, argv, "r:n:f:k:b:h")) != -1) {
+		switch(opt) {
+			case 'r': config.rate = atoi(optarg); break;
+			case 'n': config.frames = atoi(optarg); break;
+			case 'f': config.frameSize = atoi(optarg); break;
+			case 'k': config.chunk = atoi(optarg); break;
+			case 'b': config.baud = atoi(optarg); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(config.rate < 1 || config.frames < 1 || config.frameSize < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		perror("posix_openpt");
+		return 1;
+	}
+	const char* slavePath = ptsname(master);
+
+	SerialPort probe;
+	if(probe.open(slavePath)) {
+		std::cout << "Low latency mode " << (probe.setLowLatency(true) ? "supported" : "not supported") << " on the pty" << std::endl;
+		probe.close();
+	}
+
+	std::cout << config.frames << " frames of " << config.frameSize << " bytes at " << config.rate << "/s";
+	if(config.chunk > 0) std::cout << " in chunks of " << config.chunk;
+	std::cout << std::endl << std::endl;
+	std::cout << std::left << std::setw(10) << "mode" << std::right
+	          << std::setw(10) << "wakeups" << std::setw(12) << "per frame" << std::setw(10) << "cpu ms"
+	          << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(10) << "max us"
+	          << std::setw(8) << "lost" << std::endl;
+
+	const char* names[] = {"poll", "blocking"};
+	const int modes[] = {SERIAL_MODE_POLL, SERIAL_MODE_BLOCKING};
+	for(int m = 0; m < 2; ++m) {
+		ModeResult result;
+		if(!runMode(slavePath, master, modes[m], config, result)) return 1;
+
+		std::vector<int64_t>& lat = result.latency;
+		int lost = config.frames - (int)lat.size();
+		int64_t p50 = percentile(lat, 0.5), p99 = percentile(lat, 0.99);
+		int64_t max = lat.empty() ? 0 : lat.back();
+		std::cout << std::left << std::setw(10) << names[m] << std::right
+		          << std::setw(10) << result.wakeups
+		          << std::setw(12) << std::fixed << std::setprecision(2) << (double)result.wakeups / config.frames
+		          << std::setw(10) << std::setprecision(1) << result.cpuNs / 1e6
+		          << std::setw(10) << p50 / 1000 << std::setw(10) << p99 / 1000 << std::setw(10) << max / 1000
+		          << std::setw(8) << lost << std::endl;
+	}
+
+	close(master);
+	return 0;
+}
@@ -0,0 +1,64 @@
+// What a trace span costs, and a sample trace to open in a viewer.
+//
+//   trace_bench [-n spans] [-t threads] [-o file]
+//
+// Always built with the trace points in, whatever TRACE says. Times empty
+// spans on one thread, then has several threads record nested spans at once
+// the way the reader, controller and main threads do, and dumps the result
+// as Chrome trace JSON.
+
+#ifndef PICOTROLLER_TRACE
+#define PICOTROLLER_TRACE
+#endif
+#include "bench.h"
+#include "../trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+static void worker(int index, int spans) {
+	char name[TRACE_NAME_SIZE];
+	snprintf(name, sizeof(name), "worker %d", index);
+	TRACE_THREAD(name);
+	for(int i = 0; i < spans; ++i) {
+		TRACE_SCOPE("outer");
+		TRACE_SCOPE("inner");
+	}
+}
+
+int main(int argc, char* argv[]) {
+	int spans = 10000000, threads = 3;
+	std::string path = "/tmp/trace_bench.json";
+	int opt;
+	while((opt = getopt(argc, argv, "n:t:o:h")) != -1) {
+		switch(opt) {
+			case 'n': spans = atoi(optarg); break;
+			case 't': threads = atoi(optarg); break;
+			case 'o': path = optarg; break;
+			default:
+				std::cerr << "Usage: " << argv[0] << " [-n spans] [-t threads] [-o file]" << std::endl;
+				return 1;
+		}
+	}
+	if(spans < 1 || threads < 0) return 1;
+
+	TRACE_THREAD("main");
+	Trace::record("warm up", Trace::now(), Trace::now()); // Attach outside the timing
+
+	int64_t start = nowNs();
+	for(int i = 0; i < spans; ++i) {
+		TRACE_SCOPE("span");
+	}
+	int64_t ps = (nowNs() - start) * 1000 / spans;
+	std::cout << "One span: " << ps / 1000 << "." << (ps % 1000) / 100 << " ns" << std::endl;
+
+	std::vector<std::thread> workers;
+	for(int t = 0; t < threads; ++t) workers.emplace_back(worker, t + 1, spans / 10);
+	for(auto& w : workers) w.join();
+
+	return Trace::dump(path) ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+// Checks that VolumeControl hears volume changes made by other programs.
+//
+//   volume_check [-c card] [-e element] [-n changes]
+//
+// Opens the mixer element the way the driver does, steps it up and down,
+// then writes new values through a second mixer handle, like amixer or a
+// desktop volume applet would, and waits for onChange to report each one.
+// Needs a card to play with, the ALSA dummy driver is made for it:
+//
+//   sudo modprobe snd-dummy
+//   tools/volume_check
+//
+// Fails if a step doesn't move the volume or an outside change isn't
+// reported within a second.
+
+#include "bench.h"
+#include "../volume.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#define CHANGE_TIMEOUT_MS 1000
+
+static std::atomic<int> reported(-1);
+static std::atomic<int> reports(0);
+
+// A second handle on the same element, standing in for another program
+static bool writeExternal(const std::string& card, const std::string& element, long value) {
+	snd_mixer_t* mixer;
+	int err;
+	if((err = snd_mixer_open(&mixer, 0)) < 0) {
+		std::cerr << "Unable to open mixer: " << snd_strerror(err) << std::endl;
+		return false;
+	}
+	bool ok = false;
+	if((err = snd_mixer_attach(mixer, card.c_str())) < 0 ||
+	   (err = snd_mixer_selem_register(mixer, nullptr, nullptr)) < 0 ||
+	   (err = snd_mixer_load(mixer)) < 0) {
+		std::cerr << "Unable to load mixer for " << card << ": " << snd_strerror(err) << std::endl;
+	} else {
+		snd_mixer_selem_id_t* sid;
+		snd_mixer_selem_id_alloca(&sid);
+		snd_mixer_selem_id_set_index(sid, 0);
+		snd_mixer_selem_id_set_name(sid, element.c_str());
+		snd_mixer_elem_t* elem = snd_mixer_find_selem(mixer, sid);
+		if(elem != nullptr) ok = snd_mixer_selem_set_playback_volume_all(elem, value) >= 0;
+	}
+	snd_mixer_close(mixer);
+	return ok;
+}
+
+// How long onChange took to report the value, -1 if it never did
+static int64_t waitFor(int value) {
+	int64_t start = nowNs();
+	int64_t deadline = start + CHANGE_TIMEOUT_MS * 1000000LL;
+	while(nowNs() < deadline) {
+		if(reported == value) return nowNs() - start;
+		usleep(100);
+	}
+	return -1;
+}
+
+int main(int argc, char* argv[]) {
+	std::string card = "hw:Dummy";
+	std::string element = "Master";
+	int changes = 5;
+	int opt;
+	while((opt = getopt(argc, argv, "c:e:n:h")) != -1) {
+		switch(opt) {
+			case 'c': card = optarg; break;
+			case 'e': element = optarg; break;
+			case 'n': changes = atoi(optarg); break;
+			default:
+				std::cerr << "Usage: " << argv[0] << " [-c card] [-e element] [-n changes]" << std::endl;
+				return 1;
+		}
+	}
+
+	VolumeControl volume;
+	volume.onChange = [](int value) {
+		reported = value;
+		reports++;
+	};
+	if(!volume.open(card, element)) {
+		std::cerr << "Is the card there? sudo modprobe snd-dummy" << std::endl;
+		return 1;
+	}
+	int min = volume.getMin(), max = volume.getMax();
+	std::cout << card << " " << element << " range " << min << " to " << max << ", at " << volume.getVolume() << std::endl;
+
+	int failures = 0;
+	volume.set(min + (max - min) / 2);
+	int before = volume.getVolume();
+	int up = volume.step(5);
+	int down = volume.step(-10);
+	std::cout << "step +5 " << before << " -> " << up << ", step -10 -> " << down << std::endl;
+	if(up <= before || down >= up) {
+		std::cerr << "Stepping didn't move the volume" << std::endl;
+		failures++;
+	}
+
+	for(int i = 0; i < changes; i++) {
+		int value = min + (max - min) * (i + 1) / (changes + 1);
+		if(value == volume.getVolume()) value++;
+		if(!writeExternal(card, element, value)) {
+			std::cerr << "Unable to write " << value << " from a second handle" << std::endl;
+			return 1;
+		}
+		int64_t took = waitFor(value);
+		if(took < 0) {
+			std::cerr << "Outside change to " << value << " never reported, last report " << reported << std::endl;
+			failures++;
+		} else {
+			std::cout << "outside change to " << value << " reported after " << took / 1000 << " us" << std::endl;
+		}
+	}
+
+	std::cout << reports << " reports, " << failures << " failures" << std::endl;
+	volume.close();
+	return failures > 0 ? 1 : 0;
+}
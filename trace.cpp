@@ -0,0 +1,102 @@
+#include "trace.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+thread_local TraceRing* traceRing = nullptr;
+
+static std::mutex ringLock;
+static TraceRing* rings[TRACE_MAX_THREADS];
+static int ringCount = 0;
+static TraceRing refusedRing;
+
+// Counter ticks per second, what Trace::now() counts in
+static uint64_t tickRate() {
+#if defined(__aarch64__)
+	uint64_t rate;
+	asm volatile("mrs %0, cntfrq_el0" : "=r"(rate));
+	return rate;
+#elif defined(__arm__) && __ARM_ARCH >= 7
+	uint32_t rate;
+	asm volatile("mrc p15, 0, %0, c14, c0, 0" : "=r"(rate));
+	return rate;
+#else
+	return 1000000000ULL;
+#endif
+}
+
+// A thread's first span gives it a ring, kept after it exits so a dump
+// still shows what it did
+TraceRing* Trace::attach() {
+	std::lock_guard<std::mutex> guard(ringLock);
+	if(ringCount >= TRACE_MAX_THREADS) {
+		refusedRing.refused = true;
+		traceRing = &refusedRing;
+		return traceRing;
+	}
+	TraceRing* ring = new TraceRing();
+	ring->tid = syscall(SYS_gettid);
+	snprintf(ring->threadName, TRACE_NAME_SIZE, "thread %d", ring->tid);
+	rings[ringCount++] = ring;
+	traceRing = ring;
+	return ring;
+}
+
+void Trace::setThreadName(const char* name) {
+	TraceRing* ring = traceRing;
+	if(ring == nullptr) ring = attach();
+	if(ring->refused) return;
+	std::lock_guard<std::mutex> guard(ringLock);
+	snprintf(ring->threadName, TRACE_NAME_SIZE, "%s", name);
+}
+
+// Copies each ring out and then drops whatever its thread may have
+// overwritten meanwhile, so the threads never wait on a dump
+bool Trace::dump(const std::string& path) {
+	FILE* out = fopen(path.c_str(), "w");
+	if(out == nullptr) {
+		perror("Trace: fopen");
+		return false;
+	}
+
+	std::vector<TraceSpan> copy(TRACE_RING_SIZE);
+	double usPerTick = 1000000.0 / tickRate();
+	int pid = getpid();
+	size_t total = 0;
+
+	std::lock_guard<std::mutex> guard(ringLock);
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for(int r = 0; r < ringCount; ++r) {
+		TraceRing* ring = rings[r];
+		fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		        r == 0 ? "" : ",\n", pid, ring->tid, ring->threadName);
+
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		for(uint64_t i = first; i < head; ++i) {
+			copy[i - first] = ring->spans[i & (TRACE_RING_SIZE - 1)];
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t after = ring->head.load(std::memory_order_relaxed);
+		uint64_t safe = after >= TRACE_RING_SIZE ? after - TRACE_RING_SIZE + 1 : 0;
+
+		for(uint64_t i = std::max(first, safe); i < head; ++i) {
+			const TraceSpan& span = copy[i - first];
+			fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			        span.name, pid, ring->tid, span.start * usPerTick, (span.end - span.start) * usPerTick);
+			total++;
+		}
+	}
+	fprintf(out, "\n]}\n");
+	if(fclose(out) != 0) {
+		perror("Trace: write");
+		return false;
+	}
+	std::cout << "Wrote " << total << " trace spans to " << path << std::endl;
+	return true;
+}
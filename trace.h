@@ -0,0 +1,92 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+#define TRACE_RING_SIZE   8192 // Spans kept per thread, a power of two
+#define TRACE_MAX_THREADS 16
+#define TRACE_NAME_SIZE   16
+
+// Scoped trace points for seeing where an input's time went across threads.
+// Built in with `make TRACE=1`, otherwise TRACE_SCOPE and TRACE_THREAD are
+// nothing at all. Each thread records into its own ring, oldest spans are
+// overwritten, and Trace::dump() writes what's there as Chrome trace JSON
+// for chrome://tracing or ui.perfetto.dev.
+#ifdef PICOTROLLER_TRACE
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_JOIN(traceScope, __LINE__)(name)
+#define TRACE_THREAD(name) Trace::setThreadName(name)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD(name)
+#endif
+
+struct TraceSpan {
+	const char* name; // Must outlive the dump, string literals do
+	uint64_t start, end; // Trace::now() ticks
+};
+
+// Only its own thread writes to a ring. head is published after the span,
+// so a dump running alongside can tell which spans it may have torn.
+struct TraceRing {
+	std::atomic<uint64_t> head{0};
+	int tid = 0;
+	bool refused = false; // Stand in for threads past TRACE_MAX_THREADS
+	char threadName[TRACE_NAME_SIZE] = {0};
+	TraceSpan spans[TRACE_RING_SIZE];
+};
+
+extern thread_local TraceRing* traceRing;
+
+class Trace {
+public:
+	// The CPU's own counter where user space may read it, a vDSO call costs
+	// more than the rest of a span on a Pi 3
+	static inline uint64_t now() {
+#if defined(__aarch64__)
+		uint64_t ticks;
+		asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+		return ticks;
+#elif defined(__arm__) && __ARM_ARCH >= 7
+		uint64_t ticks;
+		asm volatile("mrrc p15, 1, %Q0, %R0, c14" : "=r"(ticks));
+		return ticks;
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+	}
+
+	static inline void record(const char* name, uint64_t start, uint64_t end) {
+		TraceRing* ring = traceRing;
+		if(ring == nullptr) ring = attach();
+		if(ring->refused) return;
+		uint64_t head = ring->head.load(std::memory_order_relaxed);
+		TraceSpan& span = ring->spans[head & (TRACE_RING_SIZE - 1)];
+		span.name = name;
+		span.start = start;
+		span.end = end;
+		ring->head.store(head + 1, std::memory_order_release);
+	}
+
+	static void setThreadName(const char* name);
+	static bool dump(const std::string& path);
+
+private:
+	static TraceRing* attach();
+};
+
+struct TraceScope {
+	const char* name;
+	uint64_t start;
+
+	explicit TraceScope(const char* name) : name(name), start(Trace::now()) {}
+	~TraceScope() { Trace::record(name, start, Trace::now()); }
+};
+
+#endif // TRACE_H
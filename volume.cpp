@@ -0,0 +1,188 @@
+#include "volume.h"
+
+#include "log.h"
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+
+VolumeControl::VolumeControl() : volume(0) {
+}
+
+VolumeControl::~VolumeControl() {
+	close();
+}
+
+// Everything the other threads touch is set up under the lock, the watcher
+// only starts once it is released
+bool VolumeControl::open(const std::string& card, const std::string& element) {
+	close();
+
+	std::unique_lock<std::mutex> guard(lock);
+	int err;
+	if((err = snd_mixer_open(&mixer, 0)) < 0) {
+		LOG_ERROR("Unable to open mixer: %s", snd_strerror(err));
+		mixer = nullptr;
+		return false;
+	}
+	if((err = snd_mixer_attach(mixer, card.c_str())) < 0 ||
+	   (err = snd_mixer_selem_register(mixer, nullptr, nullptr)) < 0 ||
+	   (err = snd_mixer_load(mixer)) < 0) {
+		LOG_ERROR("Unable to load mixer for %s: %s", card.c_str(), snd_strerror(err));
+		closeMixer();
+		return false;
+	}
+
+	snd_mixer_selem_id_t* sid;
+	snd_mixer_selem_id_alloca(&sid);
+	snd_mixer_selem_id_set_index(sid, 0);
+	snd_mixer_selem_id_set_name(sid, element.c_str());
+	elem = snd_mixer_find_selem(mixer, sid);
+	if(elem == nullptr) {
+		LOG_ERROR("Unable to find mixer control '%s',0 on %s", element.c_str(), card.c_str());
+		closeMixer();
+		return false;
+	}
+
+	snd_mixer_selem_get_playback_volume_range(elem, &min, &max);
+	if(max <= min) max = min + 1;
+	stepSize = (max - min) / 100;
+	if(stepSize < 1) stepSize = 1;
+
+	snd_mixer_elem_set_callback(elem, elemCallback);
+	snd_mixer_elem_set_callback_private(elem, this);
+	volume = readVolume();
+	guard.unlock();
+
+	if(pipe(wakePipe) == -1) {
+		LOG_ERROR("pipe: %s", strerror(errno));
+		wakePipe[0] = wakePipe[1] = -1;
+	} else {
+		watcher = std::thread(&VolumeControl::watch, this);
+	}
+	return true;
+}
+
+// The watcher takes the lock itself, so it is stopped before the lock is
+// taken for the mixer
+void VolumeControl::close() {
+	if(watcher.joinable()) {
+		char c = 0;
+		if(write(wakePipe[1], &c, 1) < 0) LOG_ERROR("write: %s", strerror(errno));
+		watcher.join();
+	}
+	if(wakePipe[0] != -1) {
+		::close(wakePipe[0]);
+		::close(wakePipe[1]);
+		wakePipe[0] = wakePipe[1] = -1;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	closeMixer();
+}
+
+void VolumeControl::closeMixer() {
+	if(mixer != nullptr) snd_mixer_close(mixer);
+	mixer = nullptr;
+	elem = nullptr;
+}
+
+bool VolumeControl::isOpen() {
+	std::lock_guard<std::mutex> guard(lock);
+	return elem != nullptr;
+}
+
+// Moves the volume by a number of 1% steps and returns the new raw value
+int VolumeControl::step(int steps) {
+	std::lock_guard<std::mutex> guard(lock);
+	if(elem == nullptr) return volume;
+
+	long value = readVolume() + steps * stepSize;
+	if(value < min) value = min;
+	if(value > max) value = max;
+	if(steps != 0) snd_mixer_selem_set_playback_volume_all(elem, value);
+
+	volume = readVolume();
+	return volume;
+}
+
+// Sets the raw value, clamped to the mixer's range, and returns what it took
+int VolumeControl::set(int value) {
+	std::lock_guard<std::mutex> guard(lock);
+	if(elem == nullptr) return volume;
+
+	if(value < min) value = min;
+	if(value > max) value = max;
+	snd_mixer_selem_set_playback_volume_all(elem, value);
+
+	volume = readVolume();
+	return volume;
+}
+
+int VolumeControl::getVolume() {
+	return volume;
+}
+
+int VolumeControl::getMin() {
+	std::lock_guard<std::mutex> guard(lock);
+	return min;
+}
+
+int VolumeControl::getMax() {
+	std::lock_guard<std::mutex> guard(lock);
+	return max;
+}
+
+long VolumeControl::readVolume() {
+	long value = 0;
+	snd_mixer_selem_channel_id_t channel = snd_mixer_selem_is_playback_mono(elem) ? SND_MIXER_SCHN_MONO : SND_MIXER_SCHN_FRONT_LEFT;
+	snd_mixer_selem_get_playback_volume(elem, channel, &value);
+	return value;
+}
+
+// Called from snd_mixer_handle_events() with the lock held
+int VolumeControl::elemCallback(snd_mixer_elem_t* elem, unsigned int mask) {
+	VolumeControl* self = static_cast<VolumeControl*>(snd_mixer_elem_get_callback_private(elem));
+	if(mask == SND_CTL_EVENT_MASK_REMOVE) { // Card went away
+		self->elem = nullptr;
+		return 0;
+	}
+	if(mask & SND_CTL_EVENT_MASK_VALUE) {
+		self->volume = self->readVolume();
+		if(self->onChange) self->onChange(self->volume);
+	}
+	return 0;
+}
+
+void VolumeControl::watch() {
+	std::vector<struct pollfd> fds;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		int count = snd_mixer_poll_descriptors_count(mixer);
+		if(count <= 0) return;
+		fds.resize(count + 1);
+		snd_mixer_poll_descriptors(mixer, fds.data() + 1, count);
+	}
+	fds[0].fd = wakePipe[0];
+	fds[0].events = POLLIN;
+
+	while(true) {
+		if(poll(fds.data(), fds.size(), -1) < 0) {
+			if(errno == EINTR) continue;
+			LOG_ERROR("poll (mixer): %s", strerror(errno));
+			return;
+		}
+		if(fds[0].revents) return; // Closing
+
+		std::lock_guard<std::mutex> guard(lock);
+		unsigned short revents = 0;
+		snd_mixer_poll_descriptors_revents(mixer, fds.data() + 1, fds.size() - 1, &revents);
+		if(revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			LOG_WARN("Mixer device went away");
+			elem = nullptr;
+			return;
+		}
+		if(revents & POLLIN) snd_mixer_handle_events(mixer);
+	}
+}
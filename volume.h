@@ -0,0 +1,49 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <alsa/asoundlib.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using VolumeCallback = std::function<void(int)>;
+
+// Keeps an ALSA simple mixer element open so volume steps are a single ioctl
+// instead of a shell plus amixer. A watcher thread sleeps on the mixer's poll
+// descriptors and reports changes made by anything else.
+class VolumeControl {
+public:
+	VolumeControl();
+	~VolumeControl();
+
+	bool open(const std::string& card, const std::string& element);
+	void close();
+	bool isOpen();
+
+	int step(int steps);
+	int set(int value);
+	int getVolume();
+	int getMin();
+	int getMax();
+
+	VolumeCallback onChange;
+
+private:
+	snd_mixer_t* mixer = nullptr;
+	snd_mixer_elem_t* elem = nullptr;
+	long min = 0, max = 1, stepSize = 1;
+	std::atomic<int> volume;
+
+	std::mutex lock; // libasound handles aren't thread safe
+	std::thread watcher;
+	int wakePipe[2] = {-1, -1};
+
+	void watch();
+	void closeMixer(); // With the lock held
+	long readVolume();
+	static int elemCallback(snd_mixer_elem_t* elem, unsigned int mask);
+};
+
+#endif // VOLUME_H